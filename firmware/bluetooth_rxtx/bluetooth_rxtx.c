@@ -66,6 +66,8 @@ volatile uint8_t cs_trigger;                  // set by intr on P2.2 falling (CS
 volatile uint16_t hop_direct_channel = 0;     // for hopping directly to a channel
 
 volatile uint8_t  idle_buf_clkn_high;
+volatile uint8_t  idle_buf_epoch;
+volatile uint8_t  active_buf_epoch;
 volatile uint32_t idle_buf_clk100ns;
 volatile uint16_t idle_buf_channel = 0;
 
@@ -136,6 +138,7 @@ char unpacked[DMA_SIZE*8*2];
 
 volatile uint8_t mode = MODE_IDLE;
 volatile uint8_t requested_mode = MODE_IDLE;
+volatile uint8_t mode_epoch = 0;              // bumped by each mode change
 volatile uint8_t jam_mode = JAM_NONE;
 volatile uint8_t ego_mode = 0;
 volatile uint8_t modulation = MOD_BT_BASIC_RATE;
@@ -241,11 +244,14 @@ static int enqueue(uint8_t type, uint8_t* buf)
 	}
 
 	f->pkt_type = type;
+	f->reserved[1] = USB_PKT_EPOCH;
 	if(type == SPECAN) {
 		f->clkn_high = (clkn >> 20) & 0xff;
 		f->clk100ns = CLK100NS;
+		f->reserved[0] = mode_epoch;
 	} else {
 		f->clkn_high = idle_buf_clkn_high;
+		f->reserved[0] = idle_buf_epoch;
 		f->clk100ns = idle_buf_clk100ns;
 		f->channel = idle_buf_channel - 2402;
 		f->rssi_min = rssi_min;
@@ -277,6 +283,8 @@ int enqueue_with_ts(u8 type, u8 *buf, u32 ts)
 
 	f->clkn_high = 0;
 	f->clk100ns = ts;
+	f->reserved[0] = mode_epoch;
+	f->reserved[1] = USB_PKT_EPOCH;
 
 	f->channel = channel - 2402;
 	f->rssi_avg = 0;
@@ -347,6 +355,7 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 
 	case UBERTOOTH_RX_SYMBOLS:
 		requested_mode = MODE_RX_SYMBOLS;
+		mode_epoch++;
 		*data_len = 0;
 		break;
 
@@ -500,6 +509,7 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 
 	case UBERTOOTH_STOP:
 		requested_mode = MODE_IDLE;
+		mode_epoch++;
 		break;
 
 	case UBERTOOTH_GET_MOD:
@@ -560,6 +570,7 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 		low_freq = request_params[0];
 		high_freq = request_params[1];
 		requested_mode = MODE_SPECAN;
+		mode_epoch++;
 		*data_len = 0;
 		break;
 
@@ -628,11 +639,13 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 		DIO_SSEL_SET;
 		clk100ns_offset = (data[4] << 8) | (data[5] << 0);
 		requested_mode = MODE_BT_FOLLOW;
+		mode_epoch++;
 		break;
 
 	case UBERTOOTH_AFH:
 		hop_mode = HOP_AFH;
 		requested_mode = MODE_AFH;
+		mode_epoch++;
 
 		for(int i=0; i < 10; i++) {
 			afh_map[i] = 0;
@@ -685,6 +698,7 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 		do_hop = 0;
 		hop_mode = HOP_BTLE;
 		requested_mode = MODE_BT_FOLLOW_LE;
+		mode_epoch++;
 
 		queue_init();
 		cs_threshold_calc_and_set();
@@ -739,6 +753,7 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 
 		hop_mode = HOP_NONE;
 		requested_mode = MODE_BT_PROMISC_LE;
+		mode_epoch++;
 
 		queue_init();
 		cs_threshold_calc_and_set();
@@ -758,6 +773,7 @@ static int vendor_request_handler(u8 request, u16 *request_params, u8 *data, int
 	case UBERTOOTH_BTLE_SLAVE:
 		memcpy(slave_mac_address, data, 6);
 		requested_mode = MODE_BT_SLAVE_LE;
+		mode_epoch++;
 		break;
 
 	case UBERTOOTH_BTLE_SET_TARGET:
@@ -1030,6 +1046,10 @@ void bt_stream_dma_handler(void)
 			idle_buf_clkn_high = (clkn >> 20) & 0xff;
 			idle_buf_channel   = channel;
 
+			/* the buffer belongs to the mode it was started in */
+			idle_buf_epoch     = active_buf_epoch;
+			active_buf_epoch   = mode_epoch;
+
 			/* Keep buffer swapping in sync with DMA. */
 			volatile uint8_t* tmp = active_rxbuf;
 			active_rxbuf = idle_rxbuf;
@@ -1048,6 +1068,7 @@ void DMA_IRQHandler()
 {
 	switch (mode) {
 		case MODE_RX_SYMBOLS:
+		case MODE_AFH:
 		case MODE_SPECAN:
 		case MODE_BT_FOLLOW:
 		case MODE_BT_FOLLOW_LE:
@@ -1456,8 +1477,12 @@ void bt_stream_rx()
 
 	cs_trigger_enable();
 
-	while ( requested_mode == MODE_RX_SYMBOLS || requested_mode == MODE_BT_FOLLOW )
+	/* The stream modes switch between each other without stopping,
+	 * the host tells records apart by their mode epoch. */
+	while ( requested_mode == MODE_RX_SYMBOLS || requested_mode == MODE_BT_FOLLOW ||
+	        requested_mode == MODE_AFH )
 	{
+		mode = requested_mode;
 
 		RXLED_CLR;
 
@@ -28,6 +28,7 @@
 
 #include "ubertooth_callback.h"
 #include "ubertooth.h"
+#include "ubertooth_capture.h"
 #include "ubertooth_control.h"
 #include "ubertooth_interface.h"
 
@@ -38,6 +39,9 @@
 #define VERSION "unknown"
 #endif
 
+/* longest wait for queued packets before flushing the capture stream */
+#define QUEUED_WAKEUP_US 10000
+
 
 uint32_t systime;
 FILE* infile = NULL;
@@ -45,6 +49,7 @@ FILE* dumpfile = NULL;
 int max_ac_errors = 2;
 
 unsigned int packet_counter_max;
+unsigned int afh_sightings = AFH_SIGHTINGS_DEFAULT;
 
 void print_version() {
 	printf("libubertooth %s (%s), libbtbb %s (%s)\n", VERSION, RELEASE,
@@ -85,6 +90,17 @@ void ubertooth_set_timeout(ubertooth_t* ut, int seconds) {
 	alarm(seconds);
 }
 
+static int board_id(const struct libusb_device_descriptor* desc)
+{
+	if (desc->idVendor == TC13_VENDORID && desc->idProduct == TC13_PRODUCTID)
+		return BOARD_ID_TC13BADGE;
+	if (desc->idVendor == U0_VENDORID && desc->idProduct == U0_PRODUCTID)
+		return BOARD_ID_UBERTOOTH_ZERO;
+	if (desc->idVendor == U1_VENDORID && desc->idProduct == U1_PRODUCTID)
+		return BOARD_ID_UBERTOOTH_ONE;
+	return -1;
+}
+
 static struct libusb_device_handle* find_ubertooth_device(int ubertooth_device)
 {
 	struct libusb_context *ctx = NULL;
@@ -99,9 +115,7 @@ static struct libusb_device_handle* find_ubertooth_device(int ubertooth_device)
 		r = libusb_get_device_descriptor(usb_list[i], &desc);
 		if(r < 0)
 			fprintf(stderr, "couldn't get usb descriptor for dev #%d!\n", i);
-		if ((desc.idVendor == TC13_VENDORID && desc.idProduct == TC13_PRODUCTID)
-		    || (desc.idVendor == U0_VENDORID && desc.idProduct == U0_PRODUCTID)
-		    || (desc.idVendor == U1_VENDORID && desc.idProduct == U1_PRODUCTID))
+		if (r == 0 && board_id(&desc) >= 0 && ubertooths < UBERTOOTH_MAX_DEVICES)
 		{
 			ubertooth_devs[ubertooths] = i;
 			ubertooths++;
@@ -212,6 +226,8 @@ static void cb_xfer(struct libusb_transfer *xfer)
 	ut->full_usb_buf = ut->empty_usb_buf;
 	ut->empty_usb_buf = tmp;
 	ut->usb_really_full = 1;
+	/* keep-alives are short transfers without a record */
+	ut->full_records = xfer->actual_length / PKT_LEN;
 	ut->rx_xfer->buffer = ut->empty_usb_buf;
 
 	r = libusb_submit_transfer(ut->rx_xfer);
@@ -219,14 +235,24 @@ static void cb_xfer(struct libusb_transfer *xfer)
 		fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
 }
 
+/* the streaming thread is the one to lock, pin and prioritise */
+static void bulk_rt_apply(ubertooth_t* ut)
+{
+	if (ut->h_rt && !ut->h_rt->applied) {
+		rt_profile_apply(ut->h_rt);
+		rt_profile_prefault(ut->packets, sizeof(ringbuffer_t));
+		rt_profile_prefault(ut->usb_bufs, 2 * XFER_LEN);
+	}
+}
+
 int ubertooth_bulk_init(ubertooth_t* ut)
 {
 	int r;
-	uint8_t rx_buf1[BUFFER_SIZE];
-	uint8_t rx_buf2[BUFFER_SIZE];
 
-	ut->empty_usb_buf = &rx_buf1[0];
-	ut->full_usb_buf = &rx_buf2[0];
+	bulk_rt_apply(ut);
+
+	ut->empty_usb_buf = ut->usb_bufs;
+	ut->full_usb_buf = ut->usb_bufs + XFER_LEN;
 	ut->usb_really_full = 0;
 	ut->rx_xfer = libusb_alloc_transfer(0);
 	libusb_fill_bulk_transfer(ut->rx_xfer, ut->devh, DATA_IN, ut->empty_usb_buf,
@@ -240,23 +266,202 @@ int ubertooth_bulk_init(ubertooth_t* ut)
 	return 0;
 }
 
+/* Nothing to pass on right now: hand on what the outputs hold back */
+static void stream_idle(ubertooth_t* ut)
+{
+	if (ut->h_output && output_idle(ut->h_output) < 0)
+		ut->stop_ubertooth = 1;
+}
+
 void ubertooth_bulk_wait(ubertooth_t* ut)
 {
+	struct timeval tv;
 	int r;
 
 	while (!ut->usb_really_full) {
-		r = libusb_handle_events(NULL);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		r = libusb_handle_events_timeout(NULL, &tv);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				break;
 			show_libusb_error(r);
 		}
+		if (!ut->usb_really_full)
+			stream_idle(ut);
+	}
+}
+
+/* Add a record to the ringbuffer and pass it to the callback, unless
+ * the capture filter rejects it before any symbols are correlated.
+ * cb_rx decodes from the oldest bank, all other callbacks from the
+ * newest. */
+static void analyse_record(ubertooth_t* ut, rx_callback cb, void* cb_args)
+{
+	usb_pkt_rx* analysed;
+
+	/* windows right after a mode switch would mix in the old mode */
+	if (ut->ring_fill < NUM_BANKS && cb != cb_btle && cb != cb_ego)
+		return;
+
+	if (ut->h_filter) {
+		analysed = (cb == cb_rx) ? ringbuffer_bottom_usb(ut->packets)
+		                         : ringbuffer_top_usb(ut->packets);
+		if (filter_pre(ut->h_filter, analysed) == FILTER_FALSE) {
+			if (ut->h_metrics)
+				metrics_add(&ut->h_metrics->filtered, 1);
+			return;
+		}
+	}
+
+	if (ut->h_metrics) {
+		uint64_t start = metrics_now();
+		(*cb)(ut, cb_args);
+		metrics_latency(ut->h_metrics, metrics_now() - start);
+	} else {
+		(*cb)(ut, cb_args);
+	}
+}
+
+/* Follow the mode epoch that firmware tags its records with.  Returns
+ * -1 for a record still queued from before the last
+ * ubertooth_mode_switch(), 1 for the first record of a new epoch and 0
+ * otherwise. */
+int ubertooth_check_epoch(ubertooth_t* ut, const usb_pkt_rx* rx)
+{
+	int first;
+
+	if (!(rx->reserved[1] & USB_PKT_EPOCH))
+		return 0;
+	if (ut->epoch_valid && rx->reserved[0] == ut->epoch)
+		return ut->switching ? -1 : 0;
+
+	first = ut->epoch_valid;
+	ut->epoch = rx->reserved[0];
+	ut->epoch_valid = 1;
+	ut->switching = 0;
+	return first;
+}
+
+/* Records still queued from before a mode switch are dropped, and the
+ * ringbuffer starts over with each new mode epoch.  Returns -1 for a
+ * dropped record. */
+static int add_record(ubertooth_t* ut, const usb_pkt_rx* rx)
+{
+	int epoch = ubertooth_check_epoch(ut, rx);
+	uint64_t ts_ns;
+
+	if (epoch == 1)
+		ut->ring_fill = 0;
+
+	clock_sync_advance(&ut->clock, rx);
+
+	/* the pre-trigger window keeps every record, whatever becomes of
+	 * it here */
+	if (ut->h_trigger) {
+		ts_ns = clock_sync_ns(&ut->clock, rx);
+		trigger_add_record(ut->h_trigger,
+		                   infile ? systime : (uint32_t)(ts_ns / 1000000000ull),
+		                   ts_ns, rx);
+	}
+	if (epoch < 0)
+		return -1;
+
+	ringbuffer_add(ut->packets, rx);
+	ut->rx_seq++;
+	if (ut->ring_fill < NUM_BANKS)
+		ut->ring_fill++;
+
+	return 0;
+}
+
+void ubertooth_rx_record(ubertooth_t* ut, const usb_pkt_rx* rx, rx_callback cb, void* cb_args)
+{
+	if (ut->h_metrics)
+		metrics_record(ut->h_metrics, rx);
+	if (add_record(ut, rx) == 0)
+		analyse_record(ut, cb, cb_args);
+	else if (ut->h_metrics)
+		metrics_add(&ut->h_metrics->switch_drops, 1);
+}
+
+/* Call before sending a command that changes the firmware mode while
+ * the stream keeps running.  Firmware that tags records with a mode
+ * epoch lets the records of the old mode be dropped exactly; with older
+ * firmware only the ringbuffer context is reset. */
+void ubertooth_mode_switch(ubertooth_t* ut)
+{
+	ut->switching = ut->epoch_valid;
+	ut->ring_fill = 0;
+}
+
+/* Start hopping along with a piconet whose clock is known */
+void ubertooth_follow(ubertooth_t* ut, btbb_piconet* pn)
+{
+	ubertooth_mode_switch(ut);
+	cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
+	cmd_start_hopping(ut->devh, btbb_piconet_get_clk_offset(pn), 0);
+	ut->following = 1;
+}
+
+/* Seed the piconet from the cache before streaming.  If follow is set,
+ * a recent clock is followed right away and has CACHE_VERIFY_TIME to
+ * decode a packet of the piconet before it is discovered again. */
+int ubertooth_cache_seed(ubertooth_t* ut, btbb_piconet* pn, int follow)
+{
+	int used;
+
+	if (ut->h_cache == NULL)
+		return 0;
+	ut->cache_pn = pn;
+
+	/* the cached clock is relative to a zeroed Ubertooth clock */
+	used = piconet_cache_seed(ut->h_cache, pn, 0);
+	if ((used & CACHE_CLOCK) && (!follow || ut->devh == NULL)) {
+		btbb_piconet_set_flag(pn, BTBB_FOLLOWING, 0);
+		btbb_piconet_set_flag(pn, BTBB_CLK27_VALID, 0);
+		used &= ~CACHE_CLOCK;
+	}
+	if (used == 0)
+		return 0;
+
+	fprintf(stderr, "Cached piconet %06x: UAP %02x%s%s\n",
+	        btbb_piconet_get_lap(pn), btbb_piconet_get_uap(pn),
+	        (used & CACHE_AFH) ? ", AFH map" : "",
+	        (used & CACHE_CLOCK) ? ", clock" : "");
+
+	if (ut->devh) {
+		cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
+		if (used & CACHE_AFH)
+			cmd_set_afh_map(ut->devh, btbb_piconet_get_afh_map(pn));
+		if (used & CACHE_CLOCK) {
+			cmd_set_clock(ut->devh, 0);
+			ubertooth_follow(ut, pn);
+			ut->verify_left = CACHE_VERIFY_TIME * (1000000 / BANK_LEN);
+		}
 	}
+
+	return used;
+}
+
+/* A cached clock did not verify: start over with the LAP alone and
+ * scan for the piconet again on the running stream. */
+void ubertooth_rediscover(ubertooth_t* ut, btbb_piconet* pn)
+{
+	fprintf(stderr, "Cached piconet %06x did not verify, rediscovering\n",
+	        btbb_piconet_get_lap(pn));
+	btbb_init_piconet(pn, btbb_piconet_get_lap(pn));
+	ut->verify_left = 0;
+	ut->following = 0;
+
+	ubertooth_mode_switch(ut);
+	cmd_set_channel(ut->devh, 9999);
+	cmd_rx_syms(ut->devh);
 }
 
 int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args)
 {
-	int i, r;
+	int i, r, records = 0;
 	usb_pkt_rx* rx;
 
 	if (!ut->usb_really_full)
@@ -267,12 +472,21 @@ int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args)
 	}
 
 	if (ut->usb_really_full) {
+		/* one host clock sample per transfer */
+		clock_sync_sample(&ut->clock);
+		if (ut->h_rt && ut->full_records)
+			rt_profile_wakeup(ut->h_rt, ((usb_pkt_rx*)ut->full_usb_buf)->clk100ns);
+		if (ut->h_metrics)
+			metrics_add(&ut->h_metrics->transfers, 1);
+
 		/* process each received block */
-		for (i = 0; i < PKTS_PER_XFER; i++) {
+		for (i = 0; i < ut->full_records; i++) {
 			rx = (usb_pkt_rx*)(ut->full_usb_buf + PKT_LEN * i);
+			if (ut->h_rt)
+				rt_profile_record(ut->h_rt, rx);
 			if(rx->pkt_type != KEEP_ALIVE) {
-				ringbuffer_add(ut->packets, rx);
-				(*cb)(ut, cb_args);
+				ubertooth_rx_record(ut, rx, cb, cb_args);
+				records++;
 			}
 			if(ut->stop_ubertooth) {
 				if(ut->rx_xfer)
@@ -281,6 +495,8 @@ int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args)
 			}
 		}
 		ut->usb_really_full = 0;
+		if (records == 0)
+			stream_idle(ut);
 		fflush(stderr);
 		return 0;
 	} else {
@@ -288,6 +504,181 @@ int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args)
 	}
 }
 
+static void queued_free(ubertooth_t* ut, int i)
+{
+	libusb_free_transfer(ut->queued_xfer[i]);
+	ut->queued_xfer[i] = NULL;
+	ut->num_queued--;
+}
+
+/* Collect the record of a single-record transfer in full_usb_buf.  The
+ * transfer is only resubmitted by queued_resubmit(), so none completes
+ * twice before the records are handed on and they stay in order. */
+static void cb_queued_xfer(struct libusb_transfer* xfer)
+{
+	ubertooth_t* ut = (ubertooth_t*)xfer->user_data;
+	int i, r;
+
+	for (i = 0; ut->queued_xfer[i] != xfer; i++)
+		;
+
+	if (xfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+		r = libusb_submit_transfer(xfer);
+		if (r < 0) {
+			fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
+			queued_free(ut, i);
+		}
+		return;
+	}
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (xfer->status != LIBUSB_TRANSFER_CANCELLED)
+			rx_xfer_status(xfer->status);
+		queued_free(ut, i);
+		return;
+	}
+
+	/* keep-alives are short transfers without a record */
+	if (xfer->actual_length >= PKT_LEN) {
+		memcpy(ut->full_usb_buf + PKT_LEN * ut->full_records,
+		       xfer->buffer, PKT_LEN);
+		ut->full_records++;
+		ut->usb_really_full = 1;
+	}
+	ut->queued_done[ut->num_queued_done++] = i;
+}
+
+static void queued_resubmit(ubertooth_t* ut)
+{
+	int i, r;
+
+	for (i = 0; i < ut->num_queued_done; i++) {
+		r = libusb_submit_transfer(ut->queued_xfer[ut->queued_done[i]]);
+		if (r < 0) {
+			fprintf(stderr, "Failed to submit USB transfer (%d)\n", r);
+			queued_free(ut, ut->queued_done[i]);
+		}
+	}
+	ut->num_queued_done = 0;
+}
+
+/* Keep QUEUED_XFERS transfers of one record each in flight.  The first
+ * half of usb_bufs holds their buffers, full_usb_buf the records
+ * completed since they were last handed on. */
+static int queued_init(ubertooth_t* ut)
+{
+	struct libusb_transfer* xfer;
+	int i;
+
+	bulk_rt_apply(ut);
+
+	ut->full_usb_buf = ut->usb_bufs + XFER_LEN;
+	ut->full_records = 0;
+	ut->usb_really_full = 0;
+	ut->num_queued_done = 0;
+
+	for (i = 0; i < QUEUED_XFERS; i++) {
+		xfer = libusb_alloc_transfer(0);
+		if (xfer == NULL)
+			break;
+		libusb_fill_bulk_transfer(xfer, ut->devh, DATA_IN,
+		                          ut->usb_bufs + PKT_LEN * i, PKT_LEN,
+		                          cb_queued_xfer, ut, TIMEOUT);
+		if (libusb_submit_transfer(xfer) < 0) {
+			libusb_free_transfer(xfer);
+			break;
+		}
+		ut->queued_xfer[i] = xfer;
+		ut->num_queued++;
+	}
+
+	if (ut->num_queued == 0) {
+		fprintf(stderr, "rx_xfer submission failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Cancel the transfers in flight and wait for them to come back */
+static void queued_cancel(ubertooth_t* ut)
+{
+	struct timeval tv = { 0, 100000 };
+	int i, tries = 10;
+
+	for (i = 0; i < ut->num_queued_done; i++)
+		queued_free(ut, ut->queued_done[i]);
+	ut->num_queued_done = 0;
+
+	for (i = 0; i < QUEUED_XFERS; i++)
+		if (ut->queued_xfer[i] != NULL)
+			libusb_cancel_transfer(ut->queued_xfer[i]);
+	while (ut->num_queued > 0 && tries-- > 0)
+		libusb_handle_events_timeout(NULL, &tv);
+}
+
+/* LE and E-GO packets are queued by the firmware like the records of
+ * the other modes.  They are taken from the bulk stream in transfers of
+ * one record, several of them in flight, so that each is handed on as
+ * soon as it arrives.  cmd_poll() is used for old firmware that does
+ * not stream them (polling set, or the stream cannot be kept running).
+ * Returns -1 on USB errors. */
+int stream_rx_queued(ubertooth_t* ut, rx_callback cb, void* cb_args, int polling)
+{
+	struct timeval tv;
+	usb_pkt_rx rx;
+	int r, ret = 0;
+
+	if (!polling && queued_init(ut) < 0)
+		polling = 1;
+
+	while (!ut->stop_ubertooth) {
+		if (!polling && ut->num_queued == 0) {
+			fprintf(stderr, "Bulk stream stopped, polling for packets instead\n");
+			polling = 1;
+		}
+
+		if (polling) {
+			r = cmd_poll(ut->devh, &rx);
+			if (r < 0) {
+				fprintf(stderr, "USB error\n");
+				ret = -1;
+				break;
+			}
+			if (r == sizeof(usb_pkt_rx)) {
+				clock_sync_sample(&ut->clock);
+				ubertooth_rx_record(ut, &rx, cb, cb_args);
+			} else {
+				stream_idle(ut);
+				usleep(500);
+			}
+		} else {
+			/* wake up regularly to flush the capture stream */
+			tv.tv_sec = 0;
+			tv.tv_usec = QUEUED_WAKEUP_US;
+			r = libusb_handle_events_timeout(NULL, &tv);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+				show_libusb_error(r);
+				ret = -1;
+				break;
+			}
+			if (!ut->usb_really_full)
+				stream_idle(ut);
+			else if (ubertooth_bulk_receive(ut, cb, cb_args) == 1)
+				break;
+			ut->full_records = 0;
+			queued_resubmit(ut);
+		}
+
+		if (ut->h_stream_le && pcapng_stream_poll(ut->h_stream_le) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ut->num_queued > 0)
+		queued_cancel(ut);
+	return ret;
+}
+
 static int stream_rx_usb(ubertooth_t* ut, rx_callback cb, void* cb_args)
 {
 	// init USB transfer
@@ -309,27 +700,214 @@ static int stream_rx_usb(ubertooth_t* ut, rx_callback cb, void* cb_args)
 	}
 }
 
-/* file should be in full USB packet format (ubertooth-dump -f) */
+/* Replayed records carry the host time in whole seconds.  The first
+ * record of each second is the one closest to that time. */
+static void replay_systime(ubertooth_t* ut, uint32_t t)
+{
+	if (!ut->clock.valid || t != systime)
+		clock_sync_set_host(&ut->clock, (uint64_t)t * 1000000000ull);
+	systime = t;
+}
+
+/* Records on either side of a window marker or segment start are not
+ * contiguous, so neither the decode window nor the clock fit may span one.
+ * The same goes for records a network receiver lost. */
+static void stream_splice(ubertooth_t* ut)
+{
+	int64_t max_residual_ns = ut->clock.max_residual_ns;
+
+	ut->ring_fill = 0;
+	clock_sync_init(&ut->clock);
+	ut->clock.max_residual_ns = max_residual_ns;
+}
+
+static int stream_rx_capture(ubertooth_t* ut, FILE* fp, rx_callback cb, void* cb_args)
+{
+	capture_record rec;
+	int r;
+
+	capture_t* cap = capture_open(fp, 1);
+	if (cap == NULL)
+		return -1;
+
+	while ((r = capture_read(cap, &rec)) > 0) {
+		if (rec.segment)
+			stream_splice(ut);
+		replay_systime(ut, rec.systime);
+		ubertooth_rx_record(ut, &rec.rx, cb, cb_args);
+	}
+	capture_close(cap);
+
+	return r;
+}
+
+int dump_write_marker(FILE* fp, uint8_t kind, uint32_t systime, uint64_t seq)
+{
+	uint32_t systime_be = htobe32(DUMP_MARKER_SYSTIME);
+	dump_marker m;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	memcpy(m.magic, DUMP_MARKER_MAGIC, sizeof(m.magic));
+	m.kind = kind;
+	for (i = 0; i < 4; i++)
+		m.systime[i] = systime >> (24 - 8 * i);
+	for (i = 0; i < 8; i++)
+		m.seq[i] = seq >> (56 - 8 * i);
+
+	if (fwrite(&systime_be, sizeof(systime_be), 1, fp) != 1 ||
+	    fwrite(&m, sizeof(m), 1, fp) != 1)
+		return -1;
+	return 0;
+}
+
+/* record is a whole dump record, systime included.  Returns the marker
+ * kind, or -1 if the record holds a USB packet. */
+int dump_read_marker(const uint8_t* record, dump_marker* m)
+{
+	if (record[0] != 0xff || record[1] != 0xff ||
+	    record[2] != 0xff || record[3] != 0xff ||
+	    memcmp(record + 4, DUMP_MARKER_MAGIC, 4) != 0)
+		return -1;
+	memcpy(m, record + 4, sizeof(dump_marker));
+	return m->kind;
+}
+
+/* file should be in full USB packet format (ubertooth-dump -f) or in
+ * the capture container format.  Dumps that start with a header marker
+ * only hold the records around packets, so the callback is only run
+ * where a hit marker says that the oldest record starts a packet. */
 int stream_rx_file(ubertooth_t* ut, FILE* fp, rx_callback cb, void* cb_args)
 {
-	uint8_t buf[BUFFER_SIZE];
+	uint8_t buf[4 + PKT_LEN];
+	dump_marker m;
 	size_t nitems;
+	int kind, hits_only = 0;
+
+	ut->clock.max_residual_ns = CLOCK_SYSTIME_RESIDUAL_NS;
+
+	nitems = fread(buf, 4, 1, fp);
+	if (nitems != 1)
+		return 0;
+	if (capture_is_magic(buf))
+		return stream_rx_capture(ut, fp, cb, cb_args);
 
 	while(1) {
-		uint32_t systime_be;
-		nitems = fread(&systime_be, sizeof(systime_be), 1, fp);
-		if (nitems != 1)
+		nitems = fread(buf + 4, sizeof(buf[0]), PKT_LEN, fp);
+		if (nitems != PKT_LEN)
 			return 0;
-		systime = (time_t)be32toh(systime_be);
 
-		nitems = fread(buf, sizeof(buf[0]), PKT_LEN, fp);
-		if (nitems != PKT_LEN)
+		kind = dump_read_marker(buf, &m);
+		if (kind == DUMP_MARKER_HEADER) {
+			hits_only = 1;
+		} else if (kind == DUMP_MARKER_HIT) {
+			if (hits_only) {
+				systime = (m.systime[0] << 24) | (m.systime[1] << 16) |
+				          (m.systime[2] << 8) | m.systime[3];
+				analyse_record(ut, cb, cb_args);
+			}
+		} else if (kind == DUMP_MARKER_WINDOW) {
+			stream_splice(ut);
+		} else if (kind < 0) {
+			replay_systime(ut, (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+			if (hits_only) {
+				add_record(ut, (usb_pkt_rx*)(buf + 4));
+			} else {
+				ubertooth_rx_record(ut, (usb_pkt_rx*)(buf + 4), cb, cb_args);
+			}
+		}
+
+		nitems = fread(buf, 4, 1, fp);
+		if (nitems != 1)
 			return 0;
-		ringbuffer_add(ut->packets, (usb_pkt_rx*)buf);
-		(*cb)(ut, cb_args);
 	}
 }
 
+/* Receive the records an ubertoothd publishes, see ubertooth_attach().
+ * The producer's timestamp of the first record of each batch is used
+ * as the host time sample. */
+int stream_rx_shm(ubertooth_t* ut, rx_callback cb, void* cb_args)
+{
+	const shm_slot* slot;
+	usb_pkt_rx rx;
+	uint64_t ts_ns, overflows;
+	int r, sampled;
+
+	while (!ut->stop_ubertooth) {
+		r = shm_ring_wait(ut->h_shm, 1000);
+		if (r < 0) {
+			fprintf(stderr, "ubertoothd has stopped\n");
+			return -1;
+		}
+		if (r == 0)
+			stream_idle(ut);
+
+		sampled = 0;
+		overflows = ut->h_shm->overflows;
+		while (!ut->stop_ubertooth && (slot = shm_ring_next(ut->h_shm)) != NULL) {
+			memcpy(&rx, &slot->rx, sizeof(rx));
+			ts_ns = slot->ts_ns;
+			if (!shm_ring_valid(ut->h_shm, slot)) {
+				ut->h_shm->overflows++;
+				continue;
+			}
+			/* records the producer overwrote leave a gap */
+			if (ut->h_shm->overflows != overflows) {
+				overflows = ut->h_shm->overflows;
+				stream_splice(ut);
+				sampled = 0;
+			}
+			if (!sampled) {
+				clock_sync_set_host(&ut->clock, ts_ns);
+				sampled = 1;
+			}
+			if (rx.pkt_type != KEEP_ALIVE)
+				ubertooth_rx_record(ut, &rx, cb, cb_args);
+		}
+		if (ut->h_metrics)
+			metrics_set(&ut->h_metrics->lost, ut->h_shm->overflows);
+	}
+	return 1;
+}
+
+/* Receive the records of remote senders, see ubertooth_listen().  Like
+ * with ubertoothd, the sender's timestamp of the first record of each
+ * frame is used as the host time sample, except for replayed dumps. */
+int stream_rx_net(ubertooth_t* ut, rx_callback cb, void* cb_args)
+{
+	net_record rec;
+	int r, sampled;
+
+	while (!ut->stop_ubertooth) {
+		r = net_receiver_wait(ut->h_net, 1000);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			stream_idle(ut);
+
+		if (ut->h_metrics)
+			metrics_set(&ut->h_metrics->lost, ut->h_net->lost);
+		sampled = 0;
+		if (ut->h_net->flags & NET_REPLAY)
+			ut->clock.max_residual_ns = CLOCK_SYSTIME_RESIDUAL_NS;
+		while (!ut->stop_ubertooth && net_receiver_next(ut->h_net, &rec) > 0) {
+			if (rec.segment) {
+				stream_splice(ut);
+				sampled = 0;
+			}
+			if (ut->h_net->flags & NET_REPLAY) {
+				replay_systime(ut, rec.systime);
+			} else if (!sampled) {
+				clock_sync_set_host(&ut->clock, rec.ts_ns);
+				sampled = 1;
+			}
+			if (rec.rx.pkt_type != KEEP_ALIVE)
+				ubertooth_rx_record(ut, &rec.rx, cb, cb_args);
+		}
+	}
+	return 1;
+}
+
 /* Receive and process packets. For now, returning from
  * stream_rx_usb() means that UAP and clocks have been found, and that
  * hopping should be started. A more flexible framework would be
@@ -343,24 +921,14 @@ void rx_live(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 	if (timeout)
 		ubertooth_set_timeout(ut, timeout);
 
-	if (pn != NULL && btbb_piconet_get_flag(pn, BTBB_CLK27_VALID))
+	/* With a preset clock, follow right away.  Otherwise cb_br_rx()
+	 * switches to following on the running stream as soon as UAP and
+	 * clock have been recovered. */
+	if (pn != NULL && btbb_piconet_get_flag(pn, BTBB_CLK27_VALID) && !ut->following) {
 		cmd_set_clock(ut->devh, 0);
-	else {
-		stream_rx_usb(ut, cb_br_rx, pn);
-		/* Allow pending transfers to finish */
-		sleep(1);
-	}
-	/* Used when follow_pn is preset OR set by stream_rx_usb above
-	 * i.e. This cannot be rolled in to the above if...else
-	 */
-	if (pn != NULL && btbb_piconet_get_flag(pn, BTBB_CLK27_VALID)) {
-		ut->stop_ubertooth = 0;
-		ut->usb_really_full = 0;
-		// cmd_stop(ut->devh);
-		cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
-		cmd_start_hopping(ut->devh, btbb_piconet_get_clk_offset(pn), 0);
-		stream_rx_usb(ut, cb_br_rx, pn);
+		ubertooth_follow(ut, pn);
 	}
+	stream_rx_usb(ut, cb_br_rx, pn);
 }
 
 void rx_afh(ubertooth_t* ut, btbb_piconet* pn, int timeout)
@@ -369,25 +937,55 @@ void rx_afh(ubertooth_t* ut, btbb_piconet* pn, int timeout)
 	if (r < 0)
 		return;
 
+	time_t deadline;
+
 	cmd_set_channel(ut->devh, 9999);
+	cmd_afh(ut->devh);
 
-	if (timeout) {
-		ubertooth_set_timeout(ut, timeout);
+	/* start monitoring from a map the piconet was seeded with, during
+	 * detection no channel expires */
+	if (!timeout) {
+		cmd_set_afh_map(ut->devh, btbb_piconet_get_afh_map(pn));
+		afh_estimator_init(&ut->afh, packet_counter_max, afh_sightings);
+		afh_estimator_seed(&ut->afh, btbb_piconet_get_afh_map(pn));
+	} else {
+		afh_estimator_init(&ut->afh, 0, afh_sightings);
+	}
 
-		cmd_afh(ut->devh);
-		stream_rx_usb(ut, cb_afh_initial, pn);
+	r = ubertooth_bulk_init(ut);
+	if (r < 0)
+		return;
+	r = cmd_rx_syms(ut->devh);
+	if (r < 0)
+		return;
 
-		cmd_stop(ut->devh);
+	/* Detect the AFH channel map, then monitor it on the same
+	 * stream */
+	if (timeout) {
+		deadline = time(NULL) + timeout;
+		while (time(NULL) < deadline) {
+			ubertooth_bulk_wait(ut);
+			if (ubertooth_bulk_receive(ut, cb_afh_initial, pn) == 1)
+				return;
+		}
 
 		btbb_print_afh_map(pn);
+		ut->afh.expiry = packet_counter_max;
+		afh_estimator_seed(&ut->afh, btbb_piconet_get_afh_map(pn));
+
+		ubertooth_mode_switch(ut);
+		cmd_clear_afh_map(ut->devh);
+		cmd_afh(ut->devh);
 	}
 
 	/*
 	 * Monitor changes in AFH channel map
 	 */
-	cmd_clear_afh_map(ut->devh);
-	cmd_afh(ut->devh);
-	stream_rx_usb(ut, cb_afh_monitor, pn);
+	while (1) {
+		ubertooth_bulk_wait(ut);
+		if (ubertooth_bulk_receive(ut, cb_afh_monitor, pn) == 1)
+			return;
+	}
 }
 
 void rx_afh_r(ubertooth_t* ut, btbb_piconet* pn, int timeout __attribute__((unused)))
@@ -403,6 +1001,9 @@ void rx_afh_r(ubertooth_t* ut, btbb_piconet* pn, int timeout __attribute__((unus
 
 	cmd_afh(ut->devh);
 
+	afh_estimator_init(&ut->afh, packet_counter_max, afh_sightings);
+	afh_estimator_seed(&ut->afh, btbb_piconet_get_afh_map(pn));
+
 	// init USB transfer
 	r = ubertooth_bulk_init(ut);
 	if (r < 0)
@@ -486,9 +1087,16 @@ static void cb_dump_bitstream(ubertooth_t* ut, void* args __attribute__((unused)
 static void cb_dump_full(ubertooth_t* ut, void* args __attribute__((unused)))
 {
 	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
+	uint64_t ts_ns = clock_sync_ns(&ut->clock, rx);
+	uint32_t now = ts_ns / 1000000000ull;
 
 	fprintf(stderr, "rx block timestamp %u * 100 nanoseconds\n", rx->clk100ns);
-	uint32_t time_be = htobe32((uint32_t)time(NULL));
+	if (ut->h_capture) {
+		if (capture_append(ut->h_capture, now, ts_ns, rx) < 0)
+			ut->stop_ubertooth = 1;
+		return;
+	}
+	uint32_t time_be = htobe32(now);
 	if (dumpfile == NULL) {
 		fwrite(&time_be, 1, sizeof(time_be), stdout);
 		fwrite((uint8_t*)rx, sizeof(u8), PKT_LEN, stdout);
@@ -508,8 +1116,23 @@ void rx_dump(ubertooth_t* ut, int bitstream)
 		stream_rx_usb(ut, cb_dump_full, NULL);
 }
 
+/* Store the seeded piconet and write the cache.  Its clock offset is
+ * only meaningful for a live capture. */
+void ubertooth_cache_close(ubertooth_t* ut)
+{
+	if (ut->h_cache == NULL)
+		return;
+	if (ut->cache_pn)
+		piconet_cache_store(ut->h_cache, ut->cache_pn,
+		                    (infile == NULL && ut->devh) ? (int64_t)cmd_get_clock(ut->devh) : -1);
+	piconet_cache_close(ut->h_cache);
+	ut->h_cache = NULL;
+}
+
 void ubertooth_stop(ubertooth_t* ut)
 {
+	ubertooth_cache_close(ut);
+
 	/* make sure xfers are not active */
 	if(ut->rx_xfer != NULL)
 		libusb_cancel_transfer(ut->rx_xfer);
@@ -539,6 +1162,72 @@ void ubertooth_stop(ubertooth_t* ut)
 		lell_pcapng_close(ut->h_pcapng_le);
 		ut->h_pcapng_le = NULL;
 	}
+	if (ut->h_stream_le) {
+		pcapng_stream_close(ut->h_stream_le);
+		ut->h_stream_le = NULL;
+	}
+
+	if (ut->h_capture) {
+		capture_close(ut->h_capture);
+		ut->h_capture = NULL;
+	}
+
+	if (ut->h_output) {
+		output_close(ut->h_output);
+		ut->h_output = NULL;
+	}
+
+	if (ut->h_trigger) {
+		trigger_close(ut->h_trigger);
+		ut->h_trigger = NULL;
+	}
+
+	if (ut->h_filter) {
+		filter_free(ut->h_filter);
+		ut->h_filter = NULL;
+	}
+
+	if (ut->h_ac) {
+		ac_adapt_free(ut->h_ac);
+		ut->h_ac = NULL;
+	}
+
+	if (ut->h_shm) {
+		if (ut->h_shm->overflows)
+			fprintf(stderr, "%llu records lost while falling behind ubertoothd\n",
+			        (unsigned long long)ut->h_shm->overflows);
+		shm_ring_close(ut->h_shm);
+		ut->h_shm = NULL;
+	}
+
+	if (ut->h_net) {
+		fprintf(stderr, "%llu records received, %llu lost by the senders\n",
+		        (unsigned long long)ut->h_net->records,
+		        (unsigned long long)ut->h_net->lost);
+		net_receiver_close(ut->h_net);
+		ut->h_net = NULL;
+	}
+
+	if (ut->h_metrics) {
+		metrics_free(ut->h_metrics);
+		ut->h_metrics = NULL;
+	}
+
+	if (ut->h_rt) {
+		rt_profile_report(ut->h_rt, stderr);
+		rt_profile_free(ut->h_rt);
+		ut->h_rt = NULL;
+	}
+}
+
+/* Free what ubertooth_init() allocated, once the device is stopped. */
+void ubertooth_free(ubertooth_t* ut)
+{
+	if (ut == NULL)
+		return;
+	free(ut->packets);
+	free(ut->usb_bufs);
+	free(ut);
 }
 
 ubertooth_t* ubertooth_init()
@@ -550,19 +1239,38 @@ ubertooth_t* ubertooth_init()
 	}
 
 	ut->packets = ringbuffer_init();
-	if(ut->packets == NULL)
+	if(ut->packets == NULL) {
 		fprintf(stderr, "Unable to initialize ringbuffer\n");
+		free(ut);
+		return NULL;
+	}
+
+	ut->usb_bufs = (uint8_t*)malloc(2 * XFER_LEN);
+	if (ut->usb_bufs == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(ut->packets);
+		free(ut);
+		return NULL;
+	}
 
 	ut->devh = NULL;
 	ut->rx_xfer = NULL;
 	ut->empty_usb_buf = NULL;
 	ut->full_usb_buf = NULL;
 	ut->usb_really_full = 0;
+	ut->full_records = 0;
+	memset(ut->queued_xfer, 0, sizeof(ut->queued_xfer));
+	ut->num_queued = 0;
+	ut->num_queued_done = 0;
 	ut->stop_ubertooth = 0;
-	ut->abs_start_ns = 0;
-	ut->start_clk100ns = 0;
-	ut->last_clk100ns = 0;
-	ut->clk100ns_upper = 0;
+	clock_sync_init(&ut->clock);
+	ut->rx_seq = 0;
+	ut->dump_next = 0;
+	ut->epoch = 0;
+	ut->epoch_valid = 0;
+	ut->switching = 0;
+	ut->following = 0;
+	ut->ring_fill = NUM_BANKS;
 
 #ifdef ENABLE_PCAP
 	ut->h_pcap_bredr = NULL;
@@ -571,10 +1279,66 @@ ubertooth_t* ubertooth_init()
 
 	ut->h_pcapng_bredr = NULL;
 	ut->h_pcapng_le = NULL;
+	ut->h_stream_le = NULL;
+
+	ut->h_capture = NULL;
+	ut->h_output = NULL;
+	ut->h_trigger = NULL;
+	ut->h_filter = NULL;
+	ut->h_ac = NULL;
+	ut->h_rt = NULL;
+	ut->h_shm = NULL;
+	ut->h_net = NULL;
+	ut->h_metrics = NULL;
+	ut->h_cache = NULL;
+	ut->cache_pn = NULL;
+	ut->verify_left = 0;
 
 	return ut;
 }
 
+/* Enumerate the Ubertooths on the USB bus in -U order, with their
+ * serial numbers.  Returns the number found, or -1. */
+int ubertooth_list_devices(ubertooth_device_info* list, int max)
+{
+	struct libusb_device **usb_list = NULL;
+	struct libusb_device_handle *devh;
+	struct libusb_device_descriptor desc;
+	u8 serial[17];
+	int usb_devs, i, n = 0;
+
+	if (libusb_init(NULL) < 0) {
+		fprintf(stderr, "libusb_init failed (got 1.0?)\n");
+		return -1;
+	}
+
+	usb_devs = libusb_get_device_list(NULL, &usb_list);
+	for (i = 0; i < usb_devs && n < max; i++) {
+		if (libusb_get_device_descriptor(usb_list[i], &desc) < 0 ||
+		    board_id(&desc) < 0)
+			continue;
+
+		list[n].index = n;
+		list[n].board_id = board_id(&desc);
+		list[n].serial[0] = '\0';
+		if (libusb_open(usb_list[i], &devh) == 0) {
+			if (cmd_get_serial(devh, serial) == 0)
+				snprintf(list[n].serial, sizeof(list[n].serial), "%08x%08x%08x%08x",
+				         serial[1] | (serial[2] << 8) | (serial[3] << 16) | (serial[4] << 24),
+				         serial[5] | (serial[6] << 8) | (serial[7] << 16) | (serial[8] << 24),
+				         serial[9] | (serial[10] << 8) | (serial[11] << 16) | (serial[12] << 24),
+				         serial[13] | (serial[14] << 8) | (serial[15] << 16) | (serial[16] << 24));
+			libusb_close(devh);
+		}
+		n++;
+	}
+	if (usb_devs >= 0)
+		libusb_free_device_list(usb_list, 1);
+	libusb_exit(NULL);
+
+	return n;
+}
+
 int ubertooth_connect(ubertooth_t* ut, int ubertooth_device)
 {
 	int r = libusb_init(NULL);
@@ -600,6 +1364,22 @@ int ubertooth_connect(ubertooth_t* ut, int ubertooth_device)
 	return 1;
 }
 
+/* Receive from the shared memory ring of ubertoothd instead of
+ * claiming a device.  Commands cannot be sent to the device. */
+int ubertooth_attach(ubertooth_t* ut, const char* name)
+{
+	ut->h_shm = shm_ring_attach(name);
+	return ut->h_shm ? 0 : -1;
+}
+
+/* Receive from ubertooth-stream senders instead of a device.  spec is
+ * "[host:]port". */
+int ubertooth_listen(ubertooth_t* ut, const char* spec)
+{
+	ut->h_net = net_receiver_listen(spec);
+	return ut->h_net ? 0 : -1;
+}
+
 ubertooth_t* ubertooth_start(int ubertooth_device)
 {
 	ubertooth_t* ut = ubertooth_init();
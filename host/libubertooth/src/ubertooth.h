@@ -22,8 +22,21 @@
 #ifndef __UBERTOOTH_H__
 #define __UBERTOOTH_H__
 
+#include "ubertooth_ac.h"
+#include "ubertooth_afh.h"
+#include "ubertooth_cache.h"
+#include "ubertooth_capture.h"
+#include "ubertooth_clock.h"
 #include "ubertooth_control.h"
+#include "ubertooth_filter.h"
+#include "ubertooth_metrics.h"
+#include "ubertooth_net.h"
+#include "ubertooth_output.h"
+#include "ubertooth_pcapng.h"
 #include "ubertooth_ringbuffer.h"
+#include "ubertooth_rt.h"
+#include "ubertooth_shm.h"
+#include "ubertooth_trigger.h"
 #include <btbb.h>
 
 /* specan output types
@@ -32,30 +45,88 @@ enum specan_modes {
 	SPECAN_STDOUT         = 0,
 	SPECAN_GNUPLOT_NORMAL = 1,
 	SPECAN_GNUPLOT_3D     = 2,
-	SPECAN_FILE           = 3
+	SPECAN_FILE           = 3,
+	SPECAN_FRAMES         = 4
 };
 
+/* Raw dumps written by ubertooth-rx -d hold each USB record once.  In
+ * place of a record, a marker (systime field DUMP_MARKER_SYSTIME) says
+ * that the NUM_BANKS-th record before it starts a packet.  The first
+ * record of such a dump is a header marker.  Dumps of trigger windows
+ * (ubertooth-rx -T) start each window with a window marker, as the
+ * records on either side of it are not contiguous. */
+#define DUMP_MARKER_SYSTIME 0xffffffff
+#define DUMP_MARKER_MAGIC   "UBHI"
+
+enum dump_marker_kinds {
+	DUMP_MARKER_HEADER = 0,
+	DUMP_MARKER_HIT    = 1,
+	DUMP_MARKER_WINDOW = 2
+};
+
+typedef struct {
+	uint8_t magic[4];
+	uint8_t kind;
+	uint8_t reserved[3];
+	uint8_t systime[4];   /* big endian, as in the records */
+	uint8_t seq[8];       /* big endian, record number in the stream */
+	uint8_t pad[PKT_LEN - 20];
+} dump_marker;
+
 enum board_ids {
 	BOARD_ID_UBERTOOTH_ZERO = 0,
 	BOARD_ID_UBERTOOTH_ONE  = 1,
 	BOARD_ID_TC13BADGE      = 2
 };
 
+#define UBERTOOTH_MAX_DEVICES 8
+
+/* as found by ubertooth_list_devices(), index is the -U number */
+typedef struct {
+	int index;
+	int board_id;
+	char serial[33];    /* empty if the device could not be asked */
+} ubertooth_device_info;
+
 typedef struct {
 	/* Ringbuffers for USB and Bluetooth symbols */
 	ringbuffer_t* packets;
 
 	struct libusb_device_handle* devh;
 	struct libusb_transfer* rx_xfer;
+	uint8_t* usb_bufs;
 	uint8_t* empty_usb_buf;
 	uint8_t* full_usb_buf;
 	uint8_t usb_really_full;
+	uint8_t full_records;   /* complete records in full_usb_buf */
+
+	/* stream_rx_queued(): transfers allocated, and those completed
+	 * that are resubmitted once their records are handed on */
+	struct libusb_transfer* queued_xfer[QUEUED_XFERS];
+	uint8_t num_queued;
+	uint8_t queued_done[QUEUED_XFERS];
+	uint8_t num_queued_done;
 
 	uint8_t stop_ubertooth;
-	uint64_t abs_start_ns;
-	uint32_t start_clk100ns;
-	uint64_t last_clk100ns;
-	uint64_t clk100ns_upper;
+	clock_sync clock;
+
+	/* records received, and the next one not yet in the dump */
+	uint64_t rx_seq;
+	uint64_t dump_next;
+
+	/* mode epoch of the stream, see ubertooth_mode_switch() */
+	uint8_t epoch;
+	uint8_t epoch_valid;
+	uint8_t switching;
+	uint8_t following;
+	uint8_t ring_fill;
+
+	/* records left to decode a packet of a piconet seeded from the
+	 * cache, see ubertooth_cache_seed() */
+	uint32_t verify_left;
+
+	/* AFH map estimate of rx_afh() and rx_afh_r() */
+	afh_estimator afh;
 
 #ifdef ENABLE_PCAP
 	btbb_pcap_handle* h_pcap_bredr;
@@ -64,6 +135,19 @@ typedef struct {
 
 	btbb_pcapng_handle* h_pcapng_bredr;
 	lell_pcapng_handle* h_pcapng_le;
+	pcapng_stream* h_stream_le;     /* flushed promptly, e.g. an extcap fifo */
+
+	capture_t* h_capture;
+	output_t* h_output;
+	trigger_t* h_trigger;
+	filter_t* h_filter;
+	ac_adapt_t* h_ac;
+	rt_profile_t* h_rt;
+	shm_ring* h_shm;
+	net_receiver* h_net;
+	metrics_t* h_metrics;
+	piconet_cache* h_cache;
+	btbb_piconet* cache_pn;
 } ubertooth_t;
 
 typedef void (*rx_callback)(ubertooth_t* ut, void* args);
@@ -76,20 +160,38 @@ extern uint32_t systime;
 extern FILE* infile;
 extern FILE* dumpfile;
 extern int max_ac_errors;
+extern unsigned int packet_counter_max;
+extern unsigned int afh_sightings;
 
 void print_version();
 void register_cleanup_handler(ubertooth_t* ut);
 ubertooth_t* ubertooth_init();
 int ubertooth_connect(ubertooth_t* ut, int ubertooth_device);
+int ubertooth_list_devices(ubertooth_device_info* list, int max);
+int ubertooth_attach(ubertooth_t* ut, const char* name);
+int ubertooth_listen(ubertooth_t* ut, const char* spec);
 ubertooth_t* ubertooth_start(int ubertooth_device);
 void ubertooth_stop(ubertooth_t* ut);
+void ubertooth_free(ubertooth_t* ut);
 void ubertooth_set_timeout(ubertooth_t* ut, int seconds);
 
 int ubertooth_bulk_init(ubertooth_t* ut);
 void ubertooth_bulk_wait(ubertooth_t* ut);
 int ubertooth_bulk_receive(ubertooth_t* ut, rx_callback cb, void* cb_args);
 
+void ubertooth_rx_record(ubertooth_t* ut, const usb_pkt_rx* rx, rx_callback cb, void* cb_args);
+void ubertooth_mode_switch(ubertooth_t* ut);
+int ubertooth_check_epoch(ubertooth_t* ut, const usb_pkt_rx* rx);
+void ubertooth_follow(ubertooth_t* ut, btbb_piconet* pn);
+int ubertooth_cache_seed(ubertooth_t* ut, btbb_piconet* pn, int follow);
+void ubertooth_rediscover(ubertooth_t* ut, btbb_piconet* pn);
+void ubertooth_cache_close(ubertooth_t* ut);
+int dump_write_marker(FILE* fp, uint8_t kind, uint32_t systime, uint64_t seq);
+int dump_read_marker(const uint8_t* record, dump_marker* m);
 int stream_rx_file(ubertooth_t* ut,FILE* fp, rx_callback cb, void* cb_args);
+int stream_rx_shm(ubertooth_t* ut, rx_callback cb, void* cb_args);
+int stream_rx_net(ubertooth_t* ut, rx_callback cb, void* cb_args);
+int stream_rx_queued(ubertooth_t* ut, rx_callback cb, void* cb_args, int polling);
 
 void rx_live(ubertooth_t* ut, btbb_piconet* pn, int timeout);
 void rx_file(FILE* fp, btbb_piconet* pn);
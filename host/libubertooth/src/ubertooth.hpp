@@ -0,0 +1,489 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __UBERTOOTH_HPP__
+#define __UBERTOOTH_HPP__
+
+/*
+ * Header-only C++11 front end to libubertooth.  Stages of the receive
+ * path are composed as templates, so the whole per-record path from the
+ * source to the sink compiles into one loop without the function
+ * pointers and void* arguments of rx_callback:
+ *
+ *   ubertooth::device dev(-1);
+ *   auto p = ubertooth::pipeline(
+ *       ubertooth::filter([](const usb_pkt_rx& rx) { return rx.channel == 39; }),
+ *       ubertooth::correlate(LAP_ANY, 1),
+ *       ubertooth::decode(),
+ *       [&](const ubertooth::hit& h) { ... });
+ *   ubertooth::usb_source(dev).run(p);
+ *
+ * A stage is an object with "template<class Next> void operator()(T&
+ * item, Next& next)" that calls next() for what it passes on; the last
+ * one, the sink, is any callable taking the item.  Items are records
+ * (one USB record with its host time) before correlation and hits
+ * after it.  Hits only live during the call, copy what is kept.
+ *
+ * A filter does not take records out of the stream, since the window
+ * that correlate searches has to stay contiguous.  It flags them
+ * instead, and correlate does not search a window for a flagged record.
+ *
+ * The C API is unchanged and can be mixed in through device::get().
+ */
+
+#include <cstdio>
+#include <new>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+extern "C" {
+#include "ubertooth.h"
+#include "ubertooth_capture.h"
+#include "ubertooth_filter.h"
+}
+
+namespace ubertooth {
+
+class error : public std::runtime_error {
+public:
+	explicit error(const char* what) : std::runtime_error(what) { }
+};
+
+/* Owns an ubertooth_t and its libusb handles. */
+class device {
+public:
+	explicit device(int index = -1) : ut_(ubertooth_init())
+	{
+		if (ut_ == NULL)
+			throw std::bad_alloc();
+		if (ubertooth_connect(ut_, index) < 0) {
+			ubertooth_free(ut_);
+			throw error("unable to open the Ubertooth device");
+		}
+	}
+
+	~device() { close(); }
+
+	device(device&& other) : ut_(other.ut_) { other.ut_ = NULL; }
+	device& operator=(device&& other)
+	{
+		if (this != &other) {
+			close();
+			ut_ = other.ut_;
+			other.ut_ = NULL;
+		}
+		return *this;
+	}
+	device(const device&) = delete;
+	device& operator=(const device&) = delete;
+
+	ubertooth_t* get() const { return ut_; }
+	struct libusb_device_handle* handle() const { return ut_->devh; }
+
+	/* Ends usb_source::run() after the current transfer, also from a
+	 * sink or a signal handler. */
+	void stop() { ut_->stop_ubertooth = 1; }
+
+	void close()
+	{
+		struct timeval tv = { 0, 100000 };
+		int tries = 10;
+
+		if (ut_ == NULL)
+			return;
+		/* cb_xfer frees the transfer once the cancellation completes */
+		if (ut_->rx_xfer != NULL) {
+			libusb_cancel_transfer(ut_->rx_xfer);
+			while (ut_->rx_xfer != NULL && tries-- > 0)
+				libusb_handle_events_timeout(NULL, &tv);
+		}
+		ubertooth_stop(ut_);
+		ubertooth_free(ut_);
+		ut_ = NULL;
+	}
+
+private:
+	ubertooth_t* ut_;
+};
+
+/* One USB record and its host time.  A record flagged as a segment
+ * start does not follow on from the previous one; one flagged as
+ * skipped was rejected by a filter. */
+struct record {
+	const usb_pkt_rx* rx;
+	uint64_t ts_ns;
+	bool segment;
+	bool skip;
+};
+
+/* An access code found by correlate, in the window of NUM_BANKS records
+ * starting with rx.  decode fills in clkn. */
+struct hit {
+	const usb_pkt_rx* rx;
+	uint64_t ts_ns;
+	btbb_packet* pkt;
+	int offset;                 /* of the access code in syms */
+	char* syms;                 /* NUM_BANKS * BANK_LEN symbols */
+	uint32_t clkn;
+};
+
+/* Composition: chain<Stage, Next> passes items through Stage into Next. */
+template<class Stage, class Next>
+class chain {
+public:
+	chain(Stage stage, Next next) : stage_(std::move(stage)), next_(std::move(next)) { }
+
+	template<class T>
+	void operator()(T& item) { stage_(item, next_); }
+	template<class T>
+	void operator()(const T& item) { stage_(item, next_); }
+
+private:
+	Stage stage_;
+	Next next_;
+};
+
+template<class... S>
+struct composed;
+
+template<class Sink>
+struct composed<Sink> {
+	typedef Sink type;
+	static type make(Sink sink) { return sink; }
+};
+
+template<class Stage, class... Rest>
+struct composed<Stage, Rest...> {
+	typedef chain<Stage, typename composed<Rest...>::type> type;
+	static type make(Stage stage, Rest... rest)
+	{
+		return type(std::move(stage), composed<Rest...>::make(std::move(rest)...));
+	}
+};
+
+/* pipeline(stage..., sink) */
+template<class... S>
+typename composed<S...>::type pipeline(S... s)
+{
+	return composed<S...>::make(std::move(s)...);
+}
+
+/* Flags the records for which pred(const usb_pkt_rx&) is false as
+ * skipped and passes all of them on. */
+template<class Pred>
+class filter_stage {
+public:
+	explicit filter_stage(Pred pred) : pred_(std::move(pred)) { }
+
+	template<class Next>
+	void operator()(const record& r, Next& next)
+	{
+		record out = r;
+
+		out.skip = r.skip || !pred_(*r.rx);
+		next(out);
+	}
+
+private:
+	Pred pred_;
+};
+
+template<class Pred>
+filter_stage<Pred> filter(Pred pred)
+{
+	return filter_stage<Pred>(std::move(pred));
+}
+
+/* Skips the records that a compiled -F expression rejects, so that no
+ * symbols are correlated for them. */
+struct capture_filter_pred {
+	const filter_t* f;
+	bool operator()(const usb_pkt_rx& rx) const
+	{
+		return filter_pre(f, &rx) != FILTER_FALSE;
+	}
+};
+
+inline filter_stage<capture_filter_pred> capture_filter(const filter_t* f)
+{
+	return filter_stage<capture_filter_pred>(capture_filter_pred{f});
+}
+
+/* Searches the oldest record of a window of NUM_BANKS for an access
+ * code, as cb_rx does, unless a filter skipped that record.  Each bank
+ * of symbols is kept twice, so every window is contiguous and the
+ * symbols are never copied to search. */
+class correlate {
+public:
+	explicit correlate(uint32_t lap = LAP_ANY, int max_ac_errors = 1)
+		: lap_(lap), max_ac_errors_(max_ac_errors), bank_(0), fill_(0) { }
+
+	template<class Next>
+	void operator()(const record& r, Next& next)
+	{
+		int i, j, oldest;
+
+		if (r.segment)
+			reset();
+		bank_ = (bank_ + 1) % NUM_BANKS;
+		usb_[bank_] = *r.rx;
+		ts_ns_[bank_] = r.ts_ns;
+		skip_[bank_] = r.skip;
+		char* syms = syms_ + bank_ * BANK_LEN;
+		for (i = 0; i < SYM_LEN; i++)
+			for (j = 0; j < 8; j++)
+				syms[i * 8 + j] = (r.rx->data[i] >> (7 - j)) & 1;
+		std::memcpy(syms + NUM_BANKS * BANK_LEN, syms, BANK_LEN);
+
+		if (fill_ < NUM_BANKS && ++fill_ < NUM_BANKS)
+			return;
+
+		oldest = (bank_ + 1) % NUM_BANKS;
+		const usb_pkt_rx& rx = usb_[oldest];
+		if (skip_[oldest] || (rx.status & DISCARD) ||
+		    rx.channel > NUM_BREDR_CHANNELS - 1)
+			return;
+
+		hit h = { &rx, ts_ns_[oldest], NULL, 0, syms_ + oldest * BANK_LEN, 0 };
+		h.offset = btbb_find_ac(h.syms, BANK_LEN, lap_, max_ac_errors_, &h.pkt);
+		packet_ref ref(h.pkt);
+		if (h.offset >= 0)
+			next(h);
+	}
+
+	/* after a mode switch or a gap the window would mix in records
+	 * that do not belong together */
+	void reset() { fill_ = 0; }
+
+private:
+	struct packet_ref {
+		btbb_packet* pkt;
+		explicit packet_ref(btbb_packet* p) : pkt(p) { }
+		~packet_ref() { if (pkt) btbb_packet_unref(pkt); }
+	};
+
+	uint32_t lap_;
+	int max_ac_errors_;
+	int bank_;
+	int fill_;
+	usb_pkt_rx usb_[NUM_BANKS];
+	uint64_t ts_ns_[NUM_BANKS];
+	bool skip_[NUM_BANKS];
+	char syms_[2 * NUM_BANKS * BANK_LEN];
+};
+
+/* Fills the packet of a hit with its symbols and CLKN and, given a
+ * piconet, runs it through btbb_process_packet(). */
+class decode {
+public:
+	explicit decode(btbb_piconet* pn = NULL) : pn_(pn) { }
+
+	template<class Next>
+	void operator()(hit& h, Next& next)
+	{
+		h.clkn = (h.rx->clkn_high << 20) +
+		         (le32toh(h.rx->clk100ns) + h.offset * 10 - 4000) / 3125;
+		btbb_packet_set_modulation(h.pkt, BTBB_MOD_GFSK);
+		btbb_packet_set_transport(h.pkt, BTBB_TRANSPORT_ANY);
+		btbb_packet_set_data(h.pkt, h.syms + h.offset,
+		                     NUM_BANKS * BANK_LEN - h.offset,
+		                     h.rx->channel, h.clkn);
+		if (pn_)
+			btbb_process_packet(h.pkt, pn_);
+		next(h);
+	}
+
+private:
+	btbb_piconet* pn_;
+};
+
+/* Streams the records of a device in BR symbol mode. */
+class usb_source {
+public:
+	explicit usb_source(device& dev) : dev_(dev) { }
+
+	template<class Sink>
+	void run(Sink& sink)
+	{
+		ubertooth_t* ut = dev_.get();
+		record r;
+		int i;
+
+		r.segment = false;
+		r.skip = false;
+		if (ubertooth_bulk_init(ut) < 0 || cmd_rx_syms(ut->devh) < 0)
+			throw error("unable to start receiving");
+
+		while (!ut->stop_ubertooth) {
+			ubertooth_bulk_wait(ut);
+			if (!ut->usb_really_full)
+				continue;
+			clock_sync_sample(&ut->clock);
+			for (i = 0; i < ut->full_records; i++) {
+				r.rx = (const usb_pkt_rx*)(ut->full_usb_buf + PKT_LEN * i);
+				if (r.rx->pkt_type == KEEP_ALIVE)
+					continue;
+				clock_sync_advance(&ut->clock, r.rx);
+				r.ts_ns = clock_sync_ns(&ut->clock, r.rx);
+				sink(r);
+			}
+			ut->usb_really_full = 0;
+		}
+	}
+
+private:
+	device& dev_;
+};
+
+/* Replays a raw dump (ubertooth-dump -f, ubertooth-rx -d) or a capture
+ * file.  As with stream_rx_file(), window markers start a new segment.
+ * The records of a dump holding only those around packets are held
+ * until their hit marker and only start a segment where a window does
+ * not overlap the previous one, like ubertooth-convert does. */
+class file_source {
+public:
+	explicit file_source(FILE* fp)
+		: fp_(fp), hits_only_(false), splice_(false), segment_(false),
+		  num_held_(0), windows_(0), window_end_(0) { }
+
+	template<class Sink>
+	void run(Sink& sink)
+	{
+		uint8_t buf[4 + PKT_LEN];
+		dump_marker m;
+		int kind, i;
+
+		if (fread(buf, 4, 1, fp_) != 1)
+			return;
+		if (capture_is_magic(buf)) {
+			run_capture(sink);
+			return;
+		}
+
+		clock_sync_init(&clock_);
+		while (fread(buf + 4, PKT_LEN, 1, fp_) == 1) {
+			kind = dump_read_marker(buf, &m);
+			if (kind == DUMP_MARKER_HEADER) {
+				hits_only_ = true;
+			} else if (kind == DUMP_MARKER_WINDOW) {
+				splice_ = true;
+			} else if (kind == DUMP_MARKER_HIT && hits_only_) {
+				release_window(m);
+				for (i = 0; i < num_held_; i++)
+					emit(held_[i], sink);
+				num_held_ = 0;
+			} else if (kind < 0) {
+				if (hits_only_ && num_held_ == NUM_BANKS)
+					throw error("hits-only dump without hit markers");
+				held& h = held_[hits_only_ ? num_held_++ : 0];
+				h.systime = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+				std::memcpy(&h.rx, buf + 4, PKT_LEN);
+				if (!hits_only_)
+					emit(h, sink);
+			}
+			if (fread(buf, 4, 1, fp_) != 1)
+				break;
+		}
+
+		/* a truncated dump may end without a hit marker */
+		for (i = 0; i < num_held_; i++)
+			emit(held_[i], sink);
+		num_held_ = 0;
+	}
+
+private:
+	struct held {
+		uint32_t systime;
+		usb_pkt_rx rx;
+	};
+
+	struct capture_closer {
+		void operator()(capture_t* cap) const { capture_close(cap); }
+	};
+
+	/* Hit markers carry the sequence number of the first record of
+	 * the window, a gap shows as one past the end of the previous. */
+	void release_window(const dump_marker& m)
+	{
+		uint64_t first = 0;
+		int i;
+
+		for (i = 0; i < 8; i++)
+			first = (first << 8) | m.seq[i];
+
+		if (num_held_ && windows_ && first > window_end_)
+			segment_ = true;
+		window_end_ = (first > window_end_ ? first : window_end_) + num_held_;
+		windows_++;
+	}
+
+	template<class Sink>
+	void emit(const held& h, Sink& sink)
+	{
+		record r;
+
+		if (splice_) {
+			segment_ = true;
+			splice_ = false;
+		}
+		if (segment_)
+			clock_sync_init(&clock_);
+		r.rx = &h.rx;
+		r.ts_ns = clock_sync_replay(&clock_, h.systime, &h.rx);
+		r.segment = segment_;
+		r.skip = false;
+		segment_ = false;
+		sink(r);
+	}
+
+	template<class Sink>
+	void run_capture(Sink& sink)
+	{
+		capture_record rec;
+		record r = { &rec.rx, 0, false, false };
+
+		std::unique_ptr<capture_t, capture_closer> cap(capture_open(fp_, 1));
+		if (!cap)
+			throw error("unable to read the capture file");
+		while (capture_read(cap.get(), &rec) > 0) {
+			r.ts_ns = rec.ts_ns;
+			r.segment = rec.segment;
+			sink(r);
+		}
+	}
+
+	FILE* fp_;
+	clock_sync clock_;
+	bool hits_only_;
+	bool splice_;
+	bool segment_;
+	int num_held_;
+	unsigned long windows_;
+	uint64_t window_end_;
+	held held_[NUM_BANKS];
+};
+
+} /* namespace ubertooth */
+
+#endif /* __UBERTOOTH_HPP__ */
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ubertooth_ac.h"
+
+/* btbb_init() builds its syndrome table for up to this many errors */
+#define AC_ERRORS_LIMIT 4
+
+int ac_adapt_create(const char* range, ac_adapt_t** adapt)
+{
+	ac_adapt_t* a;
+	unsigned int min, max;
+	int i;
+
+	*adapt = NULL;
+	if (sscanf(range, "%u:%u", &min, &max) != 2 || min > max || max > AC_ERRORS_LIMIT) {
+		fprintf(stderr, "Invalid AC error range '%s', use <min>:<max> within 0-%d\n",
+		        range, AC_ERRORS_LIMIT);
+		return -1;
+	}
+
+	a = (ac_adapt_t*)calloc(1, sizeof(ac_adapt_t));
+	if (a == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	a->min_errors = min;
+	a->max_errors = max;
+	for (i = 0; i < NUM_BREDR_CHANNELS; i++)
+		a->channels[i].errors = min;
+
+	*adapt = a;
+	return 0;
+}
+
+void ac_adapt_free(ac_adapt_t* adapt)
+{
+	free(adapt);
+}
+
+uint8_t ac_adapt_errors(const ac_adapt_t* adapt, uint8_t channel)
+{
+	if (channel >= NUM_BREDR_CHANNELS)
+		return adapt->min_errors;
+	return adapt->channels[channel].errors;
+}
+
+static int16_t average_noise(const ac_adapt_t* adapt)
+{
+	int32_t sum = 0;
+	int i, n = 0;
+
+	for (i = 0; i < NUM_BREDR_CHANNELS; i++) {
+		if (adapt->channels[i].has_noise) {
+			sum += adapt->channels[i].noise;
+			n++;
+		}
+	}
+	return n ? sum / n : 0;
+}
+
+static void adjust(ac_adapt_t* adapt, ac_channel* ch)
+{
+	if (ch->hits >= AC_MIN_HITS && 2 * ch->unconfirmed > ch->hits) {
+		if (ch->errors > adapt->min_errors)
+			ch->errors--;
+	} else if (ch->unconfirmed == 0 && ch->noise <= average_noise(adapt)) {
+		if (ch->errors < adapt->max_errors)
+			ch->errors++;
+	}
+
+	ch->records = 0;
+	ch->hits = 0;
+	ch->unconfirmed = 0;
+}
+
+/* Account for a record received on the channel */
+void ac_adapt_record(ac_adapt_t* adapt, uint8_t channel, int8_t noise)
+{
+	ac_channel* ch;
+
+	if (channel >= NUM_BREDR_CHANNELS)
+		return;
+	ch = &adapt->channels[channel];
+
+	if (ch->has_noise) {
+		ch->noise += (noise * 16 - ch->noise) / 32;
+	} else {
+		ch->noise = noise * 16;
+		ch->has_noise = 1;
+	}
+
+	if (++ch->records >= AC_PERIOD)
+		adjust(adapt, ch);
+}
+
+/* Account for an access code found on the channel.  Returns 1 if the
+ * hit is confirmed by an earlier one. */
+int ac_adapt_hit(ac_adapt_t* adapt, uint8_t channel, uint32_t lap, uint32_t systime)
+{
+	ac_lap* l = &adapt->laps[(lap ^ (lap >> 8) ^ (lap >> 16)) % AC_LAP_SLOTS];
+	int confirmed;
+
+	confirmed = l->lap == lap && l->last_seen &&
+	            systime - l->last_seen <= AC_LAP_WINDOW;
+	l->lap = lap;
+	l->last_seen = systime;
+
+	if (channel < NUM_BREDR_CHANNELS) {
+		adapt->channels[channel].hits++;
+		if (!confirmed)
+			adapt->channels[channel].unconfirmed++;
+	}
+	return confirmed;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_AC_H__
+#define __UBERTOOTH_AC_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * Access code error threshold adapted per channel, selected with
+ * "-E <min>:<max>".  Instead of the global max_ac_errors each channel
+ * starts at min and is re-evaluated every AC_PERIOD records received on
+ * it:
+ *
+ *  - more than half of its hits unconfirmed: one error less
+ *  - no unconfirmed hit and a noise level not above the average of
+ *    all channels: one error more
+ *
+ * A hit is confirmed when its LAP was already seen on any channel in
+ * the last AC_LAP_WINDOW seconds; random false LAPs rarely repeat.
+ */
+
+#define AC_PERIOD      1000  /* records per channel between adjustments */
+#define AC_MIN_HITS    4     /* hits before a channel can be judged noisy */
+#define AC_LAP_WINDOW  60    /* seconds a LAP confirms later hits */
+#define AC_LAP_SLOTS   256
+
+typedef struct {
+	uint8_t errors;
+	uint16_t records;
+	uint16_t hits;
+	uint16_t unconfirmed;
+	int16_t noise;      /* dBm, 1/16 steps, exponentially averaged */
+	uint8_t has_noise;
+} ac_channel;
+
+typedef struct {
+	uint32_t lap;
+	uint32_t last_seen;
+} ac_lap;
+
+typedef struct {
+	uint8_t min_errors;
+	uint8_t max_errors;
+	ac_channel channels[NUM_BREDR_CHANNELS];
+	ac_lap laps[AC_LAP_SLOTS];
+} ac_adapt_t;
+
+int ac_adapt_create(const char* range, ac_adapt_t** adapt);
+void ac_adapt_free(ac_adapt_t* adapt);
+
+uint8_t ac_adapt_errors(const ac_adapt_t* adapt, uint8_t channel);
+void ac_adapt_record(ac_adapt_t* adapt, uint8_t channel, int8_t noise);
+int ac_adapt_hit(ac_adapt_t* adapt, uint8_t channel, uint32_t lap, uint32_t systime);
+
+#endif /* __UBERTOOTH_AC_H__ */
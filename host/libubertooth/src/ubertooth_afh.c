@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "ubertooth_afh.h"
+
+static void unlink_channel(afh_estimator* est, uint8_t c)
+{
+	if (est->prev[c] == AFH_NONE)
+		est->head = est->next[c];
+	else
+		est->next[est->prev[c]] = est->next[c];
+	if (est->next[c] == AFH_NONE)
+		est->tail = est->prev[c];
+	else
+		est->prev[est->next[c]] = est->prev[c];
+}
+
+static void append_channel(afh_estimator* est, uint8_t c)
+{
+	est->prev[c] = est->tail;
+	est->next[c] = AFH_NONE;
+	if (est->tail == AFH_NONE)
+		est->head = c;
+	else
+		est->next[est->tail] = c;
+	est->tail = c;
+}
+
+void afh_estimator_init(afh_estimator* est, uint32_t expiry, uint8_t sightings)
+{
+	memset(est, 0, sizeof(afh_estimator));
+	est->expiry = expiry;
+	est->sightings = sightings ? sightings : 1;
+	est->head = est->tail = AFH_NONE;
+}
+
+/* Start from a known map, as if each of its channels had just been
+ * confirmed. */
+void afh_estimator_seed(afh_estimator* est, const uint8_t* afh_map)
+{
+	uint8_t c;
+
+	afh_estimator_init(est, est->expiry, est->sightings);
+	for (c = 0; c < NUM_BREDR_CHANNELS; c++) {
+		if (afh_map[c / 8] & (1 << (c % 8))) {
+			est->score[c] = est->sightings;
+			est->used[c] = 1;
+			append_channel(est, c);
+		}
+	}
+}
+
+/* Account for a packet of the piconet on a channel.  Returns the number
+ * of map changes, listed in est->changes. */
+int afh_estimator_update(afh_estimator* est, uint8_t channel)
+{
+	uint8_t c;
+
+	est->num_changes = 0;
+	if (channel >= NUM_BREDR_CHANNELS)
+		return 0;
+
+	est->counter++;
+	if (est->score[channel])
+		unlink_channel(est, channel);
+	append_channel(est, channel);
+	est->last_seen[channel] = est->counter;
+	if (est->score[channel] < 255)
+		est->score[channel]++;
+
+	if (!est->used[channel] && est->score[channel] >= est->sightings) {
+		est->used[channel] = 1;
+		est->changes[est->num_changes++] = channel | AFH_ADDED;
+	}
+
+	while (est->expiry && est->head != AFH_NONE &&
+	       est->counter - est->last_seen[est->head] >= est->expiry) {
+		c = est->head;
+		unlink_channel(est, c);
+		est->score[c] = 0;
+		if (est->used[c]) {
+			est->used[c] = 0;
+			est->changes[est->num_changes++] = c;
+		}
+	}
+
+	return est->num_changes;
+}
+
+void afh_estimator_get_map(const afh_estimator* est, uint8_t* afh_map)
+{
+	uint8_t c;
+
+	memset(afh_map, 0, 10);
+	for (c = 0; c < NUM_BREDR_CHANNELS; c++)
+		if (est->used[c])
+			afh_map[c / 8] |= 1 << (c % 8);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_AFH_H__
+#define __UBERTOOTH_AFH_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * AFH channel map estimation from the channels packets of a piconet
+ * are seen on.  Time is counted in packets of the piconet.
+ *
+ * Each sighting raises a channel's score; a channel joins the map once
+ * its score reaches `sightings', so a single noisy sighting does not
+ * add it.  A channel leaves the map, and its score is reset, after
+ * `expiry' packets without a sighting.  All channels expire after the
+ * same number of packets, so a list ordered by last sighting expires
+ * them in order and an update costs O(1) amortised.
+ */
+
+#define AFH_SIGHTINGS_DEFAULT 2
+#define AFH_ADDED             0x80   /* in changes[], with the channel */
+#define AFH_NONE              0xff
+
+typedef struct {
+	uint32_t expiry;     /* 0 never expires */
+	uint8_t sightings;
+	uint32_t counter;
+
+	uint32_t last_seen[NUM_BREDR_CHANNELS];
+	uint8_t score[NUM_BREDR_CHANNELS];
+	uint8_t used[NUM_BREDR_CHANNELS];
+
+	/* channels with a score, least recently seen first */
+	uint8_t prev[NUM_BREDR_CHANNELS];
+	uint8_t next[NUM_BREDR_CHANNELS];
+	uint8_t head;
+	uint8_t tail;
+
+	/* the map changes made by the last update */
+	uint8_t changes[NUM_BREDR_CHANNELS];
+	int num_changes;
+} afh_estimator;
+
+void afh_estimator_init(afh_estimator* est, uint32_t expiry, uint8_t sightings);
+void afh_estimator_seed(afh_estimator* est, const uint8_t* afh_map);
+int afh_estimator_update(afh_estimator* est, uint8_t channel);
+void afh_estimator_get_map(const afh_estimator* est, uint8_t* afh_map);
+
+#endif /* __UBERTOOTH_AFH_H__ */
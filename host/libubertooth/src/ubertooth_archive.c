@@ -0,0 +1,590 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ubertooth_archive.h"
+#include "ubertooth_specan.h"
+
+static const uint64_t interval_ns[ARCHIVE_LEVELS] = {
+	0, 1000000000ull, 60000000000ull, 3600000000000ull
+};
+
+/* copies of a row that is being rewritten before giving up on it */
+#define COPY_TRIES 8
+
+static const char* level_names[ARCHIVE_LEVELS] = {
+	"raw", "second", "minute", "hour"
+};
+
+static uint64_t align(uint64_t v, uint64_t a)
+{
+	return (v + a - 1) & ~(a - 1);
+}
+
+static size_t state_size(uint16_t bins)
+{
+	return sizeof(archive_state) + bins * (sizeof(int64_t) + sizeof(uint32_t) + 1);
+}
+
+static size_t row_size(int level, uint16_t bins)
+{
+	return align(sizeof(archive_row) + bins * (level == ARCHIVE_RAW ? 1 : 2), 8);
+}
+
+/* Lay out the levels after the header, each on its own pages.
+ * Returns the size of the file. */
+static uint64_t layout(archive_header* hdr, const uint32_t* rows)
+{
+	uint64_t offset = ARCHIVE_HEADER_SIZE;
+	archive_level* lv;
+	int l;
+
+	for (l = 0; l < ARCHIVE_LEVELS; l++) {
+		lv = &hdr->levels[l];
+		lv->interval_ns = interval_ns[l];
+		lv->rows = rows[l];
+		lv->row_size = row_size(l, hdr->bins);
+		if (l != ARCHIVE_RAW) {
+			lv->state = offset;
+			offset = align(offset + state_size(hdr->bins), ARCHIVE_ALIGN);
+		}
+		lv->offset = offset;
+		offset = align(offset + (uint64_t)lv->rows * lv->row_size, ARCHIVE_ALIGN);
+	}
+	return offset;
+}
+
+static int validate(const char* path, const archive_header* hdr, size_t size)
+{
+	const archive_level* lv;
+	int l;
+
+	if (size < ARCHIVE_HEADER_SIZE || memcmp(hdr->magic, ARCHIVE_MAGIC, 4) != 0 ||
+	    hdr->version != ARCHIVE_VERSION || hdr->bins == 0)
+		goto invalid;
+
+	for (l = 0; l < ARCHIVE_LEVELS; l++) {
+		lv = &hdr->levels[l];
+		if (lv->rows == 0 || lv->row_size < row_size(l, hdr->bins) ||
+		    lv->offset + (uint64_t)lv->rows * lv->row_size > size)
+			goto invalid;
+		if (l != ARCHIVE_RAW && (lv->interval_ns == 0 ||
+		    lv->state + state_size(hdr->bins) > size))
+			goto invalid;
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s is not a compatible spectrum archive\n", path);
+	return -1;
+}
+
+static specan_archive* map_archive(const char* path, int fd, size_t size, int writable)
+{
+	specan_archive* a;
+	void* p;
+
+	p = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	         MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	a = (specan_archive*)calloc(1, sizeof(specan_archive));
+	if (a == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		munmap(p, size);
+		return NULL;
+	}
+	a->map = (uint8_t*)p;
+	a->size = size;
+	a->writable = writable;
+	a->hdr = (archive_header*)p;
+
+	if (validate(path, a->hdr, size) < 0) {
+		specan_archive_close(a);
+		return NULL;
+	}
+	return a;
+}
+
+specan_archive* specan_archive_create(const char* path, uint16_t low, uint16_t high,
+                                      const uint32_t* rows)
+{
+	specan_archive* a;
+	archive_header hdr;
+	struct stat st;
+	uint64_t size;
+	int fd, l;
+
+	if (high < low) {
+		fprintf(stderr, "Invalid sweep range %u-%u MHz\n", low, high);
+		return NULL;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	if (st.st_size > 0) {
+		a = map_archive(path, fd, st.st_size, 1);
+		close(fd);
+		if (a && (a->hdr->low_mhz != low || a->hdr->bins != high - low + 1)) {
+			fprintf(stderr, "%s holds %u-%u MHz, not %u-%u MHz\n", path,
+			        a->hdr->low_mhz, a->hdr->low_mhz + a->hdr->bins - 1,
+			        low, high);
+			specan_archive_close(a);
+			return NULL;
+		}
+		return a;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ARCHIVE_MAGIC, 4);
+	hdr.version = ARCHIVE_VERSION;
+	hdr.low_mhz = low;
+	hdr.bins = high - low + 1;
+	hdr.rssi_offset = SPECAN_RSSI_OFFSET;
+	for (l = 0; l < ARCHIVE_LEVELS; l++) {
+		if (rows[l] == 0) {
+			fprintf(stderr, "Every level of an archive needs rows\n");
+			close(fd);
+			return NULL;
+		}
+	}
+	size = layout(&hdr, rows);
+
+	/* the rows stay sparse until they are written */
+	if (ftruncate(fd, size) < 0) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	a = map_archive(path, fd, size, 1);
+	close(fd);
+	if (a == NULL)
+		return NULL;
+
+	for (l = ARCHIVE_SECONDS; l < ARCHIVE_LEVELS; l++)
+		memset(a->map + a->hdr->levels[l].state + sizeof(archive_state) +
+		       a->hdr->bins * (sizeof(int64_t) + sizeof(uint32_t)),
+		       SPECAN_RSSI_NONE, a->hdr->bins);
+
+	return a;
+}
+
+specan_archive* specan_archive_open(const char* path)
+{
+	specan_archive* a;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	a = map_archive(path, fd, st.st_size, 0);
+	close(fd);
+	return a;
+}
+
+void specan_archive_close(specan_archive* a)
+{
+	if (a == NULL)
+		return;
+	if (a->writable && msync(a->map, a->size, MS_SYNC) < 0)
+		perror("msync");
+	munmap(a->map, a->size);
+	free(a);
+}
+
+static archive_row* slot(const specan_archive* a, int level, uint64_t n)
+{
+	const archive_level* lv = &a->hdr->levels[level];
+
+	return (archive_row*)(a->map + lv->offset + (n % lv->rows) * lv->row_size);
+}
+
+/* readers skip the row from here until row_end() */
+static void row_begin(archive_row* row)
+{
+	__atomic_store_n(&row->key, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void row_end(archive_row* row, uint64_t n)
+{
+	__atomic_store_n(&row->key, n + 1, __ATOMIC_RELEASE);
+}
+
+static void set_head(archive_level* lv, uint64_t head)
+{
+	__atomic_store_n(&lv->head, head, __ATOMIC_RELEASE);
+}
+
+static archive_state* state(const specan_archive* a, int level)
+{
+	return (archive_state*)(a->map + a->hdr->levels[level].state);
+}
+
+static int64_t* state_sum(archive_state* st)
+{
+	return (int64_t*)(st + 1);
+}
+
+static uint32_t* state_samples(archive_state* st, uint16_t bins)
+{
+	return (uint32_t*)(state_sum(st) + bins);
+}
+
+static int8_t* state_max(archive_state* st, uint16_t bins)
+{
+	return (int8_t*)(state_samples(st, bins) + bins);
+}
+
+static void accumulate(specan_archive* a, int level, uint64_t ts_ns,
+                       archive_state* from, const int8_t* rssi);
+
+/* Write the row of the completed interval and pass it on to the next
+ * coarser level. */
+static void flush(specan_archive* a, int level)
+{
+	uint16_t i, bins = a->hdr->bins;
+	archive_level* lv = &a->hdr->levels[level];
+	archive_state* st = state(a, level);
+	int64_t* sum = state_sum(st);
+	uint32_t* samples = state_samples(st, bins);
+	int8_t* max = state_max(st, bins);
+	archive_row* row = slot(a, level, st->interval);
+	int64_t n;
+
+	row_begin(row);
+	row->ts_ns = st->interval * lv->interval_ns;
+	row->sweeps = st->sweeps;
+	memcpy(row->rssi, max, bins);
+	for (i = 0; i < bins; i++) {
+		n = samples[i];
+		if (n == 0) {
+			row->rssi[bins + i] = SPECAN_RSSI_NONE;
+			continue;
+		}
+		/* rounded to the nearest */
+		row->rssi[bins + i] = (int8_t)((sum[i] >= 0 ? sum[i] + n / 2
+		                                            : sum[i] - n / 2) / n);
+	}
+	row_end(row, st->interval);
+	if (st->interval + 1 > lv->head)
+		set_head(lv, st->interval + 1);
+
+	if (level + 1 < ARCHIVE_LEVELS)
+		accumulate(a, level + 1, row->ts_ns, st, NULL);
+
+	st->sweeps = 0;
+	memset(sum, 0, bins * sizeof(int64_t));
+	memset(samples, 0, bins * sizeof(uint32_t));
+	memset(max, SPECAN_RSSI_NONE, bins);
+}
+
+/* Add a sweep, or the accumulator of a finer level, to the interval
+ * holding ts_ns. */
+static void accumulate(specan_archive* a, int level, uint64_t ts_ns,
+                       archive_state* from, const int8_t* rssi)
+{
+	uint16_t i, bins = a->hdr->bins;
+	archive_state* st = state(a, level);
+	uint64_t interval = ts_ns / a->hdr->levels[level].interval_ns;
+	int64_t* sum = state_sum(st);
+	uint32_t* samples = state_samples(st, bins);
+	int8_t* max = state_max(st, bins);
+	int8_t* from_max;
+
+	if (st->sweeps && st->interval != interval)
+		flush(a, level);
+	st->interval = interval;
+
+	if (from) {
+		from_max = state_max(from, bins);
+		for (i = 0; i < bins; i++) {
+			if (from_max[i] > max[i])
+				max[i] = from_max[i];
+			sum[i] += state_sum(from)[i];
+			samples[i] += state_samples(from, bins)[i];
+		}
+		st->sweeps += from->sweeps;
+		return;
+	}
+
+	for (i = 0; i < bins; i++) {
+		if (rssi[i] == SPECAN_RSSI_NONE)
+			continue;
+		if (rssi[i] > max[i])
+			max[i] = rssi[i];
+		sum[i] += rssi[i];
+		samples[i]++;
+	}
+	st->sweeps++;
+}
+
+void specan_archive_add(specan_archive* a, const int8_t* rssi, uint64_t ts_ns)
+{
+	archive_level* lv = &a->hdr->levels[ARCHIVE_RAW];
+	uint64_t n = lv->head;
+	archive_row* row = slot(a, ARCHIVE_RAW, n);
+	archive_row* prev;
+
+	if (a->hdr->first_ns == 0)
+		a->hdr->first_ns = ts_ns;
+
+	/* an interval already written must not be written again, so host
+	 * time stepping back is held until it has caught up */
+	if (n > 0) {
+		prev = slot(a, ARCHIVE_RAW, n - 1);
+		if (prev->key == n && ts_ns < prev->ts_ns)
+			ts_ns = prev->ts_ns;
+	}
+
+	row_begin(row);
+	row->ts_ns = ts_ns;
+	row->sweeps = 1;
+	memcpy(row->rssi, rssi, a->hdr->bins);
+	row_end(row, n);
+	set_head(lv, n + 1);
+
+	accumulate(a, ARCHIVE_SECONDS, ts_ns, NULL, rssi);
+}
+
+/* Copy the first len bytes of row n.  A row that is being rewritten
+ * has no key, it is copied again until the writer is done with it. */
+static int copy_row(const specan_archive* a, int level, uint64_t n,
+                    archive_row* out, size_t len)
+{
+	const archive_row* row = slot(a, level, n);
+	uint64_t key;
+	int tries;
+
+	for (tries = 0; tries < COPY_TRIES; tries++) {
+		key = __atomic_load_n(&row->key, __ATOMIC_ACQUIRE);
+		if (key == 0)
+			continue;
+		if (key != n + 1)
+			return -1;
+		memcpy(out, row, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&row->key, __ATOMIC_RELAXED) == key)
+			return 0;
+	}
+	return -1;
+}
+
+int specan_archive_copy(const specan_archive* a, int level, uint64_t n,
+                        archive_row* row)
+{
+	return copy_row(a, level, n, row, a->hdr->levels[level].row_size);
+}
+
+/* host time of row n */
+static int row_ts(const specan_archive* a, int level, uint64_t n, uint64_t* ts_ns)
+{
+	archive_row row;
+
+	if (copy_row(a, level, n, &row, sizeof(row)) < 0)
+		return -1;
+	*ts_ns = row.ts_ns;
+	return 0;
+}
+
+const int8_t* specan_archive_max(const specan_archive* a __attribute__((unused)),
+                                 int level __attribute__((unused)),
+                                 const archive_row* row)
+{
+	return row->rssi;
+}
+
+/* raw rows are their own mean */
+const int8_t* specan_archive_mean(const specan_archive* a, int level,
+                                  const archive_row* row)
+{
+	return level == ARCHIVE_RAW ? row->rssi : row->rssi + a->hdr->bins;
+}
+
+static uint64_t head(const specan_archive* a, int level)
+{
+	return __atomic_load_n(&a->hdr->levels[level].head, __ATOMIC_ACQUIRE);
+}
+
+/* the oldest row number that may still be held */
+static uint64_t oldest(const specan_archive* a, int level, uint64_t h)
+{
+	const archive_level* lv = &a->hdr->levels[level];
+	uint64_t n = h > lv->rows ? h - lv->rows : 0;
+	uint64_t first;
+
+	if (level != ARCHIVE_RAW) {
+		first = a->hdr->first_ns / lv->interval_ns;
+		if (n < first)
+			n = first;
+	}
+	return n;
+}
+
+int specan_archive_span(const specan_archive* a, int level,
+                        uint64_t* start_ns, uint64_t* end_ns)
+{
+	const archive_level* lv = &a->hdr->levels[level];
+	uint64_t h = head(a, level);
+	uint64_t n;
+
+	if (h == 0)
+		return -1;
+
+	if (level != ARCHIVE_RAW) {
+		*start_ns = oldest(a, level, h) * lv->interval_ns;
+		*end_ns = h * lv->interval_ns;
+		return 0;
+	}
+
+	/* the oldest rows may be overwritten meanwhile */
+	for (n = oldest(a, level, h); n < h; n++)
+		if (row_ts(a, level, n, start_ns) == 0)
+			break;
+	if (n == h)
+		return -1;
+	if (row_ts(a, level, h - 1, end_ns) == 0)
+		*end_ns += 1;
+	else
+		*end_ns = *start_ns + 1;
+	return 0;
+}
+
+uint64_t specan_archive_find(const specan_archive* a, uint64_t ts_ns)
+{
+	uint64_t h = head(a, ARCHIVE_RAW);
+	uint64_t lo = oldest(a, ARCHIVE_RAW, h);
+	uint64_t hi = h;
+	uint64_t mid, row_ns;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (row_ts(a, ARCHIVE_RAW, mid, &row_ns) < 0 || row_ns < ts_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int specan_archive_level(const specan_archive* a, uint64_t start_ns,
+                         uint64_t end_ns, uint64_t max_rows)
+{
+	uint64_t s, e, rows, ival;
+	int l, coarsest = ARCHIVE_HOURS;
+
+	if (start_ns < a->hdr->first_ns)
+		start_ns = a->hdr->first_ns;
+	if (end_ns < start_ns)
+		end_ns = start_ns;
+
+	for (l = 0; l < ARCHIVE_LEVELS; l++) {
+		if (specan_archive_span(a, l, &s, &e) < 0)
+			continue;
+		coarsest = l;
+		if (s > start_ns)
+			continue;
+		ival = a->hdr->levels[l].interval_ns;
+		if (l == ARCHIVE_RAW)
+			rows = specan_archive_find(a, end_ns) - specan_archive_find(a, start_ns);
+		else
+			rows = (end_ns - start_ns + ival - 1) / ival;
+		if (rows <= max_rows)
+			return l;
+	}
+	return coarsest;
+}
+
+int64_t specan_archive_read(const specan_archive* a, int level, uint64_t start_ns,
+                            uint64_t end_ns, archive_cb cb, void* args)
+{
+	archive_row* row;
+	uint64_t h = head(a, level);
+	uint64_t ival = a->hdr->levels[level].interval_ns;
+	uint64_t n, last;
+	int64_t count = 0;
+
+	if (h == 0 || end_ns <= start_ns)
+		return 0;
+
+	row = (archive_row*)malloc(a->hdr->levels[level].row_size);
+	if (row == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+
+	if (level == ARCHIVE_RAW) {
+		n = specan_archive_find(a, start_ns);
+		last = h - 1;
+	} else {
+		n = start_ns / ival;
+		last = (end_ns - 1) / ival;
+		if (last > h - 1)
+			last = h - 1;
+	}
+	if (n < oldest(a, level, h))
+		n = oldest(a, level, h);
+
+	for (; n <= last; n++) {
+		if (specan_archive_copy(a, level, n, row) < 0)
+			continue;
+		if (row->ts_ns >= end_ns)
+			break;
+		if (cb(a, level, row, args) < 0) {
+			count = -1;
+			break;
+		}
+		count++;
+	}
+	free(row);
+	return count;
+}
+
+const char* specan_archive_level_name(int level)
+{
+	return level >= 0 && level < ARCHIVE_LEVELS ? level_names[level] : "unknown";
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __UBERTOOTH_ARCHIVE_H__
+#define __UBERTOOTH_ARCHIVE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Spectrum archive for long-term occupancy recording.  A fixed size
+ * file holds the sweeps of a frequency range at several resolutions:
+ *
+ *   ARCHIVE_RAW      every sweep, one int8 raw RSSI per MHz, for a
+ *                    recent window of sweeps
+ *   ARCHIVE_SECONDS  max and mean of each bin per second,
+ *   ARCHIVE_MINUTES  per minute
+ *   ARCHIVE_HOURS    and per hour
+ *
+ * Every level is a ring of rows.  Raw rows are addressed by sweep
+ * number, the rows of the other levels by interval number (host time
+ * divided by the interval), so a time span is found without reading
+ * any other row.  Coarser levels are built from the finer ones as
+ * intervals complete; the accumulators of the incomplete intervals are
+ * kept in the file too, so recording continues where it stopped after
+ * a restart or a crash.
+ *
+ * Readers map the file read-only, also while it is being recorded, and
+ * use copies of the rows.  The writer clears the key of a row before
+ * rewriting it, so a copy is intact if the key is still the same after
+ * it was made.  Host time that steps back is held at the newest sweep,
+ * so rows are never rewritten for the same key.  Fields are in host
+ * byte order.
+ */
+
+#define ARCHIVE_MAGIC       "UTSA"
+#define ARCHIVE_VERSION     1
+#define ARCHIVE_HEADER_SIZE 4096
+#define ARCHIVE_ALIGN       4096
+
+enum archive_levels {
+	ARCHIVE_RAW     = 0,
+	ARCHIVE_SECONDS = 1,
+	ARCHIVE_MINUTES = 2,
+	ARCHIVE_HOURS   = 3,
+	ARCHIVE_LEVELS
+};
+
+/* default rows: about 3 to 10 hours of sweeps, 2 days, 90 days, 10 years */
+#define ARCHIVE_DEFAULT_RAW     (1 << 20)
+#define ARCHIVE_DEFAULT_SECONDS (2 * 86400)
+#define ARCHIVE_DEFAULT_MINUTES (90 * 1440)
+#define ARCHIVE_DEFAULT_HOURS   (10 * 8760)
+
+typedef struct {
+	uint64_t interval_ns;    /* 0 for ARCHIVE_RAW */
+	uint64_t offset;         /* of row 0 in the file */
+	uint64_t state;          /* of the accumulator, 0 for ARCHIVE_RAW */
+	uint64_t head;           /* raw: next sweep number,
+	                            otherwise newest interval + 1 */
+	uint32_t rows;
+	uint32_t row_size;
+} archive_level;
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint16_t low_mhz;
+	uint16_t bins;
+	int8_t rssi_offset;      /* add to raw RSSI for dBm */
+	uint8_t pad[3];
+	uint64_t first_ns;       /* host time of the first sweep */
+	archive_level levels[ARCHIVE_LEVELS];
+} archive_header;
+
+/* Raw rows hold bins RSSI values, the others bins max values followed
+ * by bins means.  Bins without a sample hold SPECAN_RSSI_NONE. */
+typedef struct {
+	uint64_t key;            /* sweep or interval number + 1, 0 if unused */
+	uint64_t ts_ns;          /* of the sweep or the start of the interval */
+	uint32_t sweeps;
+	uint32_t pad;
+	int8_t rssi[];
+} archive_row;
+
+/* accumulator of the interval being filled, followed by
+ * int64_t sum[bins], uint32_t samples[bins] and int8_t max[bins] */
+typedef struct {
+	uint64_t interval;
+	uint32_t sweeps;
+	uint32_t pad;
+} archive_state;
+
+typedef struct {
+	uint8_t* map;
+	size_t size;
+	int writable;
+	archive_header* hdr;
+} specan_archive;
+
+/* Create the archive, or continue one recorded for the same range.
+ * rows holds the rows of each level for a new file. */
+specan_archive* specan_archive_create(const char* path, uint16_t low, uint16_t high,
+                                      const uint32_t* rows);
+void specan_archive_add(specan_archive* a, const int8_t* rssi, uint64_t ts_ns);
+
+specan_archive* specan_archive_open(const char* path);
+void specan_archive_close(specan_archive* a);
+
+/* Copy row n of a level to row, which holds row_size bytes of the
+ * level.  Returns -1 if it is not in the archive (any more). */
+int specan_archive_copy(const specan_archive* a, int level, uint64_t n,
+                        archive_row* row);
+const int8_t* specan_archive_max(const specan_archive* a, int level,
+                                 const archive_row* row);
+const int8_t* specan_archive_mean(const specan_archive* a, int level,
+                                  const archive_row* row);
+
+/* Time span [start, end) held by a level; -1 if it is empty */
+int specan_archive_span(const specan_archive* a, int level,
+                        uint64_t* start_ns, uint64_t* end_ns);
+/* First sweep at or after ts_ns */
+uint64_t specan_archive_find(const specan_archive* a, uint64_t ts_ns);
+/* The finest level that holds start_ns in at most max_rows rows, else
+ * the coarsest one holding any data */
+int specan_archive_level(const specan_archive* a, uint64_t start_ns,
+                         uint64_t end_ns, uint64_t max_rows);
+
+/* Call cb with a copy of each row of the level in [start_ns, end_ns),
+ * in time order.  Returns the number of rows, or -1 if cb returned < 0. */
+typedef int (*archive_cb)(const specan_archive* a, int level,
+                          const archive_row* row, void* args);
+int64_t specan_archive_read(const specan_archive* a, int level, uint64_t start_ns,
+                            uint64_t end_ns, archive_cb cb, void* args);
+
+const char* specan_archive_level_name(int level);
+
+#endif /* __UBERTOOTH_ARCHIVE_H__ */
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "ubertooth_cache.h"
+
+#define CLK27_MASK   0x7ffffff
+#define CLK_TICK_NS  312500ull
+#define LINE_LEN     1024
+
+static uint64_t realtime_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return 1000000000ull * (uint64_t)tv.tv_sec + 1000ull * (uint64_t)tv.tv_usec;
+}
+
+static piconet_entry* add_entry(piconet_cache* cache, uint32_t lap)
+{
+	piconet_entry* e;
+
+	if (cache->num_entries == cache->size) {
+		int size = cache->size ? 2 * cache->size : 16;
+		e = (piconet_entry*)realloc(cache->entries, size * sizeof(piconet_entry));
+		if (e == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return NULL;
+		}
+		cache->entries = e;
+		cache->size = size;
+	}
+	e = &cache->entries[cache->num_entries++];
+	memset(e, 0, sizeof(piconet_entry));
+	e->lap = lap;
+
+	return e;
+}
+
+static int parse_line(piconet_entry* e, char* p)
+{
+	char* end;
+	int i;
+
+	e->uap = strtoul(p, &end, 16);
+	e->flags = strtoul(end, &end, 16);
+	e->clk = strtoul(end, &end, 16);
+	e->clk_time_ns = strtoull(end, &end, 10);
+	e->updated = strtoull(end, &end, 10);
+
+	while (*end == ' ')
+		end++;
+	for (i = 0; i < 10; i++) {
+		if (sscanf(end + 2 * i, "%2hhx", &e->afh_map[i]) != 1)
+			return -1;
+	}
+	end += 20;
+
+	for (i = 0; i < NUM_BREDR_CHANNELS; i++) {
+		p = end + (i ? 1 : 0);
+		e->packets[i] = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Load the cache.  A missing file is an empty cache. */
+piconet_cache* piconet_cache_open(const char* path)
+{
+	piconet_cache* cache;
+	piconet_entry* e;
+	char line[LINE_LEN];
+	char* end;
+	uint32_t lap;
+	int n = 0;
+	FILE* fp;
+
+	cache = (piconet_cache*)calloc(1, sizeof(piconet_cache));
+	if (cache == NULL || (cache->path = strdup(path)) == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(cache);
+		return NULL;
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno == ENOENT)
+			return cache;
+		perror(path);
+		piconet_cache_close(cache);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		lap = strtoul(line, &end, 16);
+		e = add_entry(cache, lap);
+		if (e == NULL)
+			break;
+		if (end == line || parse_line(e, end) < 0) {
+			fprintf(stderr, "%s:%d: ignoring invalid entry\n", path, n);
+			cache->num_entries--;
+		}
+	}
+	fclose(fp);
+
+	return cache;
+}
+
+/* Write to a temporary file first, so that an interrupted run never
+ * leaves a truncated cache behind. */
+int piconet_cache_save(piconet_cache* cache)
+{
+	char tmp[1024];
+	piconet_entry* e;
+	FILE* fp;
+	int i, j;
+
+	if (!cache->dirty)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "# lap uap flags clk clk_time updated afh_map packets\n");
+	for (i = 0; i < cache->num_entries; i++) {
+		e = &cache->entries[i];
+		fprintf(fp, "%06x %02x %x %07x %llu %llu ", e->lap, e->uap,
+		        e->flags, e->clk, (unsigned long long)e->clk_time_ns,
+		        (unsigned long long)e->updated);
+		for (j = 0; j < 10; j++)
+			fprintf(fp, "%02x", e->afh_map[j]);
+		for (j = 0; j < NUM_BREDR_CHANNELS; j++)
+			fprintf(fp, "%c%u", j ? ',' : ' ', e->packets[j]);
+		fprintf(fp, "\n");
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, cache->path) < 0) {
+		perror(cache->path);
+		return -1;
+	}
+	cache->dirty = 0;
+
+	return 0;
+}
+
+void piconet_cache_close(piconet_cache* cache)
+{
+	piconet_cache_save(cache);
+	free(cache->path);
+	free(cache->entries);
+	free(cache);
+}
+
+piconet_entry* piconet_cache_find(piconet_cache* cache, uint32_t lap)
+{
+	int i;
+
+	for (i = 0; i < cache->num_entries; i++)
+		if (cache->entries[i].lap == lap)
+			return &cache->entries[i];
+	return NULL;
+}
+
+/* Fill in what is known about a piconet with a valid LAP.  clkn is the
+ * Ubertooth's current clock.  Returns the cache flags that were used;
+ * a seeded clock still has to be verified by decoding a packet. */
+int piconet_cache_seed(piconet_cache* cache, btbb_piconet* pn, uint32_t clkn)
+{
+	piconet_entry* e = piconet_cache_find(cache, btbb_piconet_get_lap(pn));
+	uint64_t now = realtime_ns();
+	uint32_t clk;
+	int used = 0;
+
+	if (e == NULL)
+		return 0;
+
+	/* a different UAP given by the user makes the rest useless */
+	if (btbb_piconet_get_flag(pn, BTBB_UAP_VALID)) {
+		if (!(e->flags & CACHE_UAP) || btbb_piconet_get_uap(pn) != e->uap)
+			return 0;
+	} else if (e->flags & CACHE_UAP) {
+		btbb_piconet_set_uap(pn, e->uap);
+		used |= CACHE_UAP;
+	} else {
+		return 0;
+	}
+
+	if ((e->flags & CACHE_AFH) && now < (e->updated + CACHE_AFH_MAX_AGE) * 1000000000ull) {
+		btbb_piconet_set_afh_map(pn, e->afh_map);
+		used |= CACHE_AFH;
+	}
+
+	if ((e->flags & CACHE_CLOCK) && now < e->clk_time_ns + CACHE_CLOCK_MAX_AGE * 1000000000ull) {
+		clk = (e->clk + (now - e->clk_time_ns) / CLK_TICK_NS) & CLK27_MASK;
+		btbb_piconet_set_clk_offset(pn, (clk - clkn) & CLK27_MASK);
+		btbb_piconet_set_flag(pn, BTBB_FOLLOWING, 1);
+		btbb_piconet_set_flag(pn, BTBB_CLK27_VALID, 1);
+		used |= CACHE_CLOCK;
+	}
+
+	return used;
+}
+
+/* Remember what has been learned about a piconet.  clkn is the
+ * Ubertooth's current clock, or -1 if the piconet's clock offset does
+ * not relate to it, e.g. when reading from a file. */
+void piconet_cache_store(piconet_cache* cache, btbb_piconet* pn, int64_t clkn)
+{
+	piconet_entry* e;
+	uint8_t* afh_map;
+	uint64_t now = realtime_ns();
+	int i;
+
+	if (!btbb_piconet_get_flag(pn, BTBB_LAP_VALID))
+		return;
+
+	e = piconet_cache_find(cache, btbb_piconet_get_lap(pn));
+	if (e == NULL && (e = add_entry(cache, btbb_piconet_get_lap(pn))) == NULL)
+		return;
+
+	if (btbb_piconet_get_flag(pn, BTBB_UAP_VALID)) {
+		if ((e->flags & CACHE_UAP) && e->uap != btbb_piconet_get_uap(pn))
+			e->flags = 0;
+		e->uap = btbb_piconet_get_uap(pn);
+		e->flags |= CACHE_UAP;
+	}
+
+	if (clkn >= 0 && btbb_piconet_get_flag(pn, BTBB_CLK27_VALID)) {
+		e->clk = ((uint32_t)clkn + btbb_piconet_get_clk_offset(pn)) & CLK27_MASK;
+		e->clk_time_ns = now;
+		e->flags |= CACHE_CLOCK;
+	}
+
+	afh_map = btbb_piconet_get_afh_map(pn);
+	for (i = 0; i < 10; i++) {
+		if (afh_map[i]) {
+			memcpy(e->afh_map, afh_map, 10);
+			e->flags |= CACHE_AFH;
+			break;
+		}
+	}
+
+	e->updated = now / 1000000000ull;
+	cache->dirty = 1;
+}
+
+/* Count a packet of a cached piconet on a channel */
+void piconet_cache_count(piconet_cache* cache, uint32_t lap, uint8_t channel)
+{
+	piconet_entry* e = piconet_cache_find(cache, lap);
+
+	if (e == NULL || channel >= NUM_BREDR_CHANNELS)
+		return;
+	e->packets[channel]++;
+	cache->dirty = 1;
+}
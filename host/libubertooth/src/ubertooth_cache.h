@@ -0,0 +1,77 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CACHE_H__
+#define __UBERTOOTH_CACHE_H__
+
+#include "ubertooth_control.h"
+#include <btbb.h>
+
+/*
+ * Piconets seen in earlier runs, keyed by LAP.  The cache is a text
+ * file with one line per piconet:
+ *
+ *   <lap> <uap> <flags> <clk> <clk_time> <updated> <afh_map> <packets>
+ *
+ * clk is the master's CLK27-0 at clk_time (ns since the epoch), so a
+ * clock can be predicted for a later run on any Ubertooth.  packets is
+ * a comma separated count per channel.
+ */
+
+#define CACHE_CLOCK_MAX_AGE 5   /* seconds a cached clock can be trusted */
+#define CACHE_AFH_MAX_AGE   600 /* seconds a cached AFH map can be trusted */
+#define CACHE_VERIFY_TIME   3   /* seconds to decode a packet after seeding */
+
+enum cache_flags {
+	CACHE_UAP   = 0x01,
+	CACHE_CLOCK = 0x02,
+	CACHE_AFH   = 0x04
+};
+
+typedef struct {
+	uint32_t lap;
+	uint8_t uap;
+	uint8_t flags;
+	uint32_t clk;
+	uint64_t clk_time_ns;
+	uint64_t updated;
+	uint8_t afh_map[10];
+	uint32_t packets[NUM_BREDR_CHANNELS];
+} piconet_entry;
+
+typedef struct {
+	char* path;
+	piconet_entry* entries;
+	int num_entries;
+	int size;
+	int dirty;
+} piconet_cache;
+
+piconet_cache* piconet_cache_open(const char* path);
+int piconet_cache_save(piconet_cache* cache);
+void piconet_cache_close(piconet_cache* cache);
+
+piconet_entry* piconet_cache_find(piconet_cache* cache, uint32_t lap);
+int piconet_cache_seed(piconet_cache* cache, btbb_piconet* pn, uint32_t clkn);
+void piconet_cache_store(piconet_cache* cache, btbb_piconet* pn, int64_t clkn);
+void piconet_cache_count(piconet_cache* cache, uint32_t lap, uint8_t channel);
+
+#endif /* __UBERTOOTH_CACHE_H__ */
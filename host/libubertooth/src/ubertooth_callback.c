@@ -27,10 +27,9 @@
 
 #include "ubertooth_callback.h"
 
-unsigned int packet_counter_max;
 uint8_t calibrated = 0;
 
-static int8_t cc2400_rssi_to_dbm( const int8_t rssi )
+int8_t cc2400_rssi_to_dbm( const int8_t rssi )
 {
 	/* models the cc2400 datasheet fig 22 for 1M as piece-wise linear */
 	if (rssi < -48) {
@@ -86,43 +85,35 @@ static void determine_signal_and_noise( usb_pkt_rx *rx, int8_t * sig, int8_t * n
 	*noise = cc2400_rssi_to_dbm( rx->rssi_avg );
 }
 
-static uint64_t now_ns( void )
+/* Errors allowed in an access code found on the channel */
+static int ac_errors(ubertooth_t* ut, uint8_t channel)
 {
-/* As per Apple QA1398 */
-#if defined( __APPLE__ )
-	static mach_timebase_info_data_t sTimebaseInfo;
-	uint64_t ts = mach_absolute_time( );
-	if (sTimebaseInfo.denom == 0) {
-		(void) mach_timebase_info(&sTimebaseInfo);
-	}
-	return (ts*sTimebaseInfo.numer/sTimebaseInfo.denom);
-#else
-	struct timespec ts = { 0, 0 };
-	(void) clock_gettime( CLOCK_REALTIME, &ts );
-	return (1000000000ull*(uint64_t) ts.tv_sec) + (uint64_t) ts.tv_nsec;
-#endif
+	return ut->h_ac ? ac_adapt_errors(ut->h_ac, channel) : max_ac_errors;
 }
 
-static void track_clk100ns( ubertooth_t* ut, const usb_pkt_rx* rx )
+/* Count the packet in the piconet cache and check a clock seeded from
+ * it: a packet of the piconet with a correct header proves both UAP
+ * and clock. */
+static void cache_packet(ubertooth_t* ut, btbb_piconet* pn, btbb_packet* pkt)
 {
-	/* track clk100ns */
-	if (!ut->start_clk100ns) {
-		ut->last_clk100ns = ut->start_clk100ns = rx->clk100ns;
-		ut->abs_start_ns = now_ns( );
-	}
-	/* detect clk100ns roll-over */
-	if (rx->clk100ns < ut->last_clk100ns) {
-		ut->clk100ns_upper += 1;
+	uint32_t lap = btbb_packet_get_lap(pkt);
+
+	if (ut->h_cache)
+		piconet_cache_count(ut->h_cache, lap, btbb_packet_get_channel(pkt));
+
+	if (ut->verify_left && pn && lap == btbb_piconet_get_lap(pn) &&
+	    btbb_packet_get_flag(pkt, BTBB_HEC_CORRECT)) {
+		fprintf(stderr, "Cached piconet %06x verified\n", lap);
+		ut->verify_left = 0;
 	}
-	ut->last_clk100ns = rx->clk100ns;
 }
 
-static uint64_t now_ns_from_clk100ns( ubertooth_t* ut, const usb_pkt_rx* rx )
+/* A failed write (full disk, closed pipe) has been reported by the
+ * output and ends the capture, rather than losing everything after it */
+static void write_output(ubertooth_t* ut, const output_packet* op)
 {
-	track_clk100ns( ut, rx );
-	return ut->abs_start_ns +
-	       100ull*(uint64_t)((rx->clk100ns - ut->start_clk100ns) & 0xffffffff) +
-	       ((100ull*ut->clk100ns_upper)<<32);
+	if (output_write(ut->h_output, op) < 0)
+		ut->stop_ubertooth = 1;
 }
 
 /* Sniff for LAPs. If a piconet is provided, use the given LAP to
@@ -147,10 +138,21 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		goto out;
 
-	uint64_t nowns = now_ns_from_clk100ns( ut, rx );
+	/* a seeded clock that decodes nothing is discovered again */
+	if (ut->verify_left && --ut->verify_left == 0) {
+		ubertooth_rediscover(ut, pn);
+		goto out;
+	}
+
+	uint64_t nowns = clock_sync_ns(&ut->clock, rx);
 
 	determine_signal_and_noise( rx, &signal_level, &noise_level );
 	snr = signal_level - noise_level;
+	if (ut->h_ac)
+		ac_adapt_record(ut->h_ac, rx->channel, noise_level);
+
+	if (ut->h_trigger && trigger_match_rssi(ut->h_trigger, signal_level))
+		trigger_fire(ut->h_trigger, nowns, "RSSI");
 
 	/* Look for packets with specified LAP, if given. Otherwise
 	 * search for any packet.  Also determine if UAP is known. */
@@ -161,9 +163,15 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 
 	/* Pass packet-pointer-pointer so that
 	 * packet can be created in libbtbb. */
-	offset = btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, lap, max_ac_errors, &pkt);
+	offset = btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, lap,
+	                      ac_errors(ut, rx->channel), &pkt);
 	if (offset < 0)
 		goto out;
+	if (ut->h_metrics)
+		metrics_packet(ut->h_metrics, rx->channel);
+	if (ut->h_ac)
+		ac_adapt_hit(ut->h_ac, rx->channel, btbb_packet_get_lap(pkt),
+		             (uint32_t)(nowns / 1000000000ull));
 
 	btbb_packet_set_modulation(pkt, BTBB_MOD_GFSK);
 	btbb_packet_set_transport(pkt, BTBB_TRANSPORT_ANY);
@@ -175,15 +183,19 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 	btbb_packet_set_data(pkt, ringbuffer_top_bt(ut->packets) + offset, NUM_BANKS * BANK_LEN - offset,
 	                     rx->channel, clkn);
 
+	if (ut->h_filter &&
+	    !filter_match(ut->h_filter, rx, btbb_packet_get_lap(pkt),
+	                  btbb_packet_get_ac_errors(pkt)))
+		goto out;
+
 	/* When reading from file, caller will read
 	 * systime before calling this routine, so do
 	 * not overwrite. Otherwise, get current time. */
 	if (infile == NULL)
-		systime = time(NULL);
+		systime = nowns / 1000000000ull;
 
-	/* If dumpfile is specified, write out all banks to the
-	 * file. There could be duplicate data in the dump if more
-	 * than one LAP is found within the span of NUM_BANKS. */
+	/* If dumpfile is specified, write out the record in which
+	 * the packet was found. */
 	if (dumpfile) {
 		uint32_t systime_be = htobe32(systime);
 		fwrite(&systime_be, sizeof(systime_be), 1, dumpfile);
@@ -191,16 +203,32 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 		fflush(dumpfile);
 	}
 
-	printf("systime=%u ch=%2d LAP=%06x err=%u clk100ns=%u clk1=%u s=%d n=%d snr=%d\n",
-	       (int)systime,
-	       btbb_packet_get_channel(pkt),
-	       btbb_packet_get_lap(pkt),
-	       btbb_packet_get_ac_errors(pkt),
-	       rx->clk100ns,
-	       btbb_packet_get_clkn(pkt),
-	       signal_level,
-	       noise_level,
-	       snr);
+	if (ut->h_output) {
+		output_packet op = {
+			.type = OUTPUT_BR,
+			.channel = btbb_packet_get_channel(pkt),
+			.signal = signal_level,
+			.noise = noise_level,
+			.ac_errors = btbb_packet_get_ac_errors(pkt),
+			.systime = systime,
+			.ts_ns = nowns,
+			.clk100ns = rx->clk100ns,
+			.clkn = btbb_packet_get_clkn(pkt),
+			.address = btbb_packet_get_lap(pkt),
+		};
+		write_output(ut, &op);
+	} else {
+		printf("systime=%u ch=%2d LAP=%06x err=%u clk100ns=%u clk1=%u s=%d n=%d snr=%d\n",
+		       (int)systime,
+		       btbb_packet_get_channel(pkt),
+		       btbb_packet_get_lap(pkt),
+		       btbb_packet_get_ac_errors(pkt),
+		       rx->clk100ns,
+		       btbb_packet_get_clkn(pkt),
+		       signal_level,
+		       noise_level,
+		       snr);
+	}
 
 	/* Dump to PCAP/PCAPNG if specified */
 #ifdef ENABLE_PCAP
@@ -216,9 +244,23 @@ void cb_br_rx(ubertooth_t* ut, void* args)
 		                          lap, uap, pkt);
 	}
 
+	if (ut->h_trigger) {
+		if (trigger_match_address(ut->h_trigger, btbb_packet_get_lap(pkt)))
+			trigger_fire(ut->h_trigger, nowns, "watched LAP");
+		trigger_add_bredr(ut->h_trigger, nowns, signal_level, noise_level,
+		                  lap, uap, pkt);
+	}
+
+	/* Once UAP and clock are known, follow the piconet without
+	 * stopping the stream */
 	int r = btbb_process_packet(pkt, pn);
+	cache_packet(ut, pn, pkt);
 	if(r < 0) {
-		ut->stop_ubertooth = 1;
+		if (infile == NULL && ut->devh && pn && !ut->following &&
+		    btbb_piconet_get_flag(pn, BTBB_CLK27_VALID))
+			ubertooth_follow(ut, pn);
+		else
+			ut->stop_ubertooth = 1;
 	}
 
 out:
@@ -237,10 +279,11 @@ void cb_afh_initial(ubertooth_t* ut, void* args)
 		goto out;
 
 	/* detect AFH map
-	 * set current channel as used channel and send updated AFH
-	 * map to ubertooth */
+	 * set current channel as used channel once it has been seen often
+	 * enough and send updated AFH map to ubertooth */
 	channel = ringbuffer_top_usb(ut->packets)->channel;
-	if(btbb_piconet_set_channel_seen(pn, channel)) {
+	if (afh_estimator_update(&ut->afh, channel) &&
+	    btbb_piconet_set_channel_seen(pn, channel)) {
 
 		/* Don't allow single unused channels */
 		if (!btbb_piconet_get_channel_seen(pn, channel+1) &&
@@ -271,32 +314,23 @@ void cb_afh_monitor(ubertooth_t* ut, void* args)
 	btbb_piconet* pn = (btbb_piconet*)args;
 	btbb_packet* pkt = NULL;
 	uint8_t channel;
-	int i;
-
-	static unsigned long last_seen[79] = {0};
-	static unsigned long counter = 0;
+	int i, n;
 
 
 	if( btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, btbb_piconet_get_lap(pn), max_ac_errors, &pkt) < 0 )
 		goto out;
 
-	counter++;
+	/* print only what changed */
 	channel = ringbuffer_top_usb(ut->packets)->channel;
-	last_seen[channel]=counter;
-
-	if(btbb_piconet_set_channel_seen(pn, channel)) {
-		printf("+ channel %2d is used now\n", channel);
-		btbb_print_afh_map(pn);
-	// } else {
-	// 	printf("channel %d is already used\n", channel);
-	}
-
-	for(i=0; i<79; i++) {
-		if((counter - last_seen[i] >= packet_counter_max)) {
-			if(btbb_piconet_clear_channel_seen(pn, i)) {
-				printf("- channel %2d is not used any more\n", i);
-				btbb_print_afh_map(pn);
-			}
+	n = afh_estimator_update(&ut->afh, channel);
+	for (i = 0; i < n; i++) {
+		channel = ut->afh.changes[i] & ~AFH_ADDED;
+		if (ut->afh.changes[i] & AFH_ADDED) {
+			if (btbb_piconet_set_channel_seen(pn, channel))
+				printf("+ channel %2d is used now\n", channel);
+		} else {
+			if (btbb_piconet_clear_channel_seen(pn, channel))
+				printf("- channel %2d is not used any more\n", channel);
 		}
 	}
 	cmd_hop(ut->devh);
@@ -311,25 +345,20 @@ void cb_afh_r(ubertooth_t* ut, void* args)
 	btbb_piconet* pn = (btbb_piconet*)args;
 	btbb_packet* pkt = NULL;
 	uint8_t channel;
-	int i;
-
-	static unsigned long last_seen[79] = {0};
-	static unsigned long counter = 0;
+	int i, n;
 
 	if( btbb_find_ac(ringbuffer_top_bt(ut->packets), BANK_LEN - 64, btbb_piconet_get_lap(pn), max_ac_errors, &pkt) < 0 )
 		goto out;
 
 
-	counter++;
 	channel = ringbuffer_top_usb(ut->packets)->channel;
-	last_seen[channel]=counter;
-
-	btbb_piconet_set_channel_seen(pn, channel);
-
-	for(i=0; i<79; i++) {
-		if((counter - last_seen[i] >= packet_counter_max)) {
-			btbb_piconet_clear_channel_seen(pn, i);
-		}
+	n = afh_estimator_update(&ut->afh, channel);
+	for (i = 0; i < n; i++) {
+		channel = ut->afh.changes[i] & ~AFH_ADDED;
+		if (ut->afh.changes[i] & AFH_ADDED)
+			btbb_piconet_set_channel_seen(pn, channel);
+		else
+			btbb_piconet_clear_channel_seen(pn, channel);
 	}
 	cmd_hop(ut->devh);
 
@@ -342,6 +371,33 @@ out:
 /*
  * Sniff Bluetooth Low Energy packets.
  */
+/* Write the record in the DLT_BLUETOOTH_LE_LL_WITH_PHDR format that
+ * libbtbb uses, access address to CRC */
+static int stream_le_packet(pcapng_stream* s, uint64_t ts_ns, const usb_pkt_rx* rx,
+                            int8_t sig, int8_t noise, uint32_t ref_aa, unsigned offenses)
+{
+	uint8_t buf[LE_PHDR_LEN + DMA_SIZE];
+	uint16_t flags = LE_PHDR_DEWHITENED | LE_PHDR_SIGPOWER_VALID |
+	                 LE_PHDR_NOISEPOWER_VALID | LE_PHDR_AA_OFFENSES_VALID;
+	int len = MIN((rx->data[5] & 0x3f) + 6 + 3, DMA_SIZE);
+
+	if (ref_aa)
+		flags |= LE_PHDR_REF_AA_VALID;
+	buf[0] = rx->channel / 2;
+	buf[1] = sig;
+	buf[2] = noise;
+	buf[3] = MIN(offenses, 0xff);
+	buf[4] = ref_aa & 0xff;
+	buf[5] = (ref_aa >> 8) & 0xff;
+	buf[6] = (ref_aa >> 16) & 0xff;
+	buf[7] = ref_aa >> 24;
+	buf[8] = flags & 0xff;
+	buf[9] = flags >> 8;
+	memcpy(buf + LE_PHDR_LEN, rx->data, len);
+
+	return pcapng_stream_write(s, ts_ns, buf, LE_PHDR_LEN + len);
+}
+
 void cb_btle(ubertooth_t* ut, void* args)
 {
 	lell_packet* pkt;
@@ -358,39 +414,41 @@ void cb_btle(ubertooth_t* ut, void* args)
 	if (rx->pkt_type == LE_PROMISC) {
 		u8 state = rx->data[0];
 		void *val = &rx->data[1];
+		/* keep structured output parseable */
+		FILE* msg = ut->h_output ? stderr : stdout;
 
-		printf("--------------------\n");
-		printf("LE Promisc - ");
+		fprintf(msg, "--------------------\n");
+		fprintf(msg, "LE Promisc - ");
 		switch (state) {
 			case 0:
-				printf("Access Address: %08x\n", *(uint32_t *)val);
+				fprintf(msg, "Access Address: %08x\n", *(uint32_t *)val);
 				break;
 			case 1:
-				printf("CRC Init: %06x\n", *(uint32_t *)val);
+				fprintf(msg, "CRC Init: %06x\n", *(uint32_t *)val);
 				break;
 			case 2:
-				printf("Hop interval: %g ms\n", *(uint16_t *)val * 1.25);
+				fprintf(msg, "Hop interval: %g ms\n", *(uint16_t *)val * 1.25);
 				break;
 			case 3:
-				printf("Hop increment: %u\n", *(uint8_t *)val);
+				fprintf(msg, "Hop increment: %u\n", *(uint8_t *)val);
 				break;
 			default:
-				printf("Unknown %u\n", state);
+				fprintf(msg, "Unknown %u\n", state);
 				break;
 		};
-		printf("\n");
+		fprintf(msg, "\n");
 
 		return;
 	}
 
-	uint64_t nowns = now_ns_from_clk100ns( ut, rx );
+	uint64_t nowns = clock_sync_ns(&ut->clock, rx);
 
 	/* Sanity check */
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		return;
 
 	if (infile == NULL)
-		systime = time(NULL);
+		systime = nowns / 1000000000ull;
 
 	/* Dump to sumpfile if specified */
 	if (dumpfile) {
@@ -409,10 +467,32 @@ void cb_btle(ubertooth_t* ut, void* args)
 		lell_packet_unref(pkt);
 		return;
 	}
+	if (ut->h_metrics)
+		metrics_packet(ut->h_metrics, rx->channel);
+
+	if (ut->h_filter &&
+	    !filter_match(ut->h_filter, rx, lell_get_access_address(pkt),
+	                  lell_get_access_address_offenses(pkt))) {
+		lell_packet_unref(pkt);
+		return;
+	}
 
 	/* Dump to PCAP/PCAPNG if specified */
 	refAA = lell_packet_is_data(pkt) ? 0 : 0x8e89bed6;
 	determine_signal_and_noise( rx, &sig, &noise );
+
+	if (ut->h_trigger) {
+		/* CONNECT_REQ on an advertising channel */
+		if (ut->h_trigger->le_connect && refAA &&
+		    lell_get_access_address(pkt) == 0x8e89bed6 &&
+		    (rx->data[4] & 0x0f) == 0x05)
+			trigger_fire(ut->h_trigger, nowns, "new LE connection");
+		if (trigger_match_address(ut->h_trigger, lell_get_access_address(pkt)))
+			trigger_fire(ut->h_trigger, nowns, "watched access address");
+		if (trigger_match_rssi(ut->h_trigger, sig))
+			trigger_fire(ut->h_trigger, nowns, "RSSI");
+		trigger_add_le(ut->h_trigger, nowns, sig, noise, refAA, pkt);
+	}
 #ifdef ENABLE_PCAP
 	if (ut->h_pcap_le) {
 		/* only one of these two will succeed, depending on
@@ -432,6 +512,30 @@ void cb_btle(ubertooth_t* ut, void* args)
 		                          sig, noise,
 		                          refAA, pkt);
 	}
+	if (ut->h_stream_le &&
+	    stream_le_packet(ut->h_stream_le, nowns, rx, sig, noise, refAA,
+	                     lell_get_access_address_offenses(pkt)) < 0)
+		ut->stop_ubertooth = 1;
+
+	if (ut->h_output) {
+		int len = (rx->data[5] & 0x3f) + 6 + 3;
+		output_packet op = {
+			.type = OUTPUT_LE,
+			.channel = rx->channel,
+			.signal = rx->rssi_min - 54,
+			.noise = noise,
+			.ac_errors = lell_get_access_address_offenses(pkt),
+			.systime = systime,
+			.ts_ns = nowns,
+			.clk100ns = rx->clk100ns,
+			.address = lell_get_access_address(pkt),
+			.data = rx->data + 4,
+			.data_len = MIN(len, DMA_SIZE) - 4,
+		};
+		write_output(ut, &op);
+		lell_packet_unref(pkt);
+		return;
+	}
 
 	// rollover
 	u32 rx_ts = rx->clk100ns;
@@ -466,6 +570,19 @@ void cb_ego(ubertooth_t* ut, void* args __attribute__((unused)))
 	static u32 prev_ts = 0;
 	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
 
+	if (ut->h_output) {
+		output_packet op = {
+			.type = OUTPUT_EGO,
+			.channel = rx->channel,
+			.ts_ns = clock_sync_ns(&ut->clock, rx),
+			.clk100ns = rx->clk100ns,
+			.data = rx->data,
+			.data_len = 36,
+		};
+		write_output(ut, &op);
+		return;
+	}
+
 	u32 rx_time = rx->clk100ns;
 	if (rx_time < prev_ts)
 		rx_time += 3276800000; // rollover
@@ -485,6 +602,29 @@ void cb_ego(ubertooth_t* ut, void* args __attribute__((unused)))
 }
 
 
+/* Write the records of the decode window that are not in the dump yet,
+ * followed by a hit marker.  Windows of packets found close together
+ * overlap, but every record is written once. */
+static void dump_window(ubertooth_t* ut)
+{
+	uint64_t first = ut->rx_seq > NUM_BANKS ? ut->rx_seq - NUM_BANKS : 0;
+	uint64_t seq = MAX(first, ut->dump_next);
+	uint32_t systime_be = htobe32(systime);
+
+	if (ut->dump_next == 0)
+		dump_write_marker(dumpfile, DUMP_MARKER_HEADER, systime, 0);
+
+	for (; seq < ut->rx_seq; seq++) {
+		fwrite(&systime_be, sizeof(systime_be), 1, dumpfile);
+		fwrite(ringbuffer_get_usb(ut->packets, NUM_BANKS - (ut->rx_seq - seq)),
+		       sizeof(usb_pkt_rx), 1, dumpfile);
+	}
+	ut->dump_next = ut->rx_seq;
+
+	dump_write_marker(dumpfile, DUMP_MARKER_HIT, systime, first);
+	fflush(dumpfile);
+}
+
 void cb_rx(ubertooth_t* ut, void* args)
 {
 	btbb_packet* pkt = NULL;
@@ -500,20 +640,30 @@ void cb_rx(ubertooth_t* ut, void* args)
 	/* Do analysis based on oldest packet */
 	usb_pkt_rx* rx = ringbuffer_bottom_usb(ut->packets);
 
+	uint64_t nowns = clock_sync_ns(&ut->clock, rx);
+
 	if (rx->status & DISCARD) {
 		goto out;
 	}
 
+	if (ut->verify_left && --ut->verify_left == 0) {
+		ubertooth_rediscover(ut, pn);
+		goto out;
+	}
+
 	// /* Sanity check */
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		goto out;
 
-	uint64_t nowns = now_ns_from_clk100ns( ut, rx );
-
 	int8_t signal_level = rx->rssi_max;
 	int8_t noise_level = rx->rssi_min;
 	determine_signal_and_noise( rx, &signal_level, &noise_level );
 	int8_t snr = signal_level - noise_level;
+	if (ut->h_ac)
+		ac_adapt_record(ut->h_ac, rx->channel, noise_level);
+
+	if (ut->h_trigger && trigger_match_rssi(ut->h_trigger, signal_level))
+		trigger_fire(ut->h_trigger, nowns, "RSSI");
 
 	/* Copy out remaining banks of symbols for full analysis. */
 	for (i = 0; i < NUM_BANKS; i++)
@@ -530,9 +680,14 @@ void cb_rx(ubertooth_t* ut, void* args)
 
 	/* Pass packet-pointer-pointer so that
 	 * packet can be created in libbtbb. */
-	offset = btbb_find_ac(syms, BANK_LEN, lap, max_ac_errors, &pkt);
+	offset = btbb_find_ac(syms, BANK_LEN, lap, ac_errors(ut, rx->channel), &pkt);
 	if (offset < 0)
 		goto out;
+	if (ut->h_metrics)
+		metrics_packet(ut->h_metrics, rx->channel);
+	if (ut->h_ac)
+		ac_adapt_hit(ut->h_ac, rx->channel, btbb_packet_get_lap(pkt),
+		             (uint32_t)(nowns / 1000000000ull));
 
 	/* calculate the offset between the first bit of the AC and the rising edge of CLKN */
 	clk_offset = (le32toh(rx->clk100ns) + offset*10 + 6250 - 4000) % 6250;
@@ -547,27 +702,48 @@ void cb_rx(ubertooth_t* ut, void* args)
 	btbb_packet_set_data(pkt, syms + offset, NUM_BANKS * BANK_LEN - offset,
 	                     rx->channel, clkn);
 
+	if (ut->h_filter &&
+	    !filter_match(ut->h_filter, rx, btbb_packet_get_lap(pkt),
+	                  btbb_packet_get_ac_errors(pkt)))
+		goto out;
+
 	/* When reading from file, caller will read
 	 * systime before calling this routine, so do
 	 * not overwrite. Otherwise, get current time. */
 	if (infile == NULL)
-		systime = time(NULL);
-
-	printf("systime=%u ch=%2d LAP=%06x err=%u clkn=%u clk_offset=%u s=%d n=%d snr=%d\n",
-	       (uint32_t)time(NULL),
-	       btbb_packet_get_channel(pkt),
-	       btbb_packet_get_lap(pkt),
-	       btbb_packet_get_ac_errors(pkt),
-	       clkn,
-	       clk_offset,
-	       signal_level,
-	       noise_level,
-	       snr
-	);
+		systime = nowns / 1000000000ull;
+
+	if (ut->h_output) {
+		output_packet op = {
+			.type = OUTPUT_BR,
+			.channel = btbb_packet_get_channel(pkt),
+			.signal = signal_level,
+			.noise = noise_level,
+			.ac_errors = btbb_packet_get_ac_errors(pkt),
+			.systime = systime,
+			.ts_ns = nowns,
+			.clk100ns = rx->clk100ns,
+			.clkn = clkn,
+			.address = btbb_packet_get_lap(pkt),
+		};
+		write_output(ut, &op);
+	} else {
+		printf("systime=%u ch=%2d LAP=%06x err=%u clkn=%u clk_offset=%u s=%d n=%d snr=%d\n",
+		       systime,
+		       btbb_packet_get_channel(pkt),
+		       btbb_packet_get_lap(pkt),
+		       btbb_packet_get_ac_errors(pkt),
+		       clkn,
+		       clk_offset,
+		       signal_level,
+		       noise_level,
+		       snr
+		);
+	}
 
 	/* calibrate Ubertooth clock such that the first bit of the AC
 	 * arrives CLK_TUNE_TIME after the rising edge of CLKN */
-	if (infile == NULL && !calibrated) {
+	if (infile == NULL && ut->devh && !calibrated) {
 		if (clk_offset < CLK_TUNE_TIME) {
 			printf("offset < CLK_TUNE_TIME\n");
 			printf("CLK100ns Trim: %d\n", 6250 + clk_offset - CLK_TUNE_TIME);
@@ -581,15 +757,9 @@ void cb_rx(ubertooth_t* ut, void* args)
 		goto out;
 	}
 
-	/* If dumpfile is specified, write out all banks to the
-	 * file. There could be duplicate data in the dump if more
-	 * than one LAP is found within the span of NUM_BANKS. */
-	if (dumpfile) {
-		uint32_t systime_be = htobe32(systime);
-		fwrite(&systime_be, sizeof(systime_be), 1, dumpfile);
-		fwrite(rx, sizeof(usb_pkt_rx), 1, dumpfile);
-		fflush(dumpfile);
-	}
+	/* If dumpfile is specified, write out all banks to the file */
+	if (dumpfile)
+		dump_window(ut);
 
 	/* Dump to PCAP/PCAPNG if specified */
 #ifdef ENABLE_PCAP
@@ -605,9 +775,17 @@ void cb_rx(ubertooth_t* ut, void* args)
 		                          lap, uap, pkt);
 	}
 
+	if (ut->h_trigger) {
+		if (trigger_match_address(ut->h_trigger, btbb_packet_get_lap(pkt)))
+			trigger_fire(ut->h_trigger, nowns, "watched LAP");
+		trigger_add_bredr(ut->h_trigger, nowns, signal_level, noise_level,
+		                  lap, uap, pkt);
+	}
+
 	int r = btbb_process_packet(pkt, pn);
-	if(infile == NULL && r < 0)
-		cmd_start_hopping(ut->devh, btbb_piconet_get_clk_offset(pn), 0);
+	cache_packet(ut, pn, pkt);
+	if(infile == NULL && ut->devh && r < 0 && !ut->following)
+		ubertooth_follow(ut, pn);
 
 out:
 	if (pkt)
@@ -26,6 +26,7 @@
 #include "ubertooth_control.h"
 #include "ubertooth.h"
 
+int8_t cc2400_rssi_to_dbm( const int8_t rssi );
 void cb_br_rx(ubertooth_t* ut, void* args);
 void cb_afh_initial(ubertooth_t* ut, void* args);
 void cb_afh_monitor(ubertooth_t* ut, void* args);
@@ -0,0 +1,870 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ubertooth_capture.h"
+#include "ubertooth_codec.h"
+
+#define CHUNK_HEADER_LEN  48
+#define CHUNK_FOOTER_LEN  40
+#define DIR_ENTRY_LEN     44
+#define TAIL_LEN          12
+
+/* record flags */
+#define REC_TYPE      0x01
+#define REC_STATUS    0x02
+#define REC_CHANNEL   0x04
+#define REC_CLKN_HIGH 0x08
+#define REC_RSSI      0x10
+#define REC_RESERVED  0x20
+#define REC_SYSTIME   0x40
+#define REC_NODATA    0x80
+
+/* chunk flags */
+#define CHUNK_COMPRESSED 0x01
+#define CHUNK_COLUMNS    0x02
+#define CHUNK_SEGMENT    0x04
+
+/* largest possible encoded record, field by field as encode_record()
+ * writes them: flags, clk100ns delta, timestamp delta, type, status,
+ * channel, clkn_high, RSSI, reserved, systime delta and the symbols */
+#define MAX_VARINT_LEN   5    /* of a 32 bit value */
+#define MAX_VARINT64_LEN 10
+#define MAX_RECORD_LEN (1 + MAX_VARINT_LEN + MAX_VARINT64_LEN + \
+                        1 + 1 + 1 + 1 + 4 + 2 + MAX_VARINT_LEN + DMA_SIZE)
+
+static const uint8_t file_magic[4]   = { 'U', 'B', 'T', 'C' };
+static const uint8_t chunk_magic[4]  = { 'U', 'T', 'C', 'K' };
+static const uint8_t footer_magic[4] = { 'U', 'T', 'C', 'F' };
+static const uint8_t dir_magic[4]    = { 'U', 'T', 'C', 'D' };
+static const uint8_t tail_magic[4]   = { 'U', 'T', 'C', 'E' };
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+	put_u16(p, v & 0xffff);
+	put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+	put_u32(p, v & 0xffffffff);
+	put_u32(p + 4, v >> 32);
+}
+
+static uint16_t get_u16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static size_t put_varint(uint8_t* p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static int get_varint64(const uint8_t* p, size_t len, size_t* pos, uint64_t* v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; shift < 70; shift += 7) {
+		if (*pos >= len)
+			return -1;
+		*v |= (uint64_t)(p[*pos] & 0x7f) << shift;
+		if (!(p[(*pos)++] & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+static int get_varint(const uint8_t* p, size_t len, size_t* pos, uint32_t* v)
+{
+	uint64_t v64;
+
+	if (get_varint64(p, len, pos, &v64) < 0 || v64 > UINT32_MAX)
+		return -1;
+	*v = v64;
+	return 0;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static uint64_t zigzag64(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag64(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+int capture_is_magic(const uint8_t* buf)
+{
+	return memcmp(buf, file_magic, sizeof(file_magic)) == 0;
+}
+
+static void put_chunk_info(uint8_t* p, const capture_chunk_info* info)
+{
+	put_u64(p, info->first_ts);
+	put_u64(p + 8, info->last_ts);
+	put_u32(p + 16, info->num_records);
+	memcpy(p + 20, info->channels, CAPTURE_CHANNEL_BYTES);
+}
+
+static void get_chunk_info(const uint8_t* p, capture_chunk_info* info)
+{
+	info->first_ts = get_u64(p);
+	info->last_ts = get_u64(p + 8);
+	info->num_records = get_u32(p + 16);
+	memcpy(info->channels, p + 20, CAPTURE_CHANNEL_BYTES);
+}
+
+static void mark_channel(uint8_t* channels, uint8_t channel)
+{
+	if (channel >= CAPTURE_CHANNEL_BYTES * 8)
+		channel = CAPTURE_CHANNEL_BYTES * 8 - 1;
+	channels[channel / 8] |= 1 << (channel % 8);
+}
+
+static int has_channel(const uint8_t* channels, int channel)
+{
+	if (channel < 0)
+		return 1;
+	if (channel >= CAPTURE_CHANNEL_BYTES * 8)
+		channel = CAPTURE_CHANNEL_BYTES * 8 - 1;
+	return (channels[channel / 8] >> (channel % 8)) & 1;
+}
+
+static void reset_chunk(capture_t* cap)
+{
+	cap->buf_len = 0;
+	cap->buf_pos = 0;
+	cap->chunk_flags = 0;
+	cap->meta_end = 0;
+	cap->data_len = 0;
+	cap->data_pos = 0;
+	cap->num_records = 0;
+	cap->record_index = 0;
+	memset(&cap->info, 0, sizeof(cap->info));
+	memset(&cap->prev, 0, sizeof(cap->prev));
+}
+
+static capture_t* capture_alloc(FILE* fp)
+{
+	capture_t* cap = (capture_t*)calloc(1, sizeof(capture_t));
+	if (cap == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	cap->fp = fp;
+	cap->end_ns = UINT64_MAX;
+	cap->channel = -1;
+
+	return cap;
+}
+
+static void capture_free(capture_t* cap)
+{
+	free(cap->chunks);
+	free(cap->buf);
+	free(cap->data);
+	free(cap->zbuf);
+	free(cap);
+}
+
+/* With CAPTURE_COMPRESS the symbols are collected apart from the
+ * metadata and each chunk is compressed when that makes it smaller.
+ * With CAPTURE_DROP_NOISE the symbols of banks flagged DISCARD or
+ * below the squelch level are not stored at all. */
+capture_t* capture_create(FILE* fp, uint32_t chunk_records, uint32_t flags)
+{
+	uint8_t header[CAPTURE_HEADER_LEN];
+	capture_t* cap = capture_alloc(fp);
+	if (cap == NULL)
+		return NULL;
+
+	if (chunk_records == 0)
+		chunk_records = CAPTURE_CHUNK_RECORDS;
+
+	cap->writing = 1;
+	cap->flags = flags;
+	cap->squelch = INT8_MIN;
+	cap->chunk_records = chunk_records;
+	cap->buf_size = (size_t)chunk_records * MAX_RECORD_LEN;
+	cap->buf = (uint8_t*)malloc(cap->buf_size);
+	if (flags & CAPTURE_COMPRESS) {
+		/* room to assemble the columns in front of the symbols */
+		cap->data_size = 4 + cap->buf_size + (size_t)chunk_records * DMA_SIZE;
+		cap->data = (uint8_t*)malloc(cap->data_size);
+		cap->zbuf_size = cap->data_size;
+		cap->zbuf = (uint8_t*)malloc(cap->zbuf_size);
+	}
+	if (cap->buf == NULL ||
+	    ((flags & CAPTURE_COMPRESS) && (cap->data == NULL || cap->zbuf == NULL))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		capture_free(cap);
+		return NULL;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, file_magic, sizeof(file_magic));
+	put_u16(header + 4, CAPTURE_VERSION);
+	put_u16(header + 6, CAPTURE_HEADER_LEN);
+	put_u32(header + 8, flags);
+	put_u32(header + 12, chunk_records);
+	put_u64(header + 16, (uint64_t)time(NULL));
+
+	if (fwrite(header, sizeof(header), 1, fp) != 1) {
+		perror("capture_create");
+		capture_free(cap);
+		return NULL;
+	}
+	cap->offset = CAPTURE_HEADER_LEN;
+	reset_chunk(cap);
+
+	return cap;
+}
+
+void capture_set_squelch(capture_t* cap, int8_t squelch)
+{
+	cap->squelch = squelch;
+}
+
+static int is_noise(const capture_t* cap, const usb_pkt_rx* rx)
+{
+	if (!(cap->flags & CAPTURE_DROP_NOISE))
+		return 0;
+	return (rx->status & DISCARD) || rx->rssi_max < cap->squelch;
+}
+
+/* Encode the metadata of a record; the caller stores the symbols
+ * unless nodata is set. */
+static size_t encode_record(uint8_t* p, const capture_record* prev,
+                            const capture_record* rec, int nodata)
+{
+	const usb_pkt_rx* a = &prev->rx;
+	const usb_pkt_rx* b = &rec->rx;
+	uint8_t flags = nodata ? REC_NODATA : 0;
+	size_t n = 1;
+
+	n += put_varint(p + n, b->clk100ns - a->clk100ns);
+	n += put_varint(p + n, zigzag64((int64_t)(rec->ts_ns - prev->ts_ns)));
+
+	if (b->pkt_type != a->pkt_type) {
+		flags |= REC_TYPE;
+		p[n++] = b->pkt_type;
+	}
+	if (b->status) {
+		flags |= REC_STATUS;
+		p[n++] = b->status;
+	}
+	if (b->channel != a->channel) {
+		flags |= REC_CHANNEL;
+		p[n++] = b->channel;
+	}
+	if (b->clkn_high != a->clkn_high) {
+		flags |= REC_CLKN_HIGH;
+		p[n++] = b->clkn_high;
+	}
+	if (b->rssi_max != a->rssi_max || b->rssi_min != a->rssi_min ||
+	    b->rssi_avg != a->rssi_avg || b->rssi_count != a->rssi_count) {
+		flags |= REC_RSSI;
+		p[n++] = b->rssi_max;
+		p[n++] = b->rssi_min;
+		p[n++] = b->rssi_avg;
+		p[n++] = b->rssi_count;
+	}
+	if (b->reserved[0] || b->reserved[1]) {
+		flags |= REC_RESERVED;
+		p[n++] = b->reserved[0];
+		p[n++] = b->reserved[1];
+	}
+	if (rec->systime != prev->systime) {
+		flags |= REC_SYSTIME;
+		n += put_varint(p + n, zigzag((int32_t)(rec->systime - prev->systime)));
+	}
+
+	p[0] = flags;
+	assert(n + DMA_SIZE <= MAX_RECORD_LEN);
+	return n;
+}
+
+static size_t field_len(uint8_t flags)
+{
+	return !!(flags & REC_TYPE) + !!(flags & REC_STATUS) +
+	       !!(flags & REC_CHANNEL) + !!(flags & REC_CLKN_HIGH) +
+	       ((flags & REC_RSSI) ? 4 : 0) + ((flags & REC_RESERVED) ? 2 : 0);
+}
+
+/* Decode the next record of the current chunk.  In column chunks the
+ * symbols follow all of the metadata. */
+static int decode_record(capture_t* cap, capture_record* rec)
+{
+	const capture_record* prev = &cap->prev;
+	const uint8_t* p = cap->buf;
+	size_t len = cap->meta_end;
+	size_t* pos = &cap->buf_pos;
+	size_t* data_pos = pos;
+	usb_pkt_rx* b = &rec->rx;
+	uint64_t ts;
+	uint32_t v;
+	uint8_t flags;
+
+	if (cap->chunk_flags & CHUNK_COLUMNS)
+		data_pos = &cap->data_pos;
+
+	*rec = *prev;
+	if (*pos >= len)
+		return -1;
+	flags = p[(*pos)++];
+
+	if (get_varint(p, len, pos, &v) < 0)
+		return -1;
+	b->clk100ns = prev->rx.clk100ns + v;
+	if (get_varint64(p, len, pos, &ts) < 0)
+		return -1;
+	rec->ts_ns = prev->ts_ns + unzigzag64(ts);
+
+	if (*pos + field_len(flags) > len)
+		return -1;
+
+	if (flags & REC_TYPE)
+		b->pkt_type = p[(*pos)++];
+	b->status = (flags & REC_STATUS) ? p[(*pos)++] : 0;
+	if (flags & REC_CHANNEL)
+		b->channel = p[(*pos)++];
+	if (flags & REC_CLKN_HIGH)
+		b->clkn_high = p[(*pos)++];
+	if (flags & REC_RSSI) {
+		b->rssi_max = p[(*pos)++];
+		b->rssi_min = p[(*pos)++];
+		b->rssi_avg = p[(*pos)++];
+		b->rssi_count = p[(*pos)++];
+	}
+	if (flags & REC_RESERVED) {
+		b->reserved[0] = p[(*pos)++];
+		b->reserved[1] = p[(*pos)++];
+	} else {
+		b->reserved[0] = b->reserved[1] = 0;
+	}
+	if (flags & REC_SYSTIME) {
+		if (get_varint(p, len, pos, &v) < 0)
+			return -1;
+		rec->systime = prev->systime + unzigzag(v);
+	}
+
+	if (flags & REC_NODATA) {
+		memset(b->data, 0, DMA_SIZE);
+		return 0;
+	}
+	if (*data_pos + DMA_SIZE > cap->buf_len)
+		return -1;
+	memcpy(b->data, p + *data_pos, DMA_SIZE);
+	*data_pos += DMA_SIZE;
+
+	return 0;
+}
+
+int capture_flush(capture_t* cap)
+{
+	uint8_t header[CHUNK_HEADER_LEN];
+	uint8_t footer[CHUNK_FOOTER_LEN];
+	uint8_t* payload = cap->buf;
+	size_t payload_len = cap->buf_len;
+	size_t raw_len = 0, n;
+	uint32_t chunk_flags = 0;
+
+	if (!cap->writing || cap->num_records == 0)
+		return 0;
+	if (cap->segment)
+		chunk_flags |= CHUNK_SEGMENT;
+
+	if (cap->flags & CAPTURE_COMPRESS) {
+		/* meta_len(4) metadata symbols */
+		raw_len = 4 + cap->buf_len + cap->data_len;
+		memmove(cap->data + 4 + cap->buf_len, cap->data, cap->data_len);
+		put_u32(cap->data, cap->buf_len);
+		memcpy(cap->data + 4, cap->buf, cap->buf_len);
+		chunk_flags |= CHUNK_COLUMNS;
+		payload = cap->data;
+		payload_len = raw_len;
+
+		/* keep the chunk as it is if it does not compress */
+		n = codec_compress(cap->data, raw_len, cap->zbuf, raw_len - 1);
+		if (n > 0) {
+			chunk_flags |= CHUNK_COMPRESSED;
+			payload = cap->zbuf;
+			payload_len = n;
+		}
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, chunk_magic, sizeof(chunk_magic));
+	put_u32(header + 4, chunk_flags);
+	put_u32(header + 8, cap->num_records);
+	put_u32(header + 12, payload_len);
+	put_u32(header + 16, CHUNK_FOOTER_LEN);
+	put_u32(header + 20, (chunk_flags & CHUNK_COMPRESSED) ? raw_len : 0);
+
+	cap->info.num_records = cap->num_records;
+	memcpy(footer, footer_magic, sizeof(footer_magic));
+	put_chunk_info(footer + 4, &cap->info);
+
+	if (fwrite(header, sizeof(header), 1, cap->fp) != 1 ||
+	    fwrite(payload, 1, payload_len, cap->fp) != payload_len ||
+	    fwrite(footer, sizeof(footer), 1, cap->fp) != 1) {
+		perror("capture_flush");
+		return -1;
+	}
+
+	if (cap->num_chunks == cap->chunks_size) {
+		uint32_t size = cap->chunks_size ? 2 * cap->chunks_size : 64;
+		capture_chunk_info* chunks = (capture_chunk_info*)realloc(cap->chunks,
+		                             size * sizeof(capture_chunk_info));
+		if (chunks == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		cap->chunks = chunks;
+		cap->chunks_size = size;
+	}
+	cap->info.offset = cap->offset;
+	cap->chunks[cap->num_chunks++] = cap->info;
+
+	cap->offset += CHUNK_HEADER_LEN + payload_len + CHUNK_FOOTER_LEN;
+	cap->segment = 0;
+	reset_chunk(cap);
+
+	return 0;
+}
+
+/* The next record does not follow on from the last one: it starts a
+ * new chunk flagged as a segment start. */
+int capture_segment(capture_t* cap)
+{
+	if (!cap->writing)
+		return -1;
+	if (cap->num_chunks == 0 && cap->num_records == 0)
+		return 0;
+	if (capture_flush(cap) < 0)
+		return -1;
+
+	cap->segment = 1;
+	return 0;
+}
+
+/* ts_ns is the record's clock_sync timestamp */
+int capture_append(capture_t* cap, uint32_t systime, uint64_t ts_ns,
+                   const usb_pkt_rx* rx)
+{
+	capture_record rec;
+	int nodata;
+
+	if (!cap->writing)
+		return -1;
+
+	rec.systime = systime;
+	rec.segment = 0;
+	rec.rx = *rx;
+	rec.ts_ns = ts_ns;
+
+	nodata = is_noise(cap, rx);
+	cap->buf_len += encode_record(cap->buf + cap->buf_len, &cap->prev, &rec, nodata);
+	if (!nodata) {
+		if (cap->flags & CAPTURE_COMPRESS) {
+			memcpy(cap->data + cap->data_len, rx->data, DMA_SIZE);
+			cap->data_len += DMA_SIZE;
+		} else {
+			memcpy(cap->buf + cap->buf_len, rx->data, DMA_SIZE);
+			cap->buf_len += DMA_SIZE;
+		}
+	}
+	cap->prev = rec;
+
+	if (cap->num_records == 0)
+		cap->info.first_ts = rec.ts_ns;
+	cap->info.last_ts = MAX(cap->info.last_ts, rec.ts_ns);
+	mark_channel(cap->info.channels, rx->channel);
+
+	if (++cap->num_records >= cap->chunk_records)
+		return capture_flush(cap);
+
+	return 0;
+}
+
+static int write_directory(capture_t* cap)
+{
+	uint8_t buf[DIR_ENTRY_LEN];
+	uint32_t i;
+
+	memcpy(buf, dir_magic, sizeof(dir_magic));
+	put_u32(buf + 4, cap->num_chunks);
+	if (fwrite(buf, 8, 1, cap->fp) != 1)
+		return -1;
+
+	for (i = 0; i < cap->num_chunks; i++) {
+		put_u64(buf, cap->chunks[i].offset);
+		put_chunk_info(buf + 8, &cap->chunks[i]);
+		if (fwrite(buf, DIR_ENTRY_LEN, 1, cap->fp) != 1)
+			return -1;
+	}
+
+	put_u64(buf, cap->offset);
+	memcpy(buf + 8, tail_magic, sizeof(tail_magic));
+	if (fwrite(buf, TAIL_LEN, 1, cap->fp) != 1)
+		return -1;
+
+	return 0;
+}
+
+static int skip_bytes(FILE* fp, size_t len)
+{
+	if (fseeko(fp, len, SEEK_CUR) == 0)
+		return 0;
+	while (len--)
+		if (fgetc(fp) == EOF)
+			return -1;
+	return 0;
+}
+
+/* The directory is optional; without it the reader walks the chunk
+ * headers and footers instead. */
+static void read_directory(capture_t* cap)
+{
+	uint8_t buf[DIR_ENTRY_LEN];
+	uint64_t dir_offset;
+	uint32_t i, num_chunks;
+
+	if (fseeko(cap->fp, -TAIL_LEN, SEEK_END) < 0)
+		return;
+	if (fread(buf, TAIL_LEN, 1, cap->fp) != 1 ||
+	    memcmp(buf + 8, tail_magic, sizeof(tail_magic)))
+		goto out;
+
+	dir_offset = get_u64(buf);
+	if (fseeko(cap->fp, dir_offset, SEEK_SET) < 0 ||
+	    fread(buf, 8, 1, cap->fp) != 1 ||
+	    memcmp(buf, dir_magic, sizeof(dir_magic)))
+		goto out;
+
+	num_chunks = get_u32(buf + 4);
+	cap->chunks = (capture_chunk_info*)malloc(
+		MAX(num_chunks, 1) * sizeof(capture_chunk_info));
+	if (cap->chunks == NULL)
+		goto out;
+
+	for (i = 0; i < num_chunks; i++) {
+		if (fread(buf, DIR_ENTRY_LEN, 1, cap->fp) != 1) {
+			free(cap->chunks);
+			cap->chunks = NULL;
+			goto out;
+		}
+		cap->chunks[i].offset = get_u64(buf);
+		get_chunk_info(buf + 8, &cap->chunks[i]);
+	}
+	cap->num_chunks = cap->chunks_size = num_chunks;
+
+out:
+	fseeko(cap->fp, cap->offset, SEEK_SET);
+}
+
+capture_t* capture_open(FILE* fp, int magic_read)
+{
+	uint8_t header[CAPTURE_HEADER_LEN];
+	size_t skip = magic_read ? sizeof(file_magic) : 0;
+	uint16_t header_len;
+	capture_t* cap;
+
+	memcpy(header, file_magic, skip);
+	if (fread(header + skip, CAPTURE_HEADER_LEN - skip, 1, fp) != 1 ||
+	    !capture_is_magic(header)) {
+		fprintf(stderr, "Not an Ubertooth capture file\n");
+		return NULL;
+	}
+	if (get_u16(header + 4) > CAPTURE_VERSION) {
+		fprintf(stderr, "Unsupported capture file version %d\n",
+		        get_u16(header + 4));
+		return NULL;
+	}
+
+	cap = capture_alloc(fp);
+	if (cap == NULL)
+		return NULL;
+
+	/* skip any header extension from later versions */
+	header_len = get_u16(header + 6);
+	cap->offset = MAX(header_len, CAPTURE_HEADER_LEN);
+	if (skip_bytes(fp, cap->offset - CAPTURE_HEADER_LEN) < 0) {
+		free(cap);
+		return NULL;
+	}
+
+	cap->chunk_records = get_u32(header + 12);
+	read_directory(cap);
+
+	return cap;
+}
+
+static int chunk_wanted(capture_t* cap, const capture_chunk_info* info)
+{
+	return info->last_ts >= cap->start_ns && info->first_ts <= cap->end_ns &&
+	       has_channel(info->channels, cap->channel);
+}
+
+/* Load the next chunk that may contain records in the requested
+ * range.  Returns 1 if a chunk was loaded, 0 at the end of file. */
+static int grow_buffer(uint8_t** buf, size_t* size, size_t len)
+{
+	uint8_t* p;
+
+	if (len <= *size)
+		return 0;
+	p = (uint8_t*)realloc(*buf, len);
+	if (p == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	*buf = p;
+	*size = len;
+	return 0;
+}
+
+static int load_chunk(capture_t* cap)
+{
+	uint8_t header[CHUNK_HEADER_LEN];
+	uint8_t footer[CHUNK_FOOTER_LEN];
+	uint32_t chunk_flags, payload_len, footer_len, raw_len, meta_len;
+	uint8_t* payload;
+	capture_chunk_info info;
+
+	while (1) {
+		if (cap->chunks) {
+			while (cap->next_chunk < cap->num_chunks &&
+			       !chunk_wanted(cap, &cap->chunks[cap->next_chunk]))
+				cap->next_chunk++;
+			if (cap->next_chunk == cap->num_chunks)
+				return 0;
+			if (fseeko(cap->fp, cap->chunks[cap->next_chunk++].offset, SEEK_SET) < 0)
+				return -1;
+		}
+
+		if (fread(header, 4, 1, cap->fp) != 1 ||
+		    memcmp(header, chunk_magic, sizeof(chunk_magic)))
+			return 0;
+		if (fread(header + 4, sizeof(header) - 4, 1, cap->fp) != 1)
+			return 0;
+
+		chunk_flags = get_u32(header + 4);
+		payload_len = get_u32(header + 12);
+		footer_len = get_u32(header + 16);
+		raw_len = get_u32(header + 20);
+		if (footer_len < CHUNK_FOOTER_LEN ||
+		    (chunk_flags & ~(CHUNK_COMPRESSED | CHUNK_COLUMNS | CHUNK_SEGMENT)))
+			return -1;
+
+		/* Without a directory, peek at the footer first so that
+		 * unwanted chunks are skipped without reading them. */
+		if (!cap->chunks && fseeko(cap->fp, payload_len, SEEK_CUR) == 0) {
+			if (fread(footer, sizeof(footer), 1, cap->fp) != 1)
+				return 0;
+			get_chunk_info(footer + 4, &info);
+			if (!chunk_wanted(cap, &info)) {
+				if (skip_bytes(cap->fp, footer_len - CHUNK_FOOTER_LEN) < 0)
+					return 0;
+				continue;
+			}
+			if (fseeko(cap->fp, -(off_t)(payload_len + CHUNK_FOOTER_LEN), SEEK_CUR) < 0)
+				return -1;
+		}
+
+		if (chunk_flags & CHUNK_COMPRESSED) {
+			if (grow_buffer(&cap->zbuf, &cap->zbuf_size, payload_len) < 0 ||
+			    grow_buffer(&cap->buf, &cap->buf_size, raw_len) < 0)
+				return -1;
+			payload = cap->zbuf;
+		} else {
+			if (grow_buffer(&cap->buf, &cap->buf_size, payload_len) < 0)
+				return -1;
+			payload = cap->buf;
+			raw_len = payload_len;
+		}
+		if (fread(payload, 1, payload_len, cap->fp) != payload_len ||
+		    fread(footer, sizeof(footer), 1, cap->fp) != 1 ||
+		    memcmp(footer, footer_magic, sizeof(footer_magic)) ||
+		    skip_bytes(cap->fp, footer_len - CHUNK_FOOTER_LEN) < 0)
+			return 0;
+
+		get_chunk_info(footer + 4, &info);
+		if (!chunk_wanted(cap, &info))
+			continue;
+
+		if ((chunk_flags & CHUNK_COMPRESSED) &&
+		    codec_decompress(cap->zbuf, payload_len, cap->buf, raw_len) < 0)
+			return -1;
+
+		reset_chunk(cap);
+		cap->num_records = get_u32(header + 8);
+		cap->buf_len = raw_len;
+		cap->chunk_flags = chunk_flags;
+		cap->info = info;
+		if (chunk_flags & CHUNK_SEGMENT)
+			cap->segment = 1;
+
+		cap->meta_end = raw_len;
+		if (chunk_flags & CHUNK_COLUMNS) {
+			if (raw_len < 4)
+				return -1;
+			meta_len = get_u32(cap->buf);
+			if (meta_len > raw_len - 4)
+				return -1;
+			cap->buf_pos = 4;
+			cap->meta_end = 4 + meta_len;
+			cap->data_pos = cap->meta_end;
+		}
+		return 1;
+	}
+}
+
+/* Returns 1 when a record was read, 0 at the end of the requested
+ * range and a negative value on a corrupt file. */
+int capture_read(capture_t* cap, capture_record* rec)
+{
+	int r;
+
+	if (cap->writing)
+		return -1;
+
+	while (1) {
+		if (cap->record_index >= cap->num_records) {
+			r = load_chunk(cap);
+			if (r <= 0)
+				return r;
+		}
+
+		if (decode_record(cap, rec) < 0) {
+			fprintf(stderr, "Corrupt capture chunk\n");
+			return -1;
+		}
+		cap->record_index++;
+		cap->prev = *rec;
+
+		if (rec->ts_ns > cap->end_ns)
+			return 0;
+		if (rec->ts_ns >= cap->start_ns &&
+		    (cap->channel < 0 || rec->rx.channel == cap->channel)) {
+			rec->segment = cap->segment;
+			cap->segment = 0;
+			return 1;
+		}
+	}
+}
+
+/* Restrict reading to records with start_ns <= ts_ns <= end_ns.  With
+ * a chunk directory this seeks directly to the first matching chunk. */
+int capture_set_range(capture_t* cap, uint64_t start_ns, uint64_t end_ns)
+{
+	uint32_t lo, hi, mid;
+
+	if (cap->writing)
+		return -1;
+
+	cap->start_ns = start_ns;
+	cap->end_ns = end_ns;
+
+	if (cap->chunks) {
+		/* first chunk whose last_ts >= start_ns */
+		lo = 0;
+		hi = cap->num_chunks;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (cap->chunks[mid].last_ts < start_ns)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		cap->next_chunk = lo;
+		cap->record_index = cap->num_records = 0;
+	}
+
+	return 0;
+}
+
+void capture_set_channel(capture_t* cap, int channel)
+{
+	cap->channel = channel;
+}
+
+/* Flushes pending records and writes the chunk directory.  The file
+ * itself is left open for the caller to close. */
+int capture_close(capture_t* cap)
+{
+	int r = 0;
+
+	if (cap->writing) {
+		r = capture_flush(cap);
+		if (r == 0)
+			r = write_directory(cap);
+		if (r == 0)
+			r = fflush(cap->fp);
+		if (r < 0)
+			perror("capture_close");
+	}
+
+	capture_free(cap);
+
+	return r;
+}
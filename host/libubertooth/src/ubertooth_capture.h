@@ -0,0 +1,136 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CAPTURE_H__
+#define __UBERTOOTH_CAPTURE_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * Chunked capture container for raw USB packets.
+ *
+ * file    := header chunk* directory? tail?
+ * header  := "UBTC" version(2) header_len(2) flags(4) chunk_records(4)
+ *            created(8) reserved(8)
+ * chunk   := chunk_header records footer
+ * footer  := "UTCF" first_ts(8) last_ts(8) num_records(4) channels(16)
+ * tail    := directory_offset(8) "UTCE"
+ *
+ * All integers are little endian.  Each chunk is self contained, so a
+ * reader can start decoding at any chunk boundary.  Records store the
+ * packet metadata as deltas against the previous record in the same
+ * chunk.  Timestamps are the 64-bit nanoseconds the writer got from
+ * clock_sync, stored as deltas like the rest of the metadata.  The
+ * directory at the end of the file lists every chunk with its time
+ * range and channel mask; truncated files can still be walked chunk by
+ * chunk without reading the records.
+ *
+ * In compressed chunks the packet metadata and the symbols are stored
+ * in separate columns and the chunk is compressed with the built-in
+ * codec.  Records whose symbols were dropped as noise keep only their
+ * metadata.
+ *
+ * A chunk flagged as a segment start holds records that do not follow
+ * on from those of the chunk before it, e.g. the windows of a
+ * hits-only or trigger dump.  Readers see the segment flag on its
+ * first record and must not correlate across it.
+ */
+
+#define CAPTURE_VERSION        1
+#define CAPTURE_HEADER_LEN     32
+#define CAPTURE_CHUNK_RECORDS  1024
+#define CAPTURE_CHANNEL_BYTES  16
+
+/* capture_create() flags */
+#define CAPTURE_COMPRESS       0x01
+#define CAPTURE_DROP_NOISE     0x02
+
+typedef struct {
+	uint64_t ts_ns;
+	uint32_t systime;
+	uint8_t segment;    /* first record after a gap */
+	usb_pkt_rx rx;
+} capture_record;
+
+typedef struct {
+	uint64_t offset;
+	uint64_t first_ts;
+	uint64_t last_ts;
+	uint32_t num_records;
+	uint8_t channels[CAPTURE_CHANNEL_BYTES];
+} capture_chunk_info;
+
+typedef struct {
+	FILE* fp;
+	uint8_t writing;
+	uint32_t flags;
+	uint32_t chunk_records;
+	int8_t squelch;
+
+	/* current chunk */
+	uint8_t* buf;
+	size_t buf_len;
+	size_t buf_size;
+	size_t buf_pos;
+	uint32_t chunk_flags;
+	uint8_t segment;
+	size_t meta_end;
+	uint8_t* data;
+	size_t data_len;
+	size_t data_size;
+	size_t data_pos;
+	uint8_t* zbuf;
+	size_t zbuf_size;
+	uint32_t num_records;
+	uint32_t record_index;
+	capture_chunk_info info;
+	capture_record prev;
+
+	/* chunk directory */
+	capture_chunk_info* chunks;
+	uint32_t num_chunks;
+	uint32_t chunks_size;
+	uint32_t next_chunk;
+	uint64_t offset;
+
+	/* read-side range restrictions */
+	uint64_t start_ns;
+	uint64_t end_ns;
+	int channel;
+} capture_t;
+
+int capture_is_magic(const uint8_t* buf);
+
+capture_t* capture_create(FILE* fp, uint32_t chunk_records, uint32_t flags);
+void capture_set_squelch(capture_t* cap, int8_t squelch);
+int capture_append(capture_t* cap, uint32_t systime, uint64_t ts_ns,
+                   const usb_pkt_rx* rx);
+int capture_segment(capture_t* cap);
+int capture_flush(capture_t* cap);
+
+capture_t* capture_open(FILE* fp, int magic_read);
+int capture_read(capture_t* cap, capture_record* rec);
+int capture_set_range(capture_t* cap, uint64_t start_ns, uint64_t end_ns);
+void capture_set_channel(capture_t* cap, int channel);
+
+int capture_close(capture_t* cap);
+
+#endif /* __UBERTOOTH_CAPTURE_H__ */
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#if defined( __APPLE__ )
+#include <mach/mach_time.h>
+#endif
+
+#include "ubertooth_clock.h"
+
+static uint64_t monotonic_ns(void)
+{
+/* As per Apple QA1398 */
+#if defined( __APPLE__ )
+	static mach_timebase_info_data_t sTimebaseInfo;
+	uint64_t ts = mach_absolute_time( );
+	if (sTimebaseInfo.denom == 0) {
+		(void) mach_timebase_info(&sTimebaseInfo);
+	}
+	return (ts*sTimebaseInfo.numer/sTimebaseInfo.denom);
+#else
+	struct timespec ts = { 0, 0 };
+	(void) clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (1000000000ull*(uint64_t) ts.tv_sec) + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static uint64_t realtime_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return 1000000000ull * (uint64_t)tv.tv_sec + 1000ull * (uint64_t)tv.tv_usec;
+}
+
+/* The extended tick closest to ref with the given clk100ns */
+static uint64_t unwrap(uint32_t clk100ns, uint64_t ref)
+{
+	uint64_t tick = ref - ref % CLOCK_PERIOD + le32toh(clk100ns) % CLOCK_PERIOD;
+
+	if (tick + CLOCK_PERIOD / 2 < ref)
+		tick += CLOCK_PERIOD;
+	else if (tick > ref + CLOCK_PERIOD / 2 && tick >= CLOCK_PERIOD)
+		tick -= CLOCK_PERIOD;
+	return tick;
+}
+
+static double fitted(const clock_sync* clk, double x)
+{
+	return clk->mean_y + clk->slope * (x - clk->mean_x);
+}
+
+static void restart(clock_sync* clk, uint64_t tick, uint64_t host_ns)
+{
+	clk->tick = tick;
+	clk->anchor_tick = tick;
+	clk->anchor_ns = host_ns;
+	clk->mean_x = clk->mean_y = 0;
+	clk->var_x = clk->cov_xy = 0;
+	clk->slope = CLOCK_NOMINAL_SLOPE;
+	clk->points = 0;
+	clk->interval_tick = tick;
+	clk->have_best = 0;
+}
+
+/* Exponentially weighted least squares, a plain average until
+ * CLOCK_FIT_WEIGHT points have been seen. */
+static void add_point(clock_sync* clk, double x, double y)
+{
+	double alpha = 1.0 / MIN(clk->points + 1, CLOCK_FIT_WEIGHT);
+	double dx = x - clk->mean_x;
+	double dy = y - clk->mean_y;
+	double min = CLOCK_NOMINAL_SLOPE * (1.0 - CLOCK_MAX_DRIFT);
+	double max = CLOCK_NOMINAL_SLOPE * (1.0 + CLOCK_MAX_DRIFT);
+
+	clk->mean_x += alpha * dx;
+	clk->mean_y += alpha * dy;
+	clk->var_x = (1.0 - alpha) * (clk->var_x + alpha * dx * dx);
+	clk->cov_xy = (1.0 - alpha) * (clk->cov_xy + alpha * dx * dy);
+	clk->points++;
+
+	if (clk->points >= CLOCK_MIN_POINTS && clk->var_x > 0)
+		clk->slope = MAX(min, MIN(max, clk->cov_xy / clk->var_x));
+}
+
+void clock_sync_init(clock_sync* clk)
+{
+	memset(clk, 0, sizeof(clock_sync));
+	clk->slope = CLOCK_NOMINAL_SLOPE;
+	clk->max_residual_ns = CLOCK_MAX_RESIDUAL_NS;
+}
+
+/* Read the host clock for the next record.  Timestamps are reported in
+ * CLOCK_REALTIME, offset once so that steps of the system clock do not
+ * show up in a capture. */
+void clock_sync_sample(clock_sync* clk)
+{
+	clk->pending_ns = monotonic_ns();
+	clk->pending = 1;
+	if (!clk->realtime_offset_ns)
+		clk->realtime_offset_ns = (int64_t)(realtime_ns() - clk->pending_ns);
+}
+
+/* Host time from elsewhere, e.g. the systime of a dump record.  Set
+ * max_residual_ns to match its resolution. */
+void clock_sync_set_host(clock_sync* clk, uint64_t host_ns)
+{
+	clk->pending_ns = host_ns;
+	clk->pending = 1;
+}
+
+/* Place the next record, in the order received, on the extended tick
+ * and feed a pending host sample to the fit. */
+void clock_sync_advance(clock_sync* clk, const usb_pkt_rx* rx)
+{
+	uint64_t tick, predicted;
+	double x, y, px, residual;
+
+	if (!clk->valid) {
+		if (!clk->pending)
+			clock_sync_sample(clk);
+		restart(clk, (uint64_t)rx->clkn_high * CLOCK_PERIOD + le32toh(rx->clk100ns),
+		        clk->pending_ns);
+		clk->pending = 0;
+		clk->valid = 1;
+		return;
+	}
+
+	if (!clk->pending) {
+		clk->tick = unwrap(rx->clk100ns, clk->tick);
+		return;
+	}
+	clk->pending = 0;
+
+	/* the host time tells how many roll-overs have passed */
+	y = (double)(int64_t)(clk->pending_ns - clk->anchor_ns);
+	px = clk->mean_x + (y - clk->mean_y) / clk->slope;
+	predicted = clk->anchor_tick + (px > 0 ? (uint64_t)px : 0);
+	tick = unwrap(rx->clk100ns, predicted);
+
+	x = (double)(int64_t)(tick - clk->anchor_tick);
+	residual = y - fitted(clk, x);
+	if (residual > clk->max_residual_ns || residual < -clk->max_residual_ns) {
+		/* the firmware clock has jumped */
+		clk->resyncs++;
+		restart(clk, tick, clk->pending_ns);
+		return;
+	}
+	clk->tick = tick;
+
+	/* host time is late by the USB latency, so the earliest sample of
+	 * each interval is the best one */
+	if (!clk->have_best || residual < clk->best_y - fitted(clk, clk->best_x)) {
+		clk->best_x = x;
+		clk->best_y = y;
+		clk->have_best = 1;
+	}
+	if ((int64_t)(tick - clk->interval_tick) >= (int64_t)CLOCK_FIT_TICKS) {
+		add_point(clk, clk->best_x, clk->best_y);
+		clk->have_best = 0;
+		clk->interval_tick = tick;
+	}
+}
+
+/* Extended tick of a record close to the newest one, e.g. the oldest
+ * record in the ringbuffer. */
+uint64_t clock_sync_tick(const clock_sync* clk, const usb_pkt_rx* rx)
+{
+	if (!clk->valid)
+		return (uint64_t)rx->clkn_high * CLOCK_PERIOD + le32toh(rx->clk100ns);
+	return unwrap(rx->clk100ns, clk->tick);
+}
+
+/* Host time in ns of any extended tick, past or future */
+static uint64_t tick_ns(const clock_sync* clk, uint64_t tick)
+{
+	double x = (double)(int64_t)(tick - clk->anchor_tick);
+
+	return clk->anchor_ns + (int64_t)fitted(clk, x) + clk->realtime_offset_ns;
+}
+
+uint64_t clock_sync_ns(const clock_sync* clk, const usb_pkt_rx* rx)
+{
+	return tick_ns(clk, clock_sync_tick(clk, rx));
+}
+
+/* Timestamp the next record of a dump that holds the host time in
+ * whole seconds only.  The first record of each second is taken to be
+ * the one closest to that time. */
+uint64_t clock_sync_replay(clock_sync* clk, uint32_t systime, const usb_pkt_rx* rx)
+{
+	clk->max_residual_ns = CLOCK_SYSTIME_RESIDUAL_NS;
+	if (!clk->valid || systime != clk->systime)
+		clock_sync_set_host(clk, (uint64_t)systime * 1000000000ull);
+	clk->systime = systime;
+
+	clock_sync_advance(clk, rx);
+	return clock_sync_ns(clk, rx);
+}
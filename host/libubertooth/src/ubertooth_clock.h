@@ -0,0 +1,87 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CLOCK_H__
+#define __UBERTOOTH_CLOCK_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * Correlation of the firmware clock with host time.
+ *
+ * clk100ns counts 100 ns ticks and rolls over every CLOCK_PERIOD, when
+ * CLKN bit 20 toggles.  Every record is placed on an extended tick
+ * count that never rolls over, and host time is fitted against it by a
+ * running linear regression, so the crystal's drift is corrected.
+ *
+ * Host time is only read when the caller asks for a sample, e.g. once
+ * per USB transfer; every record in between is timestamped from the
+ * fit alone.  A sample also recovers roll-overs missed while no records
+ * arrived, and restarts the fit when the firmware clock jumps.
+ */
+
+#define CLOCK_PERIOD          3276800000ull
+#define CLOCK_NOMINAL_SLOPE   100.0           /* ns per tick */
+#define CLOCK_MAX_DRIFT       0.001           /* of the nominal slope */
+#define CLOCK_FIT_TICKS       10000000ull     /* one point per second */
+#define CLOCK_FIT_WEIGHT      64              /* points in the running fit */
+#define CLOCK_MIN_POINTS      4
+#define CLOCK_MAX_RESIDUAL_NS 50000000ll     /* larger means a clock jump */
+#define CLOCK_SYSTIME_RESIDUAL_NS 1500000000ll /* host time in seconds */
+
+typedef struct {
+	int valid;
+	uint64_t tick;              /* extended tick of the newest record */
+	int pending;
+	uint64_t pending_ns;        /* host time for the next record */
+	int64_t realtime_offset_ns; /* added to the fitted host time */
+	int64_t max_residual_ns;
+	uint32_t systime;           /* of the last replayed record */
+
+	/* fit of host time (y) against the extended tick (x), both
+	 * relative to the anchor */
+	uint64_t anchor_tick;
+	uint64_t anchor_ns;
+	double mean_x;
+	double mean_y;
+	double var_x;
+	double cov_xy;
+	double slope;
+	uint32_t points;
+
+	/* the sample with the least USB latency is used for each point */
+	uint64_t interval_tick;
+	double best_x;
+	double best_y;
+	int have_best;
+
+	uint32_t resyncs;
+} clock_sync;
+
+void clock_sync_init(clock_sync* clk);
+void clock_sync_sample(clock_sync* clk);
+void clock_sync_set_host(clock_sync* clk, uint64_t host_ns);
+void clock_sync_advance(clock_sync* clk, const usb_pkt_rx* rx);
+uint64_t clock_sync_tick(const clock_sync* clk, const usb_pkt_rx* rx);
+uint64_t clock_sync_ns(const clock_sync* clk, const usb_pkt_rx* rx);
+uint64_t clock_sync_replay(clock_sync* clk, uint32_t systime, const usb_pkt_rx* rx);
+
+#endif /* __UBERTOOTH_CLOCK_H__ */
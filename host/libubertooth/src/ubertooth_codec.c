@@ -0,0 +1,199 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "ubertooth_codec.h"
+
+#define HASH_BITS  13
+#define MAX_OFFSET 65535
+
+/* after this many literals in a row the match search starts skipping
+ * ahead, so incompressible symbol data costs little time */
+#define SKIP_SHIFT 5
+
+static uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t codec_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Emit literals [lit, lit + lit_len) followed by a match, or only the
+ * literals when match_len is 0.  Returns NULL if dst is too small. */
+static uint8_t* put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* lit,
+                             size_t lit_len, size_t offset, size_t match_len)
+{
+	size_t ml = match_len ? match_len - CODEC_MIN_MATCH : 0;
+	uint8_t* token;
+
+	if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + ml / 255 + 1)
+		return NULL;
+
+	token = op++;
+	*token = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+	if (lit_len >= 15)
+		op = put_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len) {
+		*op++ = offset & 0xff;
+		*op++ = (offset >> 8) & 0xff;
+		if (ml >= 15)
+			op = put_length(op, ml - 15);
+	}
+
+	return op;
+}
+
+/* Returns the compressed length, or 0 if the data did not fit in
+ * dst_size bytes. */
+size_t codec_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_size)
+{
+	uint32_t table[1 << HASH_BITS];
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* iend = src + len;
+	const uint8_t* ref;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + dst_size;
+	size_t match_len;
+	uint32_t h;
+
+	/* positions are stored off by one so that 0 means empty */
+	memset(table, 0, sizeof(table));
+
+	while (ip + CODEC_MIN_MATCH <= iend) {
+		h = hash(read32(ip));
+		ref = table[h] ? src + table[h] - 1 : NULL;
+		table[h] = (uint32_t)(ip - src) + 1;
+
+		if (ref == NULL || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+			ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+			continue;
+		}
+
+		match_len = CODEC_MIN_MATCH;
+		while (ip + match_len < iend && ref[match_len] == ip[match_len])
+			match_len++;
+
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len);
+		if (op == NULL)
+			return 0;
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+
+	return op - dst;
+}
+
+static int get_length(const uint8_t** ip, const uint8_t* iend, size_t* len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/* Decompress exactly dst_len bytes.  Returns 0 on success and -1 if
+ * the input is corrupt. */
+int codec_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len)
+{
+	const uint8_t* ip = src;
+	const uint8_t* iend = src + len;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + dst_len;
+	const uint8_t* ref;
+	size_t lit_len, match_len, offset;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if (lit_len == 15 && get_length(&ip, iend, &lit_len) < 0)
+			return -1;
+		if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		match_len = token & 0x0f;
+		if (match_len == 15 && get_length(&ip, iend, &match_len) < 0)
+			return -1;
+		match_len += CODEC_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - dst) ||
+		    match_len > (size_t)(oend - op))
+			return -1;
+		ref = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		} else {
+			/* overlapping copy repeats the last offset bytes */
+			while (match_len--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op == oend ? 0 : -1;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_CODEC_H__
+#define __UBERTOOTH_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte oriented LZ77 compressor used for capture chunks.
+ *
+ * The output is a series of sequences:
+ *
+ * sequence := token literal_len* literals offset(2) match_len*
+ *
+ * The high nibble of the token is the literal count and the low nibble
+ * the match length minus CODEC_MIN_MATCH.  A nibble of 15 is followed
+ * by extra length bytes, each added to it, until one is below 255.
+ * Offsets are little endian and at most 65535 bytes back.  The last
+ * sequence ends after its literals.
+ */
+
+#define CODEC_MIN_MATCH 4
+
+size_t codec_bound(size_t len);
+size_t codec_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_size);
+int codec_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len);
+
+#endif /* __UBERTOOTH_CODEC_H__ */
@@ -69,6 +69,7 @@
 #define PKTS_PER_XFER 8
 #define NUM_BANKS     10
 #define XFER_LEN      (PKT_LEN * PKTS_PER_XFER)
+#define QUEUED_XFERS  PKTS_PER_XFER  /* single-record transfers in flight */
 #define BANK_LEN      (SYM_LEN * PKTS_PER_XFER)
 
 #define MAX(a,b) ((a)>(b) ? (a) : (b))
@@ -0,0 +1,367 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubertooth_callback.h"
+#include "ubertooth_filter.h"
+
+/* The program is in postfix order.  Tests push a result, the logical
+ * operators combine the top of the stack. */
+enum filter_ops {
+	OP_RANGE,       /* field in [lo, hi] */
+	OP_STATUS,      /* rx->status & lo */
+	OP_KEEPALIVE,
+	OP_NOT,
+	OP_AND,
+	OP_OR
+};
+
+enum filter_fields {
+	FIELD_CHANNEL,
+	FIELD_RSSI,
+	FIELD_TYPE,
+	FIELD_LAP,
+	FIELD_AA,
+	FIELD_ERR
+};
+
+static const struct {
+	const char* name;
+	uint8_t field;
+	uint8_t hex;
+	int64_t max;
+} fields[] = {
+	{ "channel", FIELD_CHANNEL, 0, 255 },
+	{ "rssi",    FIELD_RSSI,    0, 127 },
+	{ "type",    FIELD_TYPE,    0, 255 },
+	{ "lap",     FIELD_LAP,     1, 0xffffff },
+	{ "aa",      FIELD_AA,      1, 0xffffffff },
+	{ "err",     FIELD_ERR,     0, 255 },
+};
+
+#define NUM_FIELDS (sizeof(fields) / sizeof(fields[0]))
+#define FIELD_MIN(f) ((f) == FIELD_RSSI ? -128 : 0)
+
+typedef struct {
+	const char* pos;
+	filter_t* filter;
+	int error;
+} parser;
+
+static void parse_or(parser* p);
+
+static void fail(parser* p, const char* msg)
+{
+	if (!p->error)
+		fprintf(stderr, "Filter: %s at '%s'\n", msg, *p->pos ? p->pos : "end");
+	p->error = 1;
+}
+
+static void emit(parser* p, uint8_t op, uint8_t field, int64_t lo, int64_t hi)
+{
+	filter_insn* insn;
+
+	if (p->filter->num_insns == FILTER_MAX_INSNS) {
+		fail(p, "expression too long");
+		return;
+	}
+	insn = &p->filter->insns[p->filter->num_insns++];
+	insn->op = op;
+	insn->field = field;
+	insn->lo = lo;
+	insn->hi = hi;
+	if (op == OP_RANGE && field >= FIELD_LAP)
+		p->filter->needs_decode = 1;
+}
+
+static void skip_space(parser* p)
+{
+	while (isspace((unsigned char)*p->pos))
+		p->pos++;
+}
+
+/* Consume s if it is next.  Words must not run into the next word. */
+static int accept(parser* p, const char* s)
+{
+	size_t len = strlen(s);
+
+	skip_space(p);
+	if (strncmp(p->pos, s, len) != 0)
+		return 0;
+	if (isalnum((unsigned char)s[len - 1]) &&
+	    (isalnum((unsigned char)p->pos[len]) || p->pos[len] == '_'))
+		return 0;
+	p->pos += len;
+	return 1;
+}
+
+static int64_t parse_value(parser* p, int hex)
+{
+	char* end;
+	int64_t v;
+
+	skip_space(p);
+	if (hex)
+		v = (int64_t)strtoull(p->pos, &end, 16);
+	else
+		v = strtoll(p->pos, &end, 0);
+	if (end == p->pos)
+		fail(p, "expected a number");
+	p->pos = end;
+	return v;
+}
+
+/* field in {v, lo..hi, ...} */
+static void parse_set(parser* p, int f)
+{
+	int64_t lo, hi;
+	int n = 0;
+
+	if (!accept(p, "{")) {
+		fail(p, "expected '{'");
+		return;
+	}
+	do {
+		lo = hi = parse_value(p, fields[f].hex);
+		if (accept(p, ".."))
+			hi = parse_value(p, fields[f].hex);
+		emit(p, OP_RANGE, fields[f].field, lo, hi);
+		if (n++)
+			emit(p, OP_OR, 0, 0, 0);
+	} while (!p->error && accept(p, ","));
+	if (!accept(p, "}"))
+		fail(p, "expected '}'");
+}
+
+/* comparisons become ranges, so every test is a single instruction */
+static void parse_compare(parser* p, int f)
+{
+	uint8_t field = fields[f].field;
+	int64_t min = FIELD_MIN(field), max = fields[f].max;
+	int64_t v;
+
+	if (accept(p, "in")) {
+		parse_set(p, f);
+	} else if (accept(p, "==")) {
+		v = parse_value(p, fields[f].hex);
+		emit(p, OP_RANGE, field, v, v);
+	} else if (accept(p, "!=")) {
+		v = parse_value(p, fields[f].hex);
+		emit(p, OP_RANGE, field, v, v);
+		emit(p, OP_NOT, 0, 0, 0);
+	} else if (accept(p, "<=")) {
+		emit(p, OP_RANGE, field, min, parse_value(p, fields[f].hex));
+	} else if (accept(p, ">=")) {
+		emit(p, OP_RANGE, field, parse_value(p, fields[f].hex), max);
+	} else if (accept(p, "<")) {
+		emit(p, OP_RANGE, field, min, parse_value(p, fields[f].hex) - 1);
+	} else if (accept(p, ">")) {
+		emit(p, OP_RANGE, field, parse_value(p, fields[f].hex) + 1, max);
+	} else {
+		fail(p, "expected a comparison");
+	}
+}
+
+static void parse_primary(parser* p)
+{
+	size_t f;
+
+	if (accept(p, "(")) {
+		parse_or(p);
+		if (!accept(p, ")"))
+			fail(p, "expected ')'");
+		return;
+	}
+	if (accept(p, "not") || accept(p, "!")) {
+		parse_primary(p);
+		emit(p, OP_NOT, 0, 0, 0);
+		return;
+	}
+
+	if (accept(p, "br"))
+		emit(p, OP_RANGE, FIELD_TYPE, BR_PACKET, BR_PACKET);
+	else if (accept(p, "le"))
+		emit(p, OP_RANGE, FIELD_TYPE, LE_PACKET, LE_PACKET);
+	else if (accept(p, "discard"))
+		emit(p, OP_STATUS, 0, DISCARD, 0);
+	else if (accept(p, "overflow"))
+		emit(p, OP_STATUS, 0, DMA_OVERFLOW | FIFO_OVERFLOW, 0);
+	else if (accept(p, "keepalive"))
+		emit(p, OP_KEEPALIVE, 0, 0, 0);
+	else {
+		for (f = 0; f < NUM_FIELDS; f++) {
+			if (accept(p, fields[f].name)) {
+				parse_compare(p, f);
+				return;
+			}
+		}
+		fail(p, "unknown field");
+	}
+}
+
+static void parse_and(parser* p)
+{
+	parse_primary(p);
+	while (!p->error && (accept(p, "and") || accept(p, "&&"))) {
+		parse_primary(p);
+		emit(p, OP_AND, 0, 0, 0);
+	}
+}
+
+static void parse_or(parser* p)
+{
+	parse_and(p);
+	while (!p->error && (accept(p, "or") || accept(p, "||"))) {
+		parse_and(p);
+		emit(p, OP_OR, 0, 0, 0);
+	}
+}
+
+filter_t* filter_compile(const char* expr)
+{
+	parser p;
+
+	p.pos = expr;
+	p.error = 0;
+	p.filter = (filter_t*)calloc(1, sizeof(filter_t));
+	if (p.filter == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+
+	parse_or(&p);
+	skip_space(&p);
+	if (*p.pos != '\0')
+		fail(&p, "unexpected input");
+	if (p.error) {
+		free(p.filter);
+		return NULL;
+	}
+
+	return p.filter;
+}
+
+void filter_free(filter_t* filter)
+{
+	free(filter);
+}
+
+/* an LE data channel PDU with no payload */
+static int is_keepalive(const usb_pkt_rx* rx)
+{
+	uint32_t aa;
+
+	if (rx->pkt_type == KEEP_ALIVE)
+		return 1;
+	if (rx->pkt_type != LE_PACKET)
+		return 0;
+	aa = rx->data[0] | (rx->data[1] << 8) | (rx->data[2] << 16) | ((uint32_t)rx->data[3] << 24);
+	return aa != 0x8e89bed6 && (rx->data[4] & 0x03) == 0x01 && (rx->data[5] & 0x3f) == 0;
+}
+
+/* Run the program with Kleene logic; decoded fields are unknown when
+ * decoded is 0. */
+static int run(const filter_t* filter, const usb_pkt_rx* rx, int decoded,
+               uint32_t address, uint8_t ac_errors)
+{
+	uint8_t stack[FILTER_MAX_INSNS];
+	const filter_insn* insn;
+	int64_t v;
+	int i, sp = 0;
+	uint8_t a, b;
+
+	for (i = 0; i < filter->num_insns; i++) {
+		insn = &filter->insns[i];
+		switch (insn->op) {
+		case OP_RANGE:
+			switch (insn->field) {
+			case FIELD_CHANNEL: v = rx->channel; break;
+			case FIELD_RSSI:    v = cc2400_rssi_to_dbm(rx->rssi_max); break;
+			case FIELD_TYPE:    v = rx->pkt_type; break;
+			case FIELD_LAP:
+			case FIELD_AA:
+				/* lap only matches BR packets and aa only LE */
+				if ((rx->pkt_type == LE_PACKET) != (insn->field == FIELD_AA)) {
+					stack[sp++] = FILTER_FALSE;
+					continue;
+				}
+				v = address;
+				break;
+			default:            v = ac_errors; break;
+			}
+			if (insn->field >= FIELD_LAP && !decoded)
+				stack[sp++] = FILTER_UNKNOWN;
+			else
+				stack[sp++] = v >= insn->lo && v <= insn->hi;
+			break;
+		case OP_STATUS:
+			stack[sp++] = (rx->status & insn->lo) != 0;
+			break;
+		case OP_KEEPALIVE:
+			stack[sp++] = is_keepalive(rx);
+			break;
+		case OP_NOT:
+			a = stack[sp-1];
+			stack[sp-1] = a == FILTER_UNKNOWN ? a : !a;
+			break;
+		case OP_AND:
+			b = stack[--sp];
+			a = stack[sp-1];
+			if (a == FILTER_FALSE || b == FILTER_FALSE)
+				stack[sp-1] = FILTER_FALSE;
+			else
+				stack[sp-1] = (a == FILTER_UNKNOWN || b == FILTER_UNKNOWN) ? FILTER_UNKNOWN : FILTER_TRUE;
+			break;
+		case OP_OR:
+			b = stack[--sp];
+			a = stack[sp-1];
+			if (a == FILTER_TRUE || b == FILTER_TRUE)
+				stack[sp-1] = FILTER_TRUE;
+			else
+				stack[sp-1] = (a == FILTER_UNKNOWN || b == FILTER_UNKNOWN) ? FILTER_UNKNOWN : FILTER_FALSE;
+			break;
+		}
+	}
+
+	return stack[0];
+}
+
+/* Evaluate on the raw record.  FILTER_FALSE means the record can be
+ * dropped without correlating its symbols. */
+int filter_pre(const filter_t* filter, const usb_pkt_rx* rx)
+{
+	return run(filter, rx, 0, 0, 0);
+}
+
+/* Evaluate on a decoded packet, address being the LAP or the LE access
+ * address.  Returns 1 if the packet should be kept.  Without decoded
+ * fields the record has already passed filter_pre. */
+int filter_match(const filter_t* filter, const usb_pkt_rx* rx,
+                 uint32_t address, uint8_t ac_errors)
+{
+	if (!filter->needs_decode)
+		return 1;
+	return run(filter, rx, 1, address, ac_errors) == FILTER_TRUE;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_FILTER_H__
+#define __UBERTOOTH_FILTER_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * Capture filter expressions (-F), e.g.
+ *
+ *   channel >= 20 and channel <= 40 and rssi > -70 and not discard
+ *   lap in {9e8b33, 0c3d2e} or aa == 8e89bed6
+ *   le and not keepalive
+ *
+ * Fields:   channel, rssi (dBm), type, lap, aa, err
+ * Keywords: br, le, discard, overflow, keepalive
+ * Operators: == != < <= > >= in {v, lo..hi, ...}, and or not ( )
+ *
+ * lap and aa values are hexadecimal, all others decimal or 0x hex.
+ * The expression is compiled into a flat program that is run once on
+ * the raw USB record, with lap, aa and err unknown, before any symbols
+ * are correlated, and again on the decoded packet before it is
+ * written anywhere.
+ */
+
+#define FILTER_MAX_INSNS 64
+
+enum filter_results {
+	FILTER_FALSE   = 0,
+	FILTER_TRUE    = 1,
+	FILTER_UNKNOWN = 2
+};
+
+typedef struct {
+	uint8_t op;
+	uint8_t field;
+	int64_t lo;
+	int64_t hi;
+} filter_insn;
+
+typedef struct {
+	filter_insn insns[FILTER_MAX_INSNS];
+	int num_insns;
+	int needs_decode;
+} filter_t;
+
+filter_t* filter_compile(const char* expr);
+void filter_free(filter_t* filter);
+int filter_pre(const filter_t* filter, const usb_pkt_rx* rx);
+int filter_match(const filter_t* filter, const usb_pkt_rx* rx,
+                 uint32_t address, uint8_t ac_errors);
+
+#endif /* __UBERTOOTH_FILTER_H__ */
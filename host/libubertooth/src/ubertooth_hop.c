@@ -0,0 +1,125 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "ubertooth_hop.h"
+
+#define CHANNEL_USED(map, c) ((map)[(c) / 8] & (1 << ((c) % 8)))
+
+/* Set up the hop selection for UAP << 24 | LAP of the master.  afh_map
+ * may be NULL for the basic hopping sequence. */
+void hop_init(hop_ctx* h, uint32_t address, const uint8_t* afh_map)
+{
+	int i;
+
+	memset(h, 0, sizeof(hop_ctx));
+
+	h->a1 = (address >> 23) & 0x1f;
+	h->b = (address >> 19) & 0x0f;
+	h->c1 = ((address >> 4) & 0x10) +
+		((address >> 3) & 0x08) +
+		((address >> 2) & 0x04) +
+		((address >> 1) & 0x02) +
+		(address & 0x01);
+	h->d1 = (address >> 10) & 0x1ff;
+	h->e = ((address >> 7) & 0x40) +
+		((address >> 6) & 0x20) +
+		((address >> 5) & 0x10) +
+		((address >> 4) & 0x08) +
+		((address >> 3) & 0x04) +
+		((address >> 2) & 0x02) +
+		((address >> 1) & 0x01);
+
+	for (i = 0; i < NUM_BREDR_CHANNELS; i++)
+		h->bank[i] = (i * 2) % NUM_BREDR_CHANNELS;
+
+	if (afh_map) {
+		memcpy(h->afh_map, afh_map, 10);
+		for (i = 0; i < NUM_BREDR_CHANNELS; i++)
+			if (CHANNEL_USED(afh_map, h->bank[i]))
+				h->afh_bank[h->used_channels++] = h->bank[i];
+	}
+}
+
+/* 5 bit butterfly permutation, one conditional swap per control bit */
+static uint8_t perm5(uint8_t z, uint8_t p_high, uint16_t p_low)
+{
+	static const uint8_t index1[] = {0, 2, 1, 3, 0, 1, 0, 3, 1, 0, 2, 1, 0, 1};
+	static const uint8_t index2[] = {1, 3, 2, 4, 4, 3, 2, 4, 4, 3, 4, 3, 3, 2};
+	uint32_t p = (p_low & 0x1ff) | ((uint32_t)(p_high & 0x1f) << 9);
+	uint8_t t;
+	int i;
+
+	z &= 0x1f;
+	for (i = 13; i >= 0; i--) {
+		t = ((z >> index1[i]) ^ (z >> index2[i])) & (p >> i) & 1;
+		z ^= (t << index1[i]) | (t << index2[i]);
+	}
+
+	return z;
+}
+
+/* Channels of the slots starting at clk, clk + 2, ...  All inputs but X
+ * and Y1 only change every 128 ticks, so they are computed once for
+ * each block of 64 slots. */
+void hop_sequence(const hop_ctx* h, uint32_t clk, uint32_t slots, uint8_t* channels)
+{
+	uint8_t a, c, x, y1, perm, channel;
+	uint16_t d;
+	uint32_t base_f, f, f_dash, block;
+
+	clk &= 0x0fffffff;
+	while (slots > 0) {
+		/* Variable names used in Vol 2, Part B, Section 2.6 of the spec */
+		block = clk >> 7;
+		a = (h->a1 ^ (clk >> 21)) & 0x1f;
+		c = (h->c1 ^ (clk >> 16)) & 0x1f;
+		d = (h->d1 ^ (clk >> 7)) & 0x1ff;
+		base_f = (clk >> 3) & 0x1fffff0;
+		f = base_f % NUM_BREDR_CHANNELS;
+		f_dash = h->used_channels ? base_f % h->used_channels : 0;
+
+		while (slots > 0 && (clk >> 7) == block) {
+			x = (clk >> 2) & 0x1f;
+			/* same channel mechanism: the slave answers on the
+			 * master's channel */
+			y1 = h->used_channels ? 0 : (clk >> 1) & 0x01;
+
+			perm = perm5(((x + a) % 32) ^ h->b, (y1 * 0x1f) ^ c, d);
+			channel = h->bank[(perm + h->e + f + 32 * y1) % NUM_BREDR_CHANNELS];
+			if (h->used_channels && !CHANNEL_USED(h->afh_map, channel))
+				channel = h->afh_bank[(perm + h->e + f_dash) % h->used_channels];
+
+			*channels++ = channel;
+			slots--;
+			clk = (clk + 2) & 0x0fffffff;
+		}
+	}
+}
+
+uint8_t hop_channel(const hop_ctx* h, uint32_t clk)
+{
+	uint8_t channel;
+
+	hop_sequence(h, clk, 1, &channel);
+	return channel;
+}
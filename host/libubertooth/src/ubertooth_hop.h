@@ -0,0 +1,58 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_HOP_H__
+#define __UBERTOOTH_HOP_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * BR/EDR hop selection in the connection state (Vol 2, Part B, Section
+ * 2.6 of the spec), computed on the host for any range of the master's
+ * clock.  The firmware computes one hop at a time in next_hop().
+ *
+ * Channels are numbered 0-78 as in the USB packets.  With an AFH map a
+ * hop onto an unused channel is remapped to the used channels, and the
+ * slave transmits on the channel of the preceding master slot.
+ */
+
+typedef struct {
+	/* address dependent inputs */
+	uint8_t a1;
+	uint8_t b;
+	uint8_t c1;
+	uint16_t d1;
+	uint8_t e;
+
+	/* basic register bank: even channels, then odd channels */
+	uint8_t bank[NUM_BREDR_CHANNELS];
+
+	/* used channels in bank order, 0 without AFH */
+	uint8_t afh_map[10];
+	uint8_t afh_bank[NUM_BREDR_CHANNELS];
+	uint8_t used_channels;
+} hop_ctx;
+
+void hop_init(hop_ctx* h, uint32_t address, const uint8_t* afh_map);
+uint8_t hop_channel(const hop_ctx* h, uint32_t clk);
+void hop_sequence(const hop_ctx* h, uint32_t clk, uint32_t slots, uint8_t* channels);
+
+#endif /* __UBERTOOTH_HOP_H__ */
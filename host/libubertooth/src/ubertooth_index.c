@@ -0,0 +1,474 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ubertooth.h"
+#include "ubertooth_capture.h"
+#include "ubertooth_index.h"
+#include "ubertooth_pcapng.h"
+
+static const uint8_t index_magic[4] = { 'U', 'T', 'I', 'X' };
+
+/* offsets into the libbtbb pcap pseudo-headers */
+#define BREDR_HDR_CHANNEL   0
+#define BREDR_HDR_OFFENSES  3
+#define BREDR_HDR_LAP       8
+#define BREDR_HDR_LEN       22
+#define LE_HDR_CHANNEL      0
+#define LE_HDR_OFFENSES     3
+#define LE_HDR_AA           10
+#define LE_HDR_LEN          14
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+	put_u16(p, v & 0xffff);
+	put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+	put_u32(p, v & 0xffffffff);
+	put_u32(p + 4, v >> 32);
+}
+
+static uint16_t get_u16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+index_t* index_init(void)
+{
+	index_t* idx = (index_t*)calloc(1, sizeof(index_t));
+	if (idx == NULL)
+		fprintf(stderr, "Unable to allocate memory\n");
+	return idx;
+}
+
+void index_free(index_t* idx)
+{
+	free(idx->entries);
+	free(idx);
+}
+
+static int index_reserve(index_t* idx, uint64_t num)
+{
+	uint64_t size;
+	index_entry* entries;
+
+	if (num <= idx->entries_size)
+		return 0;
+
+	size = idx->entries_size ? idx->entries_size : 1024;
+	while (size < num)
+		size *= 2;
+
+	entries = (index_entry*)realloc(idx->entries, size * sizeof(index_entry));
+	if (entries == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	idx->entries = entries;
+	idx->entries_size = size;
+	return 0;
+}
+
+int index_add(index_t* idx, const index_entry* e)
+{
+	if (index_reserve(idx, idx->num_entries + 1) < 0)
+		return -1;
+	idx->entries[idx->num_entries++] = *e;
+	return 0;
+}
+
+int index_append(index_t* dst, const index_t* src)
+{
+	if (index_reserve(dst, dst->num_entries + src->num_entries) < 0)
+		return -1;
+	memcpy(dst->entries + dst->num_entries, src->entries,
+	       src->num_entries * sizeof(index_entry));
+	dst->num_entries += src->num_entries;
+	return 0;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+	const index_entry* ea = (const index_entry*)a;
+	const index_entry* eb = (const index_entry*)b;
+
+	if (ea->lap != eb->lap)
+		return ea->lap < eb->lap ? -1 : 1;
+	if (ea->ts_ns != eb->ts_ns)
+		return ea->ts_ns < eb->ts_ns ? -1 : 1;
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	return 0;
+}
+
+void index_sort(index_t* idx)
+{
+	qsort(idx->entries, idx->num_entries, sizeof(index_entry), compare_entries);
+}
+
+/* first entry for lap at or after ts_ns */
+uint64_t index_lower_bound(const index_t* idx, uint32_t lap, uint64_t ts_ns)
+{
+	uint64_t lo = 0, hi = idx->num_entries, mid;
+	const index_entry* e;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &idx->entries[mid];
+		if (e->lap < lap || (e->lap == lap && e->ts_ns < ts_ns))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+char* index_path(const char* source)
+{
+	char* path = (char*)malloc(strlen(source) + sizeof(INDEX_SUFFIX));
+	if (path == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	strcpy(path, source);
+	strcat(path, INDEX_SUFFIX);
+	return path;
+}
+
+/* Identify a capture from its first bytes.  Leaves the file positioned
+ * at the start. */
+int index_source_type(FILE* fp)
+{
+	uint8_t magic[4];
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1) {
+		fprintf(stderr, "Empty input\n");
+		return -1;
+	}
+	if (fseeko(fp, 0, SEEK_SET) < 0) {
+		perror("fseek");
+		return -1;
+	}
+
+	if (pcapng_is_magic(magic))
+		return INDEX_SOURCE_PCAPNG;
+	if (capture_is_magic(magic)) {
+		fprintf(stderr, "Capture files are not indexed, use ubertooth-convert -l first\n");
+		return -1;
+	}
+	return INDEX_SOURCE_RAW;
+}
+
+int index_set_source(index_t* idx, const char* path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	idx->source_size = st.st_size;
+	idx->source_mtime = st.st_mtime;
+	return 0;
+}
+
+/* An index is only valid for the exact file it was built from. */
+int index_is_current(const index_t* idx, const char* path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return 0;
+	}
+	return idx->source_size == (uint64_t)st.st_size &&
+	       idx->source_mtime == (uint64_t)st.st_mtime;
+}
+
+int index_write(const index_t* idx, FILE* fp)
+{
+	uint8_t buf[INDEX_HEADER_LEN];
+	const index_entry* e;
+	uint64_t i;
+
+	memcpy(buf, index_magic, sizeof(index_magic));
+	put_u16(buf + 4, INDEX_VERSION);
+	put_u16(buf + 6, idx->source);
+	put_u64(buf + 8, idx->source_size);
+	put_u64(buf + 16, idx->source_mtime);
+	put_u64(buf + 24, idx->num_entries);
+	if (fwrite(buf, INDEX_HEADER_LEN, 1, fp) != 1)
+		goto err;
+
+	for (i = 0; i < idx->num_entries; i++) {
+		e = &idx->entries[i];
+		put_u64(buf, e->ts_ns);
+		put_u64(buf + 8, e->offset);
+		put_u32(buf + 16, e->lap);
+		buf[20] = e->channel;
+		buf[21] = e->ac_errors;
+		buf[22] = e->flags;
+		buf[23] = 0;
+		if (fwrite(buf, INDEX_ENTRY_LEN, 1, fp) != 1)
+			goto err;
+	}
+
+	if (fflush(fp) == 0)
+		return 0;
+err:
+	perror("index write");
+	return -1;
+}
+
+index_t* index_read(FILE* fp)
+{
+	uint8_t buf[INDEX_HEADER_LEN];
+	index_entry* e;
+	index_t* idx;
+	uint64_t i, num;
+
+	if (fread(buf, INDEX_HEADER_LEN, 1, fp) != 1 ||
+	    memcmp(buf, index_magic, sizeof(index_magic)) != 0) {
+		fprintf(stderr, "Not an index file\n");
+		return NULL;
+	}
+	if (get_u16(buf + 4) != INDEX_VERSION) {
+		fprintf(stderr, "Unsupported index version %u\n", get_u16(buf + 4));
+		return NULL;
+	}
+
+	idx = index_init();
+	if (idx == NULL)
+		return NULL;
+	idx->source = get_u16(buf + 6);
+	idx->source_size = get_u64(buf + 8);
+	idx->source_mtime = get_u64(buf + 16);
+	num = get_u64(buf + 24);
+
+	if (index_reserve(idx, num) < 0)
+		goto err;
+
+	for (i = 0; i < num; i++) {
+		if (fread(buf, INDEX_ENTRY_LEN, 1, fp) != 1) {
+			fprintf(stderr, "Index file is truncated\n");
+			goto err;
+		}
+		e = &idx->entries[i];
+		e->ts_ns = get_u64(buf);
+		e->offset = get_u64(buf + 8);
+		e->lap = get_u32(buf + 16);
+		e->channel = buf[20];
+		e->ac_errors = buf[21];
+		e->flags = buf[22];
+	}
+	idx->num_entries = num;
+
+	return idx;
+err:
+	index_free(idx);
+	return NULL;
+}
+
+/* Look for an access code in the window whose oldest record was read
+ * from offset.  Returns 1 if an entry was added. */
+static int scan_window(index_t* idx, ringbuffer_t* rb, uint32_t systime,
+                       uint64_t offset)
+{
+	char syms[NUM_BANKS * BANK_LEN];
+	index_entry e;
+	btbb_packet* pkt;
+	usb_pkt_rx* rx;
+	int i;
+
+	rx = ringbuffer_bottom_usb(rb);
+	if (rx->status & DISCARD)
+		return 0;
+	if (rx->channel > (NUM_BREDR_CHANNELS-1))
+		return 0;
+
+	for (i = 0; i < NUM_BANKS; i++)
+		memcpy(syms + i * BANK_LEN, ringbuffer_get_bt(rb, i), BANK_LEN);
+
+	pkt = NULL;
+	if (btbb_find_ac(syms, BANK_LEN, LAP_ANY, max_ac_errors, &pkt) < 0)
+		return 0;
+
+	memset(&e, 0, sizeof(e));
+	e.ts_ns = (uint64_t)systime * 1000000000ull;
+	e.offset = offset;
+	e.lap = btbb_packet_get_lap(pkt);
+	e.channel = rx->channel;
+	e.ac_errors = btbb_packet_get_ac_errors(pkt);
+	btbb_packet_unref(pkt);
+
+	return index_add(idx, &e) < 0 ? -1 : 1;
+}
+
+/* Search records [first, first + count) of a raw dump for access codes
+ * the same way cb_rx() does on replay: each record is examined together
+ * with the NUM_BANKS - 1 records that follow it.  In dumps that start
+ * with a header marker only the windows ending at a hit marker are
+ * examined, and a hit belongs to the segment holding its marker.
+ * Segments can be scanned independently, which lets a dump be split
+ * across threads.  btbb_init() must have been called. */
+int index_scan_raw(index_t* idx, FILE* fp, uint64_t first, uint64_t count)
+{
+	uint8_t buf[INDEX_RAW_RECORD_LEN];
+	ringbuffer_t* rb;
+	dump_marker m;
+	uint32_t systime[NUM_BANKS];
+	uint64_t offsets[NUM_BANKS];
+	uint64_t n, start, end, bottom;
+	int kind, oldest, hits_only, records = 0, ret = 0;
+
+	hits_only = fread(buf, INDEX_RAW_RECORD_LEN, 1, fp) == 1 &&
+	            dump_read_marker(buf, &m) == DUMP_MARKER_HEADER;
+
+	/* A hit needs the NUM_BANKS records before its marker, which may be
+	 * interleaved with as many markers.  Otherwise a window needs the
+	 * records after its oldest one. */
+	if (hits_only) {
+		start = first > 2 * NUM_BANKS ? first - 2 * NUM_BANKS : 0;
+		end = first + count;
+	} else {
+		start = first;
+		end = first + count + 2 * NUM_BANKS;
+	}
+
+	if (fseeko(fp, start * INDEX_RAW_RECORD_LEN, SEEK_SET) < 0) {
+		perror("fseek");
+		return -1;
+	}
+
+	rb = ringbuffer_init();
+	if (rb == NULL)
+		return -1;
+
+	for (n = start; n < end; n++) {
+		if (fread(buf, INDEX_RAW_RECORD_LEN, 1, fp) != 1)
+			break;
+
+		kind = dump_read_marker(buf, &m);
+		if (kind < 0) {
+			ringbuffer_add(rb, (usb_pkt_rx*)(buf + 4));
+			systime[rb->current_bank] = (buf[0] << 24) | (buf[1] << 16) |
+			                            (buf[2] << 8) | buf[3];
+			offsets[rb->current_bank] = n * INDEX_RAW_RECORD_LEN;
+			records++;
+			if (hits_only)
+				continue;
+		} else if (kind == DUMP_MARKER_WINDOW) {
+			/* no window spans the records of two trigger windows */
+			records = 0;
+			continue;
+		} else if (!hits_only || kind != DUMP_MARKER_HIT || n < first) {
+			continue;
+		}
+		if (records < NUM_BANKS)
+			continue;
+
+		oldest = (rb->current_bank + 1) % NUM_BANKS;
+		bottom = offsets[oldest] / INDEX_RAW_RECORD_LEN;
+		if (!hits_only && bottom >= first + count)
+			break;
+
+		if (scan_window(idx, rb, systime[oldest], offsets[oldest]) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(rb);
+	return ret;
+}
+
+/* Index every BR/EDR and LE packet written by libbtbb into a pcapng
+ * file.  Packets of other link types are ignored. */
+int index_scan_pcapng(index_t* idx, FILE* fp)
+{
+	pcapng_reader* r;
+	index_entry e;
+	const uint8_t* p;
+	uint16_t linktype;
+	int ret;
+
+	r = pcapng_open(fp);
+	if (r == NULL)
+		return -1;
+
+	memset(&e, 0, sizeof(e));
+	while ((ret = pcapng_next_block(r)) > 0) {
+		if (r->block_type != PCAPNG_EPB)
+			continue;
+
+		p = r->packet;
+		linktype = r->ifaces[r->iface].linktype;
+		if (linktype == DLT_BLUETOOTH_BREDR_BB && r->caplen >= BREDR_HDR_LEN) {
+			e.lap = get_u32(p + BREDR_HDR_LAP) & 0xffffff;
+			e.channel = p[BREDR_HDR_CHANNEL];
+			e.ac_errors = p[BREDR_HDR_OFFENSES];
+			e.flags = 0;
+		} else if (linktype == DLT_BLUETOOTH_LE_LL_WITH_PHDR && r->caplen >= LE_HDR_LEN) {
+			e.lap = get_u32(p + LE_HDR_AA);
+			e.channel = p[LE_HDR_CHANNEL];
+			e.ac_errors = p[LE_HDR_OFFENSES];
+			e.flags = INDEX_FLAG_LE;
+		} else {
+			continue;
+		}
+		e.ts_ns = r->ts_ns;
+		e.offset = r->block_offset;
+
+		if (index_add(idx, &e) < 0) {
+			pcapng_close(r);
+			return -1;
+		}
+	}
+	if (ret < 0)
+		fprintf(stderr, "Malformed pcapng block at offset %llu\n",
+		        (unsigned long long)r->block_offset);
+
+	pcapng_close(r);
+	return ret;
+}
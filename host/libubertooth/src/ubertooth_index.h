@@ -0,0 +1,96 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_INDEX_H__
+#define __UBERTOOTH_INDEX_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Sidecar index of access code hits in an existing capture, stored
+ * next to it as <capture>.utx.
+ *
+ * file   := "UTIX" version(2) source(2) source_size(8) source_mtime(8)
+ *           count(8) entry*
+ * entry  := ts_ns(8) offset(8) lap(4) channel(1) ac_errors(1) flags(1)
+ *           reserved(1)
+ *
+ * All integers are little endian.  Entries are sorted by LAP and then
+ * by time so that a query for one LAP is a binary search followed by a
+ * sequential read.  For raw dumps the offset is that of the first
+ * record of the NUM_BANKS record window in which the access code was
+ * found, for pcapng files it is the offset of the packet block.  LE
+ * packets from pcapng files are indexed by access address.
+ */
+
+#define INDEX_VERSION        1
+#define INDEX_HEADER_LEN     32
+#define INDEX_ENTRY_LEN      24
+#define INDEX_SUFFIX         ".utx"
+
+#define INDEX_SOURCE_RAW     1
+#define INDEX_SOURCE_PCAPNG  2
+
+#define INDEX_FLAG_LE        0x01
+
+/* raw dump record: big endian systime followed by a USB packet */
+#define INDEX_RAW_RECORD_LEN 68
+
+typedef struct {
+	uint64_t ts_ns;
+	uint64_t offset;
+	uint32_t lap;
+	uint8_t channel;
+	uint8_t ac_errors;
+	uint8_t flags;
+} index_entry;
+
+typedef struct {
+	uint16_t source;
+	uint64_t source_size;
+	uint64_t source_mtime;
+
+	index_entry* entries;
+	uint64_t num_entries;
+	uint64_t entries_size;
+} index_t;
+
+index_t* index_init(void);
+void index_free(index_t* idx);
+
+int index_add(index_t* idx, const index_entry* e);
+int index_append(index_t* dst, const index_t* src);
+void index_sort(index_t* idx);
+uint64_t index_lower_bound(const index_t* idx, uint32_t lap, uint64_t ts_ns);
+
+char* index_path(const char* source);
+int index_source_type(FILE* fp);
+int index_set_source(index_t* idx, const char* path);
+int index_is_current(const index_t* idx, const char* path);
+
+int index_write(const index_t* idx, FILE* fp);
+index_t* index_read(FILE* fp);
+
+int index_scan_raw(index_t* idx, FILE* fp, uint64_t first, uint64_t count);
+int index_scan_pcapng(index_t* idx, FILE* fp);
+
+#endif /* __UBERTOOTH_INDEX_H__ */
@@ -142,6 +142,11 @@ enum usb_pkt_status {
 	DISCARD       = 0x20,
 };
 
+/* reserved[0] holds the mode epoch when reserved[1] has USB_PKT_EPOCH
+ * set.  Firmware bumps the epoch on every mode change, so the host can
+ * drop records from before a change without stopping the stream. */
+#define USB_PKT_EPOCH 0x01
+
 /*
  * USB packet for Bluetooth RX (64 total bytes)
  */
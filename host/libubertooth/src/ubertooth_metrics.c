@@ -0,0 +1,253 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ubertooth_metrics.h"
+#include "ubertooth_net.h"
+
+#define METRICS_UNIX_PREFIX "unix:"
+
+static uint64_t load(const uint64_t* counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000ull * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_record(metrics_t* m, const usb_pkt_rx* rx)
+{
+	metrics_add(&m->records, 1);
+	if (rx->channel < METRICS_CHANNELS)
+		metrics_add(&m->channel_records[rx->channel], 1);
+	if (rx->status & (DMA_OVERFLOW | FIFO_OVERFLOW))
+		metrics_add(&m->overflows, 1);
+}
+
+void metrics_packet(metrics_t* m, unsigned channel)
+{
+	metrics_add(&m->packets, 1);
+	if (channel < METRICS_CHANNELS)
+		metrics_add(&m->channel_packets[channel], 1);
+}
+
+void metrics_latency(metrics_t* m, uint64_t ns)
+{
+	int i = 0;
+
+	while (i < METRICS_LATENCY_BUCKETS && ns > (1000ull << i))
+		i++;
+	metrics_add(&m->latency[i], 1);
+	metrics_add(&m->latency_sum_ns, ns);
+}
+
+static void counter(FILE* fp, const char* name, const char* help, const uint64_t* c)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+	        name, help, name, name, (unsigned long long)load(c));
+}
+
+static void per_channel(FILE* fp, const char* name, const char* help, const uint64_t* c)
+{
+	int i;
+
+	fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	for (i = 0; i < METRICS_CHANNELS; i++)
+		fprintf(fp, "%s{channel=\"%d\"} %llu\n", name, i,
+		        (unsigned long long)load(&c[i]));
+}
+
+static void write_metrics(metrics_t* m, FILE* fp)
+{
+	uint64_t n = 0;
+	int i;
+
+	counter(fp, "ubertooth_transfers_total", "USB transfers received.", &m->transfers);
+	counter(fp, "ubertooth_records_total", "Records passed to the decoder.", &m->records);
+	counter(fp, "ubertooth_overflow_records_total",
+	        "Records flagged with a DMA or FIFO overflow by the firmware.", &m->overflows);
+	counter(fp, "ubertooth_switch_dropped_records_total",
+	        "Records dropped because they belong to a previous mode.", &m->switch_drops);
+	counter(fp, "ubertooth_filtered_records_total",
+	        "Records rejected by the capture filter before correlation.", &m->filtered);
+	counter(fp, "ubertooth_lost_records_total",
+	        "Records lost between ubertoothd or a remote sender and this process.", &m->lost);
+	counter(fp, "ubertooth_packets_total", "Packets decoded.", &m->packets);
+	per_channel(fp, "ubertooth_channel_records_total", "Records received per channel.",
+	            m->channel_records);
+	per_channel(fp, "ubertooth_channel_packets_total", "Packets decoded per channel.",
+	            m->channel_packets);
+
+	fprintf(fp, "# HELP ubertooth_callback_seconds Time spent decoding each record.\n");
+	fprintf(fp, "# TYPE ubertooth_callback_seconds histogram\n");
+	for (i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+		n += load(&m->latency[i]);
+		fprintf(fp, "ubertooth_callback_seconds_bucket{le=\"%g\"} %llu\n",
+		        (double)(1ull << i) / 1e6, (unsigned long long)n);
+	}
+	n += load(&m->latency[METRICS_LATENCY_BUCKETS]);
+	fprintf(fp, "ubertooth_callback_seconds_bucket{le=\"+Inf\"} %llu\n",
+	        (unsigned long long)n);
+	fprintf(fp, "ubertooth_callback_seconds_sum %.9f\n", load(&m->latency_sum_ns) / 1e9);
+	fprintf(fp, "ubertooth_callback_seconds_count %llu\n", (unsigned long long)n);
+}
+
+/* Answer any request with the metrics, HTTP/1.0 style */
+static void serve(metrics_t* m, int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char request[1024];
+	FILE* fp;
+
+	/* the request itself does not matter, but is read so that closing
+	 * the socket does not reset the connection */
+	if (poll(&pfd, 1, 1000) > 0 && read(fd, request, sizeof(request)) < 0) {
+		close(fd);
+		return;
+	}
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		close(fd);
+		return;
+	}
+	fprintf(fp, "HTTP/1.0 200 OK\r\n"
+	            "Content-Type: text/plain; version=0.0.4\r\n"
+	            "Connection: close\r\n\r\n");
+	write_metrics(m, fp);
+	fclose(fp);
+}
+
+static void* exporter(void* arg)
+{
+	metrics_t* m = (metrics_t*)arg;
+	struct pollfd pfd;
+	int fd;
+
+	pfd.fd = m->fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+		fd = accept(m->fd, NULL, NULL);
+		if (fd >= 0)
+			serve(m, fd);
+	}
+	return NULL;
+}
+
+static int listen_unix(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Start the exporter.  The thread is created right away, before a
+ * real-time profile pins and prioritises the receive thread. */
+int metrics_create(const char* spec, metrics_t** out)
+{
+	metrics_t* m;
+	size_t n = strlen(METRICS_UNIX_PREFIX);
+	char local[64];
+
+	m = (metrics_t*)calloc(1, sizeof(metrics_t));
+	if (m == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+
+	if (strncmp(spec, METRICS_UNIX_PREFIX, n) == 0) {
+		m->unix_path = strdup(spec + n);
+		m->fd = m->unix_path ? listen_unix(m->unix_path) : -1;
+	} else if (spec[0] == ':' || strspn(spec, "0123456789") == strlen(spec)) {
+		/* a bare port stays local, other hosts have to be asked for */
+		spec += spec[0] == ':';
+		snprintf(local, sizeof(local), "127.0.0.1:%s", spec);
+		m->fd = net_listen(local, 4);
+		if (m->fd < 0) {
+			snprintf(local, sizeof(local), "[::1]:%s", spec);
+			m->fd = net_listen(local, 4);
+		}
+	} else {
+		m->fd = net_listen(spec, 4);
+	}
+	if (m->fd < 0)
+		goto fail;
+
+	if (pthread_create(&m->thread, NULL, exporter, m) != 0) {
+		fprintf(stderr, "Unable to start the metrics exporter\n");
+		close(m->fd);
+		goto fail;
+	}
+
+	*out = m;
+	return 0;
+
+fail:
+	free(m->unix_path);
+	free(m);
+	return -1;
+}
+
+void metrics_free(metrics_t* m)
+{
+	__atomic_store_n(&m->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(m->thread, NULL);
+	close(m->fd);
+	if (m->unix_path) {
+		unlink(m->unix_path);
+		free(m->unix_path);
+	}
+	free(m);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_METRICS_H__
+#define __UBERTOOTH_METRICS_H__
+
+#include <pthread.h>
+
+#include "ubertooth_control.h"
+
+/*
+ * Counters of the receive path, served in the Prometheus text format
+ * by a thread of their own, selected with "-M [<host>:]<port>" or
+ * "-M unix:<path>".  Without a host only the loopback interface is
+ * served.
+ *
+ * Only the receive thread writes the counters, with plain atomic
+ * stores and no read-modify-write, so the hot path never waits.  The
+ * exporter loads each counter atomically when it is scraped; a scrape
+ * is not a consistent snapshot across counters, which Prometheus
+ * counters do not need.
+ */
+
+#define METRICS_CHANNELS        79
+#define METRICS_LATENCY_BUCKETS 16    /* callback time, 1 us << i */
+
+typedef struct {
+	/* written by the receive thread */
+	uint64_t transfers;
+	uint64_t records;
+	uint64_t overflows;        /* records flagged by the firmware */
+	uint64_t switch_drops;     /* records of a mode switched away from */
+	uint64_t filtered;         /* rejected before correlation */
+	uint64_t lost;             /* lost on the way from ubertoothd or a sender */
+	uint64_t packets;
+	uint64_t channel_records[METRICS_CHANNELS];
+	uint64_t channel_packets[METRICS_CHANNELS];
+	uint64_t latency[METRICS_LATENCY_BUCKETS + 1];
+	uint64_t latency_sum_ns;
+
+	/* exporter */
+	int fd;
+	char* unix_path;
+	pthread_t thread;
+	int stop;
+} metrics_t;
+
+static inline void metrics_add(uint64_t* counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(uint64_t* counter, uint64_t v)
+{
+	__atomic_store_n(counter, v, __ATOMIC_RELAXED);
+}
+
+int metrics_create(const char* spec, metrics_t** m);
+void metrics_free(metrics_t* m);
+
+void metrics_record(metrics_t* m, const usb_pkt_rx* rx);
+void metrics_packet(metrics_t* m, unsigned channel);
+void metrics_latency(metrics_t* m, uint64_t ns);
+uint64_t metrics_now(void);
+
+#endif /* __UBERTOOTH_METRICS_H__ */
@@ -0,0 +1,604 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ubertooth_codec.h"
+#include "ubertooth_net.h"
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+	put_u16(p, v & 0xffff);
+	put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+	put_u32(p, v & 0xffffffff);
+	put_u32(p + 4, v >> 32);
+}
+
+static uint16_t get_u16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000ull * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec;
+}
+
+/* Split "host:port", "[v6 address]:port", "host" or "port".  A lone
+ * number is taken as the port if port_only is set. */
+static int parse_spec(const char* spec, char* host, size_t host_len,
+                      char* port, size_t port_len, int port_only)
+{
+	const char* colon = strrchr(spec, ':');
+	const char* end;
+	size_t n;
+
+	if (spec[0] == '[') {
+		end = strchr(spec, ']');
+		if (end == NULL || (end[1] != '\0' && end[1] != ':'))
+			goto invalid;
+		spec++;
+		colon = end[1] ? end + 1 : NULL;
+	} else if (colon == NULL && port_only && strspn(spec, "0123456789") == strlen(spec)) {
+		host[0] = '\0';
+		snprintf(port, port_len, "%s", spec);
+		return 0;
+	} else {
+		end = colon ? colon : spec + strlen(spec);
+	}
+
+	n = end - spec;
+	if (n >= host_len)
+		goto invalid;
+	memcpy(host, spec, n);
+	host[n] = '\0';
+	snprintf(port, port_len, "%s", colon ? colon + 1 : NET_DEFAULT_PORT);
+	if (port[0] == '\0')
+		goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid address '%s', use host:port\n", spec);
+	return -1;
+}
+
+static struct addrinfo* resolve(const char* spec, int passive)
+{
+	struct addrinfo hints, *res;
+	char host[256], port[32];
+	int r;
+
+	if (parse_spec(spec, host, sizeof(host), port, sizeof(port), passive) < 0)
+		return NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	r = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	if (r != 0) {
+		fprintf(stderr, "%s: %s\n", spec, gai_strerror(r));
+		return NULL;
+	}
+	return res;
+}
+
+net_sender* net_sender_connect(const char* spec, uint32_t batch, size_t queue_size,
+                               int compress, int blocking)
+{
+	struct addrinfo *res, *ai;
+	net_sender* s;
+	size_t raw_size;
+	int fd = -1;
+
+	if (batch < 1 || batch > NET_BATCH_MAX) {
+		fprintf(stderr, "Batch must be 1 to %d records\n", NET_BATCH_MAX);
+		return NULL;
+	}
+
+	res = resolve(spec, 0);
+	if (res == NULL)
+		return NULL;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		perror(spec);
+		return NULL;
+	}
+	if (!blocking)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	/* the queue must at least hold one frame */
+	raw_size = (size_t)batch * NET_RECORD_LEN;
+	if (queue_size < NET_HEADER_LEN + codec_bound(raw_size))
+		queue_size = NET_HEADER_LEN + codec_bound(raw_size);
+
+	s = (net_sender*)calloc(1, sizeof(net_sender));
+	if (s == NULL)
+		goto oom;
+	s->fd = fd;
+	s->blocking = blocking;
+	s->compress = compress;
+	s->batch = batch;
+	s->queue_size = queue_size;
+	s->raw = (uint8_t*)malloc(raw_size);
+	s->queue = (uint8_t*)malloc(queue_size);
+	if (s->raw == NULL || s->queue == NULL)
+		goto oom;
+	if (compress) {
+		s->zbuf_size = codec_bound(raw_size);
+		s->zbuf = (uint8_t*)malloc(s->zbuf_size);
+		if (s->zbuf == NULL)
+			goto oom;
+	}
+	return s;
+
+oom:
+	fprintf(stderr, "Unable to allocate memory\n");
+	if (s) {
+		free(s->raw);
+		free(s->queue);
+		free(s);
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Mark the following frames as coming from a dump, whose timestamps
+ * only have a resolution of one second */
+void net_sender_set_replay(net_sender* s, int replay)
+{
+	net_sender_flush(s);
+	if (replay)
+		s->flags |= NET_REPLAY;
+	else
+		s->flags &= ~NET_REPLAY;
+}
+
+/* The next record added does not follow the previous one */
+int net_sender_segment(net_sender* s)
+{
+	int r = net_sender_flush(s);
+
+	s->segment = 1;
+	return r;
+}
+
+int net_sender_add(net_sender* s, const usb_pkt_rx* rx, uint64_t ts_ns, uint32_t systime)
+{
+	uint8_t* p = s->raw + (size_t)s->count * NET_RECORD_LEN;
+
+	if (s->count == 0)
+		s->started_ns = monotonic_ns();
+	put_u64(p, ts_ns);
+	put_u32(p + 8, systime);
+	memcpy(p + 12, rx, PKT_LEN);
+
+	if (++s->count == s->batch)
+		return net_sender_flush(s);
+	return 0;
+}
+
+static void compact(net_sender* s)
+{
+	memmove(s->queue, s->queue + s->queue_pos, s->queue_len - s->queue_pos);
+	s->queue_len -= s->queue_pos;
+	s->queue_pos = 0;
+}
+
+/* Write what the socket takes within timeout_ms, -1 to wait */
+static int send_queued(net_sender* s, int timeout_ms)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	int r;
+
+	if (s->queue_pos == s->queue_len)
+		return 0;
+
+	pfd.fd = s->fd;
+	pfd.events = POLLOUT;
+	r = poll(&pfd, 1, timeout_ms);
+	if (r < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("poll");
+		return -1;
+	}
+	if (r == 0)
+		return 0;
+
+	n = write(s->fd, s->queue + s->queue_pos, s->queue_len - s->queue_pos);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("send");
+		return -1;
+	}
+	s->queue_pos += n;
+	s->bytes += n;
+	if (s->queue_pos == s->queue_len)
+		s->queue_pos = s->queue_len = 0;
+	return 0;
+}
+
+/* Turn the records added so far into a frame and queue it.  Without
+ * room in the queue, a blocking sender waits and any other drops the
+ * frame. */
+static int queue_frame(net_sender* s)
+{
+	uint32_t raw_len = s->count * NET_RECORD_LEN;
+	uint32_t payload_len = raw_len;
+	const uint8_t* payload = s->raw;
+	uint8_t flags = s->flags;
+	uint8_t* p;
+	size_t n;
+
+	/* a dropped frame leaves a gap in the sequence that marks the
+	 * segment just as well */
+	if (s->segment && s->count) {
+		flags |= NET_SEGMENT;
+		s->segment = 0;
+	}
+
+	if (s->compress) {
+		n = codec_compress(s->raw, raw_len, s->zbuf, s->zbuf_size);
+		if (n > 0 && n < raw_len) {
+			payload = s->zbuf;
+			payload_len = n;
+			flags |= NET_COMPRESSED;
+		}
+	}
+
+	if (s->queue_len + NET_HEADER_LEN + payload_len > s->queue_size)
+		compact(s);
+	while (s->queue_len + NET_HEADER_LEN + payload_len > s->queue_size) {
+		if (!s->blocking) {
+			s->dropped += s->count;
+			goto done;
+		}
+		if (send_queued(s, -1) < 0)
+			return -1;
+		compact(s);
+	}
+
+	p = s->queue + s->queue_len;
+	memcpy(p, NET_MAGIC, 4);
+	p[4] = NET_VERSION;
+	p[5] = flags;
+	put_u16(p + 6, s->count);
+	put_u64(p + 8, s->seq);
+	put_u32(p + 16, raw_len);
+	put_u32(p + 20, payload_len);
+	memcpy(p + NET_HEADER_LEN, payload, payload_len);
+	s->queue_len += NET_HEADER_LEN + payload_len;
+	s->frames++;
+	s->raw_bytes += raw_len;
+
+done:
+	s->seq += s->count;
+	s->count = 0;
+	return send_queued(s, 0);
+}
+
+int net_sender_flush(net_sender* s)
+{
+	if (s->count == 0)
+		return 0;
+	return queue_frame(s);
+}
+
+/* Send what the socket takes within timeout_ms (-1 to wait) and flush a
+ * partial frame whose first record is older than NET_FLUSH_MS.  Call
+ * this regularly, e.g. after every USB transfer. */
+int net_sender_poll(net_sender* s, int timeout_ms)
+{
+	if (s->count && monotonic_ns() - s->started_ns >= NET_FLUSH_MS * 1000000ull &&
+	    net_sender_flush(s) < 0)
+		return -1;
+	return send_queued(s, timeout_ms);
+}
+
+/* Give up if the receiver stops taking data for a few seconds */
+static int drain(net_sender* s)
+{
+	size_t pos;
+	int r = 0;
+
+	while (r == 0 && s->queue_len > 0) {
+		pos = s->queue_pos;
+		r = send_queued(s, 5000);
+		if (r == 0 && s->queue_pos == pos && s->queue_len > 0) {
+			fprintf(stderr, "Receiver stalled, %zu bytes not sent\n",
+			        s->queue_len - s->queue_pos);
+			r = -1;
+		}
+	}
+	return r;
+}
+
+/* Send the remaining records and print what was sent.  A last, empty
+ * frame carries the final sequence number, so that the receiver also
+ * counts records dropped after the last frame that went out. */
+int net_sender_close(net_sender* s)
+{
+	int r;
+
+	r = net_sender_flush(s);
+	if (r == 0)
+		r = drain(s);
+	if (r == 0)
+		r = queue_frame(s);
+	if (r == 0)
+		r = drain(s);
+
+	fprintf(stderr, "%llu records in %llu frames, %llu bytes sent for %llu, %llu records dropped\n",
+	        (unsigned long long)(s->seq - s->dropped), (unsigned long long)s->frames,
+	        (unsigned long long)s->bytes, (unsigned long long)s->raw_bytes,
+	        (unsigned long long)s->dropped);
+
+	close(s->fd);
+	free(s->raw);
+	free(s->queue);
+	free(s->zbuf);
+	free(s);
+	return r;
+}
+
+/* Listening TCP socket for "[host:]port", or -1 */
+int net_listen(const char* spec, int backlog)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1, on = 1;
+
+	res = resolve(spec, 1);
+	if (res == NULL)
+		return -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, backlog) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		perror(spec);
+	return fd;
+}
+
+net_receiver* net_receiver_listen(const char* spec)
+{
+	net_receiver* r;
+	int fd;
+
+	fd = net_listen(spec, 1);
+	if (fd < 0)
+		return NULL;
+
+	r = (net_receiver*)calloc(1, sizeof(net_receiver));
+	if (r == NULL)
+		goto oom;
+	r->listen_fd = fd;
+	r->fd = -1;
+	r->payload = (uint8_t*)malloc(codec_bound(NET_BATCH_MAX * NET_RECORD_LEN));
+	r->raw = (uint8_t*)malloc(NET_BATCH_MAX * NET_RECORD_LEN);
+	if (r->payload == NULL || r->raw == NULL)
+		goto oom;
+	return r;
+
+oom:
+	fprintf(stderr, "Unable to allocate memory\n");
+	if (r) {
+		free(r->payload);
+		free(r->raw);
+		free(r);
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Returns 1 when len bytes were read, 0 if the sender closed the
+ * connection before the first one */
+static int read_full(int fd, uint8_t* buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return done ? -1 : 0;
+		done += n;
+	}
+	return 1;
+}
+
+static int read_frame(net_receiver* r)
+{
+	uint8_t hdr[NET_HEADER_LEN];
+	uint32_t count, raw_len, payload_len;
+	uint64_t seq;
+	int rc;
+
+	rc = read_full(r->fd, hdr, sizeof(hdr));
+	if (rc <= 0)
+		return rc;
+
+	count = get_u16(hdr + 6);
+	seq = get_u64(hdr + 8);
+	raw_len = get_u32(hdr + 16);
+	payload_len = get_u32(hdr + 20);
+	if (memcmp(hdr, NET_MAGIC, 4) != 0 || hdr[4] != NET_VERSION ||
+	    count > NET_BATCH_MAX || raw_len != count * NET_RECORD_LEN ||
+	    payload_len > codec_bound(raw_len) || seq < r->next_seq) {
+		fprintf(stderr, "Invalid frame from sender\n");
+		return -1;
+	}
+	if (read_full(r->fd, r->payload, payload_len) <= 0)
+		return -1;
+
+	if (hdr[5] & NET_COMPRESSED) {
+		if (codec_decompress(r->payload, payload_len, r->raw, raw_len) < 0) {
+			fprintf(stderr, "Corrupt compressed frame from sender\n");
+			return -1;
+		}
+		r->data = r->raw;
+	} else {
+		if (payload_len != raw_len) {
+			fprintf(stderr, "Invalid frame from sender\n");
+			return -1;
+		}
+		r->data = r->payload;
+	}
+
+	/* frames the sender dropped leave a gap in the sequence */
+	if (seq > r->next_seq || (hdr[5] & NET_SEGMENT))
+		r->segment = 1;
+	r->lost += seq - r->next_seq;
+	r->next_seq = seq + count;
+	r->bytes += NET_HEADER_LEN + payload_len;
+	r->flags = hdr[5];
+	r->seq = seq;
+	r->count = count;
+	r->index = 0;
+	return 1;
+}
+
+/* Wait up to timeout_ms for records.  Returns 1 when there are some, 0
+ * if there are none yet.  One sender is served at a time; when it goes
+ * away the next connection is accepted. */
+int net_receiver_wait(net_receiver* r, int timeout_ms)
+{
+	struct pollfd pfd;
+	int rc;
+
+	if (r->index < r->count)
+		return 1;
+
+	pfd.events = POLLIN;
+	while (1) {
+		if (r->fd < 0) {
+			pfd.fd = r->listen_fd;
+			rc = poll(&pfd, 1, timeout_ms);
+			if (rc <= 0)
+				return rc < 0 && errno != EINTR ? -1 : 0;
+			r->fd = accept(r->listen_fd, NULL, NULL);
+			if (r->fd < 0)
+				return 0;
+			r->next_seq = 0;
+			r->segment = 1;
+			fprintf(stderr, "sender connected\n");
+		}
+
+		pfd.fd = r->fd;
+		rc = poll(&pfd, 1, timeout_ms);
+		if (rc <= 0)
+			return rc < 0 && errno != EINTR ? -1 : 0;
+
+		rc = read_frame(r);
+		if (rc > 0)
+			return 1;
+		if (rc < 0)
+			fprintf(stderr, "dropping connection to sender\n");
+		else
+			fprintf(stderr, "sender disconnected\n");
+		close(r->fd);
+		r->fd = -1;
+		r->count = r->index = 0;
+	}
+}
+
+/* Take the next record of the current frame.  Returns 0 once the frame
+ * is used up. */
+int net_receiver_next(net_receiver* r, net_record* rec)
+{
+	const uint8_t* p;
+
+	if (r->index >= r->count)
+		return 0;
+
+	p = r->data + (size_t)r->index++ * NET_RECORD_LEN;
+	rec->ts_ns = get_u64(p);
+	rec->systime = get_u32(p + 8);
+	memcpy(&rec->rx, p + 12, PKT_LEN);
+	rec->segment = r->segment;
+	r->segment = 0;
+	r->records++;
+	return 1;
+}
+
+void net_receiver_close(net_receiver* r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	close(r->listen_fd);
+	free(r->payload);
+	free(r->raw);
+	free(r);
+}
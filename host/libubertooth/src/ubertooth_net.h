@@ -0,0 +1,136 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_NET_H__
+#define __UBERTOOTH_NET_H__
+
+#include "ubertooth_control.h"
+
+/*
+ * Streams USB records over TCP, so that a small sensor only has to
+ * forward them and the decoding runs on a server.
+ *
+ * The stream is a series of frames, all integers little endian:
+ *
+ * frame  := magic(4) version(1) flags(1) count(2) seq(8) raw_len(4)
+ *           payload_len(4) payload
+ * record := ts_ns(8) systime(4) usb_pkt_rx(64)
+ *
+ * seq is the number of the first record of the frame, counted from the
+ * start of the connection.  The payload holds count records, compressed
+ * with the capture codec if the flag is set.  A frame flagged as a
+ * segment start begins with a record that does not follow the one
+ * before it, as after a window marker of a replayed dump.
+ *
+ * The sender never waits for the network while receiving from a
+ * device: frames are queued up to a limit and whole frames are dropped
+ * beyond it.  Their records still take up sequence numbers, so the
+ * receiver sees the gap.  A sender replaying a file waits instead.
+ */
+
+#define NET_MAGIC          "UTNT"
+#define NET_VERSION        1
+#define NET_DEFAULT_PORT   "7727"
+#define NET_HEADER_LEN     24
+#define NET_RECORD_LEN     (8 + 4 + PKT_LEN)
+#define NET_BATCH_DEFAULT  64
+#define NET_BATCH_MAX      4096
+#define NET_FLUSH_MS       50          /* oldest record of a partial frame */
+#define NET_QUEUE_DEFAULT  (4 * 1024 * 1024)
+
+/* frame flags */
+#define NET_COMPRESSED     0x01
+#define NET_REPLAY         0x02    /* timestamps are the seconds of a dump */
+#define NET_SEGMENT        0x04    /* first record follows a gap */
+
+typedef struct {
+	int fd;
+	int blocking;
+	int compress;
+	uint8_t flags;
+	int segment;
+	uint32_t batch;
+
+	/* frame being filled */
+	uint8_t* raw;
+	uint32_t count;
+	uint64_t started_ns;
+	uint64_t seq;
+
+	/* frames waiting for the socket */
+	uint8_t* queue;
+	size_t queue_size;
+	size_t queue_len;
+	size_t queue_pos;
+	uint8_t* zbuf;
+	size_t zbuf_size;
+
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t raw_bytes;
+	uint64_t dropped;
+} net_sender;
+
+typedef struct {
+	uint64_t ts_ns;
+	uint32_t systime;
+	usb_pkt_rx rx;
+	uint8_t segment;    /* first record after a gap */
+} net_record;
+
+typedef struct {
+	int listen_fd;
+	int fd;
+
+	/* current frame */
+	uint8_t flags;
+	uint32_t count;
+	uint32_t index;
+	uint64_t seq;
+	uint8_t* payload;
+	uint8_t* raw;
+	const uint8_t* data;
+
+	/* per connection */
+	uint64_t next_seq;
+	int segment;
+
+	uint64_t records;
+	uint64_t lost;
+	uint64_t bytes;
+} net_receiver;
+
+net_sender* net_sender_connect(const char* spec, uint32_t batch, size_t queue_size,
+                               int compress, int blocking);
+void net_sender_set_replay(net_sender* s, int replay);
+int net_sender_segment(net_sender* s);
+int net_sender_add(net_sender* s, const usb_pkt_rx* rx, uint64_t ts_ns, uint32_t systime);
+int net_sender_flush(net_sender* s);
+int net_sender_poll(net_sender* s, int timeout_ms);
+int net_sender_close(net_sender* s);
+
+int net_listen(const char* spec, int backlog);
+net_receiver* net_receiver_listen(const char* spec);
+int net_receiver_wait(net_receiver* r, int timeout_ms);
+int net_receiver_next(net_receiver* r, net_record* rec);
+void net_receiver_close(net_receiver* r);
+
+#endif /* __UBERTOOTH_NET_H__ */
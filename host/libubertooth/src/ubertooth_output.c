@@ -0,0 +1,287 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubertooth_output.h"
+
+#define BINARY_HEADER_LEN 8
+#define BINARY_FIXED_LEN  28
+
+/* longest record in any format */
+#define RECORD_MAX 512
+
+static const uint8_t binary_magic[4] = { 'U', 'B', 'T', 'O' };
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Parse "<format>[:<filename>]".  The text format needs no output
+ * object, so *out is left NULL for it. */
+int output_create(const char* spec, output_t** out)
+{
+	const char* sep = strchr(spec, ':');
+	size_t name_len = sep ? (size_t)(sep - spec) : strlen(spec);
+	output_t* o;
+	int format;
+
+	*out = NULL;
+	if (name_len == 4 && strncmp(spec, "text", 4) == 0)
+		format = OUTPUT_TEXT;
+	else if (name_len == 6 && strncmp(spec, "binary", 6) == 0)
+		format = OUTPUT_BINARY;
+	else if (name_len == 4 && strncmp(spec, "json", 4) == 0)
+		format = OUTPUT_JSON;
+	else {
+		fprintf(stderr, "Unknown output format '%s', use text, binary or json\n", spec);
+		return -1;
+	}
+
+	if (format == OUTPUT_TEXT) {
+		if (sep)
+			fprintf(stderr, "The text format is always written to stdout\n");
+		return 0;
+	}
+
+	o = (output_t*)calloc(1, sizeof(output_t));
+	if (o == NULL || (o->buf = (uint8_t*)malloc(OUTPUT_BUFFER_SIZE)) == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(o);
+		return -1;
+	}
+	o->format = format;
+
+	o->fp = stdout;
+	if (sep) {
+		o->fp = fopen(sep + 1, "wb");
+		if (o->fp == NULL) {
+			perror(sep + 1);
+			free(o->buf);
+			free(o);
+			return -1;
+		}
+	}
+
+	if (format == OUTPUT_BINARY) {
+		memcpy(o->buf, binary_magic, sizeof(binary_magic));
+		o->buf[4] = OUTPUT_VERSION;
+		memset(o->buf + 5, 0, 3);
+		o->len = BINARY_HEADER_LEN;
+	}
+
+	*out = o;
+	return 0;
+}
+
+int output_flush(output_t* out)
+{
+	out->pending = 0;
+	if (out->len == 0)
+		return 0;
+	if (fwrite(out->buf, 1, out->len, out->fp) != out->len ||
+	    fflush(out->fp) != 0) {
+		perror("output");
+		out->len = 0;
+		return -1;
+	}
+	out->len = 0;
+	return 0;
+}
+
+void output_close(output_t* out)
+{
+	output_flush(out);
+	if (out->fp != stdout)
+		fclose(out->fp);
+	free(out->buf);
+	free(out);
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+	return p + 4;
+}
+
+static size_t write_binary(uint8_t* p, const output_packet* pkt)
+{
+	uint8_t* start = p;
+
+	*p++ = pkt->type;
+	*p++ = BINARY_FIXED_LEN + pkt->data_len;
+	p = put_u32(p, pkt->ts_ns & 0xffffffff);
+	p = put_u32(p, pkt->ts_ns >> 32);
+	p = put_u32(p, pkt->systime);
+	p = put_u32(p, pkt->clk100ns);
+	p = put_u32(p, pkt->clkn);
+	p = put_u32(p, pkt->address);
+	*p++ = pkt->channel;
+	*p++ = (uint8_t)pkt->signal;
+	*p++ = (uint8_t)pkt->noise;
+	*p++ = pkt->ac_errors;
+	memcpy(p, pkt->data, pkt->data_len);
+	p += pkt->data_len;
+
+	return p - start;
+}
+
+/* JSON is built by hand; snprintf for every field costs more than
+ * decoding the packet. */
+static char* put_str(char* p, const char* s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+static char* put_uint(char* p, uint64_t v)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static char* put_int(char* p, int v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return put_uint(p, (uint64_t)-(int64_t)v);
+	}
+	return put_uint(p, v);
+}
+
+static char* put_hex(char* p, uint32_t v, int digits)
+{
+	*p++ = '"';
+	while (digits--)
+		*p++ = hex_digits[(v >> (4 * digits)) & 0xf];
+	*p++ = '"';
+	return p;
+}
+
+static char* put_data(char* p, const uint8_t* data, uint8_t len)
+{
+	uint8_t i;
+
+	p = put_str(p, ",\"data\":\"");
+	for (i = 0; i < len; i++) {
+		*p++ = hex_digits[data[i] >> 4];
+		*p++ = hex_digits[data[i] & 0xf];
+	}
+	*p++ = '"';
+	return p;
+}
+
+static size_t write_json(char* p, const output_packet* pkt)
+{
+	char* start = p;
+
+	switch (pkt->type) {
+	case OUTPUT_BR:
+		p = put_str(p, "{\"type\":\"br\",\"systime\":");
+		p = put_uint(p, pkt->systime);
+		p = put_str(p, ",\"ts\":");
+		p = put_uint(p, pkt->ts_ns);
+		p = put_str(p, ",\"ch\":");
+		p = put_uint(p, pkt->channel);
+		p = put_str(p, ",\"lap\":");
+		p = put_hex(p, pkt->address, 6);
+		p = put_str(p, ",\"err\":");
+		p = put_uint(p, pkt->ac_errors);
+		p = put_str(p, ",\"clk100ns\":");
+		p = put_uint(p, pkt->clk100ns);
+		p = put_str(p, ",\"clkn\":");
+		p = put_uint(p, pkt->clkn);
+		p = put_str(p, ",\"s\":");
+		p = put_int(p, pkt->signal);
+		p = put_str(p, ",\"n\":");
+		p = put_int(p, pkt->noise);
+		break;
+	case OUTPUT_LE:
+		p = put_str(p, "{\"type\":\"le\",\"systime\":");
+		p = put_uint(p, pkt->systime);
+		p = put_str(p, ",\"ts\":");
+		p = put_uint(p, pkt->ts_ns);
+		p = put_str(p, ",\"freq\":");
+		p = put_uint(p, pkt->channel + 2402);
+		p = put_str(p, ",\"aa\":");
+		p = put_hex(p, pkt->address, 8);
+		p = put_str(p, ",\"err\":");
+		p = put_uint(p, pkt->ac_errors);
+		p = put_str(p, ",\"clk100ns\":");
+		p = put_uint(p, pkt->clk100ns);
+		p = put_str(p, ",\"rssi\":");
+		p = put_int(p, pkt->signal);
+		p = put_data(p, pkt->data, pkt->data_len);
+		break;
+	default:
+		p = put_str(p, "{\"type\":\"ego\",\"ts\":");
+		p = put_uint(p, pkt->ts_ns);
+		p = put_str(p, ",\"freq\":");
+		p = put_uint(p, pkt->channel + 2402);
+		p = put_str(p, ",\"clk100ns\":");
+		p = put_uint(p, pkt->clk100ns);
+		p = put_data(p, pkt->data, pkt->data_len);
+		break;
+	}
+	p = put_str(p, "}\n");
+
+	return p - start;
+}
+
+int output_write(output_t* out, const output_packet* pkt)
+{
+	if (out->len + RECORD_MAX > OUTPUT_BUFFER_SIZE && output_flush(out) < 0)
+		return -1;
+
+	if (out->format == OUTPUT_BINARY)
+		out->len += write_binary(out->buf + out->len, pkt);
+	else
+		out->len += write_json((char*)out->buf + out->len, pkt);
+
+	/* bound the latency for live consumers */
+	if (!out->pending) {
+		out->pending = 1;
+		out->pending_ns = pkt->ts_ns;
+	} else if (pkt->ts_ns - out->pending_ns >= 1000000000ull) {
+		return output_flush(out);
+	}
+
+	return 0;
+}
+
+/* Call when the stream has no records to pass on, so that the last
+ * records of a burst are not held back until the next one. */
+int output_idle(output_t* out)
+{
+	if (!out->pending)
+		return 0;
+	return output_flush(out);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_OUTPUT_H__
+#define __UBERTOOTH_OUTPUT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Buffered packet output for the sniffing callbacks, selected with
+ * "-o <format>[:<filename>]".  The default text format is printed by
+ * the callbacks themselves.
+ *
+ * binary := "UBTO" version(1) reserved(3) record*
+ * record := type(1) len(1) ts_ns(8) systime(4) clk100ns(4) clkn(4)
+ *           address(4) channel(1) signal(1) noise(1) ac_errors(1)
+ *           data(len - 28)
+ *
+ * All integers are little endian and len counts the bytes after it.
+ * The json format writes one object per line with the same fields.
+ * Output is flushed when the buffer fills, when a record is a second
+ * younger than the oldest unflushed one, and whenever the stream goes
+ * idle (see output_idle()).
+ */
+
+enum output_formats {
+	OUTPUT_TEXT   = 0,
+	OUTPUT_BINARY = 1,
+	OUTPUT_JSON   = 2
+};
+
+enum output_types {
+	OUTPUT_BR  = 1,
+	OUTPUT_LE  = 2,
+	OUTPUT_EGO = 3
+};
+
+#define OUTPUT_VERSION     1
+#define OUTPUT_BUFFER_SIZE 65536
+
+typedef struct {
+	uint8_t type;
+	uint8_t channel;
+	int8_t signal;
+	int8_t noise;
+	uint8_t ac_errors;
+	uint32_t systime;
+	uint64_t ts_ns;
+	uint32_t clk100ns;
+	uint32_t clkn;
+	uint32_t address;   /* LAP or LE access address */
+	const uint8_t* data;
+	uint8_t data_len;
+} output_packet;
+
+typedef struct {
+	FILE* fp;
+	int format;
+	uint8_t* buf;
+	size_t len;
+	int pending;
+	uint64_t pending_ns;   /* ts_ns of the oldest unflushed record */
+} output_t;
+
+int output_create(const char* spec, output_t** out);
+int output_write(output_t* out, const output_packet* pkt);
+int output_flush(output_t* out);
+int output_idle(output_t* out);
+void output_close(output_t* out);
+
+#endif /* __UBERTOOTH_OUTPUT_H__ */
@@ -0,0 +1,380 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "ubertooth_pcapng.h"
+
+#define MAX_BLOCK_LEN (16 * 1024 * 1024)
+
+#define OPT_ENDOFOPT   0
+#define OPT_IF_DESCRIPTION 3
+#define OPT_IF_TSRESOL 9
+
+static uint32_t swap32(uint32_t v)
+{
+	return ((v & 0xff) << 24) | ((v & 0xff00) << 8) |
+	       ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+uint32_t pcapng_u32(const pcapng_reader* r, const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return r->swapped ? swap32(v) : v;
+}
+
+uint16_t pcapng_u16(const pcapng_reader* r, const uint8_t* p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return r->swapped ? (uint16_t)((v << 8) | (v >> 8)) : v;
+}
+
+int pcapng_is_magic(const uint8_t* buf)
+{
+	uint32_t v;
+	memcpy(&v, buf, sizeof(v));
+	return v == PCAPNG_SHB;
+}
+
+pcapng_reader* pcapng_open(FILE* fp)
+{
+	pcapng_reader* r = (pcapng_reader*)calloc(1, sizeof(pcapng_reader));
+	if (r == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	r->fp = fp;
+	return r;
+}
+
+void pcapng_close(pcapng_reader* r)
+{
+	free(r->block);
+	free(r->ifaces);
+	free(r);
+}
+
+static uint64_t ts_to_ns(uint64_t ts, uint64_t units_per_sec)
+{
+	uint64_t sec = ts / units_per_sec;
+	uint64_t frac = ts % units_per_sec;
+
+	if (units_per_sec <= 1000000000ull)
+		return sec * 1000000000ull + frac * (1000000000ull / units_per_sec);
+	return sec * 1000000000ull +
+	       (uint64_t)((double)frac * 1e9 / (double)units_per_sec);
+}
+
+static int add_interface(pcapng_reader* r)
+{
+	pcapng_interface* iface;
+	uint32_t pos, code, len;
+
+	if (r->block_len < 20)
+		return -1;
+
+	if (r->num_ifaces == r->ifaces_size) {
+		uint32_t size = r->ifaces_size ? 2 * r->ifaces_size : 4;
+		iface = (pcapng_interface*)realloc(r->ifaces, size * sizeof(pcapng_interface));
+		if (iface == NULL)
+			return -1;
+		r->ifaces = iface;
+		r->ifaces_size = size;
+	}
+
+	iface = &r->ifaces[r->num_ifaces++];
+	iface->linktype = pcapng_u16(r, r->block + 8);
+	iface->tsresol = 6;
+
+	/* options run from after the snaplen to the trailing length */
+	for (pos = 16; pos + 4 <= r->block_len - 4; pos += 4 + ((len + 3) & ~3)) {
+		code = pcapng_u16(r, r->block + pos);
+		len = pcapng_u16(r, r->block + pos + 2);
+		if (code == OPT_ENDOFOPT)
+			break;
+		if (code == OPT_IF_TSRESOL && len >= 1)
+			iface->tsresol = r->block[pos + 4];
+	}
+
+	if (iface->tsresol & 0x80)
+		iface->units_per_sec = 1ull << (iface->tsresol & 0x7f);
+	else {
+		uint8_t i;
+		iface->units_per_sec = 1;
+		for (i = 0; i < iface->tsresol; i++)
+			iface->units_per_sec *= 10;
+	}
+
+	return 0;
+}
+
+/* Read the next block.  Section headers and interface descriptions are
+ * tracked so that packet timestamps are converted to nanoseconds.
+ * Returns 1 when a block was read, 0 at end of file. */
+int pcapng_next_block(pcapng_reader* r)
+{
+	uint8_t hdr[12];
+	uint32_t type, len, magic;
+
+	r->block_offset = r->offset;
+	if (fread(hdr, 8, 1, r->fp) != 1)
+		return 0;
+
+	memcpy(&type, hdr, sizeof(type));
+	if (type == PCAPNG_SHB) {
+		/* byte order is determined by each section header */
+		if (fread(hdr + 8, 4, 1, r->fp) != 1)
+			return 0;
+		memcpy(&magic, hdr + 8, sizeof(magic));
+		if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+			r->swapped = 0;
+		else if (magic == swap32(PCAPNG_BYTE_ORDER_MAGIC))
+			r->swapped = 1;
+		else
+			return -1;
+		r->num_ifaces = 0;
+	}
+
+	type = pcapng_u32(r, hdr);
+	len = pcapng_u32(r, hdr + 4);
+	if (len < 12 || len > MAX_BLOCK_LEN || (len & 3))
+		return -1;
+
+	if (len > r->block_size) {
+		uint8_t* block = (uint8_t*)realloc(r->block, len);
+		if (block == NULL)
+			return -1;
+		r->block = block;
+		r->block_size = len;
+	}
+
+	if (type == PCAPNG_SHB) {
+		memcpy(r->block, hdr, 12);
+		if (fread(r->block + 12, len - 12, 1, r->fp) != 1)
+			return 0;
+	} else {
+		memcpy(r->block, hdr, 8);
+		if (fread(r->block + 8, len - 8, 1, r->fp) != 1)
+			return 0;
+	}
+
+	r->block_type = type;
+	r->block_len = len;
+	r->offset += len;
+	r->packet = NULL;
+
+	if (type == PCAPNG_IDB) {
+		if (add_interface(r) < 0)
+			return -1;
+	} else if (type == PCAPNG_EPB) {
+		uint64_t ts;
+		if (len < 32)
+			return -1;
+		r->iface = pcapng_u32(r, r->block + 8);
+		if (r->iface >= r->num_ifaces)
+			return -1;
+		ts = ((uint64_t)pcapng_u32(r, r->block + 12) << 32) |
+		     pcapng_u32(r, r->block + 16);
+		r->ts_ns = ts_to_ns(ts, r->ifaces[r->iface].units_per_sec);
+		r->caplen = pcapng_u32(r, r->block + 20);
+		if (r->caplen > len - 32)
+			return -1;
+		r->packet = r->block + 28;
+	}
+
+	return 1;
+}
+
+/* Jump to a block previously returned by pcapng_next_block() in the
+ * same section and read it. */
+int pcapng_seek_block(pcapng_reader* r, uint64_t offset)
+{
+	if (fseeko(r->fp, offset, SEEK_SET) < 0)
+		return -1;
+	r->offset = offset;
+	return pcapng_next_block(r);
+}
+
+static int write_block(FILE* fp, uint32_t type, const uint8_t* body, uint32_t body_len)
+{
+	static const uint8_t pad[4] = { 0, 0, 0, 0 };
+	uint32_t len = 12 + ((body_len + 3) & ~3);
+
+	if (fwrite(&type, 4, 1, fp) != 1 ||
+	    fwrite(&len, 4, 1, fp) != 1 ||
+	    fwrite(body, 1, body_len, fp) != body_len ||
+	    fwrite(pad, 1, (4 - (body_len & 3)) & 3, fp) != ((4 - (body_len & 3)) & 3) ||
+	    fwrite(&len, 4, 1, fp) != 1) {
+		perror("pcapng write");
+		return -1;
+	}
+	return 0;
+}
+
+static uint8_t* put_option(uint8_t* p, uint16_t code, const void* value, uint16_t len)
+{
+	memcpy(p, &code, 2);
+	memcpy(p + 2, &len, 2);
+	if (len)
+		memcpy(p + 4, value, len);
+	memset(p + 4 + len, 0, (4 - (len & 3)) & 3);
+	return p + 4 + ((len + 3) & ~3);
+}
+
+int pcapng_write_shb(FILE* fp)
+{
+	uint8_t body[16];
+	uint32_t magic = PCAPNG_BYTE_ORDER_MAGIC;
+	uint16_t major = 1, minor = 0;
+	int64_t section_len = -1;
+
+	memcpy(body, &magic, 4);
+	memcpy(body + 4, &major, 2);
+	memcpy(body + 6, &minor, 2);
+	memcpy(body + 8, &section_len, 8);
+
+	return write_block(fp, PCAPNG_SHB, body, sizeof(body));
+}
+
+int pcapng_write_idb(FILE* fp, uint16_t linktype, const char* description)
+{
+	uint8_t body[8 + 256 + 24];
+	uint8_t* p = body;
+	uint16_t reserved = 0;
+	uint32_t snaplen = 0;
+	uint8_t tsresol = 9;
+	size_t desc_len = description ? strlen(description) : 0;
+
+	memcpy(p, &linktype, 2);
+	memcpy(p + 2, &reserved, 2);
+	memcpy(p + 4, &snaplen, 4);
+	p += 8;
+	if (desc_len > 255)
+		desc_len = 255;
+	if (desc_len)
+		p = put_option(p, OPT_IF_DESCRIPTION, description, desc_len);
+	p = put_option(p, OPT_IF_TSRESOL, &tsresol, 1);
+	p = put_option(p, OPT_ENDOFOPT, NULL, 0);
+
+	return write_block(fp, PCAPNG_IDB, body, p - body);
+}
+
+int pcapng_write_epb(FILE* fp, uint32_t iface, uint64_t ts_ns,
+                     const uint8_t* packet, uint32_t caplen, uint32_t len,
+                     const uint8_t* options, uint32_t options_len)
+{
+	static const uint8_t pad[4] = { 0, 0, 0, 0 };
+	uint32_t padded = (caplen + 3) & ~3;
+	uint32_t hdr[7];
+
+	hdr[0] = PCAPNG_EPB;
+	hdr[1] = 32 + padded + options_len;
+	hdr[2] = iface;
+	hdr[3] = (uint32_t)(ts_ns >> 32);
+	hdr[4] = (uint32_t)ts_ns;
+	hdr[5] = caplen;
+	hdr[6] = len;
+
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(packet, 1, caplen, fp) != caplen ||
+	    fwrite(pad, 1, padded - caplen, fp) != padded - caplen ||
+	    (options_len && fwrite(options, 1, options_len, fp) != options_len) ||
+	    fwrite(&hdr[1], 4, 1, fp) != 1) {
+		perror("pcapng write");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000ull * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec;
+}
+
+/* Open path, which may be a fifo, and write the headers right away so
+ * that the reader can start decoding */
+pcapng_stream* pcapng_stream_open(const char* path, uint16_t linktype,
+                                  const char* description, uint32_t flush_ms)
+{
+	pcapng_stream* s = (pcapng_stream*)calloc(1, sizeof(pcapng_stream));
+
+	if (s == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	s->fp = fopen(path, "wb");
+	if (s->fp == NULL) {
+		perror(path);
+		free(s);
+		return NULL;
+	}
+	s->flush_ms = flush_ms;
+	if (pcapng_write_shb(s->fp) < 0 ||
+	    pcapng_write_idb(s->fp, linktype, description) < 0 ||
+	    fflush(s->fp) != 0) {
+		fclose(s->fp);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+int pcapng_stream_write(pcapng_stream* s, uint64_t ts_ns, const uint8_t* packet, uint32_t len)
+{
+	if (pcapng_write_epb(s->fp, 0, ts_ns, packet, len, len, NULL, 0) < 0)
+		return -1;
+	if (!s->pending) {
+		s->pending = 1;
+		s->pending_ns = monotonic_ns();
+	}
+	return pcapng_stream_poll(s);
+}
+
+/* Flush once the oldest unflushed packet is flush_ms old.  Also call
+ * this while no packets arrive. */
+int pcapng_stream_poll(pcapng_stream* s)
+{
+	if (!s->pending)
+		return 0;
+	if (s->flush_ms && monotonic_ns() - s->pending_ns < s->flush_ms * 1000000ull)
+		return 0;
+
+	s->pending = 0;
+	if (fflush(s->fp) != 0) {
+		perror("pcapng flush");
+		return -1;
+	}
+	return 0;
+}
+
+void pcapng_stream_close(pcapng_stream* s)
+{
+	fclose(s->fp);
+	free(s);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_PCAPNG_H__
+#define __UBERTOOTH_PCAPNG_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Minimal PCAPNG block reader and writer for tools that post-process
+ * captures.  Live packets are written by the libbtbb writers, except
+ * for streams a reader is waiting on, which need control over when the
+ * output is flushed. */
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+/* link types written by libbtbb */
+#define DLT_BLUETOOTH_BREDR_BB        255
+#define DLT_BLUETOOTH_LE_LL_WITH_PHDR 256
+
+/* pseudo header of DLT_BLUETOOTH_LE_LL_WITH_PHDR, all little endian:
+ * rf_channel(1) signal(1) noise(1) aa_offenses(1) ref_aa(4) flags(2) */
+#define LE_PHDR_LEN               10
+#define LE_PHDR_DEWHITENED        0x0001
+#define LE_PHDR_SIGPOWER_VALID    0x0002
+#define LE_PHDR_NOISEPOWER_VALID  0x0004
+#define LE_PHDR_REF_AA_VALID      0x0010
+#define LE_PHDR_AA_OFFENSES_VALID 0x0020
+
+typedef struct {
+	uint16_t linktype;
+	uint8_t tsresol;
+	uint64_t units_per_sec;
+} pcapng_interface;
+
+typedef struct {
+	FILE* fp;
+	uint8_t swapped;
+	uint64_t offset;
+
+	/* current block, including type and length fields */
+	uint8_t* block;
+	uint32_t block_size;
+	uint32_t block_type;
+	uint32_t block_len;
+	uint64_t block_offset;
+
+	/* interfaces of the current section */
+	pcapng_interface* ifaces;
+	uint32_t num_ifaces;
+	uint32_t ifaces_size;
+
+	/* valid after an enhanced packet block */
+	uint32_t iface;
+	uint64_t ts_ns;
+	uint32_t caplen;
+	const uint8_t* packet;
+} pcapng_reader;
+
+/* a single interface capture written as packets arrive */
+typedef struct {
+	FILE* fp;
+	uint32_t flush_ms;     /* 0 flushes every packet */
+	uint64_t pending_ns;   /* when the oldest unflushed packet came */
+	uint8_t pending;
+} pcapng_stream;
+
+int pcapng_is_magic(const uint8_t* buf);
+
+pcapng_reader* pcapng_open(FILE* fp);
+int pcapng_next_block(pcapng_reader* r);
+int pcapng_seek_block(pcapng_reader* r, uint64_t offset);
+void pcapng_close(pcapng_reader* r);
+
+uint32_t pcapng_u32(const pcapng_reader* r, const uint8_t* p);
+uint16_t pcapng_u16(const pcapng_reader* r, const uint8_t* p);
+
+/* blocks are written in host byte order, timestamps in nanoseconds */
+int pcapng_write_shb(FILE* fp);
+int pcapng_write_idb(FILE* fp, uint16_t linktype, const char* description);
+int pcapng_write_epb(FILE* fp, uint32_t iface, uint64_t ts_ns,
+                     const uint8_t* packet, uint32_t caplen, uint32_t len,
+                     const uint8_t* options, uint32_t options_len);
+
+pcapng_stream* pcapng_stream_open(const char* path, uint16_t linktype,
+                                  const char* description, uint32_t flush_ms);
+int pcapng_stream_write(pcapng_stream* s, uint64_t ts_ns, const uint8_t* packet, uint32_t len);
+int pcapng_stream_poll(pcapng_stream* s);
+void pcapng_stream_close(pcapng_stream* s);
+
+#endif /* __UBERTOOTH_PCAPNG_H__ */
@@ -41,6 +41,8 @@ ringbuffer_t* ringbuffer_init()
 {
 	ringbuffer_t* rb = (ringbuffer_t*)malloc(sizeof(ringbuffer_t));
 
+	if (rb == NULL)
+		return NULL;
 	rb->current_bank = 0;
 
 	return rb;
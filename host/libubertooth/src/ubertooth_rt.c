@@ -0,0 +1,203 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "ubertooth_clock.h"
+#include "ubertooth_rt.h"
+
+int rt_profile_create(const char* spec, rt_profile_t** rt)
+{
+	rt_profile_t* p;
+	const char* sep = strchr(spec, ':');
+	char* end;
+
+	*rt = NULL;
+	p = (rt_profile_t*)calloc(1, sizeof(rt_profile_t));
+	if (p == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+
+	p->cpu = -1;
+	if (spec[0] != '\0' && spec[0] != ':') {
+		p->cpu = strtol(spec, &end, 10);
+		if (end == spec || (*end != '\0' && *end != ':') || p->cpu < 0)
+			goto invalid;
+	}
+	if (sep) {
+		p->priority = strtol(sep + 1, &end, 10);
+		if (end == sep + 1 || *end != '\0' ||
+		    p->priority < sched_get_priority_min(SCHED_FIFO) ||
+		    p->priority > sched_get_priority_max(SCHED_FIFO))
+			goto invalid;
+	}
+
+	*rt = p;
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid real-time profile '%s', use [<cpu>][:<priority>]\n", spec);
+	free(p);
+	return -1;
+}
+
+void rt_profile_free(rt_profile_t* rt)
+{
+	free(rt);
+}
+
+/* Touch every page so that no fault happens later */
+void rt_profile_prefault(void* buf, size_t len)
+{
+	volatile uint8_t* p = (volatile uint8_t*)buf;
+	size_t i;
+
+	for (i = 0; i < len; i += 4096)
+		p[i] = p[i];
+	if (len)
+		p[len - 1] = p[len - 1];
+}
+
+static void prefault_stack(void)
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/* Lock memory, set affinity and scheduler of the calling thread.
+ * Failures are reported and the capture goes on without them. */
+int rt_profile_apply(rt_profile_t* rt)
+{
+	struct sched_param param;
+	int ret = 0;
+
+	if (rt->applied)
+		return 0;
+	rt->applied = 1;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		ret = -1;
+	}
+	prefault_stack();
+
+#ifdef __linux__
+	if (rt->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_setaffinity");
+			ret = -1;
+		}
+	}
+#else
+	if (rt->cpu >= 0)
+		fprintf(stderr, "CPU affinity is not supported on this platform\n");
+#endif
+
+	if (rt->priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt->priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			perror("sched_setscheduler");
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000ull * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec;
+}
+
+/* Called when a transfer is handed to the decoder, with the firmware
+ * time of its first record */
+void rt_profile_wakeup(rt_profile_t* rt, uint32_t clk100ns)
+{
+	uint64_t now = monotonic_ns();
+	uint64_t fw_ns, jitter_us;
+	int64_t diff;
+	int bucket;
+
+	clk100ns = le32toh(clk100ns);
+	if (rt->last_ns) {
+		fw_ns = 100ull * ((clk100ns + CLOCK_PERIOD - rt->last_clk100ns) % CLOCK_PERIOD);
+		diff = (int64_t)(now - rt->last_ns) - (int64_t)fw_ns;
+		jitter_us = (uint64_t)(diff < 0 ? -diff : diff) / 1000;
+
+		for (bucket = 0; bucket < RT_JITTER_BUCKETS - 1 &&
+		     jitter_us >= (1ull << bucket); bucket++)
+			;
+		rt->histogram[bucket]++;
+		rt->sum_us += jitter_us;
+		if (jitter_us > rt->max_us)
+			rt->max_us = jitter_us;
+		rt->wakeups++;
+	}
+	rt->last_ns = now;
+	rt->last_clk100ns = clk100ns;
+}
+
+void rt_profile_record(rt_profile_t* rt, const usb_pkt_rx* rx)
+{
+	if (rx->status & (DMA_OVERFLOW | FIFO_OVERFLOW))
+		rt->overflows++;
+}
+
+void rt_profile_report(const rt_profile_t* rt, FILE* fp)
+{
+	uint64_t n = 0;
+	int i;
+
+	if (rt->wakeups == 0)
+		return;
+
+	/* upper bound of the bucket holding the 99th percentile */
+	for (i = 0; i < RT_JITTER_BUCKETS - 1; i++) {
+		n += rt->histogram[i];
+		if (n * 100 >= rt->wakeups * 99)
+			break;
+	}
+
+	fprintf(fp, "wakeup jitter: %llu transfers, mean %llu us, 99%% < %llu us, max %llu us, %llu overflows\n",
+	        (unsigned long long)rt->wakeups,
+	        (unsigned long long)(rt->sum_us / rt->wakeups),
+	        (unsigned long long)(1ull << i),
+	        (unsigned long long)rt->max_us,
+	        (unsigned long long)rt->overflows);
+}
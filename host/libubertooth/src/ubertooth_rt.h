@@ -0,0 +1,66 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_RT_H__
+#define __UBERTOOTH_RT_H__
+
+#include <stdio.h>
+
+#include "ubertooth_control.h"
+
+/*
+ * Real-time profile for the receive thread, selected with
+ * "-R [<cpu>][:<priority>]".  When streaming starts all memory of the
+ * process is locked and prefaulted, the thread is pinned to the CPU and,
+ * with a priority, runs under SCHED_FIFO.  USB events and decoding run
+ * on that one thread.
+ *
+ * Wakeup jitter is measured per USB transfer as the difference between
+ * the host time and the firmware time elapsed since the previous one.
+ */
+
+#define RT_STACK_PREFAULT (256 * 1024)
+#define RT_JITTER_BUCKETS 24   /* powers of two in microseconds */
+
+typedef struct {
+	int cpu;          /* -1 keeps the affinity */
+	int priority;     /* 0 keeps the scheduler */
+	int applied;
+
+	uint64_t last_ns;
+	uint32_t last_clk100ns;
+	uint64_t wakeups;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t histogram[RT_JITTER_BUCKETS];
+	uint64_t overflows;
+} rt_profile_t;
+
+int rt_profile_create(const char* spec, rt_profile_t** rt);
+void rt_profile_free(rt_profile_t* rt);
+
+int rt_profile_apply(rt_profile_t* rt);
+void rt_profile_prefault(void* buf, size_t len);
+void rt_profile_wakeup(rt_profile_t* rt, uint32_t clk100ns);
+void rt_profile_record(rt_profile_t* rt, const usb_pkt_rx* rx);
+void rt_profile_report(const rt_profile_t* rt, FILE* fp);
+
+#endif /* __UBERTOOTH_RT_H__ */
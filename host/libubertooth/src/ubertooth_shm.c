@@ -0,0 +1,302 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ubertooth_shm.h"
+
+static char* object_name(const char* name)
+{
+	char* s = (char*)malloc(strlen(name) + 2);
+
+	if (s == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	s[0] = '/';
+	strcpy(s + 1, name);
+	return s;
+}
+
+int shm_socket_path(const char* name, char* path, size_t len)
+{
+	const char* dir = getenv("UBERTOOTH_RUNTIME_DIR");
+	const char* xdg = getenv("XDG_RUNTIME_DIR");
+	size_t n;
+
+	if (dir && *dir)
+		n = snprintf(path, len, "%s/%s.sock", dir, name);
+	else if (xdg && *xdg)
+		n = snprintf(path, len, "%s/ubertooth/%s.sock", xdg, name);
+	else
+		n = snprintf(path, len, "/tmp/ubertooth-%u/%s.sock",
+		             (unsigned)geteuid(), name);
+	if (n >= len) {
+		fprintf(stderr, "Name too long: %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Create the directory of the socket path, opened to the group if one
+ * is given (not -1), or check that an existing one belongs to us and is
+ * closed to others. */
+int shm_socket_dir_create(const char* path, gid_t group)
+{
+	mode_t mode = group == (gid_t)-1 ? 0700 : 0750;
+	char* dir = strdup(path);
+	char* slash = dir ? strrchr(dir, '/') : NULL;
+	struct stat st;
+	int r = -1;
+
+	if (slash == NULL || slash == dir) {
+		fprintf(stderr, "No directory in %s\n", path);
+		free(dir);
+		return -1;
+	}
+	*slash = '\0';
+
+	if (mkdir(dir, mode) == 0) {
+		if ((group != (gid_t)-1 && chown(dir, -1, group) < 0) ||
+		    chmod(dir, mode) < 0)
+			perror(dir);
+		else
+			r = 0;
+	} else if (errno != EEXIST || lstat(dir, &st) < 0) {
+		perror(dir);
+	} else if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	           (st.st_mode & 0007)) {
+		fprintf(stderr, "%s is not a private directory of this user\n", dir);
+	} else {
+		r = 0;
+	}
+
+	free(dir);
+	return r;
+}
+
+/* Create the ring, replacing one left behind by an earlier producer.
+ * Only the user may read it, and the group if one is given (not -1). */
+shm_ring* shm_ring_create(const char* name, uint32_t slot_count, gid_t group)
+{
+	mode_t mode = group == (gid_t)-1 ? 0600 : 0640;
+	shm_ring* ring;
+	void* p;
+	int fd;
+
+	if (slot_count == 0 || (slot_count & (slot_count - 1))) {
+		fprintf(stderr, "The number of slots must be a power of two\n");
+		return NULL;
+	}
+
+	ring = (shm_ring*)calloc(1, sizeof(shm_ring));
+	if (ring == NULL || (ring->name = object_name(name)) == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(ring);
+		return NULL;
+	}
+	ring->writable = 1;
+	ring->size = sizeof(shm_header) + (size_t)slot_count * sizeof(shm_slot);
+
+	shm_unlink(ring->name);
+	fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, mode);
+	if (fd < 0 || ftruncate(fd, ring->size) < 0 ||
+	    (group != (gid_t)-1 && fchown(fd, -1, group) < 0) ||
+	    fchmod(fd, mode) < 0) {
+		perror(ring->name);
+		if (fd >= 0)
+			close(fd);
+		shm_ring_close(ring);
+		return NULL;
+	}
+	p = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		shm_ring_close(ring);
+		return NULL;
+	}
+
+	ring->hdr = (shm_header*)p;
+	ring->slots = (shm_slot*)(ring->hdr + 1);
+	ring->hdr->version = SHM_VERSION;
+	ring->hdr->slot_count = slot_count;
+	ring->hdr->slot_size = sizeof(shm_slot);
+	memcpy(ring->hdr->magic, SHM_MAGIC, 4);
+
+	return ring;
+}
+
+void shm_ring_publish(shm_ring* ring, const usb_pkt_rx* rx, uint64_t ts_ns)
+{
+	shm_header* hdr = ring->hdr;
+	uint64_t seq = hdr->write_seq;
+	shm_slot* slot = &ring->slots[seq & (hdr->slot_count - 1)];
+
+	__atomic_store_n(&slot->seq, SHM_SEQ_WRITING, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->ts_ns = ts_ns;
+	slot->systime = ts_ns / 1000000000ull;
+	slot->mode_epoch = hdr->mode_epoch;
+	memcpy(&slot->rx, rx, sizeof(usb_pkt_rx));
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->write_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void shm_ring_set_mode(shm_ring* ring, uint32_t modulation, uint32_t channel)
+{
+	ring->hdr->modulation = modulation;
+	ring->hdr->channel = channel;
+	__atomic_store_n(&ring->hdr->mode_epoch, ring->hdr->mode_epoch + 1,
+	                 __ATOMIC_RELEASE);
+}
+
+/* Map the ring read-only and start at its newest record */
+shm_ring* shm_ring_attach(const char* name)
+{
+	shm_ring* ring;
+	shm_header hdr;
+	struct stat st;
+	void* p;
+	int fd;
+
+	ring = (shm_ring*)calloc(1, sizeof(shm_ring));
+	if (ring == NULL || (ring->name = object_name(name)) == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(ring);
+		return NULL;
+	}
+
+	fd = shm_open(ring->name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(ring->name);
+		if (fd >= 0)
+			close(fd);
+		shm_ring_close(ring);
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(shm_header)) {
+		fprintf(stderr, "%s is not an Ubertooth ring\n", name);
+		close(fd);
+		shm_ring_close(ring);
+		return NULL;
+	}
+	ring->size = st.st_size;
+	p = mmap(NULL, ring->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		shm_ring_close(ring);
+		return NULL;
+	}
+	ring->hdr = (shm_header*)p;
+	ring->slots = (shm_slot*)(ring->hdr + 1);
+
+	memcpy(&hdr, ring->hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, SHM_MAGIC, 4) != 0 || hdr.version != SHM_VERSION ||
+	    hdr.slot_size != sizeof(shm_slot) ||
+	    sizeof(shm_header) + (size_t)hdr.slot_count * sizeof(shm_slot) > ring->size) {
+		fprintf(stderr, "%s is not a compatible Ubertooth ring\n", name);
+		shm_ring_close(ring);
+		return NULL;
+	}
+
+	ring->cursor = __atomic_load_n(&ring->hdr->write_seq, __ATOMIC_ACQUIRE);
+	return ring;
+}
+
+/* The next record, to be copied out and checked with shm_ring_valid(),
+ * or NULL if there is none yet */
+const shm_slot* shm_ring_next(shm_ring* ring)
+{
+	uint64_t count = ring->hdr->slot_count;
+	uint64_t write_seq;
+	const shm_slot* slot;
+
+	while (1) {
+		write_seq = __atomic_load_n(&ring->hdr->write_seq, __ATOMIC_ACQUIRE);
+		if (ring->cursor >= write_seq)
+			return NULL;
+
+		/* overtaken: skip to the oldest record still in the ring */
+		if (write_seq - ring->cursor > count) {
+			ring->overflows += write_seq - count - ring->cursor;
+			ring->cursor = write_seq - count;
+		}
+
+		slot = &ring->slots[ring->cursor & (count - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ring->cursor) {
+			ring->cursor++;
+			return slot;
+		}
+
+		/* overwritten since write_seq was read */
+		ring->overflows++;
+		ring->cursor++;
+	}
+}
+
+/* Whether the slot last returned by shm_ring_next() was left intact
+ * while it was used */
+int shm_ring_valid(const shm_ring* ring, const shm_slot* slot)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == ring->cursor - 1;
+}
+
+/* Wait for a record.  Returns 1 when one is available, 0 on timeout
+ * and -1 when the producer has closed the ring. */
+int shm_ring_wait(shm_ring* ring, int timeout_ms)
+{
+	int waited_us = 0;
+
+	while (__atomic_load_n(&ring->hdr->write_seq, __ATOMIC_ACQUIRE) <= ring->cursor) {
+		if (__atomic_load_n(&ring->hdr->closed, __ATOMIC_ACQUIRE))
+			return -1;
+		if (timeout_ms >= 0 && waited_us >= timeout_ms * 1000)
+			return 0;
+		usleep(SHM_POLL_US);
+		waited_us += SHM_POLL_US;
+	}
+	return 1;
+}
+
+void shm_ring_close(shm_ring* ring)
+{
+	if (ring == NULL)
+		return;
+	if (ring->hdr) {
+		if (ring->writable) {
+			__atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+			shm_unlink(ring->name);
+		}
+		munmap(ring->hdr, ring->size);
+	}
+	free(ring->name);
+	free(ring);
+}
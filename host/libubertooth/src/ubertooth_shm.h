@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_SHM_H__
+#define __UBERTOOTH_SHM_H__
+
+#include <sys/types.h>
+#include "ubertooth_control.h"
+
+/*
+ * Shared memory ring of USB records published by ubertoothd, so that
+ * any number of local processes can receive from one Ubertooth.
+ *
+ * The producer writes each record into slot seq % slot_count, stores
+ * seq in the slot once the record is complete and then advances
+ * write_seq.  Consumers map the ring read-only and keep their own
+ * cursor: a slot is copied out, and the copy is intact if the slot's
+ * seq is unchanged afterwards.  A consumer that falls more than slot_count
+ * records behind skips ahead and counts the records it lost.  The
+ * producer never waits for or even knows about its consumers.
+ *
+ * The ring is the POSIX shared memory object "/<name>" and ubertoothd
+ * accepts commands on the unix socket <dir>/<name>.sock.  The directory
+ * is $UBERTOOTH_RUNTIME_DIR, $XDG_RUNTIME_DIR/ubertooth or
+ * /tmp/ubertooth-<uid>.  Both are only accessible to the user running
+ * ubertoothd, and to a group if one is given.
+ */
+
+#define SHM_MAGIC         "UTSH"
+#define SHM_VERSION       1
+#define SHM_DEFAULT_NAME  "ubertooth"
+#define SHM_DEFAULT_SLOTS 65536     /* about 26 s of records */
+#define SHM_SEQ_WRITING   UINT64_MAX
+#define SHM_POLL_US       1000
+
+typedef struct {
+	uint64_t seq;
+	uint64_t ts_ns;
+	uint32_t systime;
+	uint32_t mode_epoch;
+	usb_pkt_rx rx;
+} shm_slot;
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t slot_count;     /* a power of two */
+	uint32_t slot_size;
+	uint64_t write_seq;      /* number of the next record */
+	uint32_t closed;
+	uint32_t mode_epoch;     /* advanced on every mode change */
+	uint32_t modulation;
+	uint32_t channel;
+	uint8_t pad[24];
+} shm_header;
+
+typedef struct {
+	char* name;
+	int writable;
+	shm_header* hdr;
+	shm_slot* slots;
+	size_t size;
+
+	/* consumer */
+	uint64_t cursor;
+	uint64_t overflows;
+} shm_ring;
+
+shm_ring* shm_ring_create(const char* name, uint32_t slot_count, gid_t group);
+void shm_ring_publish(shm_ring* ring, const usb_pkt_rx* rx, uint64_t ts_ns);
+void shm_ring_set_mode(shm_ring* ring, uint32_t modulation, uint32_t channel);
+
+shm_ring* shm_ring_attach(const char* name);
+const shm_slot* shm_ring_next(shm_ring* ring);
+int shm_ring_valid(const shm_ring* ring, const shm_slot* slot);
+int shm_ring_wait(shm_ring* ring, int timeout_ms);
+
+void shm_ring_close(shm_ring* ring);
+int shm_socket_path(const char* name, char* path, size_t len);
+int shm_socket_dir_create(const char* path, gid_t group);
+
+#endif /* __UBERTOOTH_SHM_H__ */
@@ -0,0 +1,285 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubertooth_specan.h"
+
+specan_sweep* specan_sweep_create(uint16_t low, uint16_t high)
+{
+	specan_sweep* s;
+
+	if (high < low) {
+		fprintf(stderr, "Invalid sweep range %u-%u MHz\n", low, high);
+		return NULL;
+	}
+
+	s = (specan_sweep*)calloc(1, sizeof(specan_sweep));
+	if (s == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	s->low = low;
+	s->high = high;
+	s->bins = high - low + 1;
+	s->rssi = (int8_t*)malloc((size_t)SPECAN_SWEEPS * s->bins);
+	s->clk100ns = (uint32_t*)calloc(SPECAN_SWEEPS, sizeof(uint32_t));
+	s->ts_ns = (uint64_t*)calloc(SPECAN_SWEEPS, sizeof(uint64_t));
+	if (s->rssi == NULL || s->clk100ns == NULL || s->ts_ns == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		specan_sweep_free(s);
+		return NULL;
+	}
+	memset(s->rssi, SPECAN_RSSI_NONE, s->bins);
+	s->last = -1;
+
+	return s;
+}
+
+void specan_sweep_free(specan_sweep* s)
+{
+	if (s == NULL)
+		return;
+	free(s->rssi);
+	free(s->clk100ns);
+	free(s->ts_ns);
+	free(s);
+}
+
+static int complete(specan_sweep* s)
+{
+	if (s->filled == 0)
+		return 0;
+
+	s->completed++;
+	memset(s->rssi + (s->completed % SPECAN_SWEEPS) * s->bins,
+	       SPECAN_RSSI_NONE, s->bins);
+	s->filled = 0;
+	s->last = -1;
+	return 1;
+}
+
+int specan_sweep_add(specan_sweep* s, const usb_pkt_rx* rx, uint64_t ts_ns)
+{
+	int j, bin, n = 0;
+	uint16_t frequency;
+	uint64_t row;
+
+	for (j = 0; j < DMA_SIZE - 2; j += 3) {
+		frequency = (rx->data[j] << 8) | rx->data[j + 1];
+		if (frequency < s->low || frequency > s->high)
+			continue;
+		bin = frequency - s->low;
+
+		/* wrapped around without the sample of the high frequency */
+		if (bin <= s->last)
+			n += complete(s);
+
+		row = s->completed % SPECAN_SWEEPS;
+		if (s->filled == 0) {
+			s->clk100ns[row] = rx->clk100ns;
+			s->ts_ns[row] = ts_ns;
+		}
+		s->rssi[row * s->bins + bin] = (int8_t)rx->data[j + 2];
+		s->filled++;
+		s->last = bin;
+
+		if (frequency == s->high)
+			n += complete(s);
+	}
+
+	return n;
+}
+
+const int8_t* specan_sweep_get(const specan_sweep* s, uint64_t n)
+{
+	/* the row of n - SPECAN_SWEEPS is being filled again */
+	if (n >= s->completed || s->completed - n >= SPECAN_SWEEPS)
+		return NULL;
+	return s->rssi + (n % SPECAN_SWEEPS) * s->bins;
+}
+
+uint32_t specan_sweep_clk100ns(const specan_sweep* s, uint64_t n)
+{
+	return s->clk100ns[n % SPECAN_SWEEPS];
+}
+
+uint64_t specan_sweep_ts_ns(const specan_sweep* s, uint64_t n)
+{
+	return s->ts_ns[n % SPECAN_SWEEPS];
+}
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+int specan_frame_write(FILE* fp, const specan_frame* f)
+{
+	uint8_t hdr[SPECAN_FRAME_HEADER_LEN];
+
+	memcpy(hdr, SPECAN_FRAME_MAGIC, 4);
+	hdr[4] = SPECAN_FRAME_VERSION;
+	hdr[5] = f->kind;
+	hdr[6] = f->percentile;
+	hdr[7] = (uint8_t)(int8_t)SPECAN_RSSI_OFFSET;
+	put_u64(hdr + 8, f->seq);
+	put_u64(hdr + 16, f->ts_ns);
+	put_u16(hdr + 24, f->start_mhz);
+	put_u16(hdr + 26, 1000);
+	put_u16(hdr + 28, f->count);
+	put_u16(hdr + 30, f->sweeps);
+
+	if (fwrite(hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(f->rssi, 1, f->count, fp) != f->count) {
+		perror("specan frame");
+		return -1;
+	}
+	return 0;
+}
+
+specan_accum* specan_accum_create(uint16_t bins, int percentiles)
+{
+	specan_accum* a = (specan_accum*)calloc(1, sizeof(specan_accum));
+
+	if (a == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	a->bins = bins;
+	a->max = (int8_t*)malloc(bins);
+	a->sum = (int32_t*)malloc(bins * sizeof(int32_t));
+	a->samples = (uint16_t*)malloc(bins * sizeof(uint16_t));
+	a->result = (int8_t*)malloc(bins);
+	if (percentiles)
+		a->histogram = (uint16_t*)malloc(bins * 256 * sizeof(uint16_t));
+	if (a->max == NULL || a->sum == NULL || a->samples == NULL ||
+	    a->result == NULL || (percentiles && a->histogram == NULL)) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		specan_accum_free(a);
+		return NULL;
+	}
+	specan_accum_reset(a);
+
+	return a;
+}
+
+void specan_accum_free(specan_accum* a)
+{
+	if (a == NULL)
+		return;
+	free(a->max);
+	free(a->sum);
+	free(a->samples);
+	free(a->histogram);
+	free(a->result);
+	free(a);
+}
+
+void specan_accum_reset(specan_accum* a)
+{
+	a->sweeps = 0;
+	memset(a->max, SPECAN_RSSI_NONE, a->bins);
+	memset(a->sum, 0, a->bins * sizeof(int32_t));
+	memset(a->samples, 0, a->bins * sizeof(uint16_t));
+	if (a->histogram)
+		memset(a->histogram, 0, a->bins * 256 * sizeof(uint16_t));
+}
+
+/* Callers reset at most every SPECAN_ACCUM_MAX_SWEEPS sweeps. */
+void specan_accum_add(specan_accum* a, const int8_t* rssi, uint64_t seq, uint64_t ts_ns)
+{
+	int i;
+
+	if (a->sweeps == 0) {
+		a->first_seq = seq;
+		a->first_ts_ns = ts_ns;
+	}
+	a->sweeps++;
+
+	for (i = 0; i < a->bins; i++) {
+		if (rssi[i] == SPECAN_RSSI_NONE)
+			continue;
+		if (rssi[i] > a->max[i])
+			a->max[i] = rssi[i];
+		a->sum[i] += rssi[i];
+		a->samples[i]++;
+		if (a->histogram)
+			a->histogram[i * 256 + (uint8_t)(rssi[i] + 128)]++;
+	}
+}
+
+const int8_t* specan_accum_max(specan_accum* a)
+{
+	return a->max;
+}
+
+const int8_t* specan_accum_average(specan_accum* a)
+{
+	int i;
+	int32_t n;
+
+	for (i = 0; i < a->bins; i++) {
+		n = a->samples[i];
+		if (n == 0) {
+			a->result[i] = SPECAN_RSSI_NONE;
+			continue;
+		}
+		/* rounded to the nearest */
+		a->result[i] = (int8_t)((a->sum[i] >= 0 ? a->sum[i] + n / 2
+		                                        : a->sum[i] - n / 2) / n);
+	}
+	return a->result;
+}
+
+const int8_t* specan_accum_percentile(specan_accum* a, uint8_t percentile)
+{
+	const uint16_t* h;
+	uint32_t rank, seen;
+	int i, v;
+
+	if (a->histogram == NULL)
+		return NULL;
+
+	for (i = 0; i < a->bins; i++) {
+		h = a->histogram + i * 256;
+		/* the smallest value at or above the given share of samples */
+		rank = (a->samples[i] * (uint32_t)percentile + 99) / 100;
+		if (rank == 0)
+			rank = 1;
+		seen = 0;
+		for (v = 0; v < 255 && seen + h[v] < rank; v++)
+			seen += h[v];
+		a->result[i] = a->samples[i] ? (int8_t)(v - 128) : SPECAN_RSSI_NONE;
+	}
+	return a->result;
+}
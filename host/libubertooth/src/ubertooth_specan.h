@@ -0,0 +1,144 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __UBERTOOTH_SPECAN_H__
+#define __UBERTOOTH_SPECAN_H__
+
+#include <stdio.h>
+
+#include "ubertooth_control.h"
+
+/*
+ * Assembles the (frequency, RSSI) samples of specan mode into complete
+ * sweeps of one RSSI per MHz from low to high.  Completed sweeps are
+ * kept in a ring owned by the assembler, so readers can use them in
+ * place: sweep n stays valid until SPECAN_SWEEPS - 1 newer sweeps have
+ * completed.
+ *
+ * A sweep completes with the sample of the high frequency, or with the
+ * first sample of the next sweep if that one was lost.  Bins without a
+ * sample hold SPECAN_RSSI_NONE.
+ */
+
+#define SPECAN_SWEEPS      32
+#define SPECAN_RSSI_NONE   -128
+#define SPECAN_RSSI_OFFSET -54    /* raw RSSI to approximate dBm */
+
+typedef struct {
+	uint16_t low;           /* MHz */
+	uint16_t high;
+	uint16_t bins;
+
+	int8_t* rssi;           /* SPECAN_SWEEPS rows of bins */
+	uint32_t* clk100ns;     /* first sample of each row */
+	uint64_t* ts_ns;        /* host time of that sample */
+	uint64_t completed;     /* sweeps so far, row completed % SPECAN_SWEEPS fills */
+	uint16_t filled;        /* samples in the sweep being filled */
+	int last;               /* bin of the latest sample */
+} specan_sweep;
+
+specan_sweep* specan_sweep_create(uint16_t low, uint16_t high);
+void specan_sweep_free(specan_sweep* s);
+
+/* Returns the number of sweeps the record, received at host time
+ * ts_ns, completed. */
+int specan_sweep_add(specan_sweep* s, const usb_pkt_rx* rx, uint64_t ts_ns);
+
+/* The RSSI row of sweep n, or NULL if it is not complete yet or has
+ * already been overwritten. */
+const int8_t* specan_sweep_get(const specan_sweep* s, uint64_t n);
+uint32_t specan_sweep_clk100ns(const specan_sweep* s, uint64_t n);
+uint64_t specan_sweep_ts_ns(const specan_sweep* s, uint64_t n);
+
+/*
+ * Sweep frames, for consumers that want whole sweeps without parsing
+ * text.  Each frame is a SPECAN_FRAME_HEADER_LEN byte header followed
+ * by count raw RSSI values (int8, add rssi_offset for dBm), for the
+ * frequencies start, start + step, ...  All fields are little endian:
+ *
+ *   0  magic "UTSF"
+ *   4  version, kind, percentile (kind SPECAN_FRAME_PERCENTILE),
+ *      rssi_offset (int8)
+ *   8  seq        u64  number of the (first) sweep
+ *  16  ts_ns      u64  host time of its first sample
+ *  24  start_mhz  u16
+ *  26  step_khz   u16
+ *  28  count      u16  RSSI values that follow
+ *  30  sweeps     u16  sweeps the values are computed from
+ */
+
+#define SPECAN_FRAME_MAGIC      "UTSF"
+#define SPECAN_FRAME_VERSION    1
+#define SPECAN_FRAME_HEADER_LEN 32
+
+enum specan_frame_kinds {
+	SPECAN_FRAME_SWEEP      = 0,   /* one sweep as received */
+	SPECAN_FRAME_MAX        = 1,   /* max-hold */
+	SPECAN_FRAME_AVERAGE    = 2,   /* mean of the sampled values */
+	SPECAN_FRAME_PERCENTILE = 3
+};
+
+typedef struct {
+	uint8_t kind;
+	uint8_t percentile;
+	uint64_t seq;
+	uint64_t ts_ns;
+	uint16_t start_mhz;
+	uint16_t count;
+	uint16_t sweeps;
+	const int8_t* rssi;
+} specan_frame;
+
+int specan_frame_write(FILE* fp, const specan_frame* f);
+
+/*
+ * Per bin accumulators over a number of sweeps: max-hold, average and,
+ * with a histogram of the raw values, percentiles.  Bins without a
+ * sample are left out; a bin never sampled reads SPECAN_RSSI_NONE.
+ */
+
+#define SPECAN_ACCUM_MAX_SWEEPS 65535
+
+typedef struct {
+	uint16_t bins;
+	uint16_t sweeps;        /* added since the reset */
+	uint64_t first_seq;
+	uint64_t first_ts_ns;
+
+	int8_t* max;
+	int32_t* sum;
+	uint16_t* samples;
+	uint16_t* histogram;    /* 256 per bin, NULL without percentiles */
+	int8_t* result;
+} specan_accum;
+
+specan_accum* specan_accum_create(uint16_t bins, int percentiles);
+void specan_accum_free(specan_accum* a);
+void specan_accum_reset(specan_accum* a);
+void specan_accum_add(specan_accum* a, const int8_t* rssi, uint64_t seq, uint64_t ts_ns);
+
+/* The result is valid until the next call. */
+const int8_t* specan_accum_max(specan_accum* a);
+const int8_t* specan_accum_average(specan_accum* a);
+const int8_t* specan_accum_percentile(specan_accum* a, uint8_t percentile);
+
+#endif /* __UBERTOOTH_SPECAN_H__ */
@@ -0,0 +1,321 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubertooth.h"
+#include "ubertooth_trigger.h"
+
+trigger_t* trigger_create(void)
+{
+	trigger_t* trig = (trigger_t*)calloc(1, sizeof(trigger_t));
+
+	if (trig == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return NULL;
+	}
+	trig->pre_ns = TRIGGER_DEFAULT_PRE * 1000000000ull;
+	trig->post_ns = TRIGGER_DEFAULT_POST * 1000000000ull;
+
+	return trig;
+}
+
+/* "<pre>[:<post>]" in seconds */
+int trigger_set_window(trigger_t* trig, const char* spec)
+{
+	char* end;
+	double pre, post;
+
+	pre = strtod(spec, &end);
+	post = TRIGGER_DEFAULT_POST;
+	if (*end == ':')
+		post = strtod(end + 1, &end);
+	if (*end != '\0' || pre <= 0 || post < 0) {
+		fprintf(stderr, "Invalid trigger window '%s', use <pre>[:<post>] seconds\n", spec);
+		return -1;
+	}
+	trig->pre_ns = (uint64_t)(pre * 1000000000.0);
+	trig->post_ns = (uint64_t)(post * 1000000000.0);
+
+	return 0;
+}
+
+/* "lap=<hex>", "aa=<hex>", "rssi=<dBm>" or "connect" */
+int trigger_add_condition(trigger_t* trig, const char* spec)
+{
+	char* end;
+
+	if (strncmp(spec, "lap=", 4) == 0 || strncmp(spec, "aa=", 3) == 0) {
+		if (trig->num_addresses == TRIGGER_MAX_ADDRESSES) {
+			fprintf(stderr, "Too many trigger addresses (max %d)\n",
+			        TRIGGER_MAX_ADDRESSES);
+			return -1;
+		}
+		spec = strchr(spec, '=') + 1;
+		trig->addresses[trig->num_addresses] = strtoul(spec, &end, 16);
+		if (*spec == '\0' || *end != '\0')
+			goto invalid;
+		trig->num_addresses++;
+	} else if (strncmp(spec, "rssi=", 5) == 0) {
+		trig->rssi = strtol(spec + 5, &end, 10);
+		if (spec[5] == '\0' || *end != '\0')
+			goto invalid;
+		trig->have_rssi = 1;
+	} else if (strcmp(spec, "connect") == 0) {
+		trig->le_connect = 1;
+	} else {
+		goto invalid;
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid trigger '%s', use lap=<LAP>, aa=<AA>, rssi=<dBm> or connect\n",
+	        spec);
+	return -1;
+}
+
+/* Allocate the rings and take over the writers.  All memory is
+ * allocated here so that receiving never allocates. */
+int trigger_start(trigger_t* trig, FILE* dumpfile,
+                  btbb_pcapng_handle* h_pcapng_bredr,
+                  lell_pcapng_handle* h_pcapng_le)
+{
+	uint64_t seconds = (trig->pre_ns + 999999999ull) / 1000000000ull;
+
+	if (trig->num_addresses == 0 && !trig->have_rssi && !trig->le_connect) {
+		fprintf(stderr, "A trigger window needs at least one trigger condition\n");
+		return -1;
+	}
+	if (dumpfile == NULL && h_pcapng_bredr == NULL && h_pcapng_le == NULL) {
+		fprintf(stderr, "A trigger window needs a dump or PCAPNG file\n");
+		return -1;
+	}
+
+	trig->records_size = seconds * TRIGGER_RECORD_RATE;
+	trig->packets_size = MIN(trig->records_size, TRIGGER_MAX_PACKETS);
+	trig->records = (trigger_record*)malloc(trig->records_size * sizeof(trigger_record));
+	trig->packets = (trigger_packet*)malloc(trig->packets_size * sizeof(trigger_packet));
+	if (trig->records == NULL || trig->packets == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(trig->records);
+		free(trig->packets);
+		trig->records = NULL;
+		trig->packets = NULL;
+		trig->records_size = trig->packets_size = 0;
+		return -1;
+	}
+
+	trig->dumpfile = dumpfile;
+	trig->h_pcapng_bredr = h_pcapng_bredr;
+	trig->h_pcapng_le = h_pcapng_le;
+
+	return 0;
+}
+
+static void write_record(trigger_t* trig, const trigger_record* r)
+{
+	uint32_t systime_be;
+
+	if (trig->dumpfile == NULL)
+		return;
+	systime_be = htobe32(r->systime);
+	fwrite(&systime_be, sizeof(systime_be), 1, trig->dumpfile);
+	fwrite(&r->rx, sizeof(usb_pkt_rx), 1, trig->dumpfile);
+}
+
+static void write_packet(trigger_t* trig, const trigger_packet* p)
+{
+	if (p->le) {
+		if (trig->h_pcapng_le)
+			lell_pcapng_append_packet(trig->h_pcapng_le, p->ts_ns,
+			                          p->signal, p->noise,
+			                          p->address, (lell_packet*)p->pkt);
+	} else {
+		if (trig->h_pcapng_bredr)
+			btbb_pcapng_append_packet(trig->h_pcapng_bredr, p->ts_ns,
+			                          p->signal, p->noise,
+			                          p->address, p->uap,
+			                          (btbb_packet*)p->pkt);
+	}
+}
+
+static void release_packet(trigger_packet* p)
+{
+	if (p->le)
+		lell_packet_unref((lell_packet*)p->pkt);
+	else
+		btbb_packet_unref((btbb_packet*)p->pkt);
+}
+
+static int in_post_window(const trigger_t* trig, uint64_t ts_ns)
+{
+	return trig->post_end_ns && ts_ns <= trig->post_end_ns;
+}
+
+void trigger_close(trigger_t* trig)
+{
+	unsigned i;
+
+	for (i = 0; i < trig->packets_count; i++)
+		release_packet(&trig->packets[(trig->packets_head + i) % trig->packets_size]);
+
+	if (trig->dumpfile)
+		fclose(trig->dumpfile);
+	if (trig->h_pcapng_bredr)
+		btbb_pcapng_close(trig->h_pcapng_bredr);
+	if (trig->h_pcapng_le)
+		lell_pcapng_close(trig->h_pcapng_le);
+
+	if (trig->fired)
+		fprintf(stderr, "Trigger fired %u times\n", trig->fired);
+
+	free(trig->records);
+	free(trig->packets);
+	free(trig);
+}
+
+int trigger_match_address(const trigger_t* trig, uint32_t address)
+{
+	int i;
+
+	for (i = 0; i < trig->num_addresses; i++)
+		if (trig->addresses[i] == address)
+			return 1;
+	return 0;
+}
+
+int trigger_match_rssi(const trigger_t* trig, int8_t signal)
+{
+	return trig->have_rssi && signal >= trig->rssi;
+}
+
+/* Write the pre-window and start (or extend) the post-window. */
+void trigger_fire(trigger_t* trig, uint64_t ts_ns, const char* reason)
+{
+	uint64_t start_ns = ts_ns > trig->pre_ns ? ts_ns - trig->pre_ns : 0;
+	trigger_record* r;
+	trigger_packet* p;
+	unsigned i;
+	int marked = 0;
+
+	if (!in_post_window(trig, ts_ns)) {
+		fprintf(stderr, "Trigger: %s\n", reason);
+		trig->fired++;
+
+		for (i = 0; i < trig->records_count; i++) {
+			r = &trig->records[(trig->records_head + i) % trig->records_size];
+			if (r->ts_ns < start_ns)
+				continue;
+			if (!marked && trig->dumpfile) {
+				dump_write_marker(trig->dumpfile, DUMP_MARKER_WINDOW, r->systime,
+				                  trig->records_seen - trig->records_count + i);
+				marked = 1;
+			}
+			write_record(trig, r);
+		}
+		if (!marked && trig->dumpfile)
+			dump_write_marker(trig->dumpfile, DUMP_MARKER_WINDOW,
+			                  ts_ns / 1000000000ull, trig->records_seen);
+		trig->records_count = 0;
+
+		for (i = 0; i < trig->packets_count; i++) {
+			p = &trig->packets[(trig->packets_head + i) % trig->packets_size];
+			if (p->ts_ns >= start_ns)
+				write_packet(trig, p);
+			release_packet(p);
+		}
+		trig->packets_count = 0;
+	}
+
+	trig->post_end_ns = ts_ns + trig->post_ns;
+	if (trig->dumpfile)
+		fflush(trig->dumpfile);
+}
+
+void trigger_add_record(trigger_t* trig, uint32_t systime, uint64_t ts_ns,
+                        const usb_pkt_rx* rx)
+{
+	trigger_record* r;
+
+	trig->records_seen++;
+	if (in_post_window(trig, ts_ns)) {
+		trigger_record tmp = { systime, ts_ns, *rx };
+		write_record(trig, &tmp);
+		return;
+	}
+
+	/* overwrite the oldest record when full */
+	if (trig->records_count == trig->records_size) {
+		trig->records_head = (trig->records_head + 1) % trig->records_size;
+		trig->records_count--;
+	}
+	r = &trig->records[(trig->records_head + trig->records_count) % trig->records_size];
+	r->systime = systime;
+	r->ts_ns = ts_ns;
+	memcpy(&r->rx, rx, sizeof(usb_pkt_rx));
+	trig->records_count++;
+}
+
+static void add_packet(trigger_t* trig, const trigger_packet* pkt)
+{
+	if (in_post_window(trig, pkt->ts_ns)) {
+		write_packet(trig, pkt);
+		return;
+	}
+
+	if (trig->packets_count == trig->packets_size) {
+		release_packet(&trig->packets[trig->packets_head]);
+		trig->packets_head = (trig->packets_head + 1) % trig->packets_size;
+		trig->packets_count--;
+	}
+	memcpy(&trig->packets[(trig->packets_head + trig->packets_count) % trig->packets_size],
+	       pkt, sizeof(trigger_packet));
+	trig->packets_count++;
+
+	/* the ring holds a reference until the packet is written or
+	 * pushed out */
+	if (pkt->le)
+		lell_packet_ref((lell_packet*)pkt->pkt);
+	else
+		btbb_packet_ref((btbb_packet*)pkt->pkt);
+}
+
+void trigger_add_bredr(trigger_t* trig, uint64_t ts_ns, int8_t signal,
+                       int8_t noise, uint32_t lap, uint8_t uap,
+                       btbb_packet* pkt)
+{
+	trigger_packet p = { ts_ns, signal, noise, uap, 0, lap, pkt };
+
+	if (trig->h_pcapng_bredr)
+		add_packet(trig, &p);
+}
+
+void trigger_add_le(trigger_t* trig, uint64_t ts_ns, int8_t signal,
+                    int8_t noise, uint32_t ref_aa, lell_packet* pkt)
+{
+	trigger_packet p = { ts_ns, signal, noise, 0, 1, ref_aa, pkt };
+
+	if (trig->h_pcapng_le)
+		add_packet(trig, &p);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UBERTOOTH_TRIGGER_H__
+#define __UBERTOOTH_TRIGGER_H__
+
+#include "ubertooth_control.h"
+#include <btbb.h>
+
+/*
+ * Pre-trigger capture.  Every USB record and every decoded packet is
+ * kept in fixed size rings covering the last few seconds instead of
+ * being written out.  When a trigger condition is met the part of the
+ * rings inside the pre-window is written to the dump file and PCAPNG
+ * writers, followed by everything received in the post-window.  Each
+ * window written to the dump file starts with a window marker.
+ *
+ * The trigger takes over the writers given to trigger_start, so the
+ * callbacks write nothing themselves while it is active.
+ */
+
+#define TRIGGER_MAX_ADDRESSES 16
+#define TRIGGER_MAX_PACKETS   4096
+
+/* USB records per second while receiving symbols */
+#define TRIGGER_RECORD_RATE   (1000000 / BANK_LEN)
+
+#define TRIGGER_DEFAULT_PRE   10
+#define TRIGGER_DEFAULT_POST  5
+
+typedef struct {
+	uint32_t systime;
+	uint64_t ts_ns;
+	usb_pkt_rx rx;
+} trigger_record;
+
+typedef struct {
+	uint64_t ts_ns;
+	int8_t signal;
+	int8_t noise;
+	uint8_t uap;
+	uint8_t le;
+	uint32_t address;   /* LAP, or reference AA for LE */
+	void* pkt;          /* btbb_packet or lell_packet, referenced */
+} trigger_packet;
+
+typedef struct {
+	/* conditions */
+	uint32_t addresses[TRIGGER_MAX_ADDRESSES];
+	int num_addresses;
+	int rssi;
+	int have_rssi;
+	int le_connect;
+
+	uint64_t pre_ns;
+	uint64_t post_ns;
+
+	/* writers owned by the trigger */
+	FILE* dumpfile;
+	btbb_pcapng_handle* h_pcapng_bredr;
+	lell_pcapng_handle* h_pcapng_le;
+
+	trigger_record* records;
+	unsigned records_size;
+	unsigned records_head;
+	unsigned records_count;
+	uint64_t records_seen;
+
+	trigger_packet* packets;
+	unsigned packets_size;
+	unsigned packets_head;
+	unsigned packets_count;
+
+	/* end of the current post-window, 0 if not triggered */
+	uint64_t post_end_ns;
+	unsigned fired;
+} trigger_t;
+
+trigger_t* trigger_create(void);
+int trigger_set_window(trigger_t* trig, const char* spec);
+int trigger_add_condition(trigger_t* trig, const char* spec);
+int trigger_start(trigger_t* trig, FILE* dumpfile,
+                  btbb_pcapng_handle* h_pcapng_bredr,
+                  lell_pcapng_handle* h_pcapng_le);
+void trigger_close(trigger_t* trig);
+
+int trigger_match_address(const trigger_t* trig, uint32_t address);
+int trigger_match_rssi(const trigger_t* trig, int8_t signal);
+void trigger_fire(trigger_t* trig, uint64_t ts_ns, const char* reason);
+
+void trigger_add_record(trigger_t* trig, uint32_t systime, uint64_t ts_ns,
+                        const usb_pkt_rx* rx);
+void trigger_add_bredr(trigger_t* trig, uint64_t ts_ns, int8_t signal,
+                       int8_t noise, uint32_t lap, uint8_t uap,
+                       btbb_packet* pkt);
+void trigger_add_le(trigger_t* trig, uint64_t ts_ns, int8_t signal,
+                    int8_t noise, uint32_t ref_aa, lell_packet* pkt);
+
+#endif /* __UBERTOOTH_TRIGGER_H__ */
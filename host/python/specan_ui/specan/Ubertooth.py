@@ -26,13 +26,38 @@ import numpy
 import time
 import subprocess
 
+try:
+    import ubertooth as binding
+except ImportError:
+    binding = None
+
 
 class Ubertooth(object):
 
     def __init__(self):
         self.proc = None
+        self.device = None
 
     def specan(self, low_frequency, high_frequency):
+        if binding is not None:
+            return self._specan_binding(low_frequency, high_frequency)
+        return self._specan_subprocess(low_frequency, high_frequency)
+
+    def _specan_binding(self, low_frequency, high_frequency):
+        low = int(round(low_frequency / 1e6))
+        high = int(round(high_frequency / 1e6))
+        try:
+            self.device = binding.Device()
+        except IOError:
+            print("Could not open Ubertooth device")
+            return
+        frequency_axis = numpy.arange(low, high + 1) * 1e6
+        rssi_values = numpy.empty((high - low + 1,), dtype=numpy.float32)
+        for _, raw_rssi in self.device.specan(low, high):
+            numpy.add(raw_rssi, binding.RSSI_OFFSET, out=rssi_values, dtype=numpy.float32)
+            yield (frequency_axis, rssi_values)
+
+    def _specan_subprocess(self, low_frequency, high_frequency):
         spacing_hz = 1e6
         bin_count = int(round((high_frequency - low_frequency) / spacing_hz)) + 1
         frequency_axis = numpy.linspace(low_frequency, high_frequency, num=bin_count, endpoint=True)
@@ -73,6 +98,9 @@ class Ubertooth(object):
                     rssi_values[index] = raw_rssi_value + rssi_offset
 
     def close(self):
+        if self.device:
+            self.device.close()
+            self.device = None
         if self.proc and not self.proc.poll():
             self.proc.terminate()
             if self.proc.poll() is not None:
@@ -0,0 +1,505 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/*
+ * CPython binding of libubertooth for analysis in Python at device rate.
+ * Sweeps and record batches are handed out as read-only buffers over
+ * memory owned by the binding, which numpy.frombuffer() turns into
+ * arrays without copying (see ubertooth/__init__.py).  A buffer is
+ * reused once enough newer sweeps or batches have been read, so callers
+ * copy what they keep longer.  The GIL is released while waiting for
+ * USB transfers.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "ubertooth.h"
+#include "ubertooth_specan.h"
+
+#define BATCH_SLOTS   8
+#define BATCH_DEFAULT 64
+#define BATCH_MAX     65536
+
+enum {
+	MODE_IDLE   = 0,
+	MODE_SPECAN = 1,
+	MODE_RX     = 2
+};
+
+/* BATCH_SLOTS batches of records followed by their host times */
+typedef struct {
+	uint32_t batch;
+	uint8_t* records;
+	uint64_t* ts_ns;
+} batch_ring;
+
+typedef struct {
+	PyObject_HEAD
+	ubertooth_t* ut;
+	int mode;
+	int busy;
+
+	PyObject* sweep_owner;      /* capsule of the specan_sweep */
+	specan_sweep* sweep;
+	uint64_t next_sweep;
+
+	PyObject* batch_owner;      /* capsule of the batch_ring */
+	batch_ring* batches;
+	uint64_t next_batch;
+	int xfer_pos;               /* next record of the full transfer */
+} DeviceObject;
+
+/* A view of memory kept alive by its owner. */
+typedef struct {
+	PyObject_HEAD
+	PyObject* owner;
+	void* buf;
+	Py_ssize_t len;
+	char* format;       /* of the bytes, "b" or "B" */
+} FrameObject;
+
+static PyTypeObject FrameType;
+
+static PyObject* frame_new(PyObject* owner, void* buf, Py_ssize_t len, char* format)
+{
+	FrameObject* f = PyObject_New(FrameObject, &FrameType);
+	if (f == NULL)
+		return NULL;
+	Py_INCREF(owner);
+	f->owner = owner;
+	f->buf = buf;
+	f->len = len;
+	f->format = format;
+	return (PyObject*)f;
+}
+
+static void frame_dealloc(FrameObject* f)
+{
+	Py_DECREF(f->owner);
+	PyObject_Del(f);
+}
+
+static int frame_getbuffer(FrameObject* f, Py_buffer* view, int flags)
+{
+	if (PyBuffer_FillInfo(view, (PyObject*)f, f->buf, f->len, 1, flags) < 0)
+		return -1;
+	if (flags & PyBUF_FORMAT)
+		view->format = f->format;
+	return 0;
+}
+
+static PyBufferProcs frame_as_buffer = {
+	(getbufferproc)frame_getbuffer,
+	NULL
+};
+
+static PyTypeObject FrameType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "ubertooth._ubertooth.Frame",
+	.tp_basicsize = sizeof(FrameObject),
+	.tp_dealloc = (destructor)frame_dealloc,
+	.tp_as_buffer = &frame_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Read-only view of a sweep or batch owned by the binding",
+};
+
+static void sweep_destructor(PyObject* capsule)
+{
+	specan_sweep_free((specan_sweep*)PyCapsule_GetPointer(capsule, NULL));
+}
+
+static void batch_destructor(PyObject* capsule)
+{
+	batch_ring* b = (batch_ring*)PyCapsule_GetPointer(capsule, NULL);
+	free(b->records);
+	free(b);
+}
+
+static int check_open(DeviceObject* d)
+{
+	if (d->ut == NULL) {
+		PyErr_SetString(PyExc_ValueError, "device is closed");
+		return -1;
+	}
+	if (d->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "device is in use by another thread");
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop whatever the device streams and drop the records left over.
+ * Records of the old mode still queued in the firmware are dropped by
+ * their mode epoch in next_record(). */
+static int stop_mode(DeviceObject* d)
+{
+	if (d->mode == MODE_IDLE)
+		return 0;
+	d->mode = MODE_IDLE;
+	d->xfer_pos = PKTS_PER_XFER;
+	d->ut->usb_really_full = 0;
+	ubertooth_mode_switch(d->ut);
+	return cmd_stop(d->ut->devh);
+}
+
+static int start_bulk(DeviceObject* d)
+{
+	if (d->ut->rx_xfer != NULL)
+		return 0;
+	if (ubertooth_bulk_init(d->ut) < 0) {
+		PyErr_SetString(PyExc_IOError, "unable to start USB transfers");
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait for the next transfer without holding the GIL.  Returns -1 with
+ * an exception set if a signal handler raised one. */
+static int wait_transfer(DeviceObject* d)
+{
+	d->busy = 1;
+	Py_BEGIN_ALLOW_THREADS
+	ubertooth_bulk_wait(d->ut);
+	Py_END_ALLOW_THREADS
+	d->busy = 0;
+
+	if (PyErr_CheckSignals() < 0)
+		return -1;
+	if (d->ut->stop_ubertooth || d->ut->rx_xfer == NULL) {
+		PyErr_SetString(PyExc_IOError, "USB transfers stopped");
+		return -1;
+	}
+	if (d->ut->usb_really_full) {
+		clock_sync_sample(&d->ut->clock);
+		d->xfer_pos = 0;
+	}
+	return 0;
+}
+
+/* The next record of the current transfer, NULL once it is used up. */
+static usb_pkt_rx* next_record(DeviceObject* d)
+{
+	usb_pkt_rx* rx;
+
+	while (d->ut->usb_really_full && d->xfer_pos < d->ut->full_records) {
+		rx = (usb_pkt_rx*)(d->ut->full_usb_buf + PKT_LEN * d->xfer_pos++);
+		if (ubertooth_check_epoch(d->ut, rx) < 0)
+			continue;
+		if (d->mode == MODE_SPECAN ? rx->pkt_type == SPECAN
+		                           : (rx->pkt_type != KEEP_ALIVE && rx->pkt_type != SPECAN))
+			return rx;
+	}
+	d->ut->usb_really_full = 0;
+	return NULL;
+}
+
+static int device_init(DeviceObject* d, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"index", NULL};
+	int index = -1;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &index))
+		return -1;
+	if (d->ut != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "device is already open");
+		return -1;
+	}
+
+	d->ut = ubertooth_init();
+	if (d->ut == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	r = ubertooth_connect(d->ut, index);
+	if (r < 0) {
+		/* ubertooth_connect() releases the device on failure */
+		ubertooth_free(d->ut);
+		d->ut = NULL;
+		PyErr_SetString(PyExc_IOError, "unable to open the Ubertooth device");
+		return -1;
+	}
+	d->xfer_pos = PKTS_PER_XFER;
+	return 0;
+}
+
+static PyObject* device_close(DeviceObject* d, PyObject* unused)
+{
+	(void)unused;
+	if (d->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "device is in use by another thread");
+		return NULL;
+	}
+	if (d->ut != NULL) {
+		ubertooth_stop(d->ut);
+		ubertooth_free(d->ut);
+		d->ut = NULL;
+	}
+	d->mode = MODE_IDLE;
+	Py_RETURN_NONE;
+}
+
+static void device_dealloc(DeviceObject* d)
+{
+	if (d->ut != NULL) {
+		ubertooth_stop(d->ut);
+		ubertooth_free(d->ut);
+	}
+	Py_XDECREF(d->sweep_owner);
+	Py_XDECREF(d->batch_owner);
+	Py_TYPE(d)->tp_free((PyObject*)d);
+}
+
+static PyObject* device_specan_start(DeviceObject* d, PyObject* args)
+{
+	unsigned short low = 2402, high = 2480;
+	specan_sweep* s;
+	PyObject* owner;
+
+	if (!PyArg_ParseTuple(args, "|HH", &low, &high))
+		return NULL;
+	if (check_open(d) < 0)
+		return NULL;
+
+	s = specan_sweep_create(low, high);
+	if (s == NULL) {
+		PyErr_SetString(PyExc_ValueError, "invalid sweep range");
+		return NULL;
+	}
+	owner = PyCapsule_New(s, NULL, sweep_destructor);
+	if (owner == NULL) {
+		specan_sweep_free(s);
+		return NULL;
+	}
+	/* sweeps already handed out keep the old assembler alive */
+	Py_XDECREF(d->sweep_owner);
+	d->sweep_owner = owner;
+	d->sweep = s;
+	d->next_sweep = 0;
+
+	stop_mode(d);
+	if (start_bulk(d) < 0)
+		return NULL;
+	if (cmd_specan(d->ut->devh, low, high) < 0) {
+		PyErr_SetString(PyExc_IOError, "unable to start specan mode");
+		return NULL;
+	}
+	d->mode = MODE_SPECAN;
+	Py_RETURN_NONE;
+}
+
+static PyObject* device_next_sweep(DeviceObject* d, PyObject* unused)
+{
+	const int8_t* row;
+	usb_pkt_rx* rx;
+	uint64_t n;
+	(void)unused;
+
+	if (check_open(d) < 0)
+		return NULL;
+	if (d->mode != MODE_SPECAN) {
+		PyErr_SetString(PyExc_RuntimeError, "specan mode is not started");
+		return NULL;
+	}
+
+	while (d->next_sweep >= d->sweep->completed) {
+		rx = next_record(d);
+		if (rx != NULL) {
+			clock_sync_advance(&d->ut->clock, rx);
+			specan_sweep_add(d->sweep, rx, clock_sync_ns(&d->ut->clock, rx));
+		} else if (wait_transfer(d) < 0) {
+			return NULL;
+		}
+	}
+
+	/* a range of a few MHz completes many sweeps per record */
+	if (d->sweep->completed - d->next_sweep >= SPECAN_SWEEPS)
+		d->next_sweep = d->sweep->completed - (SPECAN_SWEEPS - 1);
+
+	n = d->next_sweep++;
+	row = specan_sweep_get(d->sweep, n);
+	return Py_BuildValue("(KkN)", (unsigned long long)n,
+	                     (unsigned long)specan_sweep_clk100ns(d->sweep, n),
+	                     frame_new(d->sweep_owner, (void*)row, d->sweep->bins, "b"));
+}
+
+static PyObject* device_rx_start(DeviceObject* d, PyObject* args, PyObject* kwds)
+{
+	static char* kwlist[] = {"modulation", "channel", "batch", NULL};
+	unsigned short modulation = MOD_BT_BASIC_RATE, channel = 0;
+	unsigned int batch = BATCH_DEFAULT;
+	batch_ring* b;
+	PyObject* owner;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|HHI", kwlist,
+	                                 &modulation, &channel, &batch))
+		return NULL;
+	if (check_open(d) < 0)
+		return NULL;
+	if (batch < 1 || batch > BATCH_MAX) {
+		PyErr_Format(PyExc_ValueError, "batch must be 1 to %d records", BATCH_MAX);
+		return NULL;
+	}
+
+	b = (batch_ring*)calloc(1, sizeof(batch_ring));
+	if (b == NULL)
+		return PyErr_NoMemory();
+	b->batch = batch;
+	b->records = (uint8_t*)malloc((size_t)BATCH_SLOTS * batch * (PKT_LEN + sizeof(uint64_t)));
+	if (b->records == NULL) {
+		free(b);
+		return PyErr_NoMemory();
+	}
+	b->ts_ns = (uint64_t*)(b->records + (size_t)BATCH_SLOTS * batch * PKT_LEN);
+	owner = PyCapsule_New(b, NULL, batch_destructor);
+	if (owner == NULL) {
+		free(b->records);
+		free(b);
+		return NULL;
+	}
+	Py_XDECREF(d->batch_owner);
+	d->batch_owner = owner;
+	d->batches = b;
+	d->next_batch = 0;
+
+	stop_mode(d);
+	if (cmd_set_modulation(d->ut->devh, modulation) < 0 ||
+	    (channel && cmd_set_channel(d->ut->devh, channel) < 0)) {
+		PyErr_SetString(PyExc_IOError, "unable to configure the radio");
+		return NULL;
+	}
+	if (start_bulk(d) < 0)
+		return NULL;
+	if (cmd_rx_syms(d->ut->devh) < 0) {
+		PyErr_SetString(PyExc_IOError, "unable to start receiving");
+		return NULL;
+	}
+	d->mode = MODE_RX;
+	Py_RETURN_NONE;
+}
+
+static PyObject* device_next_batch(DeviceObject* d, PyObject* unused)
+{
+	batch_ring* b = d->batches;
+	usb_pkt_rx* rx;
+	uint8_t* records;
+	uint64_t* ts_ns;
+	uint32_t count = 0;
+	(void)unused;
+
+	if (check_open(d) < 0)
+		return NULL;
+	if (d->mode != MODE_RX) {
+		PyErr_SetString(PyExc_RuntimeError, "receiving is not started");
+		return NULL;
+	}
+
+	records = b->records + (size_t)(d->next_batch % BATCH_SLOTS) * b->batch * PKT_LEN;
+	ts_ns = b->ts_ns + (size_t)(d->next_batch % BATCH_SLOTS) * b->batch;
+	while (count < b->batch) {
+		rx = next_record(d);
+		if (rx == NULL) {
+			if (wait_transfer(d) < 0)
+				return NULL;
+			continue;
+		}
+		clock_sync_advance(&d->ut->clock, rx);
+		ts_ns[count] = clock_sync_ns(&d->ut->clock, rx);
+		memcpy(records + (size_t)count * PKT_LEN, rx, PKT_LEN);
+		count++;
+	}
+	d->next_batch++;
+
+	return Py_BuildValue("(NN)",
+	                     frame_new(d->batch_owner, records, (Py_ssize_t)count * PKT_LEN, "B"),
+	                     frame_new(d->batch_owner, ts_ns, (Py_ssize_t)(count * sizeof(uint64_t)), "B"));
+}
+
+static PyObject* device_get_bins(DeviceObject* d, void* closure)
+{
+	(void)closure;
+	return PyLong_FromLong(d->sweep ? d->sweep->bins : 0);
+}
+
+static PyMethodDef device_methods[] = {
+	{"specan_start", (PyCFunction)device_specan_start, METH_VARARGS,
+	 "specan_start(low=2402, high=2480): sweep from low to high MHz"},
+	{"next_sweep", (PyCFunction)device_next_sweep, METH_NOARGS,
+	 "next_sweep() -> (number, clk100ns, frame of int8 raw RSSI per MHz)"},
+	{"rx_start", (PyCFunction)(void (*)(void))device_rx_start, METH_VARARGS | METH_KEYWORDS,
+	 "rx_start(modulation=0, channel=0, batch=64): receive raw records,\n"
+	 "on the given channel in MHz unless it is 0"},
+	{"next_batch", (PyCFunction)device_next_batch, METH_NOARGS,
+	 "next_batch() -> (frame of usb_pkt_rx records, frame of host times in ns)"},
+	{"close", (PyCFunction)device_close, METH_NOARGS,
+	 "close(): stop the device, handed out frames stay valid"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef device_getset[] = {
+	{"bins", (getter)device_get_bins, NULL, "MHz bins per sweep", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject DeviceType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "ubertooth._ubertooth.Device",
+	.tp_basicsize = sizeof(DeviceObject),
+	.tp_dealloc = (destructor)device_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Device(index=-1): an Ubertooth, -1 for the first one found",
+	.tp_methods = device_methods,
+	.tp_getset = device_getset,
+	.tp_init = (initproc)device_init,
+	.tp_new = PyType_GenericNew,
+};
+
+static struct PyModuleDef module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "ubertooth._ubertooth",
+	.m_doc = "libubertooth binding",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__ubertooth(void)
+{
+	PyObject* m;
+
+	if (PyType_Ready(&FrameType) < 0 || PyType_Ready(&DeviceType) < 0)
+		return NULL;
+
+	m = PyModule_Create(&module);
+	if (m == NULL)
+		return NULL;
+
+	Py_INCREF(&DeviceType);
+	PyModule_AddObject(m, "Device", (PyObject*)&DeviceType);
+	PyModule_AddIntConstant(m, "PKT_LEN", PKT_LEN);
+	PyModule_AddIntConstant(m, "SPECAN_SWEEPS", SPECAN_SWEEPS);
+	PyModule_AddIntConstant(m, "BATCH_SLOTS", BATCH_SLOTS);
+	PyModule_AddIntConstant(m, "RSSI_NONE", SPECAN_RSSI_NONE);
+	PyModule_AddIntConstant(m, "RSSI_OFFSET", SPECAN_RSSI_OFFSET);
+	PyModule_AddIntConstant(m, "MOD_BT_BASIC_RATE", MOD_BT_BASIC_RATE);
+	PyModule_AddIntConstant(m, "MOD_BT_LOW_ENERGY", MOD_BT_LOW_ENERGY);
+	return m;
+}
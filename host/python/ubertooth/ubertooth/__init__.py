@@ -0,0 +1,93 @@
+#
+# Copyright 2016 Ubertooth contributors
+#
+# This file is part of Project Ubertooth.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; see the file COPYING.  If not, write to
+# the Free Software Foundation, Inc., 51 Franklin Street,
+# Boston, MA 02110-1301, USA.
+
+"""
+Ubertooth access without subprocesses or per-sample parsing.
+
+Sweeps and raw records arrive as numpy arrays over memory owned by the
+binding.  An array is reused after SPECAN_SWEEPS further sweeps or
+BATCH_SLOTS further batches have been read; copy() what is kept longer.
+
+    import ubertooth
+    with ubertooth.Device() as dev:
+        for frequencies, rssi in dev.specan(2402, 2480):
+            print(frequencies[rssi.argmax()])
+"""
+
+import numpy
+
+from ._ubertooth import (Device as _Device, SPECAN_SWEEPS, BATCH_SLOTS,
+                         RSSI_NONE, RSSI_OFFSET, MOD_BT_BASIC_RATE,
+                         MOD_BT_LOW_ENERGY)
+
+# usb_pkt_rx of ubertooth_interface.h
+RECORD_DTYPE = numpy.dtype([
+    ('pkt_type', 'u1'),
+    ('status', 'u1'),
+    ('channel', 'u1'),
+    ('clkn_high', 'u1'),
+    ('clk100ns', '<u4'),
+    ('rssi_max', 'i1'),
+    ('rssi_min', 'i1'),
+    ('rssi_avg', 'i1'),
+    ('rssi_count', 'u1'),
+    ('reserved', 'u1', (2,)),
+    ('data', 'u1', (50,)),
+])
+
+
+class Device(object):
+
+    def __init__(self, index=-1):
+        self._dev = _Device(index)
+
+    def specan(self, low=2402, high=2480):
+        """Yield (frequencies in MHz, raw int8 RSSI) for each sweep.
+        Bins without a sample hold RSSI_NONE, add RSSI_OFFSET for dBm."""
+        self._dev.specan_start(low, high)
+        frequencies = numpy.arange(low, high + 1)
+        while True:
+            _, _, frame = self._dev.next_sweep()
+            yield frequencies, numpy.frombuffer(frame, dtype=numpy.int8)
+
+    def sweeps(self, low=2402, high=2480):
+        """Like specan(), yielding (sweep number, clk100ns, RSSI)."""
+        self._dev.specan_start(low, high)
+        while True:
+            n, clk100ns, frame = self._dev.next_sweep()
+            yield n, clk100ns, numpy.frombuffer(frame, dtype=numpy.int8)
+
+    def records(self, modulation=MOD_BT_BASIC_RATE, channel=0, batch=64):
+        """Yield (records, host times in ns) in batches of raw USB records
+        with RECORD_DTYPE, on channel MHz unless it is 0."""
+        self._dev.rx_start(modulation, channel, batch)
+        while True:
+            records, ts_ns = self._dev.next_batch()
+            yield (numpy.frombuffer(records, dtype=RECORD_DTYPE),
+                   numpy.frombuffer(ts_ns, dtype=numpy.uint64))
+
+    def close(self):
+        self._dev.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
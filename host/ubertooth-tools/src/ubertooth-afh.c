@@ -26,8 +26,6 @@
 #include <unistd.h>
 #include <string.h>
 
-extern int max_ac_errors;
-extern unsigned int packet_counter_max;
 
 static void usage()
 {
@@ -41,7 +39,9 @@ static void usage()
 	printf("\t-U <0-7> set ubertooth device to use\n");
 	printf("\t-t <seconds> timeout for initial AFH map detection\n");
 	printf("\t-m <int> threshold for channel removal\n");
+	printf("\t-s <int> sightings before a channel is added (default: %u)\n", afh_sightings);
 	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-C <filename> piconet cache: take UAP and a recent AFH map from it, store what is learned\n");
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 }
 
@@ -55,10 +55,12 @@ int main(int argc, char* argv[])
 	uint32_t lap = 0;
 	uint8_t uap = 0;
 	uint8_t use_r_format = 0;
+	piconet_cache* cache = NULL;
+	piconet_entry* e;
 
 	ubertooth_t* ut = NULL;
 
-	while ((opt=getopt(argc,argv,"rhVl:u:U:e:a:t:m:")) != EOF) {
+	while ((opt=getopt(argc,argv,"rhVl:u:U:e:a:t:m:s:C:")) != EOF) {
 		switch(opt) {
 		case 'l':
 			lap = strtol(optarg, &end, 16);
@@ -86,12 +88,20 @@ int main(int argc, char* argv[])
 		case 'm':
 			packet_counter_max = atoi(optarg);
 			break;
+		case 's':
+			afh_sightings = atoi(optarg);
+			break;
 		case 'V':
 			print_version();
 			return 0;
 		case 'r':
 			use_r_format = 1;
 			break;
+		case 'C':
+			cache = piconet_cache_open(optarg);
+			if (cache == NULL)
+				return 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -99,6 +109,14 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if (cache && have_lap && !have_uap) {
+		e = piconet_cache_find(cache, lap);
+		if (e && (e->flags & CACHE_UAP)) {
+			uap = e->uap;
+			have_uap = 1;
+		}
+	}
+
 	if (have_lap && have_uap) {
 		pn = btbb_piconet_new();
 		btbb_init_piconet(pn, lap);
@@ -127,6 +145,11 @@ int main(int argc, char* argv[])
 	/* Clean up on exit. */
 	register_cleanup_handler(ut);
 
+	/* a recent map skips the initial detection */
+	ut->h_cache = cache;
+	if (ubertooth_cache_seed(ut, pn, 0) & CACHE_AFH)
+		timeout = 0;
+
 	if (use_r_format)
 		rx_afh_r(ut, pn, timeout);
 	else
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.hpp"
+#include <getopt.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Replays a dump through stream_rx_file() with an rx_callback doing
+ * what cb_rx does to find access codes, and through the C++ pipeline
+ * of ubertooth.hpp, and reports the best time of each. */
+
+typedef struct {
+	uint32_t lap;
+	int max_ac_errors;
+	unsigned long hits;
+	uint32_t clkn_sum;
+} bench_t;
+
+static void usage(void)
+{
+	printf("ubertooth-bench - time the receive paths of libubertooth on a dump\n");
+	printf("Usage: ubertooth-bench [options] <dump>\n");
+	printf("\t-h this help\n");
+	printf("\t-l <LAP> search for this LAP only (default: any)\n");
+	printf("\t-e <n> access code errors allowed (default: 1)\n");
+	printf("\t-n <n> runs of each path, the best is reported (default: 5)\n");
+	printf("\nThe dump is read from the page cache after the first run.  Both paths\n");
+	printf("report the access codes found and a sum of their CLKNs, which agree\n");
+	printf("for full dumps.  Hits-only dumps are decoded at their hit markers by\n");
+	printf("stream_rx_file() but in every window of a segment by the pipeline.\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t hit_clkn(const usb_pkt_rx* rx, int offset)
+{
+	return (rx->clkn_high << 20) +
+	       (le32toh(rx->clk100ns) + offset * 10 - 4000) / 3125;
+}
+
+/* The search of cb_rx, without the piconet and output handling */
+static void cb_bench(ubertooth_t* ut, void* args)
+{
+	bench_t* b = (bench_t*)args;
+	btbb_packet* pkt = NULL;
+	char syms[NUM_BANKS * BANK_LEN];
+	int offset, i;
+
+	usb_pkt_rx* rx = ringbuffer_bottom_usb(ut->packets);
+	if ((rx->status & DISCARD) || rx->channel > NUM_BREDR_CHANNELS - 1)
+		return;
+
+	for (i = 0; i < NUM_BANKS; i++)
+		memcpy(syms + i * BANK_LEN,
+		       ringbuffer_get_bt(ut->packets, i),
+		       BANK_LEN);
+
+	offset = btbb_find_ac(syms, BANK_LEN, b->lap, b->max_ac_errors, &pkt);
+	if (offset >= 0) {
+		uint32_t clkn = hit_clkn(rx, offset);
+		btbb_packet_set_modulation(pkt, BTBB_MOD_GFSK);
+		btbb_packet_set_transport(pkt, BTBB_TRANSPORT_ANY);
+		btbb_packet_set_data(pkt, syms + offset, NUM_BANKS * BANK_LEN - offset,
+		                     rx->channel, clkn);
+		b->hits++;
+		b->clkn_sum += clkn;
+	}
+	if (pkt)
+		btbb_packet_unref(pkt);
+}
+
+static int run_callback(FILE* fp, bench_t* b)
+{
+	ubertooth_t* ut = ubertooth_init();
+
+	if (ut == NULL)
+		return -1;
+	stream_rx_file(ut, fp, cb_bench, b);
+	ubertooth_free(ut);
+	return 0;
+}
+
+static int run_pipeline(FILE* fp, bench_t* b)
+{
+	auto p = ubertooth::pipeline(
+		ubertooth::correlate(b->lap, b->max_ac_errors),
+		ubertooth::decode(),
+		[b](const ubertooth::hit& h) {
+			b->hits++;
+			b->clkn_sum += h.clkn;
+		});
+
+	try {
+		ubertooth::file_source(fp).run(p);
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+	return 0;
+}
+
+static int bench(const char* name, FILE* fp, int runs, bench_t* b,
+                 int (*run)(FILE*, bench_t*))
+{
+	double start, t, best = 0;
+	int i;
+
+	for (i = 0; i < runs; i++) {
+		rewind(fp);
+		b->hits = 0;
+		b->clkn_sum = 0;
+		start = now();
+		if (run(fp, b) < 0)
+			return -1;
+		t = now() - start;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	printf("%-36s %8.3f s  %lu hits, CLKN sum %08x\n", name, best,
+	       b->hits, b->clkn_sum);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	int runs = 5;
+	bench_t b;
+	FILE* fp;
+
+	b.lap = LAP_ANY;
+	b.max_ac_errors = 1;
+
+	while ((opt=getopt(argc,argv,"hl:e:n:")) != EOF) {
+		switch(opt) {
+		case 'l':
+			b.lap = strtoul(optarg, NULL, 16);
+			break;
+		case 'e':
+			b.max_ac_errors = atoi(optarg);
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || runs < 1) {
+		usage();
+		return 1;
+	}
+
+	fp = fopen(argv[optind], "rb");
+	if (fp == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	btbb_init(b.max_ac_errors);
+	if (bench("stream_rx_file + rx_callback", fp, runs, &b, run_callback) < 0 ||
+	    bench("file_source + correlate/decode", fp, runs, &b, run_pipeline) < 0) {
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	return 0;
+}
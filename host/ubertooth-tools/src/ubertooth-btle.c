@@ -24,6 +24,7 @@
 #include <ctype.h>
 #include <err.h>
 #include <getopt.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -35,6 +36,81 @@ extern pcap_dumper_t *dumper;
 #endif // ENABLE_PCAP
 
 
+/* Wireshark extcap interface, see the extcap documentation of Wireshark */
+enum {
+	OPT_EXTCAP_INTERFACES = 256,
+	OPT_EXTCAP_INTERFACE,
+	OPT_EXTCAP_DLTS,
+	OPT_EXTCAP_CONFIG,
+	OPT_EXTCAP_VERSION,
+	OPT_EXTCAP_FILTER,
+	OPT_CAPTURE,
+	OPT_FIFO,
+	OPT_CHANNEL,
+	OPT_FLUSH,
+};
+
+static const struct option long_options[] = {
+	{ "extcap-interfaces",     no_argument,       NULL, OPT_EXTCAP_INTERFACES },
+	{ "extcap-interface",      required_argument, NULL, OPT_EXTCAP_INTERFACE },
+	{ "extcap-dlts",           no_argument,       NULL, OPT_EXTCAP_DLTS },
+	{ "extcap-config",         no_argument,       NULL, OPT_EXTCAP_CONFIG },
+	{ "extcap-version",        optional_argument, NULL, OPT_EXTCAP_VERSION },
+	{ "extcap-capture-filter", required_argument, NULL, OPT_EXTCAP_FILTER },
+	{ "capture",               no_argument,       NULL, OPT_CAPTURE },
+	{ "fifo",                  required_argument, NULL, OPT_FIFO },
+	{ "channel",               required_argument, NULL, OPT_CHANNEL },
+	{ "flush-interval",        required_argument, NULL, OPT_FLUSH },
+	{ NULL, 0, NULL, 0 }
+};
+
+#define EXTCAP_PREFIX "ubertooth"
+
+static const char* board_name(int board_id)
+{
+	switch (board_id) {
+	case BOARD_ID_UBERTOOTH_ZERO:
+		return "Ubertooth Zero";
+	case BOARD_ID_TC13BADGE:
+		return "ToorCon 13 Badge";
+	default:
+		return "Ubertooth One";
+	}
+}
+
+static int extcap_interfaces(void)
+{
+	ubertooth_device_info devices[UBERTOOTH_MAX_DEVICES];
+	int i, n;
+
+	printf("extcap {version=%s}{help=https://github.com/greatscottgadgets/ubertooth/wiki}\n",
+	       VERSION);
+	n = ubertooth_list_devices(devices, UBERTOOTH_MAX_DEVICES);
+	for (i = 0; i < n; i++)
+		printf("interface {value=" EXTCAP_PREFIX "%d}{display=%s %s}\n",
+		       devices[i].index, board_name(devices[i].board_id),
+		       devices[i].serial[0] ? devices[i].serial : "(busy)");
+	return n < 0;
+}
+
+static void extcap_dlts(void)
+{
+	printf("dlt {number=%d}{name=BLUETOOTH_LE_LL_WITH_PHDR}{display=Bluetooth Low Energy}\n",
+	       DLT_BLUETOOTH_LE_LL_WITH_PHDR);
+}
+
+static void extcap_config(void)
+{
+	printf("arg {number=0}{call=--channel}{display=Advertising channel}"
+	       "{type=selector}{tooltip=Channel to wait for connections on}\n");
+	printf("value {arg=0}{value=37}{display=37}{default=true}\n");
+	printf("value {arg=0}{value=38}{display=38}{default=false}\n");
+	printf("value {arg=0}{value=39}{display=39}{default=false}\n");
+	printf("arg {number=1}{call=--flush-interval}{display=Flush interval (ms)}"
+	       "{type=integer}{range=0,1000}{default=0}"
+	       "{tooltip=Longest time a packet waits before Wireshark sees it, 0 for every packet}\n");
+}
+
 int convert_mac_address(char *s, uint8_t *o) {
 	int i;
 
@@ -76,6 +152,7 @@ static void usage(void)
 	printf("    Major modes:\n");
 	printf("\t-f follow connections\n");
 	printf("\t-p promiscuous: sniff active connections\n");
+	printf("\t-P poll for packets, for firmware that does not stream them\n");
 	printf("\t-a[address] get/set access address (example: -a8e89bed6)\n");
 	printf("\t-s<address> faux slave mode, using MAC addr (example: -s22:44:66:88:aa:cc)\n");
 	printf("\t-t<address> set connection following target (example: -t22:44:66:88:aa:cc)\n");
@@ -89,6 +166,12 @@ static void usage(void)
 	printf("\n");
 	printf("    Misc:\n");
 	printf("\t-r<filename> capture packets to PCAPNG file\n");
+	printf("\t-o <format>[:<filename>] output format: text, binary or json [Default: text]\n");
+	printf("\t-F<expression> capture filter, e.g. -F\"aa == 8e89bed6 and not keepalive\"\n");
+	printf("\t-M[<host>:]<port>|unix:<path> serve Prometheus metrics over HTTP\n");
+	printf("\t-W<pre>[:<post>] only write -r packets around triggers, seconds (default %d:%d)\n",
+	       TRIGGER_DEFAULT_PRE, TRIGGER_DEFAULT_POST);
+	printf("\t-T<trigger> connect, aa=<AA> or rssi=<dBm>, may be repeated (implies -W)\n");
 #ifdef ENABLE_PCAP
 	printf("\t-q<filename> capture packets to PCAP file (DLT_BLUETOOTH_LE_LL_WITH_PHDR)\n");
 	printf("\t-c<filename> capture packets to PCAP file (DLT_PPI)\n");
@@ -96,6 +179,10 @@ static void usage(void)
 	printf("\t-A<index> advertising channel index (default 37)\n");
 	printf("\t-v[01] verify CRC mode, get status or enable/disable\n");
 	printf("\t-x<n> allow n access address offenses (default 32)\n");
+	printf("\n    Wireshark extcap (link or copy ubertooth-btle to the extcap folder):\n");
+	printf("\t--extcap-interfaces, --extcap-dlts, --extcap-config\n");
+	printf("\t--capture --extcap-interface " EXTCAP_PREFIX "<n> --fifo <path>\n");
+	printf("\t--channel <37-39> --flush-interval <ms> --extcap-capture-filter <-F expression>\n");
 
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 	printf("In get/set mode no capture occurs.\n");
@@ -112,6 +199,10 @@ int main(int argc, char *argv[])
 	int do_target;
 	enum jam_modes jam_mode = JAM_NONE;
 	char ubertooth_device = -1;
+	int extcap = 0;
+	int polling = 0;
+	const char* fifo = NULL;
+	uint32_t flush_ms = 0;
 	ubertooth_t* ut = ubertooth_init();
 
 	btle_options cb_opts = { .allowed_access_address_errors = 32 };
@@ -126,8 +217,50 @@ int main(int argc, char *argv[])
 	do_adv_index = 37;
 	do_slave_mode = do_target = 0;
 
-	while ((opt=getopt(argc,argv,"a::r:hfpU:v::A:s:t:x:c:q:jJiI")) != EOF) {
+	while ((opt=getopt_long(argc,argv,"a::r:hfpPU:v::A:s:t:x:c:q:jJiIo:W:T:F:M:",
+	                        long_options, NULL)) != EOF) {
 		switch(opt) {
+		case OPT_EXTCAP_INTERFACES:
+			return extcap_interfaces();
+		case OPT_EXTCAP_DLTS:
+			extcap = OPT_EXTCAP_DLTS;
+			break;
+		case OPT_EXTCAP_CONFIG:
+			extcap = OPT_EXTCAP_CONFIG;
+			break;
+		case OPT_EXTCAP_VERSION:
+			break;
+		case OPT_EXTCAP_INTERFACE:
+			if (strncmp(optarg, EXTCAP_PREFIX, strlen(EXTCAP_PREFIX)) != 0) {
+				fprintf(stderr, "Unknown interface %s\n", optarg);
+				return 1;
+			}
+			ubertooth_device = atoi(optarg + strlen(EXTCAP_PREFIX));
+			break;
+		case OPT_EXTCAP_FILTER:
+			if (optarg[0] == '\0')
+				break;
+			ut->h_filter = filter_compile(optarg);
+			if (ut->h_filter == NULL)
+				return 1;
+			break;
+		case OPT_CAPTURE:
+			extcap = OPT_CAPTURE;
+			do_follow = 1;
+			break;
+		case OPT_FIFO:
+			fifo = optarg;
+			break;
+		case OPT_CHANNEL:
+			do_adv_index = atoi(optarg);
+			if (do_adv_index < 37 || do_adv_index > 39) {
+				fprintf(stderr, "Error: advertising index must be 37, 38, or 39\n");
+				return 1;
+			}
+			break;
+		case OPT_FLUSH:
+			flush_ms = strtoul(optarg, NULL, 10);
+			break;
 		case 'a':
 			if (optarg == NULL) {
 				do_get_aa = 1;
@@ -142,6 +275,9 @@ int main(int argc, char *argv[])
 		case 'p':
 			do_promisc = 1;
 			break;
+		case 'P':
+			polling = 1;
+			break;
 		case 'U':
 			ubertooth_device = atoi(optarg);
 			break;
@@ -223,6 +359,31 @@ int main(int argc, char *argv[])
 		case 'J':
 			jam_mode = JAM_CONTINUOUS;
 			break;
+		case 'o':
+			if (output_create(optarg, &ut->h_output) < 0)
+				return 1;
+			break;
+		case 'F':
+			ut->h_filter = filter_compile(optarg);
+			if (ut->h_filter == NULL)
+				return 1;
+			break;
+		case 'M':
+			if (metrics_create(optarg, &ut->h_metrics) < 0)
+				return 1;
+			break;
+		case 'W':
+			if (!ut->h_trigger && (ut->h_trigger = trigger_create()) == NULL)
+				return 1;
+			if (trigger_set_window(ut->h_trigger, optarg) < 0)
+				return 1;
+			break;
+		case 'T':
+			if (!ut->h_trigger && (ut->h_trigger = trigger_create()) == NULL)
+				return 1;
+			if (trigger_add_condition(ut->h_trigger, optarg) < 0)
+				return 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -230,6 +391,36 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (extcap == OPT_EXTCAP_DLTS) {
+		extcap_dlts();
+		return 0;
+	}
+	if (extcap == OPT_EXTCAP_CONFIG) {
+		extcap_config();
+		return 0;
+	}
+	if (extcap == OPT_CAPTURE) {
+		if (fifo == NULL) {
+			fprintf(stderr, "--capture needs --fifo\n");
+			return 1;
+		}
+		ut->h_stream_le = pcapng_stream_open(fifo, DLT_BLUETOOTH_LE_LL_WITH_PHDR,
+		                                     "Ubertooth", flush_ms);
+		if (ut->h_stream_le == NULL)
+			return 1;
+		/* Wireshark closing the fifo ends the capture, and nobody
+		 * reads the text output */
+		signal(SIGPIPE, SIG_IGN);
+		if (freopen("/dev/null", "w", stdout) == NULL)
+			return 1;
+	}
+
+	if (ut->h_trigger) {
+		if (trigger_start(ut->h_trigger, NULL, NULL, ut->h_pcapng_le) < 0)
+			return 1;
+		/* the trigger writes the capture from now on */
+		ut->h_pcapng_le = NULL;
+	}
 
 	r = ubertooth_connect(ut, ubertooth_device);
 	if (r < 0) {
@@ -246,8 +437,6 @@ int main(int argc, char *argv[])
 	}
 
 	if (do_follow || do_promisc) {
-		usb_pkt_rx rx;
-
 		r = cmd_set_jam_mode(ut->devh, jam_mode);
 		if (jam_mode != JAM_NONE && r != 0) {
 			printf("Jamming not supported\n");
@@ -269,18 +458,7 @@ int main(int argc, char *argv[])
 			cmd_btle_promisc(ut->devh);
 		}
 
-		while (1) {
-			int r = cmd_poll(ut->devh, &rx);
-			if (r < 0) {
-				printf("USB error\n");
-				break;
-			}
-			if (r == sizeof(usb_pkt_rx)) {
-				ringbuffer_add(ut->packets, &rx);
-				cb_btle(ut, &cb_opts);
-			}
-			usleep(500);
-		}
+		stream_rx_queued(ut, cb_btle, &cb_opts, polling);
 		ubertooth_stop(ut);
 	}
 
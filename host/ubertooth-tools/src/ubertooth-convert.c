@@ -0,0 +1,299 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_capture.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(void)
+{
+	printf("ubertooth-convert - convert between raw dump and capture container formats\n");
+	printf("Usage:\n");
+	printf("\t-h this help\n");
+	printf("\t-i <filename> input, raw dump (ubertooth-dump -f) or capture file [Default: stdin]\n");
+	printf("\t-o <filename> output [Default: stdout]\n");
+	printf("\t-l write raw dump format instead of a capture file\n");
+	printf("\t-s <seconds> only records at or after this UNIX time\n");
+	printf("\t-e <seconds> only records up to this UNIX time\n");
+	printf("\t-c <channel> only records received on this channel\n");
+	printf("\t-n <records> records per capture chunk (default: %d)\n",
+	       CAPTURE_CHUNK_RECORDS);
+	printf("\t-z compress the capture file\n");
+	printf("\t-q <rssi> drop the symbols of banks below this RSSI or flagged DISCARD\n");
+	printf("\nTime ranges and channels are looked up in the capture index, so extracting\n");
+	printf("from a capture file does not read the whole file.\n");
+}
+
+static uint64_t parse_time(const char* s)
+{
+	return (uint64_t)(strtod(s, NULL) * 1000000000.0);
+}
+
+typedef struct {
+	FILE* fp;
+	capture_t* cap;
+	clock_sync clock;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	int channel;
+	int pending;
+	uint32_t systime_be;
+	int splice;         /* a window marker was read */
+	int segment;        /* the next record passed on starts a segment */
+
+	/* Records of hits-only dumps are held back until the hit marker
+	 * after them tells whether they follow on from the last window. */
+	int hits_only;
+	int windows;
+	uint64_t window_end;
+	capture_record held[NUM_BANKS];
+	int num_held;
+	int num_released;
+	int next_held;
+} input_t;
+
+/* Read the next record or marker of a raw dump.  Returns 1 for a
+ * record, 2 for a marker and 0 at the end of the file. */
+static int read_raw(input_t* in, capture_record* rec, dump_marker* m)
+{
+	uint8_t buf[4 + PKT_LEN];
+
+	if (!in->pending &&
+	    fread(&in->systime_be, sizeof(in->systime_be), 1, in->fp) != 1)
+		return 0;
+	in->pending = 0;
+	if (fread(&rec->rx, PKT_LEN, 1, in->fp) != 1)
+		return 0;
+
+	memcpy(buf, &in->systime_be, 4);
+	memcpy(buf + 4, &rec->rx, PKT_LEN);
+	if (dump_read_marker(buf, m) >= 0)
+		return 2;
+
+	rec->systime = be32toh(in->systime_be);
+	rec->segment = 0;
+	return 1;
+}
+
+/* A hit marker gives the stream number of its window's first record.
+ * Each window is written from there on, or from the end of the last
+ * window if they overlap, so a gap shows as a first record past that
+ * end. */
+static void release_window(input_t* in, const dump_marker* m)
+{
+	uint64_t first = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		first = (first << 8) | m->seq[i];
+
+	if (in->num_held && in->windows && first > in->window_end)
+		in->held[0].segment = 1;
+	in->window_end = MAX(first, in->window_end) + in->num_held;
+	in->windows++;
+	in->num_released = in->num_held;
+}
+
+/* Read the next record from either input format.  Raw dumps are
+ * filtered here, capture files are filtered by the library.  Markers
+ * become segment starts, as the container has none: replaying it
+ * decodes every window of a segment. */
+static int read_record(input_t* in, capture_record* rec)
+{
+	dump_marker m;
+	int r;
+
+	if (in->cap)
+		return capture_read(in->cap, rec);
+
+	while (1) {
+		if (in->next_held < in->num_released) {
+			*rec = in->held[in->next_held++];
+		} else {
+			if (in->next_held)
+				in->num_held = in->num_released = in->next_held = 0;
+			r = read_raw(in, rec, &m);
+			if (r == 0) {
+				/* a truncated dump may end without a hit marker */
+				if (in->num_held == 0)
+					return 0;
+				in->num_released = in->num_held;
+				continue;
+			}
+			if (r == 2) {
+				if (m.kind == DUMP_MARKER_HEADER)
+					in->hits_only = 1;
+				else if (m.kind == DUMP_MARKER_WINDOW)
+					in->splice = 1;
+				else if (m.kind == DUMP_MARKER_HIT && in->hits_only)
+					release_window(in, &m);
+				continue;
+			}
+			if (in->hits_only) {
+				if (in->num_held == NUM_BANKS) {
+					fprintf(stderr, "Hits-only dump without hit markers\n");
+					return -1;
+				}
+				in->held[in->num_held++] = *rec;
+				continue;
+			}
+		}
+
+		/* a segment start that is filtered out moves on to the next
+		 * record passed on */
+		if (rec->segment || in->splice) {
+			clock_sync_init(&in->clock);
+			in->segment = 1;
+			in->splice = 0;
+		}
+		rec->ts_ns = clock_sync_replay(&in->clock, rec->systime, &rec->rx);
+
+		if (rec->ts_ns > in->end_ns)
+			return 0;
+		if (rec->ts_ns >= in->start_ns &&
+		    (in->channel < 0 || rec->rx.channel == in->channel)) {
+			rec->segment = in->segment;
+			in->segment = 0;
+			return 1;
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, r;
+	int legacy = 0;
+	int squelch = INT8_MIN;
+	uint32_t flags = 0;
+	uint32_t chunk_records = CAPTURE_CHUNK_RECORDS;
+	uint32_t systime_be;
+	unsigned long count = 0;
+	FILE* outfile = stdout;
+	capture_t* out = NULL;
+	capture_record rec;
+	input_t in;
+
+	memset(&in, 0, sizeof(in));
+	clock_sync_init(&in.clock);
+	in.fp = stdin;
+	in.end_ns = UINT64_MAX;
+	in.channel = -1;
+
+	while ((opt=getopt(argc,argv,"hi:o:ls:e:c:n:zq:")) != EOF) {
+		switch(opt) {
+		case 'i':
+			in.fp = fopen(optarg, "rb");
+			if (in.fp == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			outfile = fopen(optarg, "wb");
+			if (outfile == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			legacy = 1;
+			break;
+		case 's':
+			in.start_ns = parse_time(optarg);
+			break;
+		case 'e':
+			in.end_ns = parse_time(optarg);
+			break;
+		case 'c':
+			in.channel = atoi(optarg);
+			break;
+		case 'n':
+			chunk_records = atoi(optarg);
+			break;
+		case 'z':
+			flags |= CAPTURE_COMPRESS;
+			break;
+		case 'q':
+			squelch = MAX(MIN(atoi(optarg), INT8_MAX), INT8_MIN);
+			flags |= CAPTURE_DROP_NOISE;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (fread(&in.systime_be, sizeof(in.systime_be), 1, in.fp) != 1) {
+		fprintf(stderr, "Empty input\n");
+		return 1;
+	}
+	if (capture_is_magic((uint8_t*)&in.systime_be)) {
+		in.cap = capture_open(in.fp, 1);
+		if (in.cap == NULL)
+			return 1;
+		capture_set_range(in.cap, in.start_ns, in.end_ns);
+		capture_set_channel(in.cap, in.channel);
+	} else {
+		in.pending = 1;
+	}
+
+	if (!legacy) {
+		out = capture_create(outfile, chunk_records, flags);
+		if (out == NULL)
+			return 1;
+		capture_set_squelch(out, squelch);
+	}
+
+	while ((r = read_record(&in, &rec)) > 0) {
+		if (out) {
+			if ((rec.segment && capture_segment(out) < 0) ||
+			    capture_append(out, rec.systime, rec.ts_ns, &rec.rx) < 0)
+				return 1;
+		} else {
+			if (rec.segment && count &&
+			    dump_write_marker(outfile, DUMP_MARKER_WINDOW, rec.systime, count) < 0) {
+				perror("write");
+				return 1;
+			}
+			systime_be = htobe32(rec.systime);
+			if (fwrite(&systime_be, sizeof(systime_be), 1, outfile) != 1 ||
+			    fwrite(&rec.rx, PKT_LEN, 1, outfile) != 1) {
+				perror("write");
+				return 1;
+			}
+		}
+		count++;
+	}
+
+	if (in.cap)
+		capture_close(in.cap);
+	if (out && capture_close(out) < 0)
+		return 1;
+
+	fclose(in.fp);
+	fclose(outfile);
+
+	fprintf(stderr, "%lu records converted\n", count);
+	return r < 0 ? 1 : 0;
+}
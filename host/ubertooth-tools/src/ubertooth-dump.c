@@ -33,6 +33,10 @@ static void usage(void)
 	printf("\t-l LE modulation\n");
 	printf("\t-U<0-7> set ubertooth device to use\n");
 	printf("\t-d filename\n");
+	printf("\t-z write a compressed capture file instead of raw USB packets\n");
+	printf("\t-q <rssi> with -z, drop the symbols of banks below this RSSI or flagged DISCARD\n");
+	printf("\t-F <expression> capture filter, e.g. \"channel >= 20 and rssi > -70\" (no lap, aa or err)\n");
+	printf("\t-R [<cpu>][:<priority>] real-time: lock memory, pin to cpu, SCHED_FIFO priority\n");
 	printf("\nThis program sends binary data to stdout.  You probably don't want to\n");
 	printf("run it from a terminal without redirecting the output.\n");
 }
@@ -43,18 +47,26 @@ static void usage(void)
  *
  * The -b output format is a stream of bytes, each either 0x00 or 0x01
  * representing the symbol determined by the demodulator (GnuRadio style)
+ *
+ * The -z output format is the capture container (see ubertooth_capture.h)
+ * with compressed chunks.  It can be replayed with ubertooth-rx -i and
+ * converted back to the normal format with ubertooth-convert -l.
  */
 
 int main(int argc, char *argv[])
 {
 	int opt;
 	int bitstream = 0;
+	int squelch = INT8_MIN;
+	uint32_t capture_flags = 0;
 	int modulation = MOD_BT_BASIC_RATE;
 	char ubertooth_device = -1;
 
 	ubertooth_t* ut = NULL;
+	filter_t* filter = NULL;
+	rt_profile_t* rt = NULL;
 
-	while ((opt=getopt(argc,argv,"bhclU:d:")) != EOF) {
+	while ((opt=getopt(argc,argv,"bhclU:d:zq:F:R:")) != EOF) {
 		switch(opt) {
 		case 'b':
 			bitstream = 1;
@@ -75,6 +87,30 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 			break;
+		case 'z':
+			capture_flags |= CAPTURE_COMPRESS;
+			break;
+		case 'q':
+			squelch = MAX(MIN(atoi(optarg), INT8_MAX), INT8_MIN);
+			capture_flags |= CAPTURE_DROP_NOISE;
+			break;
+		case 'F':
+			filter = filter_compile(optarg);
+			if (filter == NULL)
+				return 1;
+			/* nothing is decoded, so lap, aa and err would never
+			 * be known and every record would pass */
+			if (filter->needs_decode) {
+				fprintf(stderr, "ubertooth-dump does not decode packets, "
+				        "the filter cannot use lap, aa or err\n");
+				filter_free(filter);
+				return 1;
+			}
+			break;
+		case 'R':
+			if (rt_profile_create(optarg, &rt) < 0)
+				return 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -82,12 +118,29 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (capture_flags && (bitstream || !(capture_flags & CAPTURE_COMPRESS))) {
+		fprintf(stderr, "-q requires -z, which cannot be combined with -b\n");
+		return 1;
+	}
+
 	ut = ubertooth_start(ubertooth_device);
 
 	if (ut == NULL) {
 		usage();
 		return 1;
 	}
+	ut->h_filter = filter;
+	ut->h_rt = rt;
+
+	if (capture_flags) {
+		ut->h_capture = capture_create(dumpfile ? dumpfile : stdout, 0,
+		                               capture_flags);
+		if (ut->h_capture == NULL) {
+			ubertooth_stop(ut);
+			return 1;
+		}
+		capture_set_squelch(ut->h_capture, squelch);
+	}
 
 	/* Clean up on exit. */
 	register_cleanup_handler(ut);
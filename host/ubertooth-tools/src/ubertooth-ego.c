@@ -43,6 +43,9 @@ static void usage(void)
 	printf("\n");
 	printf("    Options:\n");
 	printf("\t-c <2402-2480> set channel in MHz (for continuous rx)\n");
+	printf("\t-P poll for packets, for firmware that does not stream them\n");
+	printf("\t-o <format>[:<filename>] output format: text, binary or json [Default: text]\n");
+	printf("\t-F <expression> capture filter, e.g. \"channel >= 20 and rssi > -70\"\n");
 }
 
 int main(int argc, char *argv[])
@@ -50,10 +53,13 @@ int main(int argc, char *argv[])
 	int opt;
 	int do_mode = -1;
 	int do_channel = 2418;
+	int polling = 0;
 	char ubertooth_device = -1;
+	output_t* output = NULL;
+	filter_t* filter = NULL;
 	int r;
 
-	while ((opt=getopt(argc,argv,"frijc:U:h")) != EOF) {
+	while ((opt=getopt(argc,argv,"frijc:PU:o:F:h")) != EOF) {
 		switch(opt) {
 		case 'f':
 			do_mode = 0;
@@ -68,9 +74,21 @@ int main(int argc, char *argv[])
 		case 'c':
 			do_channel = atoi(optarg);
 			break;
+		case 'P':
+			polling = 1;
+			break;
+		case 'F':
+			filter = filter_compile(optarg);
+			if (filter == NULL)
+				return 1;
+			break;
 		case 'U':
 			ubertooth_device = atoi(optarg);
 			break;
+		case 'o':
+			if (output_create(optarg, &output) < 0)
+				return 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -84,12 +102,13 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	ut->h_output = output;
+	ut->h_filter = filter;
+
 	/* Clean up on exit. */
 	register_cleanup_handler(ut);
 
 	if (do_mode >= 0) {
-		usb_pkt_rx rx;
-
 		if (do_mode == 1) // FIXME magic number!
 			cmd_set_channel(ut->devh, do_channel);
 
@@ -102,18 +121,7 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 
-		while (1) {
-			int r = cmd_poll(ut->devh, &rx);
-			if (r < 0) {
-				printf("USB error\n");
-				break;
-			}
-			if (r == sizeof(usb_pkt_rx)) {
-				ringbuffer_add(ut->packets, &rx);
-				cb_ego(ut, NULL);
-			}
-			usleep(500);
-		}
+		stream_rx_queued(ut, cb_ego, NULL, polling);
 		ubertooth_stop(ut);
 	}
 
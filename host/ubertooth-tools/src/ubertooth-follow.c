@@ -45,10 +45,14 @@ static void usage()
 	printf("\t-q<filename> capture packets to PCAP file\n");
 #endif
 	printf("\t-e max_ac_errors\n");
+	printf("\t-E <min>:<max> adapt max_ac_errors per channel within this range\n");
 	printf("\t-d filename\n");
+	printf("\t-o <format>[:<filename>] output format: text, binary or json [Default: text]\n");
+	printf("\t-F <expression> capture filter, e.g. \"channel >= 20 and rssi > -70\"\n");
 	printf("\t-a Enable AFH\n");
 	printf("\t-b Bluetooth device (hci0)\n");
 	printf("\t-w USB delay in 625us timeslots (default:5)\n");
+	printf("\t-C <filename> piconet cache: take the UAP from it if not given, store what is learned\n");
 	printf("\nLAP and UAP are both required, if not given they are read from the local device, in some cases this may give the incorrect address.\n");
 //	printf("If an input file is not specified, an Ubertooth device is used for live capture.\n");
 }
@@ -73,7 +77,7 @@ int main(int argc, char *argv[])
 	pn = btbb_piconet_new();
 	ubertooth_t* ut = ubertooth_init();
 
-	while ((opt=getopt(argc,argv,"hl:u:U:e:d:ab:w:r:q:")) != EOF) {
+	while ((opt=getopt(argc,argv,"hl:u:U:e:E:d:ab:w:r:q:o:F:C:")) != EOF) {
 		switch(opt) {
 		case 'l':
 			lap = strtol(optarg, &end, 16);
@@ -115,6 +119,10 @@ int main(int argc, char *argv[])
 		case 'e':
 			max_ac_errors = atoi(optarg);
 			break;
+		case 'E':
+			if (ac_adapt_create(optarg, &ut->h_ac) < 0)
+				return 1;
+			break;
 		case 'd':
 			dumpfile = fopen(optarg, "w");
 			if (dumpfile == NULL) {
@@ -135,6 +143,20 @@ int main(int argc, char *argv[])
 		case 'w': //wait
 			delay = atoi(optarg);
 			break;
+		case 'C':
+			ut->h_cache = piconet_cache_open(optarg);
+			if (ut->h_cache == NULL)
+				return 1;
+			break;
+		case 'o':
+			if (output_create(optarg, &ut->h_output) < 0)
+				return 1;
+			break;
+		case 'F':
+			ut->h_filter = filter_compile(optarg);
+			if (ut->h_filter == NULL)
+				return 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -142,6 +164,15 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (ut->h_cache && have_lap == 1 && !have_uap) {
+		piconet_entry* e = piconet_cache_find(ut->h_cache, lap);
+		if (e && (e->flags & CACHE_UAP)) {
+			uap = e->uap;
+			have_uap = 1;
+			printf("UAP=%02x from cache\n", uap);
+		}
+	}
+
 	dev_id = hci_devid(bt_dev);
 	sock = hci_open_dev(dev_id);
 	hci_read_clock(sock, 0, 0, &clock, &accuracy, 0);
@@ -217,6 +248,10 @@ int main(int argc, char *argv[])
 		hci_disconnect(sock, handle, HCI_OE_USER_ENDED_CONNECTION, 10000);
 	}
 
+	/* the correlator must allow the most errors any channel may use */
+	if (ut->h_ac)
+		max_ac_errors = ut->h_ac->max_errors;
+
 	/* Clean up on exit. */
 	register_cleanup_handler(ut);
 
@@ -231,6 +266,7 @@ int main(int argc, char *argv[])
 	btbb_piconet_set_clk_offset(pn, clock+delay);
 	btbb_piconet_set_flag(pn, BTBB_FOLLOWING, 1);
 	btbb_piconet_set_flag(pn, BTBB_CLK27_VALID, 1);
+	ut->cache_pn = pn;
 	rx_live(ut, pn, 0);
 	ubertooth_stop(ut);
 
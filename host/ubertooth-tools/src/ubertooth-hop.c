@@ -0,0 +1,509 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_hop.h"
+#include "ubertooth_pcapng.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TICK_NS      312500  /* one tick of CLK */
+#define ACQ_SLOTS    32      /* slots either side of the prediction to acquire an offset */
+#define ACQ_PACKETS  64      /* packets of each interface used to acquire it */
+#define ACQ_MIN      4       /* votes needed for an offset */
+#define TRACK_SLOTS  3       /* slots either side of the prediction once acquired */
+
+/* offsets into the libbtbb BR/EDR pseudo-header */
+#define BREDR_HDR_CHANNEL 0
+#define BREDR_HDR_LAP     8
+#define BREDR_HDR_LEN     22
+
+typedef struct {
+	int64_t offset;     /* ticks between the prediction and the slot */
+	int acquired;
+	uint32_t votes[2 * ACQ_SLOTS + 1];
+	uint32_t acq_packets;
+	uint64_t packets;
+	uint64_t matched;
+} iface_state;
+
+typedef struct {
+	const char* path;
+	FILE* fp;
+	pcapng_reader* r;
+	iface_state* ifaces;
+	uint32_t num_ifaces;
+	uint32_t first_out;  /* output interface of its first interface */
+} source_t;
+
+typedef struct {
+	int64_t clk;         /* unwrapped CLK of the slot */
+	uint32_t source;
+	uint32_t channel;
+	uint64_t offset;     /* of the packet's block */
+} slot_entry;
+
+static hop_ctx hop;
+static uint32_t lap;
+static int64_t ref_clk;
+static uint64_t ref_ns;
+
+static slot_entry* entries;
+static uint64_t num_entries;
+static uint64_t entries_size;
+
+static void usage(void)
+{
+	printf("ubertooth-hop - compute the hopping sequence of a piconet and reassemble\n");
+	printf("its packets from captures on several channels\n");
+	printf("Usage: ubertooth-hop [options] [<capture>...]\n");
+	printf("\t-h this help\n");
+	printf("\t-l <LAP> of the master (6 hex)\n");
+	printf("\t-u <UAP> of the master (2 hex)\n");
+	printf("\t-a <map> AFH channel map (20 hex digits, channels 0-7 first)\n");
+	printf("\t-C <filename> piconet cache: take UAP, AFH map and clock from it if not given\n");
+	printf("\t-c <CLK>@<seconds> master's clock (hex) at a UNIX time of the captures\n");
+	printf("\t-s <CLK> first slot of the sequence to print (hex, default: 0)\n");
+	printf("\t-n <slots> number of slots to print (default: 79)\n");
+	printf("\t-w <filename> write the piconet's packets in clock order here\n");
+	printf("\nWithout captures the hopping sequence is printed.  With captures, e.g.\n");
+	printf("merged with ubertooth-merge, each packet of the piconet is placed in the\n");
+	printf("slot near its timestamp whose channel it was received on; the offset of\n");
+	printf("each interface is acquired from its first %d packets and then tracked.\n",
+	       ACQ_PACKETS);
+	printf("Without -w the slots are listed.\n");
+}
+
+static uint32_t get_le32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int parse_afh_map(const char* s, uint8_t* afh_map)
+{
+	int i;
+
+	if (strncmp(s, "0x", 2) == 0)
+		s += 2;
+	if (strlen(s) != 20)
+		return -1;
+	for (i = 0; i < 10; i++)
+		if (sscanf(s + 2 * i, "%2hhx", &afh_map[i]) != 1)
+			return -1;
+	return 0;
+}
+
+static iface_state* get_iface(source_t* s, uint32_t iface)
+{
+	iface_state* ifaces;
+
+	if (iface >= s->num_ifaces) {
+		ifaces = (iface_state*)realloc(s->ifaces, (iface + 1) * sizeof(iface_state));
+		if (ifaces == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return NULL;
+		}
+		memset(ifaces + s->num_ifaces, 0,
+		       (iface + 1 - s->num_ifaces) * sizeof(iface_state));
+		s->ifaces = ifaces;
+		s->num_ifaces = iface + 1;
+	}
+	return &s->ifaces[iface];
+}
+
+/* Returns 1 if the current block is a packet of the piconet */
+static int piconet_packet(pcapng_reader* r, uint8_t* channel)
+{
+	if (r->block_type != PCAPNG_EPB ||
+	    r->ifaces[r->iface].linktype != DLT_BLUETOOTH_BREDR_BB ||
+	    r->caplen < BREDR_HDR_LEN ||
+	    (get_le32(r->packet + BREDR_HDR_LAP) & 0xffffff) != lap)
+		return 0;
+
+	*channel = r->packet[BREDR_HDR_CHANNEL];
+	return *channel < NUM_BREDR_CHANNELS;
+}
+
+/* start of the slot the timestamp falls into */
+static int64_t predict_slot(uint64_t ts_ns, int64_t offset)
+{
+	int64_t clk = ref_clk + ((int64_t)ts_ns - (int64_t)ref_ns) / TICK_NS + offset;
+
+	return clk - (clk & 1);
+}
+
+static void acquire(iface_state* st, uint64_t ts_ns, uint8_t channel)
+{
+	uint8_t seq[2 * ACQ_SLOTS + 1];
+	int64_t slot = predict_slot(ts_ns, 0);
+	int i;
+
+	hop_sequence(&hop, (uint32_t)((slot - 2 * ACQ_SLOTS) & 0x0fffffff),
+	             2 * ACQ_SLOTS + 1, seq);
+	for (i = 0; i < 2 * ACQ_SLOTS + 1; i++)
+		if (seq[i] == channel)
+			st->votes[i]++;
+	st->acq_packets++;
+}
+
+static void finish_acquire(source_t* s)
+{
+	iface_state* st;
+	uint32_t i;
+	int j, best;
+
+	for (i = 0; i < s->num_ifaces; i++) {
+		st = &s->ifaces[i];
+		if (st->acq_packets == 0)
+			continue;
+		best = 0;
+		for (j = 1; j < 2 * ACQ_SLOTS + 1; j++)
+			if (st->votes[j] > st->votes[best])
+				best = j;
+		if (st->votes[best] < ACQ_MIN || st->votes[best] * 2 < st->acq_packets) {
+			fprintf(stderr, "%s:%u: no slot offset fits the hopping sequence\n",
+			        s->path, i);
+			continue;
+		}
+		st->offset = 2 * (best - ACQ_SLOTS);
+		st->acquired = 1;
+		fprintf(stderr, "%s:%u: offset %+d slots (%u of %u packets)\n", s->path, i,
+		        best - ACQ_SLOTS, st->votes[best], st->acq_packets);
+	}
+}
+
+static int add_entry(int64_t clk, uint32_t source, uint8_t channel, uint64_t offset)
+{
+	slot_entry* e;
+
+	if (num_entries == entries_size) {
+		uint64_t size = entries_size ? 2 * entries_size : 4096;
+		e = (slot_entry*)realloc(entries, size * sizeof(slot_entry));
+		if (e == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		entries = e;
+		entries_size = size;
+	}
+	e = &entries[num_entries++];
+	e->clk = clk;
+	e->source = source;
+	e->channel = channel;
+	e->offset = offset;
+	return 0;
+}
+
+/* Place a packet in the slot nearest to its prediction that hops onto
+ * its channel, and follow the drift of the interface's clock. */
+static int track(iface_state* st, uint32_t source, pcapng_reader* r, uint8_t channel)
+{
+	uint8_t seq[2 * TRACK_SLOTS + 1];
+	int64_t slot = predict_slot(r->ts_ns, st->offset);
+	int i, d;
+
+	st->packets++;
+	hop_sequence(&hop, (uint32_t)((slot - 2 * TRACK_SLOTS) & 0x0fffffff),
+	             2 * TRACK_SLOTS + 1, seq);
+	for (d = 0; d <= TRACK_SLOTS; d++) {
+		for (i = TRACK_SLOTS - d; i <= TRACK_SLOTS + d; i += d ? 2 * d : 1) {
+			if (seq[i] != channel)
+				continue;
+			st->offset += 2 * (i - TRACK_SLOTS);
+			st->matched++;
+			return add_entry(slot + 2 * (i - TRACK_SLOTS), source, channel,
+			                 r->block_offset);
+		}
+	}
+	return 0;
+}
+
+/* Pass over a capture, acquiring the offsets of its interfaces or
+ * placing its packets once they are acquired. */
+static int scan_source(source_t* s, uint32_t source, int acquiring)
+{
+	iface_state* st;
+	uint8_t channel;
+	int r;
+
+	rewind(s->fp);
+	s->r->offset = 0;
+	while ((r = pcapng_next_block(s->r)) > 0) {
+		if (!piconet_packet(s->r, &channel))
+			continue;
+		st = get_iface(s, s->r->iface);
+		if (st == NULL)
+			return -1;
+		if (acquiring) {
+			if (st->acq_packets < ACQ_PACKETS)
+				acquire(st, s->r->ts_ns, channel);
+		} else if (st->acquired) {
+			if (track(st, source, s->r, channel) < 0)
+				return -1;
+		}
+	}
+	if (r < 0)
+		fprintf(stderr, "%s: corrupt block at offset %llu\n", s->path,
+		        (unsigned long long)s->r->block_offset);
+	return r;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+	const slot_entry* ea = (const slot_entry*)a;
+	const slot_entry* eb = (const slot_entry*)b;
+
+	if (ea->clk != eb->clk)
+		return ea->clk < eb->clk ? -1 : 1;
+	if (ea->source != eb->source)
+		return ea->source < eb->source ? -1 : 1;
+	return ea->offset < eb->offset ? -1 : (ea->offset > eb->offset);
+}
+
+static int write_entries(FILE* out, source_t* sources, int num_sources)
+{
+	pcapng_reader* r;
+	slot_entry* e;
+	source_t* s;
+	char desc[256];
+	uint32_t i, padded, options_len, out_ifaces = 0;
+	uint64_t n;
+	int64_t ts;
+	int j;
+
+	if (pcapng_write_shb(out) < 0)
+		return -1;
+	for (j = 0; j < num_sources; j++) {
+		s = &sources[j];
+		s->first_out = out_ifaces;
+		for (i = 0; i < s->r->num_ifaces; i++) {
+			snprintf(desc, sizeof(desc), "%s:%u", s->path, i);
+			if (pcapng_write_idb(out, s->r->ifaces[i].linktype, desc) < 0)
+				return -1;
+			out_ifaces++;
+		}
+	}
+
+	for (n = 0; n < num_entries; n++) {
+		e = &entries[n];
+		s = &sources[e->source];
+		r = s->r;
+		if (pcapng_seek_block(r, e->offset) <= 0 || r->block_type != PCAPNG_EPB) {
+			fprintf(stderr, "%s: unable to read block at offset %llu\n", s->path,
+			        (unsigned long long)e->offset);
+			return -1;
+		}
+
+		/* timestamps follow the master's clock */
+		ts = (int64_t)ref_ns + (e->clk - ref_clk) * TICK_NS;
+		padded = (r->caplen + 3) & ~3;
+		options_len = r->swapped ? 0 : r->block_len - 32 - padded;
+		if (pcapng_write_epb(out, s->first_out + r->iface, ts < 0 ? 0 : (uint64_t)ts,
+		                     r->packet, r->caplen, pcapng_u32(r, r->block + 24),
+		                     r->block + 28 + padded, options_len) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int reconstruct(source_t* sources, int num_sources, FILE* out)
+{
+	uint64_t n;
+	uint32_t i;
+	int j;
+
+	for (j = 0; j < num_sources; j++) {
+		if (scan_source(&sources[j], j, 1) < 0)
+			return -1;
+		finish_acquire(&sources[j]);
+		if (scan_source(&sources[j], j, 0) < 0)
+			return -1;
+	}
+
+	qsort(entries, num_entries, sizeof(slot_entry), compare_entries);
+
+	if (out) {
+		if (write_entries(out, sources, num_sources) < 0)
+			return -1;
+	} else {
+		for (n = 0; n < num_entries; n++)
+			printf("%07x %2u %s\n", (uint32_t)(entries[n].clk & 0x0fffffff),
+			       entries[n].channel, sources[entries[n].source].path);
+	}
+
+	for (j = 0; j < num_sources; j++)
+		for (i = 0; i < sources[j].num_ifaces; i++)
+			if (sources[j].ifaces[i].packets)
+				fprintf(stderr, "%s:%u: %llu of %llu packets placed\n",
+				        sources[j].path, i,
+				        (unsigned long long)sources[j].ifaces[i].matched,
+				        (unsigned long long)sources[j].ifaces[i].packets);
+	fprintf(stderr, "%llu packets of the piconet\n", (unsigned long long)num_entries);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, i, num_sources;
+	int have_lap = 0, have_uap = 0, have_afh = 0, have_ref = 0;
+	uint8_t uap = 0, afh_map[10], seq[256];
+	uint32_t start = 0, slots = NUM_BREDR_CHANNELS, n;
+	piconet_cache* cache = NULL;
+	piconet_entry* e;
+	source_t* sources;
+	FILE* out = NULL;
+	char* end;
+	int ret = 0;
+
+	while ((opt=getopt(argc,argv,"hl:u:a:C:c:s:n:w:")) != EOF) {
+		switch(opt) {
+		case 'l':
+			lap = strtoul(optarg, &end, 16) & 0xffffff;
+			have_lap = 1;
+			break;
+		case 'u':
+			uap = strtoul(optarg, &end, 16);
+			have_uap = 1;
+			break;
+		case 'a':
+			if (parse_afh_map(optarg, afh_map) < 0) {
+				fprintf(stderr, "Invalid AFH map '%s'\n", optarg);
+				return 1;
+			}
+			have_afh = 1;
+			break;
+		case 'C':
+			cache = piconet_cache_open(optarg);
+			if (cache == NULL)
+				return 1;
+			break;
+		case 'c':
+			ref_clk = strtoul(optarg, &end, 16) & 0x0fffffff;
+			if (*end != '@') {
+				fprintf(stderr, "Invalid clock '%s', use <CLK>@<seconds>\n", optarg);
+				return 1;
+			}
+			ref_ns = (uint64_t)(strtod(end + 1, NULL) * 1000000000.0);
+			have_ref = 1;
+			break;
+		case 's':
+			start = strtoul(optarg, &end, 16) & 0x0fffffff;
+			break;
+		case 'n':
+			slots = strtoul(optarg, &end, 10);
+			break;
+		case 'w':
+			out = fopen(optarg, "wb");
+			if (out == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!have_lap) {
+		usage();
+		return 1;
+	}
+
+	e = cache ? piconet_cache_find(cache, lap) : NULL;
+	if (e) {
+		if (!have_uap && (e->flags & CACHE_UAP)) {
+			uap = e->uap;
+			have_uap = 1;
+		}
+		if (!have_afh && (e->flags & CACHE_AFH)) {
+			memcpy(afh_map, e->afh_map, sizeof(afh_map));
+			have_afh = 1;
+		}
+		if (!have_ref && (e->flags & CACHE_CLOCK)) {
+			ref_clk = e->clk;
+			ref_ns = e->clk_time_ns;
+			have_ref = 1;
+		}
+	}
+	if (cache)
+		piconet_cache_close(cache);
+
+	if (!have_uap) {
+		fprintf(stderr, "The UAP is required for the hopping sequence\n");
+		return 1;
+	}
+	hop_init(&hop, ((uint32_t)uap << 24) | lap, have_afh ? afh_map : NULL);
+
+	num_sources = argc - optind;
+	if (num_sources == 0) {
+		while (slots > 0) {
+			n = MIN(slots, sizeof(seq));
+			hop_sequence(&hop, start, n, seq);
+			for (i = 0; i < (int)n; i++)
+				printf("%07x %2d\n", (start + 2 * i) & 0x0fffffff, seq[i]);
+			start = (start + 2 * n) & 0x0fffffff;
+			slots -= n;
+		}
+		return 0;
+	}
+
+	if (!have_ref) {
+		fprintf(stderr, "The master's clock is required to place packets, use -c or -C\n");
+		return 1;
+	}
+
+	sources = (source_t*)calloc(num_sources, sizeof(source_t));
+	if (sources == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return 1;
+	}
+	for (i = 0; i < num_sources; i++) {
+		sources[i].path = argv[optind + i];
+		sources[i].fp = fopen(sources[i].path, "rb");
+		if (sources[i].fp == NULL) {
+			perror(sources[i].path);
+			return 1;
+		}
+		sources[i].r = pcapng_open(sources[i].fp);
+		if (sources[i].r == NULL)
+			return 1;
+	}
+
+	if (reconstruct(sources, num_sources, out) < 0)
+		ret = 1;
+
+	if (out && fclose(out) != 0) {
+		perror("close");
+		ret = 1;
+	}
+	for (i = 0; i < num_sources; i++) {
+		pcapng_close(sources[i].r);
+		fclose(sources[i].fp);
+		free(sources[i].ifaces);
+	}
+	free(sources);
+	free(entries);
+
+	return ret;
+}
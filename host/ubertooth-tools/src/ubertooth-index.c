@@ -0,0 +1,245 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_index.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS 64
+
+static void usage(void)
+{
+	printf("ubertooth-index - build sidecar indexes of access codes in captures\n");
+	printf("Usage: ubertooth-index [options] <capture>...\n");
+	printf("\t-h this help\n");
+	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-j <threads> threads used per raw dump (default: 4)\n");
+	printf("\t-f rebuild indexes that are up to date\n");
+	printf("\nCaptures may be raw dumps (ubertooth-dump -f) or PCAPNG files. The index\n");
+	printf("for <capture> is written to <capture>%s and is used by ubertooth-query.\n",
+	       INDEX_SUFFIX);
+}
+
+typedef struct {
+	const char* path;
+	uint64_t first;
+	uint64_t count;
+	index_t* idx;
+	int ret;
+} segment_t;
+
+static void* scan_segment(void* arg)
+{
+	segment_t* seg = (segment_t*)arg;
+	FILE* fp;
+
+	seg->ret = -1;
+	fp = fopen(seg->path, "rb");
+	if (fp == NULL) {
+		perror(seg->path);
+		return NULL;
+	}
+	seg->ret = index_scan_raw(seg->idx, fp, seg->first, seg->count);
+	fclose(fp);
+	return NULL;
+}
+
+/* Split a raw dump into one segment per thread.  Each segment reads
+ * NUM_BANKS - 1 records past its end so that every record is examined
+ * with the same look-ahead as in a sequential pass. */
+static int scan_raw(index_t* idx, const char* path, int threads)
+{
+	segment_t seg[MAX_THREADS];
+	pthread_t tid[MAX_THREADS];
+	uint64_t records, per_thread;
+	int i, ret = 0;
+
+	records = idx->source_size / INDEX_RAW_RECORD_LEN;
+	per_thread = (records + threads - 1) / threads;
+	if (per_thread < 1024)
+		per_thread = 1024;
+
+	for (i = 0; i < threads; i++) {
+		seg[i].path = path;
+		seg[i].first = i * per_thread;
+		seg[i].count = 0;
+		seg[i].idx = NULL;
+		seg[i].ret = 0;
+		if (seg[i].first >= records)
+			continue;
+		seg[i].count = MIN(per_thread, records - seg[i].first);
+		seg[i].idx = index_init();
+		if (seg[i].idx == NULL ||
+		    pthread_create(&tid[i], NULL, scan_segment, &seg[i]) != 0) {
+			fprintf(stderr, "Unable to start indexing thread\n");
+			seg[i].count = 0;
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (seg[i].count == 0)
+			continue;
+		pthread_join(tid[i], NULL);
+		if (seg[i].ret < 0 || index_append(idx, seg[i].idx) < 0)
+			ret = -1;
+	}
+
+	for (i = 0; i < threads; i++)
+		if (seg[i].idx)
+			index_free(seg[i].idx);
+
+	return ret;
+}
+
+static int build_index(const char* path, int threads, int force)
+{
+	index_t* idx = NULL;
+	char* idx_path = NULL;
+	char* tmp_path = NULL;
+	FILE* fp;
+	int source, ret = -1;
+
+	idx_path = index_path(path);
+	if (idx_path == NULL)
+		return -1;
+
+	if (!force) {
+		fp = fopen(idx_path, "rb");
+		if (fp) {
+			idx = index_read(fp);
+			fclose(fp);
+			if (idx && index_is_current(idx, path)) {
+				fprintf(stderr, "%s: index is up to date\n", path);
+				ret = 0;
+				goto out;
+			}
+			if (idx)
+				index_free(idx);
+		}
+	}
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror(path);
+		goto out;
+	}
+	source = index_source_type(fp);
+
+	idx = index_init();
+	if (source < 0 || idx == NULL || index_set_source(idx, path) < 0) {
+		fclose(fp);
+		goto out;
+	}
+	idx->source = source;
+
+	if (source == INDEX_SOURCE_PCAPNG)
+		ret = index_scan_pcapng(idx, fp);
+	else
+		ret = scan_raw(idx, path, threads);
+	fclose(fp);
+	if (ret < 0)
+		goto out;
+
+	index_sort(idx);
+
+	/* write to a temporary file so an interrupted run never leaves a
+	 * truncated index that looks current */
+	ret = -1;
+	tmp_path = (char*)malloc(strlen(idx_path) + 5);
+	if (tmp_path == NULL)
+		goto out;
+	sprintf(tmp_path, "%s.tmp", idx_path);
+	fp = fopen(tmp_path, "wb");
+	if (fp == NULL) {
+		perror(tmp_path);
+		goto out;
+	}
+	if (index_write(idx, fp) < 0) {
+		fclose(fp);
+		remove(tmp_path);
+		goto out;
+	}
+	fclose(fp);
+	if (rename(tmp_path, idx_path) < 0) {
+		perror(idx_path);
+		goto out;
+	}
+
+	fprintf(stderr, "%s: %llu access codes indexed\n", path,
+	        (unsigned long long)idx->num_entries);
+	ret = 0;
+
+out:
+	if (idx)
+		index_free(idx);
+	free(tmp_path);
+	free(idx_path);
+	return ret;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, i;
+	int threads = 4;
+	int force = 0;
+	int ret = 0;
+
+	while ((opt=getopt(argc,argv,"he:j:f")) != EOF) {
+		switch(opt) {
+		case 'e':
+			max_ac_errors = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > MAX_THREADS) {
+				fprintf(stderr, "Thread count must be between 1 and %d\n",
+				        MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		return 1;
+	}
+
+	if (btbb_init(max_ac_errors) < 0)
+		return 1;
+
+	for (i = optind; i < argc; i++)
+		if (build_index(argv[i], threads, force) < 0)
+			ret = 1;
+
+	return ret;
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth_pcapng.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* large stdio buffers keep dozens of inputs streaming sequentially */
+#define IO_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+	const char* path;
+	FILE* fp;
+	pcapng_reader* r;
+	int64_t offset_ns;
+
+	/* output interface for each interface of the current section */
+	uint32_t* iface_map;
+	uint32_t map_size;
+
+	uint64_t ts_ns;     /* of the pending packet, offset applied */
+	uint64_t packets;
+} source_t;
+
+static FILE* out;
+static uint32_t out_ifaces;
+
+static void usage(void)
+{
+	printf("ubertooth-merge - merge PCAPNG captures from several Ubertooths by time\n");
+	printf("Usage: ubertooth-merge [options] <capture>...\n");
+	printf("\t-h this help\n");
+	printf("\t-w <filename> write the merged capture here (default: stdout)\n");
+	printf("\t-O <n>:<seconds> add this clock offset to the timestamps of the n-th capture\n");
+	printf("\nEach interface of each capture becomes a separate interface in the\n");
+	printf("output, described by the capture's file name.  Inputs are read once and\n");
+	printf("only one packet per input is held in memory.\n");
+}
+
+/* Write an interface description for the block just read and remember
+ * its number in the output. */
+static int map_interface(source_t* s)
+{
+	pcapng_interface* iface = &s->r->ifaces[s->r->num_ifaces - 1];
+	char desc[256];
+
+	if (s->r->num_ifaces > s->map_size) {
+		uint32_t size = s->map_size ? 2 * s->map_size : 4;
+		uint32_t* map = (uint32_t*)realloc(s->iface_map, size * sizeof(uint32_t));
+		if (map == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return -1;
+		}
+		s->iface_map = map;
+		s->map_size = size;
+	}
+
+	snprintf(desc, sizeof(desc), "%s:%u", s->path, s->r->num_ifaces - 1);
+	if (pcapng_write_idb(out, iface->linktype, desc) < 0)
+		return -1;
+	s->iface_map[s->r->num_ifaces - 1] = out_ifaces++;
+
+	return 0;
+}
+
+/* Advance to the next packet.  Returns 1 if there is one, 0 at the end
+ * of the capture. */
+static int next_packet(source_t* s)
+{
+	int r;
+	int64_t ts;
+
+	while ((r = pcapng_next_block(s->r)) > 0) {
+		if (s->r->block_type == PCAPNG_IDB) {
+			if (map_interface(s) < 0)
+				return -1;
+		} else if (s->r->block_type == PCAPNG_EPB) {
+			ts = (int64_t)s->r->ts_ns + s->offset_ns;
+			s->ts_ns = ts < 0 ? 0 : (uint64_t)ts;
+			return 1;
+		}
+	}
+	if (r < 0)
+		fprintf(stderr, "%s: corrupt block at offset %llu\n", s->path,
+		        (unsigned long long)s->r->block_offset);
+	return r;
+}
+
+static int write_packet(source_t* s)
+{
+	pcapng_reader* r = s->r;
+	uint32_t padded = (r->caplen + 3) & ~3;
+	uint32_t options_len = r->block_len - 32 - padded;
+
+	/* options can only be copied when they are in our byte order */
+	if (r->swapped)
+		options_len = 0;
+
+	return pcapng_write_epb(out, s->iface_map[r->iface], s->ts_ns,
+	                        r->packet, r->caplen,
+	                        pcapng_u32(r, r->block + 24),
+	                        r->block + 28 + padded, options_len);
+}
+
+static int before(const source_t* a, const source_t* b)
+{
+	return a->ts_ns < b->ts_ns || (a->ts_ns == b->ts_ns && a < b);
+}
+
+static void sift_down(source_t** heap, int n, int i)
+{
+	source_t* tmp;
+	int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, i, n, num_sources, r;
+	int ret = 0;
+	uint8_t magic[4];
+	uint64_t total = 0;
+	source_t* sources;
+	source_t** heap;
+	char** offsets;
+	int num_offsets = 0;
+	char* end;
+	long index;
+
+	out = stdout;
+
+	/* offsets are parsed once the number of inputs is known */
+	offsets = (char**)calloc(argc, sizeof(char*));
+	if (offsets == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return 1;
+	}
+
+	while ((opt=getopt(argc,argv,"hw:O:")) != EOF) {
+		switch(opt) {
+		case 'w':
+			out = fopen(optarg, "wb");
+			if (out == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'O':
+			offsets[num_offsets++] = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	num_sources = argc - optind;
+	if (num_sources < 1) {
+		usage();
+		return 1;
+	}
+
+	sources = (source_t*)calloc(num_sources, sizeof(source_t));
+	heap = (source_t**)calloc(num_sources, sizeof(source_t*));
+	if (sources == NULL || heap == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < num_offsets; i++) {
+		index = strtol(offsets[i], &end, 10);
+		if (*end != ':' || index < 1 || index > num_sources) {
+			fprintf(stderr, "Invalid offset '%s', use <n>:<seconds> with n from 1 to %d\n",
+			        offsets[i], num_sources);
+			return 1;
+		}
+		sources[index - 1].offset_ns = (int64_t)(strtod(end + 1, NULL) * 1000000000.0);
+	}
+	free(offsets);
+
+	setvbuf(out, NULL, _IOFBF, IO_BUFFER_SIZE);
+	if (pcapng_write_shb(out) < 0)
+		return 1;
+
+	n = 0;
+	for (i = 0; i < num_sources; i++) {
+		source_t* s = &sources[i];
+
+		s->path = argv[optind + i];
+		s->fp = fopen(s->path, "rb");
+		if (s->fp == NULL) {
+			perror(s->path);
+			return 1;
+		}
+		setvbuf(s->fp, NULL, _IOFBF, IO_BUFFER_SIZE);
+		if (fread(magic, sizeof(magic), 1, s->fp) != 1 || !pcapng_is_magic(magic)) {
+			fprintf(stderr, "%s is not a PCAPNG file\n", s->path);
+			return 1;
+		}
+		rewind(s->fp);
+		s->r = pcapng_open(s->fp);
+		if (s->r == NULL)
+			return 1;
+
+		r = next_packet(s);
+		if (r < 0)
+			return 1;
+		if (r > 0)
+			heap[n++] = s;
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		sift_down(heap, n, i);
+
+	/* the root always holds the earliest pending packet */
+	while (n > 0) {
+		source_t* s = heap[0];
+
+		if (write_packet(s) < 0) {
+			ret = 1;
+			break;
+		}
+		s->packets++;
+		total++;
+
+		r = next_packet(s);
+		if (r < 0) {
+			ret = 1;
+			break;
+		}
+		if (r == 0)
+			heap[0] = heap[--n];
+		sift_down(heap, n, 0);
+	}
+
+	for (i = 0; i < num_sources; i++) {
+		source_t* s = &sources[i];
+
+		fprintf(stderr, "%s: %llu packets\n", s->path, (unsigned long long)s->packets);
+		pcapng_close(s->r);
+		fclose(s->fp);
+		free(s->iface_map);
+	}
+	fprintf(stderr, "%llu packets merged\n", (unsigned long long)total);
+
+	if (fclose(out) != 0) {
+		perror("close");
+		ret = 1;
+	}
+	free(sources);
+	free(heap);
+
+	return ret;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include "ubertooth_index.h"
+#include "ubertooth_pcapng.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(void)
+{
+	printf("ubertooth-query - find packets in an indexed capture\n");
+	printf("Usage:\n");
+	printf("\t-h this help\n");
+	printf("\t-i <filename> capture indexed with ubertooth-index\n");
+	printf("\t-l <LAP> only this LAP (6 hex) or LE access address (8 hex)\n");
+	printf("\t-s <seconds> only packets at or after this UNIX time\n");
+	printf("\t-e <seconds> only packets up to this UNIX time\n");
+	printf("\t-c <channel> only packets received on this channel\n");
+	printf("\t-o <filename> extract matching packets in the format of the capture\n");
+	printf("\nWithout -o the matching index entries are listed. Raw dump extracts hold\n");
+	printf("the %d records needed to decode each packet and can be replayed with\n",
+	       NUM_BANKS);
+	printf("ubertooth-rx -i.\n");
+}
+
+static uint64_t parse_time(const char* s)
+{
+	return (uint64_t)(strtod(s, NULL) * 1000000000.0);
+}
+
+static int compare_offsets(const void* a, const void* b)
+{
+	uint64_t oa = *(const uint64_t*)a;
+	uint64_t ob = *(const uint64_t*)b;
+
+	return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+static int write_record(FILE* out, const uint8_t* buf)
+{
+	if (fwrite(buf, INDEX_RAW_RECORD_LEN, 1, out) != 1) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+/* Write the decode window of each hit as a hits-only dump, like
+ * ubertooth-rx -d does: the records of overlapping windows are written
+ * once and in file order, each window is followed by its hit marker,
+ * and a window marker separates windows that are not contiguous.
+ * Markers of the source are not copied, its windows may hold some
+ * between their records. */
+static int extract_raw(FILE* in, FILE* out, const uint64_t* offsets, uint64_t num)
+{
+	uint8_t buf[INDEX_RAW_RECORD_LEN];
+	uint64_t pending[NUM_BANKS];
+	uint64_t i, pos, written;
+	uint32_t systime;
+	dump_marker m;
+	int head, count;
+
+	i = pos = written = 0;
+	head = count = 0;
+	while (i < num || count > 0) {
+		/* start a run of windows at the next hit */
+		if (count == 0 && offsets[i] != pos) {
+			if (written && dump_write_marker(out, DUMP_MARKER_WINDOW, 0, written) < 0) {
+				perror("write");
+				return -1;
+			}
+			pos = offsets[i];
+			if (fseeko(in, pos, SEEK_SET) < 0) {
+				perror("fseek");
+				return -1;
+			}
+		}
+
+		if (fread(buf, INDEX_RAW_RECORD_LEN, 1, in) != 1) {
+			fprintf(stderr, "Capture changed since it was indexed\n");
+			return -1;
+		}
+		pos += INDEX_RAW_RECORD_LEN;
+		if (dump_read_marker(buf, &m) >= 0)
+			continue;
+
+		systime = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		if (written == 0 && dump_write_marker(out, DUMP_MARKER_HEADER, systime, 0) < 0) {
+			perror("write");
+			return -1;
+		}
+		for (; i < num && offsets[i] < pos; i++) {
+			if (count > 0 && pending[(head + count - 1) % NUM_BANKS] == written)
+				continue;
+			pending[(head + count++) % NUM_BANKS] = written;
+		}
+		if (write_record(out, buf) < 0)
+			return -1;
+		written++;
+
+		if (count > 0 && pending[head] + NUM_BANKS == written) {
+			if (dump_write_marker(out, DUMP_MARKER_HIT, systime, pending[head]) < 0) {
+				perror("write");
+				return -1;
+			}
+			head = (head + 1) % NUM_BANKS;
+			count--;
+		}
+	}
+	return 0;
+}
+
+/* Copy the section and interface blocks that precede the first packet,
+ * then each matching packet block verbatim. */
+static int extract_pcapng(FILE* in, FILE* out, const uint64_t* offsets, uint64_t num)
+{
+	pcapng_reader* r;
+	uint64_t i;
+	int ret = 0;
+
+	r = pcapng_open(in);
+	if (r == NULL)
+		return -1;
+
+	while ((ret = pcapng_next_block(r)) > 0 && r->block_type != PCAPNG_EPB) {
+		if (fwrite(r->block, r->block_len, 1, out) != 1) {
+			perror("write");
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; ret >= 0 && i < num; i++) {
+		if (i > 0 && offsets[i] == offsets[i-1])
+			continue;
+		ret = pcapng_seek_block(r, offsets[i]);
+		if (ret <= 0) {
+			fprintf(stderr, "Capture changed since it was indexed\n");
+			ret = -1;
+			break;
+		}
+		if (fwrite(r->block, r->block_len, 1, out) != 1) {
+			perror("write");
+			ret = -1;
+		}
+	}
+
+	pcapng_close(r);
+	return ret < 0 ? -1 : 0;
+}
+
+static int matches(const index_entry* e, uint64_t start_ns, uint64_t end_ns,
+                   int channel)
+{
+	return e->ts_ns >= start_ns && e->ts_ns <= end_ns &&
+	       (channel < 0 || e->channel == channel);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, ret = 0;
+	int have_lap = 0;
+	int channel = -1;
+	uint32_t lap = 0;
+	uint64_t start_ns = 0, end_ns = UINT64_MAX;
+	uint64_t i, first, num = 0;
+	uint64_t* offsets = NULL;
+	char* path = NULL;
+	char* idx_path;
+	char* end;
+	FILE* fp;
+	FILE* outfile = NULL;
+	index_t* idx;
+	index_entry* e;
+
+	while ((opt=getopt(argc,argv,"hi:l:s:e:c:o:")) != EOF) {
+		switch(opt) {
+		case 'i':
+			path = optarg;
+			break;
+		case 'l':
+			lap = strtoul(optarg, &end, 16);
+			have_lap++;
+			break;
+		case 's':
+			start_ns = parse_time(optarg);
+			break;
+		case 'e':
+			end_ns = parse_time(optarg);
+			break;
+		case 'c':
+			channel = atoi(optarg);
+			break;
+		case 'o':
+			outfile = fopen(optarg, "wb");
+			if (outfile == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (path == NULL) {
+		usage();
+		return 1;
+	}
+
+	idx_path = index_path(path);
+	if (idx_path == NULL)
+		return 1;
+	fp = fopen(idx_path, "rb");
+	if (fp == NULL) {
+		perror(idx_path);
+		fprintf(stderr, "Build the index with ubertooth-index first\n");
+		return 1;
+	}
+	idx = index_read(fp);
+	fclose(fp);
+	free(idx_path);
+	if (idx == NULL)
+		return 1;
+	if (!index_is_current(idx, path)) {
+		fprintf(stderr, "%s has changed since it was indexed, run ubertooth-index again\n",
+		        path);
+		return 1;
+	}
+
+	if (outfile) {
+		offsets = (uint64_t*)malloc(MAX(idx->num_entries, 1) * sizeof(uint64_t));
+		if (offsets == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return 1;
+		}
+	}
+
+	/* entries are sorted by LAP and time, so a LAP query only touches
+	 * its own entries */
+	first = have_lap ? index_lower_bound(idx, lap, start_ns) : 0;
+	for (i = first; i < idx->num_entries; i++) {
+		e = &idx->entries[i];
+		if (have_lap && (e->lap != lap || e->ts_ns > end_ns))
+			break;
+		if (!matches(e, start_ns, end_ns, channel))
+			continue;
+
+		if (outfile) {
+			offsets[num] = e->offset;
+		} else {
+			printf("systime=%llu.%09llu ch=%2d %s=%0*x err=%u offset=%llu\n",
+			       (unsigned long long)(e->ts_ns / 1000000000ull),
+			       (unsigned long long)(e->ts_ns % 1000000000ull),
+			       e->channel,
+			       (e->flags & INDEX_FLAG_LE) ? "AA" : "LAP",
+			       (e->flags & INDEX_FLAG_LE) ? 8 : 6,
+			       e->lap, e->ac_errors,
+			       (unsigned long long)e->offset);
+		}
+		num++;
+	}
+
+	if (outfile) {
+		qsort(offsets, num, sizeof(uint64_t), compare_offsets);
+
+		fp = fopen(path, "rb");
+		if (fp == NULL) {
+			perror(path);
+			return 1;
+		}
+		if (idx->source == INDEX_SOURCE_PCAPNG)
+			ret = extract_pcapng(fp, outfile, offsets, num);
+		else
+			ret = extract_raw(fp, outfile, offsets, num);
+		fclose(fp);
+		fclose(outfile);
+		free(offsets);
+	}
+
+	fprintf(stderr, "%llu matching packets\n", (unsigned long long)num);
+	index_free(idx);
+
+	return ret < 0 ? 1 : 0;
+}
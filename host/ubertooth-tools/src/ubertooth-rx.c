@@ -36,15 +36,27 @@ static void usage()
 	printf("\t-l <LAP> to decode (6 hex), otherwise sniff all LAPs\n");
 	printf("\t-u <UAP> to decode (2 hex), otherwise try to calculate (requires LAP)\n");
 	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-D <name> receive from ubertoothd instead of a device (default name: %s)\n",
+	       SHM_DEFAULT_NAME);
+	printf("\t-N [<host>:]<port> receive from ubertooth-stream senders instead of a device\n");
 	printf("\t-r<filename> capture packets to PCAPNG file\n");
 #ifdef ENABLE_PCAP
 	printf("\t-q<filename> capture packets to PCAP file\n");
 #endif
 	printf("\t-d<filename> dump packets to binary file\n");
+	printf("\t-o <format>[:<filename>] output format: text, binary or json [Default: text]\n");
+	printf("\t-F <expression> capture filter, e.g. \"channel >= 20 and rssi > -70\"\n");
+	printf("\t-R [<cpu>][:<priority>] real-time: lock memory, pin to cpu, SCHED_FIFO priority\n");
+	printf("\t-M [<host>:]<port>|unix:<path> serve Prometheus metrics over HTTP\n");
+	printf("\t-W <pre>[:<post>] only write -d/-r data around triggers, seconds [Default: %d:%d]\n",
+	       TRIGGER_DEFAULT_PRE, TRIGGER_DEFAULT_POST);
+	printf("\t-T <trigger> lap=<LAP> or rssi=<dBm>, may be repeated (implies -W)\n");
 	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-E <min>:<max> adapt max_ac_errors per channel within this range\n");
 	printf("\t-s reset channel scanning\n");
 	printf("\t-t <SECONDS> sniff timeout - 0 means no timeout [Default: 0]\n");
 	printf("\t-z Survey mode - discover and list piconets (implies -s -t 20)\n");
+	printf("\t-C <filename> piconet cache: seed the LAP's piconet from it, store what is learned\n");
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 }
 
@@ -63,7 +75,7 @@ int main(int argc, char* argv[])
 
 	ubertooth_t* ut = ubertooth_init();
 
-	while ((opt=getopt(argc,argv,"hVi:l:u:U:d:e:r:sq:t:z")) != EOF) {
+	while ((opt=getopt(argc,argv,"hVi:l:u:U:D:N:d:e:E:r:sq:t:zo:W:T:F:C:R:M:")) != EOF) {
 		switch(opt) {
 		case 'i':
 			infile = fopen(optarg, "r");
@@ -84,6 +96,14 @@ int main(int argc, char* argv[])
 		case 'U':
 			ubertooth_device = atoi(optarg);
 			break;
+		case 'D':
+			if (ubertooth_attach(ut, optarg) < 0)
+				return 1;
+			break;
+		case 'N':
+			if (ubertooth_listen(ut, optarg) < 0)
+				return 1;
+			break;
 		case 'r':
 			if (!ut->h_pcapng_bredr) {
 				if (btbb_pcapng_create_file( optarg, "Ubertooth", &ut->h_pcapng_bredr )) {
@@ -116,6 +136,44 @@ int main(int argc, char* argv[])
 		case 'e':
 			max_ac_errors = atoi(optarg);
 			break;
+		case 'E':
+			if (ac_adapt_create(optarg, &ut->h_ac) < 0)
+				return 1;
+			break;
+		case 'R':
+			if (rt_profile_create(optarg, &ut->h_rt) < 0)
+				return 1;
+			break;
+		case 'M':
+			if (metrics_create(optarg, &ut->h_metrics) < 0)
+				return 1;
+			break;
+		case 'o':
+			if (output_create(optarg, &ut->h_output) < 0)
+				return 1;
+			break;
+		case 'F':
+			ut->h_filter = filter_compile(optarg);
+			if (ut->h_filter == NULL)
+				return 1;
+			break;
+		case 'W':
+			if (!ut->h_trigger && (ut->h_trigger = trigger_create()) == NULL)
+				return 1;
+			if (trigger_set_window(ut->h_trigger, optarg) < 0)
+				return 1;
+			break;
+		case 'T':
+			if (!ut->h_trigger && (ut->h_trigger = trigger_create()) == NULL)
+				return 1;
+			if (trigger_add_condition(ut->h_trigger, optarg) < 0)
+				return 1;
+			break;
+		case 'C':
+			ut->h_cache = piconet_cache_open(optarg);
+			if (ut->h_cache == NULL)
+				return 1;
+			break;
 		case 's':
 			++reset_scan;
 			break;
@@ -143,12 +201,18 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	r = ubertooth_connect(ut, ubertooth_device);
-	if (r < 0) {
-		usage();
-		return 1;
+	if (ut->h_shm == NULL && ut->h_net == NULL) {
+		r = ubertooth_connect(ut, ubertooth_device);
+		if (r < 0) {
+			usage();
+			return 1;
+		}
 	}
 
+	/* the correlator must allow the most errors any channel may use */
+	if (ut->h_ac)
+		max_ac_errors = ut->h_ac->max_errors;
+
 	r = btbb_init(max_ac_errors);
 	if (r < 0)
 		return r;
@@ -161,7 +225,12 @@ int main(int argc, char* argv[])
 			btbb_init_piconet(pn, lap);
 			if (have_uap) {
 				btbb_piconet_set_uap(pn, uap);
-				cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
+				if (ut->devh)
+					cmd_set_bdaddr(ut->devh, btbb_piconet_get_bdaddr(pn));
+			}
+			if (ubertooth_cache_seed(ut, pn, infile == NULL && ut->devh) & CACHE_UAP) {
+				uap = btbb_piconet_get_uap(pn);
+				have_uap = 1;
 			}
 			if (ut->h_pcapng_bredr) {
 				btbb_pcapng_record_bdaddr(ut->h_pcapng_bredr,
@@ -175,11 +244,20 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if (ut->h_trigger) {
+		if (trigger_start(ut->h_trigger, dumpfile, ut->h_pcapng_bredr, NULL) < 0)
+			return 1;
+		/* the trigger writes these from now on */
+		dumpfile = NULL;
+		ut->h_pcapng_bredr = NULL;
+	}
+
 	if (infile == NULL) {
 		/* Scan all frequencies. Same effect as
 		 * ubertooth-utils -c9999. This is necessary after
-		 * following a piconet. */
-		if (reset_scan) {
+		 * following a piconet, but not when a cached clock is
+		 * being followed already. */
+		if (reset_scan && ut->devh && !ut->following) {
 			cmd_set_channel(ut->devh, 9999);
 		}
 
@@ -188,7 +266,13 @@ int main(int argc, char* argv[])
 
 		if (timeout)
 			ubertooth_set_timeout(ut, timeout);
+	}
 
+	if (ut->h_shm) {
+		stream_rx_shm(ut, cb_rx, pn);
+	} else if (ut->h_net) {
+		stream_rx_net(ut, cb_rx, pn);
+	} else if (infile == NULL) {
 		// init USB transfer
 		r = ubertooth_bulk_init(ut);
 		if (r < 0)
@@ -204,11 +288,17 @@ int main(int argc, char* argv[])
 			ubertooth_bulk_wait(ut);
 			ubertooth_bulk_receive(ut, cb_rx, pn);
 		}
-
-		ubertooth_stop(ut);
 	} else {
 		stream_rx_file(ut, infile, cb_rx, pn);
 		fclose(infile);
+		if (ut->h_output) {
+			output_close(ut->h_output);
+			ut->h_output = NULL;
+		}
+		if (ut->h_trigger) {
+			trigger_close(ut->h_trigger);
+			ut->h_trigger = NULL;
+		}
 	}
 
 	if(survey_mode) {
@@ -224,8 +314,15 @@ int main(int argc, char* argv[])
 				printf("??:??:??:%02X:%02X:%02X\n", (lap >> 16) & 0xFF,
 					   (lap >> 8) & 0xFF, lap & 0xFF);
 			//btbb_print_afh_map(pn);
+			if (ut->h_cache)
+				piconet_cache_store(ut->h_cache, pn, -1);
 		}
 	}
+
+	if (infile == NULL)
+		ubertooth_stop(ut);
+	else
+		ubertooth_cache_close(ut);
 	if(dumpfile != NULL)
 		fclose(dumpfile);
 
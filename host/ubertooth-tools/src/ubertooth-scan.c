@@ -21,7 +21,12 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -35,6 +40,108 @@
 #include <btbb.h>
 #include <getopt.h>
 
+#define MAX_THREADS       16
+#define DEFAULT_THREADS   4
+#define DEFAULT_TIMEOUT   10     /* seconds per remote request */
+#define DEFAULT_MAX_AGE   3600   /* seconds a cached device is not queried again */
+#define CMD_TIMEOUT_MS    2000   /* for the controller to accept a command */
+#define RETRY_MS          100    /* while the controller is busy paging */
+#define EVENT_POLL_MS     100    /* for the event thread to notice the end */
+#define MAX_FEATURE_PAGES 4
+#define LINE_LEN          1024
+
+enum info_flags {
+	INFO_NAME     = 0x01,
+	INFO_EXTENDED = 0x02,   /* connected, the fields below were requested */
+	INFO_VERSION  = 0x04,
+	INFO_CLOCK    = 0x08,
+	INFO_AFH      = 0x10
+};
+
+/* What was learned about a device, also the entry of the cache */
+typedef struct {
+	bdaddr_t bdaddr;
+	uint64_t updated;       /* seconds since the epoch */
+	uint8_t flags;
+	uint8_t lmp_ver;
+	uint16_t lmp_subver;
+	uint16_t manufacturer;
+	uint8_t max_page;
+	uint8_t pages;          /* mask of the feature pages read */
+	uint8_t features[MAX_FEATURE_PAGES][8];
+	uint16_t clock_offset;
+	uint8_t afh_mode;
+	uint8_t afh_map[10];
+	char name[HCI_MAX_NAME_LENGTH + 1];
+} device_info;
+
+typedef struct {
+	device_info info;
+	char addr[19];          /* printable, "??" for an unknown NAP */
+	int query;
+	uint8_t pscan_rep_mode;
+	uint16_t clock_offset;  /* from the inquiry, HCI byte order */
+	btbb_piconet* pn;       /* survey result */
+	int cached;
+	int done;
+	char error[128];
+} job_t;
+
+enum waiter_state {
+	WAIT_STATUS,            /* for the controller to accept the command */
+	WAIT_EVENT,             /* for the completion event */
+	WAIT_DONE
+};
+
+/* A request waiting for its events, see hci_start() */
+typedef struct hci_waiter {
+	uint16_t opcode;        /* HCI byte order */
+	uint8_t event;          /* completion event, 0 for Command Complete */
+	int key_offset;
+	const void* key;
+	int key_len;
+	void* rparam;
+	int rlen;
+	int state;
+	uint8_t status;
+	int orphan;             /* holds the place of a request given up */
+	struct hci_waiter* next;
+} hci_waiter;
+
+typedef struct {
+	int dev_id;
+	struct hci_dev_info di;
+	int extended;
+	int timeout_ms;
+	int threads;
+
+	job_t* jobs;
+	int num_jobs;
+	int next;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+
+	/* the socket shared by all threads and its event thread, under
+	 * hci_lock */
+	int dd;
+	int hci_error;          /* errno once the socket failed */
+	int stopping;
+	hci_waiter* waiters;    /* in the order the commands were sent */
+	pthread_cond_t events;  /* on the clock of now_ms() */
+} pool_t;
+
+typedef struct {
+	char* path;
+	device_info* entries;
+	int num_entries;
+	int size;
+	int max_age;
+	int dirty;
+} device_cache;
+
+/* The list of waiters and sending commands, see hci_start() */
+static pthread_mutex_t hci_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void usage()
 {
 	printf("ubertooth-scan - active(bluez) device scan and inquiry supported by Ubertooth\n");
@@ -46,136 +153,887 @@ static void usage()
 	printf("\t-s hci Scan - perform the equivalent of 'hcitool scan'\n");
 	printf("\t-x eXtended scan - retrieve additional information about target devices\n");
 	printf("\t-b Bluetooth device (hci0)\n");
+	printf("\t-F <expression> capture filter, e.g. \"channel >= 20 and rssi > -70\"\n");
+	printf("\t-j <threads> devices queried at once (default: %d, max: %d)\n",
+	       DEFAULT_THREADS, MAX_THREADS);
+	printf("\t-T <seconds> deadline of each remote request (default: %d)\n", DEFAULT_TIMEOUT);
+	printf("\t-C <filename> device cache: reuse what was learned about a device\n");
+	printf("\t-A <seconds> query cached devices again after this time (default: %d)\n",
+	       DEFAULT_MAX_AGE);
 }
 
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000ull * ts.tv_sec + ts.tv_nsec / 1000000;
+}
 
-void extra_info(int dd, int dev_id, bdaddr_t* bdaddr)
+/* Wait for an event until the deadline.  Returns the length of its
+ * parameters, or -1 with errno set. */
+static int read_event(int dd, uint8_t* buf, uint8_t* evt, uint8_t** params,
+                      uint64_t deadline)
 {
-	uint16_t handle, offset;
-	uint8_t features[8], max_page = 0;
-	char name[249], *tmp;
-	char addr[19] = { 0 };
-	uint8_t mode, afh_map[10];
-	struct hci_version version;
-	struct hci_dev_info di;
-	struct hci_conn_info_req *cr;
-	int i, cc = 0;
+	hci_event_hdr* hdr;
+	struct pollfd pfd;
+	uint64_t now;
+	int len, r;
 
-	if (hci_devinfo(dev_id, &di) < 0) {
-		perror("Can't get device info");
-		exit(1);
+	while (1) {
+		now = now_ms();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		pfd.fd = dd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, deadline - now);
+		if (r < 0 && errno != EINTR)
+			return -1;
+		if (r <= 0)
+			continue;
+
+		len = read(dd, buf, HCI_MAX_EVENT_SIZE);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+			continue;
+		hdr = (hci_event_hdr*)(buf + 1);
+		if (hdr->plen > len - 1 - HCI_EVENT_HDR_SIZE)
+			continue;
+		*evt = hdr->evt;
+		*params = buf + 1 + HCI_EVENT_HDR_SIZE;
+		return hdr->plen;
 	}
+}
+
+static int event_status(uint8_t status)
+{
+	if (status == 0)
+		return 0;
+	errno = status == HCI_COMMAND_DISALLOWED ? EBUSY : EIO;
+	return -1;
+}
 
-	printf("Requesting information ...\n");
+static void deliver(hci_waiter* w, const uint8_t* p, int plen)
+{
+	memcpy(w->rparam, p, MIN(w->rlen, plen));
+	w->status = p[0];
+	w->state = WAIT_DONE;
+}
+
+/* The oldest request with this opcode still waiting for its status */
+static hci_waiter** find_status(pool_t* pool, uint16_t opcode)
+{
+	hci_waiter** p;
 
-	cr = malloc(sizeof(*cr) + sizeof(struct hci_conn_info));
-	if (!cr) {
-		perror("Can't get connection info");
-		exit(1);
+	for (p = &pool->waiters; *p; p = &(*p)->next)
+		if ((*p)->state == WAIT_STATUS && (*p)->opcode == opcode)
+			return p;
+	return NULL;
+}
+
+/*
+ * Hand an event to the request it belongs to.  Every socket receives
+ * every event, so completion events are matched on the address or
+ * handle at key_offset of their parameters.  Statuses carry only the
+ * opcode and the controller answers commands in order, so they go to
+ * the oldest request with that opcode still waiting for one.
+ */
+static void dispatch(pool_t* pool, uint8_t evt, uint8_t* p, int plen)
+{
+	evt_cmd_status* cs;
+	evt_cmd_complete* cc;
+	hci_waiter** pw = NULL;
+	hci_waiter* w;
+
+	if (evt == EVT_CMD_STATUS && plen >= EVT_CMD_STATUS_SIZE) {
+		cs = (evt_cmd_status*)p;
+		pw = find_status(pool, cs->opcode);
+		if (pw && !(*pw)->orphan) {
+			w = *pw;
+			w->status = cs->status;
+			w->state = cs->status ? WAIT_DONE : WAIT_EVENT;
+		}
+	} else if (evt == EVT_CMD_COMPLETE && plen > EVT_CMD_COMPLETE_SIZE) {
+		cc = (evt_cmd_complete*)p;
+		pw = find_status(pool, cc->opcode);
+		if (pw && !(*pw)->orphan)
+			deliver(*pw, p + EVT_CMD_COMPLETE_SIZE, plen - EVT_CMD_COMPLETE_SIZE);
+	} else {
+		for (w = pool->waiters; w; w = w->next) {
+			if (w->state == WAIT_EVENT && w->event == evt &&
+			    plen >= w->key_offset + w->key_len &&
+			    memcmp(p + w->key_offset, w->key, w->key_len) == 0) {
+				deliver(w, p, plen);
+				break;
+			}
+		}
 	}
+	/* the status a given up request was waiting for has come */
+	if (pw && (*pw)->orphan) {
+		w = *pw;
+		*pw = w->next;
+		free(w);
+	}
+	pthread_cond_broadcast(&pool->events);
+}
+
+/* The only reader of the socket, so no thread holds a lock while it
+ * waits for a slow device */
+static void* read_events(void* arg)
+{
+	pool_t* pool = (pool_t*)arg;
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	uint8_t* p;
+	uint8_t evt;
+	int plen, stopping = 0;
+
+	while (!stopping) {
+		plen = read_event(pool->dd, buf, &evt, &p, now_ms() + EVENT_POLL_MS);
+
+		pthread_mutex_lock(&hci_lock);
+		if (plen >= 0) {
+			dispatch(pool, evt, p, plen);
+		} else if (errno != ETIMEDOUT) {
+			pool->hci_error = errno;
+			pthread_cond_broadcast(&pool->events);
+			stopping = 1;
+		}
+		if (pool->stopping)
+			stopping = 1;
+		pthread_mutex_unlock(&hci_lock);
+	}
+	return NULL;
+}
+
+static void waiter_init(hci_waiter* w, uint8_t event, int key_offset, const void* key,
+                        int key_len, void* rparam, int rlen)
+{
+	memset(w, 0, sizeof(*w));
+	w->event = event;
+	w->key_offset = key_offset;
+	w->key = key;
+	w->key_len = key_len;
+	w->rparam = rparam;
+	w->rlen = rlen;
+}
+
+/* Send a command and queue w for its events.  Both happen under the
+ * lock, so the waiters are in the order of the commands. */
+static int hci_start(pool_t* pool, hci_waiter* w, uint16_t ogf, uint16_t ocf,
+                     void* cparam, uint8_t clen)
+{
+	hci_waiter** tail;
+	int r = 0;
+
+	w->opcode = htobs(cmd_opcode_pack(ogf, ocf));
+	w->state = WAIT_STATUS;
+	w->next = NULL;
+
+	pthread_mutex_lock(&hci_lock);
+	if (pool->hci_error) {
+		errno = pool->hci_error;
+		r = -1;
+	} else if (hci_send_cmd(pool->dd, ogf, ocf, clen, cparam) < 0) {
+		r = -1;
+	} else {
+		for (tail = &pool->waiters; *tail; tail = &(*tail)->next)
+			;
+		*tail = w;
+	}
+	pthread_mutex_unlock(&hci_lock);
+	return r;
+}
+
+/* Wait until w has got past state, or the deadline.  Returns -1 with
+ * errno set if it did not, or if the command or its event failed. */
+static int hci_wait(pool_t* pool, hci_waiter* w, int state, uint64_t deadline)
+{
+	struct timespec ts;
+	int r;
 
-	bacpy(&cr->bdaddr, bdaddr);
+	ts.tv_sec = deadline / 1000;
+	ts.tv_nsec = (deadline % 1000) * 1000000;
+
+	pthread_mutex_lock(&hci_lock);
+	while (w->state <= state && !pool->hci_error &&
+	       pthread_cond_timedwait(&pool->events, &hci_lock, &ts) != ETIMEDOUT)
+		;
+	if (w->state == WAIT_DONE) {
+		r = event_status(w->status);
+	} else if (w->state > state) {
+		r = 0;
+	} else {
+		errno = pool->hci_error ? pool->hci_error : ETIMEDOUT;
+		r = -1;
+	}
+	pthread_mutex_unlock(&hci_lock);
+	return r;
+}
+
+/* Stop waiting for the events of w, if it was queued.  Without its
+ * status yet, a copy keeps its place so that the status does not go to
+ * a later command with the same opcode. */
+static void hci_end(pool_t* pool, hci_waiter* w)
+{
+	hci_waiter** p;
+	hci_waiter* orphan;
+
+	pthread_mutex_lock(&hci_lock);
+	for (p = &pool->waiters; *p; p = &(*p)->next) {
+		if (*p != w)
+			continue;
+		orphan = NULL;
+		if (w->state == WAIT_STATUS)
+			orphan = (hci_waiter*)calloc(1, sizeof(hci_waiter));
+		if (orphan) {
+			orphan->opcode = w->opcode;
+			orphan->state = WAIT_STATUS;
+			orphan->orphan = 1;
+			orphan->next = w->next;
+			*p = orphan;
+		} else {
+			*p = w->next;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&hci_lock);
+}
+
+/* Send a command and wait for its completion event, or with event 0 for
+ * its Command Complete parameters.  The controller has CMD_TIMEOUT_MS to
+ * accept it.  Leaves w queued for the caller to end. */
+static int hci_send_once(pool_t* pool, hci_waiter* w, uint16_t ogf, uint16_t ocf,
+                         void* cparam, uint8_t clen, uint64_t deadline)
+{
+	if (hci_start(pool, w, ogf, ocf, cparam, clen) < 0 ||
+	    hci_wait(pool, w, WAIT_STATUS, MIN(deadline, now_ms() + CMD_TIMEOUT_MS)) < 0)
+		return -1;
+	return hci_wait(pool, w, WAIT_EVENT, deadline);
+}
+
+/* As hci_send_once(), retried while the controller is busy */
+static int hci_send(pool_t* pool, hci_waiter* w, uint16_t ogf, uint16_t ocf,
+                    void* cparam, uint8_t clen, uint64_t deadline)
+{
+	int r;
+
+	while ((r = hci_send_once(pool, w, ogf, ocf, cparam, clen, deadline)) < 0 &&
+	       errno == EBUSY && now_ms() + RETRY_MS < deadline) {
+		hci_end(pool, w);
+		usleep(RETRY_MS * 1000);
+	}
+	return r;
+}
+
+static int hci_request(pool_t* pool, uint16_t ogf, uint16_t ocf, void* cparam, uint8_t clen,
+                       uint8_t event, int key_offset, const void* key, int key_len,
+                       void* rparam, int rlen, int timeout_ms)
+{
+	hci_waiter w;
+	int r, err;
+
+	waiter_init(&w, event, key_offset, key, key_len, rparam, rlen);
+	r = hci_send(pool, &w, ogf, ocf, cparam, clen, now_ms() + timeout_ms);
+	err = errno;
+	hci_end(pool, &w);
+	errno = err;
+	return r;
+}
+
+static int open_socket(int dev_id)
+{
+	struct hci_filter flt;
+	int dd;
+
+	dd = hci_open_dev(dev_id);
+	if (dd < 0)
+		return -1;
+
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_event(EVT_CMD_STATUS, &flt);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+	hci_filter_set_event(EVT_REMOTE_NAME_REQ_COMPLETE, &flt);
+	hci_filter_set_event(EVT_CONN_COMPLETE, &flt);
+	hci_filter_set_event(EVT_READ_REMOTE_VERSION_COMPLETE, &flt);
+	hci_filter_set_event(EVT_READ_REMOTE_FEATURES_COMPLETE, &flt);
+	hci_filter_set_event(EVT_READ_REMOTE_EXT_FEATURES_COMPLETE, &flt);
+	hci_filter_set_event(EVT_READ_CLOCK_OFFSET_COMPLETE, &flt);
+	hci_filter_set_event(EVT_DISCONN_COMPLETE, &flt);
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+		close(dd);
+		return -1;
+	}
+	return dd;
+}
+
+static void read_name(pool_t* pool, job_t* job)
+{
+	remote_name_req_cp cp;
+	evt_remote_name_req_complete rp;
+	int i;
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.bdaddr, &job->info.bdaddr);
+	cp.pscan_rep_mode = job->pscan_rep_mode;
+	cp.clock_offset = job->clock_offset;
+	if (hci_request(pool, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ, &cp, REMOTE_NAME_REQ_CP_SIZE,
+	                EVT_REMOTE_NAME_REQ_COMPLETE, 1, &cp.bdaddr, sizeof(bdaddr_t),
+	                &rp, sizeof(rp), pool->timeout_ms) < 0)
+		return;
+
+	memcpy(job->info.name, rp.name, HCI_MAX_NAME_LENGTH);
+	job->info.name[HCI_MAX_NAME_LENGTH] = '\0';
+	/* names end up on a line of their own in the cache */
+	for (i = 0; job->info.name[i]; i++)
+		if ((uint8_t)job->info.name[i] < ' ')
+			job->info.name[i] = '?';
+	job->info.flags |= INFO_NAME;
+}
+
+static void disconnect(pool_t* pool, uint16_t handle)
+{
+	disconnect_cp cp;
+	evt_disconn_complete rp;
+
+	cp.handle = handle;
+	cp.reason = HCI_OE_USER_ENDED_CONNECTION;
+	hci_request(pool, OGF_LINK_CTL, OCF_DISCONNECT, &cp, DISCONNECT_CP_SIZE,
+	            EVT_DISCONN_COMPLETE, 1, &handle, 2, &rp, sizeof(rp),
+	            pool->timeout_ms);
+}
+
+/* A connection accepted by the controller but not complete by the
+ * deadline is cancelled.  If it completes anyway, it is torn down. */
+static void cancel_connection(pool_t* pool, hci_waiter* w, const bdaddr_t* bdaddr)
+{
+	create_conn_cancel_cp cp;
+	uint8_t rp[1 + sizeof(bdaddr_t)];
+	evt_conn_complete* conn = (evt_conn_complete*)w->rparam;
+
+	bacpy(&cp.bdaddr, bdaddr);
+	hci_request(pool, OGF_LINK_CTL, OCF_CREATE_CONN_CANCEL, &cp,
+	            CREATE_CONN_CANCEL_CP_SIZE, 0, 0, NULL, 0, rp, sizeof(rp),
+	            CMD_TIMEOUT_MS);
+	if (hci_wait(pool, w, WAIT_EVENT, now_ms() + CMD_TIMEOUT_MS) == 0)
+		disconnect(pool, conn->handle);
+}
+
+/* The handle of an existing or new ACL link, or -1 */
+static int connect_device(pool_t* pool, job_t* job, int* created)
+{
+	uint8_t req[sizeof(struct hci_conn_info_req) + sizeof(struct hci_conn_info)];
+	struct hci_conn_info_req* cr = (struct hci_conn_info_req*)req;
+	create_conn_cp cp;
+	evt_conn_complete rp;
+	hci_waiter w;
+	int r, err;
+
+	bacpy(&cr->bdaddr, &job->info.bdaddr);
 	cr->type = ACL_LINK;
-	if (ioctl(dd, HCIGETCONNINFO, (unsigned long) cr) < 0) {
-		if (hci_create_connection(dd, bdaddr,
-					htobs(di.pkt_type & ACL_PTYPE_MASK),
-					0, 0x01, &handle, 25000) < 0) {
-			perror("Can't create connection");
-			return;
+	if (ioctl(pool->dd, HCIGETCONNINFO, (unsigned long) cr) == 0) {
+		*created = 0;
+		return htobs(cr->conn_info->handle);
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.bdaddr, &job->info.bdaddr);
+	cp.pkt_type = htobs(pool->di.pkt_type & ACL_PTYPE_MASK);
+	cp.pscan_rep_mode = job->pscan_rep_mode;
+	cp.clock_offset = job->clock_offset;
+	cp.role_switch = 0x01;
+	waiter_init(&w, EVT_CONN_COMPLETE, 3, &cp.bdaddr, sizeof(bdaddr_t), &rp, sizeof(rp));
+	r = hci_send(pool, &w, OGF_LINK_CTL, OCF_CREATE_CONN, &cp, CREATE_CONN_CP_SIZE,
+	             now_ms() + pool->timeout_ms);
+	err = errno;
+	if (r < 0 && err == ETIMEDOUT)
+		cancel_connection(pool, &w, &cp.bdaddr);
+	hci_end(pool, &w);
+	if (r < 0) {
+		snprintf(job->error, sizeof(job->error), "Can't create connection: %s",
+		         strerror(err));
+		return -1;
+	}
+	*created = 1;
+	return rp.handle;
+}
+
+/* Link level information, each request with its own deadline.  Handles
+ * are kept in HCI byte order. */
+static void read_extended(pool_t* pool, job_t* job)
+{
+	device_info* info = &job->info;
+	read_remote_version_cp version_cp;
+	evt_read_remote_version_complete version;
+	read_remote_features_cp features_cp;
+	evt_read_remote_features_complete features;
+	read_remote_ext_features_cp ext_cp;
+	evt_read_remote_ext_features_complete ext;
+	read_clock_offset_cp offset_cp;
+	evt_read_clock_offset_complete offset;
+	read_afh_map_cp afh_cp;
+	read_afh_map_rp afh;
+	uint16_t handle;
+	int r, i, created;
+
+	r = connect_device(pool, job, &created);
+	if (r < 0)
+		return;
+	handle = r;
+	info->flags |= INFO_EXTENDED;
+
+	version_cp.handle = handle;
+	if (hci_request(pool, OGF_LINK_CTL, OCF_READ_REMOTE_VERSION, &version_cp,
+	                READ_REMOTE_VERSION_CP_SIZE, EVT_READ_REMOTE_VERSION_COMPLETE,
+	                1, &handle, 2, &version, sizeof(version), pool->timeout_ms) == 0) {
+		info->lmp_ver = version.lmp_ver;
+		info->lmp_subver = btohs(version.lmp_subver);
+		info->manufacturer = btohs(version.manufacturer);
+		info->flags |= INFO_VERSION;
+	}
+
+	features_cp.handle = handle;
+	if (hci_request(pool, OGF_LINK_CTL, OCF_READ_REMOTE_FEATURES, &features_cp,
+	                READ_REMOTE_FEATURES_CP_SIZE, EVT_READ_REMOTE_FEATURES_COMPLETE,
+	                1, &handle, 2, &features, sizeof(features), pool->timeout_ms) == 0) {
+		memcpy(info->features[0], features.features, 8);
+		info->pages |= 1;
+	}
+
+	for (i = 0; i <= info->max_page && i < MAX_FEATURE_PAGES; i++) {
+		/* page 0 again only to learn the number of pages */
+		if (i == 0 && !((pool->di.features[7] & LMP_EXT_FEAT) &&
+		                (info->features[0][7] & LMP_EXT_FEAT)))
+			break;
+		ext_cp.handle = handle;
+		ext_cp.page_num = i;
+		if (hci_request(pool, OGF_LINK_CTL, OCF_READ_REMOTE_EXT_FEATURES, &ext_cp,
+		                READ_REMOTE_EXT_FEATURES_CP_SIZE,
+		                EVT_READ_REMOTE_EXT_FEATURES_COMPLETE, 1, &handle, 2,
+		                &ext, sizeof(ext), pool->timeout_ms) < 0)
+			continue;
+		if (i == 0)
+			info->max_page = ext.max_page_num;
+		memcpy(info->features[i], ext.features, 8);
+		info->pages |= 1 << i;
+	}
+
+	offset_cp.handle = handle;
+	if (hci_request(pool, OGF_LINK_CTL, OCF_READ_CLOCK_OFFSET, &offset_cp,
+	                READ_CLOCK_OFFSET_CP_SIZE, EVT_READ_CLOCK_OFFSET_COMPLETE,
+	                1, &handle, 2, &offset, sizeof(offset), pool->timeout_ms) == 0) {
+		info->clock_offset = btohs(offset.clock_offset);
+		info->flags |= INFO_CLOCK;
+	}
+
+	afh_cp.handle = handle;
+	if (hci_request(pool, OGF_STATUS_PARAM, OCF_READ_AFH_MAP, &afh_cp,
+	                READ_AFH_MAP_CP_SIZE, 0, 0, NULL, 0,
+	                &afh, sizeof(afh), pool->timeout_ms) == 0) {
+		info->afh_mode = afh.mode;
+		memcpy(info->afh_map, afh.map, 10);
+		info->flags |= INFO_AFH;
+	}
+
+	if (created)
+		disconnect(pool, handle);
+}
+
+static void* worker(void* arg)
+{
+	pool_t* pool = (pool_t*)arg;
+	job_t* job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->num_jobs) {
+		job = &pool->jobs[pool->next++];
+		if (job->done)
+			continue;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (pool->dd < 0) {
+			snprintf(job->error, sizeof(job->error), "HCI device open failed: %s",
+			         strerror(pool->hci_error));
+		} else {
+			read_name(pool, job);
+			if (pool->extended)
+				read_extended(pool, job);
 		}
-		sleep(1);
-		cc = 1;
-	} else
-		handle = htobs(cr->conn_info->handle);
+		job->info.updated = time(NULL);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
 
-	ba2str(bdaddr, addr);
-	printf("\tBD Address:  %s\n", addr);
+static void print_features(const char* title, const uint8_t* f)
+{
+	printf("\t%s: 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x\n",
+	       title, f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+}
 
-	if (hci_read_remote_name(dd, bdaddr, sizeof(name), name, 25000) == 0)
-		printf("\tDevice Name: %s\n", name);
+static void print_extended(const job_t* job)
+{
+	const device_info* info = &job->info;
+	uint8_t features[8];
+	char title[32];
+	char* tmp;
+	int i;
 
-	if (hci_read_remote_version(dd, handle, &version, 20000) == 0) {
-		char *ver = lmp_vertostr(version.lmp_ver);
+	printf("\tBD Address:  %s\n", job->addr);
+	if (info->flags & INFO_NAME)
+		printf("\tDevice Name: %s\n", info->name);
+
+	if (info->flags & INFO_VERSION) {
+		char *ver = lmp_vertostr(info->lmp_ver);
 		printf("\tLMP Version: %s (0x%x) LMP Subversion: 0x%x\n"
 			"\tManufacturer: %s (%d)\n",
 			ver ? ver : "n/a",
-			version.lmp_ver,
-			version.lmp_subver,
-			bt_compidtostr(version.manufacturer),
-			version.manufacturer);
+			info->lmp_ver,
+			info->lmp_subver,
+			bt_compidtostr(info->manufacturer),
+			info->manufacturer);
 		if (ver)
 			bt_free(ver);
 	}
 
-	memset(features, 0, sizeof(features));
-	hci_read_remote_features(dd, handle, features, 20000);
-
-	if ((di.features[7] & LMP_EXT_FEAT) && (features[7] & LMP_EXT_FEAT))
-		hci_read_remote_ext_features(dd, handle, 0, &max_page,
-							features, 20000);
-
-	printf("\tFeatures%s: 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x "
-				"0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x\n",
-		(max_page > 0) ? " page 0" : "",
-		features[0], features[1], features[2], features[3],
-		features[4], features[5], features[6], features[7]);
-
+	memcpy(features, info->features[0], 8);
+	print_features(info->max_page > 0 ? "Features page 0" : "Features", features);
 	tmp = lmp_featurestostr(features, "\t\t", 63);
 	printf("%s\n", tmp);
 	bt_free(tmp);
 
-	for (i = 1; i <= max_page; i++) {
-		if (hci_read_remote_ext_features(dd, handle, i, NULL,
-							features, 20000) < 0)
+	for (i = 1; i <= info->max_page && i < MAX_FEATURE_PAGES; i++) {
+		if (!(info->pages & (1 << i)))
 			continue;
-
-		printf("\tFeatures page %d: 0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x "
-					"0x%2.2x 0x%2.2x 0x%2.2x 0x%2.2x\n", i,
-			features[0], features[1], features[2], features[3],
-			features[4], features[5], features[6], features[7]);
-	}
-
-	if (hci_read_clock_offset(dd, handle, &offset, 1000) < 0) {
-		perror("Reading clock offset failed");
-		exit(1);
+		snprintf(title, sizeof(title), "Features page %d", i);
+		print_features(title, info->features[i]);
 	}
 
-	printf("\tClock offset: 0x%4.4x\n", btohs(offset));
+	if (info->flags & INFO_CLOCK)
+		printf("\tClock offset: 0x%4.4x\n", info->clock_offset);
+	else
+		fprintf(stderr, "Reading clock offset failed\n");
 
-	if(hci_read_afh_map(dd, handle, &mode, afh_map, 1000) < 0) {
-	perror("HCI read AFH map request failed");
-	}
-	if(mode == 0x01) {
+	if (!(info->flags & INFO_AFH))
+		fprintf(stderr, "HCI read AFH map request failed\n");
+	if ((info->flags & INFO_AFH) && info->afh_mode == 0x01) {
 		// DGS: Replace with call to btbb_print_afh_map - need a piconet
 		printf("\tAFH Map: 0x");
 		for(i=0; i<10; i++)
-			printf("%02x", afh_map[i]);
+			printf("%02x", info->afh_map[i]);
 		printf("\n");
 	} else {
 		printf("AFH disabled.\n");
 	}
-	free(cr);
+}
+
+/* For a given BD_ADDR, print address, name and class */
+static void print_job(pool_t* pool, const job_t* job)
+{
+	int lap;
 
-	if (cc) {
-		usleep(10000);
-		hci_disconnect(dd, handle, HCI_OE_USER_ENDED_CONNECTION, 10000);
+	if (job->query) {
+		printf("%s\t%s%s\n", job->addr,
+		       (job->info.flags & INFO_NAME) ? job->info.name : "[unknown]",
+		       job->cached ? "\t(cached)" : "");
+		if (pool->extended) {
+			printf("Requesting information ...\n");
+			if (job->error[0])
+				fprintf(stderr, "%s\n", job->error);
+			if (job->info.flags & INFO_EXTENDED)
+				print_extended(job);
+		}
+	} else if (job->pn) {
+		lap = btbb_piconet_get_lap(job->pn);
+		printf("??:??:??:%02X:%02X:%02X\n", (lap >> 16) & 0xFF,
+		       (lap >> 8) & 0xFF, lap & 0xFF);
 	}
+	if (job->pn)
+		btbb_print_afh_map(job->pn);
 }
 
-/* For a given BD_ADDR, print address, name and class */
-void print_name_and_class(int dev_handle, int dev_id, bdaddr_t *bdaddr,
-						  char* printable_addr, uint8_t extended)
+static device_info* cache_find(device_cache* cache, const bdaddr_t* bdaddr)
+{
+	int i;
+
+	for (i = 0; i < cache->num_entries; i++)
+		if (bacmp(&cache->entries[i].bdaddr, bdaddr) == 0)
+			return &cache->entries[i];
+	return NULL;
+}
+
+/* Keep what was learned unless the device did not answer at all */
+static void cache_store(device_cache* cache, const device_info* info)
+{
+	device_info* e;
+
+	if (!(info->flags & (INFO_NAME | INFO_EXTENDED)))
+		return;
+
+	e = cache_find(cache, &info->bdaddr);
+	if (e == NULL) {
+		if (cache->num_entries == cache->size) {
+			int size = cache->size ? 2 * cache->size : 16;
+			e = (device_info*)realloc(cache->entries, size * sizeof(device_info));
+			if (e == NULL) {
+				fprintf(stderr, "Unable to allocate memory\n");
+				return;
+			}
+			cache->entries = e;
+			cache->size = size;
+		}
+		e = &cache->entries[cache->num_entries++];
+	}
+	memcpy(e, info, sizeof(device_info));
+	cache->dirty = 1;
+}
+
+/*
+ * The cache is a text file with one line per device:
+ *
+ *   <bdaddr> <updated> <flags> <lmp_ver> <lmp_subver> <manufacturer>
+ *   <max_page> <pages> <features> <clock_offset> <afh_mode> <afh_map> <name>
+ *
+ * features holds MAX_FEATURE_PAGES pages of 8 bytes in hex.
+ */
+static int parse_entry(device_info* e, const char* line)
+{
+	char addr[18], features[2 * 8 * MAX_FEATURE_PAGES + 1], afh_map[21];
+	unsigned long long updated;
+	int i, name = 0;
+	size_t len;
+
+	memset(e, 0, sizeof(device_info));
+	if (sscanf(line, "%17s %llu %hhx %hhx %hx %hu %hhu %hhx %64s %hx %hhx %20s %n",
+	           addr, &updated, &e->flags, &e->lmp_ver, &e->lmp_subver,
+	           &e->manufacturer, &e->max_page, &e->pages, features,
+	           &e->clock_offset, &e->afh_mode, afh_map, &name) < 12 || name == 0 ||
+	    strlen(features) != sizeof(features) - 1 || strlen(afh_map) != 20 ||
+	    str2ba(addr, &e->bdaddr) < 0)
+		return -1;
+	e->updated = updated;
+
+	for (i = 0; i < 8 * MAX_FEATURE_PAGES; i++)
+		if (sscanf(features + 2 * i, "%2hhx", &e->features[i / 8][i % 8]) != 1)
+			return -1;
+	for (i = 0; i < 10; i++)
+		if (sscanf(afh_map + 2 * i, "%2hhx", &e->afh_map[i]) != 1)
+			return -1;
+
+	snprintf(e->name, sizeof(e->name), "%s", line + name);
+	len = strlen(e->name);
+	if (len > 0 && e->name[len - 1] == '\n')
+		e->name[len - 1] = '\0';
+	return 0;
+}
+
+/* Load the cache.  A missing file is an empty cache. */
+static device_cache* cache_open(const char* path, int max_age)
+{
+	device_cache* cache;
+	device_info e;
+	char line[LINE_LEN];
+	int n = 0;
+	FILE* fp;
+
+	cache = (device_cache*)calloc(1, sizeof(device_cache));
+	if (cache == NULL || (cache->path = strdup(path)) == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(cache);
+		return NULL;
+	}
+	cache->max_age = max_age;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno == ENOENT)
+			return cache;
+		perror(path);
+		free(cache->path);
+		free(cache);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (parse_entry(&e, line) < 0)
+			fprintf(stderr, "%s:%d: ignoring invalid entry\n", path, n);
+		else
+			cache_store(cache, &e);
+	}
+	fclose(fp);
+	cache->dirty = 0;
+
+	return cache;
+}
+
+/* Write to a temporary file first, so that an interrupted run never
+ * leaves a truncated cache behind. */
+static int cache_save(device_cache* cache)
+{
+	char tmp[1024], addr[18];
+	device_info* e;
+	FILE* fp;
+	int i, j;
+
+	if (!cache->dirty)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "# bdaddr updated flags lmp_ver lmp_subver manufacturer max_page pages features clock_offset afh_mode afh_map name\n");
+	for (i = 0; i < cache->num_entries; i++) {
+		e = &cache->entries[i];
+		ba2str(&e->bdaddr, addr);
+		fprintf(fp, "%s %llu %x %x %x %u %u %x ", addr,
+		        (unsigned long long)e->updated, e->flags, e->lmp_ver,
+		        e->lmp_subver, e->manufacturer, e->max_page, e->pages);
+		for (j = 0; j < 8 * MAX_FEATURE_PAGES; j++)
+			fprintf(fp, "%02x", e->features[j / 8][j % 8]);
+		fprintf(fp, " %x %x ", e->clock_offset, e->afh_mode);
+		for (j = 0; j < 10; j++)
+			fprintf(fp, "%02x", e->afh_map[j]);
+		fprintf(fp, " %s\n", e->name);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, cache->path) < 0) {
+		perror(cache->path);
+		return -1;
+	}
+	cache->dirty = 0;
+
+	return 0;
+}
+
+static void cache_close(device_cache* cache)
 {
-    char name[248] = { 0 };
+	cache_save(cache);
+	free(cache->path);
+	free(cache->entries);
+	free(cache);
+}
 
-	if (hci_read_remote_name(dev_handle, bdaddr, sizeof(name), name, 0) < 0)
-			strcpy(name, "[unknown]");
+static job_t* add_job(job_t** jobs, int* num_jobs, int* size)
+{
+	job_t* job;
 
-	printf("%s\t%s\n", printable_addr, name);
-	if (extended)
-		extra_info(dev_handle, dev_id, bdaddr);
+	if (*num_jobs == *size) {
+		int n = *size ? 2 * *size : 16;
+		job = (job_t*)realloc(*jobs, n * sizeof(job_t));
+		if (job == NULL) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			return NULL;
+		}
+		*jobs = job;
+		*size = n;
+	}
+	job = &(*jobs)[(*num_jobs)++];
+	memset(job, 0, sizeof(job_t));
+	/* R2 and no clock offset, as hci_read_remote_name() */
+	job->pscan_rep_mode = 0x02;
+	return job;
 }
 
+/*
+ * Query the devices with a pool of threads sharing an HCI socket, whose
+ * events are read by a thread of their own, and print the results in
+ * the order of the jobs as they complete.  Devices found in the cache
+ * are not queried again.
+ */
+static void enrich(pool_t* pool, job_t* jobs, int num_jobs, device_cache* cache)
+{
+	pthread_t tid[MAX_THREADS];
+	pthread_t reader;
+	device_info* cached;
+	hci_waiter* w;
+	int i, r, threads, pending = 0;
+
+	for (i = 0; i < num_jobs; i++) {
+		if (!jobs[i].query) {
+			jobs[i].done = 1;
+			continue;
+		}
+		cached = cache ? cache_find(cache, &jobs[i].info.bdaddr) : NULL;
+		if (cached && (uint64_t)time(NULL) - cached->updated <= (uint64_t)cache->max_age &&
+		    (!pool->extended || (cached->flags & INFO_EXTENDED))) {
+			memcpy(&jobs[i].info, cached, sizeof(device_info));
+			jobs[i].cached = 1;
+			jobs[i].done = 1;
+			continue;
+		}
+		pending++;
+	}
+
+	pool->jobs = jobs;
+	pool->num_jobs = num_jobs;
+	pool->next = 0;
+	pool->hci_error = 0;
+	pool->stopping = 0;
+	pool->dd = -1;
+	if (pending && (pool->dd = open_socket(pool->dev_id)) < 0) {
+		pool->hci_error = errno;
+	} else if (pending && (r = pthread_create(&reader, NULL, read_events, pool)) != 0) {
+		close(pool->dd);
+		pool->dd = -1;
+		pool->hci_error = r;
+	}
+
+	threads = MIN(pool->threads, pending);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tid[i], NULL, worker, pool) != 0) {
+			fprintf(stderr, "Unable to start query thread\n");
+			break;
+		}
+	}
+	threads = i;
+	/* without any thread the jobs are done here */
+	if (threads == 0 && pending > 0)
+		worker(pool);
+
+	for (i = 0; i < num_jobs; i++) {
+		pthread_mutex_lock(&pool->lock);
+		while (!jobs[i].done)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+
+		print_job(pool, &jobs[i]);
+		if (cache && jobs[i].query && !jobs[i].cached)
+			cache_store(cache, &jobs[i].info);
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	if (pool->dd >= 0) {
+		pthread_mutex_lock(&hci_lock);
+		pool->stopping = 1;
+		pthread_mutex_unlock(&hci_lock);
+		pthread_join(reader, NULL);
+		close(pool->dd);
+	}
+	while ((w = pool->waiters) != NULL) {
+		pool->waiters = w->next;
+		free(w);
+	}
+}
 
 int main(int argc, char *argv[])
 {
@@ -185,12 +1043,30 @@ int main(int argc, char *argv[])
 	uint8_t scan = 0;
 	char ubertooth_device = -1;
 	char *bt_dev = "hci0";
-    char addr[19] = { 0 };
+	char *cache_path = NULL;
+	int max_age = DEFAULT_MAX_AGE;
 	ubertooth_t* ut = NULL;
 	btbb_piconet* pn;
-	bdaddr_t bdaddr;
+	filter_t* filter = NULL;
+	device_cache* cache = NULL;
+	pool_t pool;
+	pthread_condattr_t attr;
+	job_t* jobs = NULL;
+	job_t* job;
+	int num_jobs = 0, size = 0;
+	char addr[19];
+
+	memset(&pool, 0, sizeof(pool));
+	pool.threads = DEFAULT_THREADS;
+	pool.timeout_ms = DEFAULT_TIMEOUT * 1000;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool.events, &attr);
+	pthread_condattr_destroy(&attr);
 
-	while ((opt=getopt(argc,argv,"hU:t:e:xsb:")) != EOF) {
+	while ((opt=getopt(argc,argv,"hU:t:e:xsb:F:j:T:C:A:")) != EOF) {
 		switch(opt) {
 		case 'U':
 			ubertooth_device = atoi(optarg);
@@ -208,12 +1084,37 @@ int main(int argc, char *argv[])
 		case 'e':
 			max_ac_errors = atoi(optarg);
 			break;
+		case 'F':
+			filter = filter_compile(optarg);
+			if (filter == NULL)
+				return 1;
+			break;
 		case 'x':
 			extended = 1;
 			break;
 		case 's':
 			scan = 1;
 			break;
+		case 'j':
+			pool.threads = atoi(optarg);
+			if (pool.threads < 1 || pool.threads > MAX_THREADS) {
+				fprintf(stderr, "-j takes 1 to %d threads\n", MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 'T':
+			pool.timeout_ms = atof(optarg) * 1000;
+			if (pool.timeout_ms <= 0) {
+				fprintf(stderr, "-T takes a number of seconds\n");
+				return 1;
+			}
+			break;
+		case 'C':
+			cache_path = optarg;
+			break;
+		case 'A':
+			max_age = atoi(optarg);
+			break;
 		case 'h':
 		default:
 			usage();
@@ -233,11 +1134,25 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	pool.dev_id = dev_id;
+	pool.extended = extended;
+	if (extended && hci_devinfo(dev_id, &pool.di) < 0) {
+		perror("Can't get device info");
+		return 1;
+	}
+
+	if (cache_path) {
+		cache = cache_open(cache_path, max_age);
+		if (cache == NULL)
+			return 1;
+	}
+
 	ut = ubertooth_start(ubertooth_device);
 	if (ut == NULL) {
 		usage();
 		return 1;
 	}
+	ut->h_filter = filter;
 	/* Set sweep mode - otherwise AFH map is useless */
 	cmd_set_channel(ut->devh, 9999);
 
@@ -254,10 +1169,18 @@ int main(int argc, char *argv[])
 			perror("hci_inquiry");
 
 		for (i = 0; i < num_rsp; i++) {
-			ba2str(&(ii+i)->bdaddr, addr);
-			print_name_and_class(dev_handle, dev_id, &(ii+i)->bdaddr, addr,
-								 extended);
+			job = add_job(&jobs, &num_jobs, &size);
+			if (job == NULL)
+				return 1;
+			bacpy(&job->info.bdaddr, &(ii+i)->bdaddr);
+			ba2str(&(ii+i)->bdaddr, job->addr);
+			/* the inquiry tells how to page the device quickly */
+			job->pscan_rep_mode = (ii+i)->pscan_rep_mode;
+			job->clock_offset = htobs(btohs((ii+i)->clock_offset) | 0x8000);
+			job->query = 1;
 		}
+		enrich(&pool, jobs, num_jobs, cache);
+		num_jobs = 0;
 		free(ii);
 	}
 
@@ -268,21 +1191,27 @@ int main(int argc, char *argv[])
 	ubertooth_stop(ut);
 
 	while((pn=btbb_next_survey_result()) != NULL) {
+		job = add_job(&jobs, &num_jobs, &size);
+		if (job == NULL)
+			return 1;
+		job->pn = pn;
 		lap = btbb_piconet_get_lap(pn);
 		if (btbb_piconet_get_flag(pn, BTBB_UAP_VALID)) {
 			uap = btbb_piconet_get_uap(pn);
 			sprintf(addr, "00:00:%02X:%02X:%02X:%02X", uap,
 					(lap >> 16) & 0xFF, (lap >> 8) & 0xFF, lap & 0xFF);
-			str2ba(addr, &bdaddr);
+			str2ba(addr, &job->info.bdaddr);
 			/* Printable version showing that the NAP is unknown */
-			sprintf(addr, "??:??:%02X:%02X:%02X:%02X", uap,
+			sprintf(job->addr, "??:??:%02X:%02X:%02X:%02X", uap,
 					(lap >> 16) & 0xFF, (lap >> 8) & 0xFF, lap & 0xFF);
-			print_name_and_class(dev_handle, dev_id, &bdaddr, addr, extended);
-		} else
-			printf("??:??:??:%02X:%02X:%02X\n", (lap >> 16) & 0xFF,
-				   (lap >> 8) & 0xFF, lap & 0xFF);
-		btbb_print_afh_map(pn);
+			job->query = 1;
+		}
 	}
+	enrich(&pool, jobs, num_jobs, cache);
+	free(jobs);
+
+	if (cache)
+		cache_close(cache);
 
     close(dev_handle);
     return 0;
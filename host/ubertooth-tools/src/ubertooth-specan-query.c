@@ -0,0 +1,218 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubertooth_archive.h"
+#include "ubertooth_specan.h"
+
+#define DEFAULT_ROWS 1000
+
+typedef struct {
+	FILE* fp;       /* frames, NULL for text */
+	int mean;
+} query_t;
+
+static void usage(void)
+{
+	printf("ubertooth-specan-query - read a time span from a spectrum archive\n");
+	printf("Usage:\n");
+	printf("\t-h this help\n");
+	printf("\t-i <filename> archive recorded with ubertooth-specan -A\n");
+	printf("\t-s <seconds> start at this UNIX time (default: the oldest data)\n");
+	printf("\t-e <seconds> end before this UNIX time (default: the newest data)\n");
+	printf("\t-r <rows> use the finest resolution with at most this many rows (default %d)\n",
+	       DEFAULT_ROWS);
+	printf("\t-L <level> use this resolution: raw, second, minute or hour\n");
+	printf("\t-m print the mean instead of the max of each bin\n");
+	printf("\t-f <filename> write binary sweep frames to file ('-' for stdout)\n");
+	printf("\t-I describe the archive\n");
+	printf("\nText output has a line of time, frequency and raw RSSI per bin and\n");
+	printf("a blank line after each row, suitable for feedgnuplot --3d.\n");
+}
+
+static uint64_t parse_time(const char* s)
+{
+	return (uint64_t)(strtod(s, NULL) * 1000000000.0);
+}
+
+static int print_row(const specan_archive* a, int level, const archive_row* row,
+                     void* args)
+{
+	query_t* q = (query_t*)args;
+	const int8_t* rssi = q->mean ? specan_archive_mean(a, level, row)
+	                             : specan_archive_max(a, level, row);
+	specan_frame frame = {
+		.seq = row->key - 1,
+		.ts_ns = row->ts_ns,
+		.start_mhz = a->hdr->low_mhz,
+		.count = a->hdr->bins,
+		.sweeps = row->sweeps > 0xffff ? 0xffff : row->sweeps,
+	};
+	int i;
+
+	if (q->fp) {
+		if (level == ARCHIVE_RAW) {
+			frame.kind = SPECAN_FRAME_SWEEP;
+			frame.rssi = rssi;
+			return specan_frame_write(q->fp, &frame);
+		}
+		frame.kind = SPECAN_FRAME_MAX;
+		frame.rssi = specan_archive_max(a, level, row);
+		if (specan_frame_write(q->fp, &frame) < 0)
+			return -1;
+		frame.kind = SPECAN_FRAME_AVERAGE;
+		frame.rssi = specan_archive_mean(a, level, row);
+		return specan_frame_write(q->fp, &frame);
+	}
+
+	for (i = 0; i < a->hdr->bins; i++) {
+		if (rssi[i] == SPECAN_RSSI_NONE)
+			continue;
+		printf("%f %d %d\n", row->ts_ns / 1e9, a->hdr->low_mhz + i, rssi[i]);
+	}
+	printf("\n");
+	return 0;
+}
+
+static void describe(const specan_archive* a)
+{
+	const archive_level* lv;
+	uint64_t start, end;
+	int l;
+
+	printf("%u-%u MHz, %u bins, RSSI offset %d, %zu bytes\n",
+	       a->hdr->low_mhz, a->hdr->low_mhz + a->hdr->bins - 1,
+	       a->hdr->bins, a->hdr->rssi_offset, a->size);
+	for (l = 0; l < ARCHIVE_LEVELS; l++) {
+		lv = &a->hdr->levels[l];
+		printf("%-6s %10u rows", specan_archive_level_name(l), lv->rows);
+		if (specan_archive_span(a, l, &start, &end) == 0)
+			printf(", %f to %f", start / 1e9, end / 1e9);
+		printf("\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, l, info = 0;
+	int level = -1;
+	char* path = NULL;
+	uint64_t start_ns = 0, end_ns = UINT64_MAX;
+	uint64_t s, e, first, last;
+	uint64_t max_rows = DEFAULT_ROWS;
+	int64_t rows;
+	query_t query;
+	specan_archive* a;
+
+	memset(&query, 0, sizeof(query));
+
+	while ((opt=getopt(argc,argv,"hi:s:e:r:L:mf:I")) != EOF) {
+		switch(opt) {
+		case 'i':
+			path = optarg;
+			break;
+		case 's':
+			start_ns = parse_time(optarg);
+			break;
+		case 'e':
+			end_ns = parse_time(optarg);
+			break;
+		case 'r':
+			max_rows = strtoull(optarg, NULL, 10);
+			break;
+		case 'L':
+			for (l = 0; l < ARCHIVE_LEVELS; l++)
+				if (strcmp(optarg, specan_archive_level_name(l)) == 0)
+					level = l;
+			if (level < 0) {
+				fprintf(stderr, "Unknown level '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			query.mean = 1;
+			break;
+		case 'f':
+			if (strcmp(optarg, "-") == 0) {
+				query.fp = stdout;
+			} else {
+				query.fp = fopen(optarg, "wb");
+				if (query.fp == NULL) {
+					perror(optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'I':
+			info = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (path == NULL) {
+		usage();
+		return 1;
+	}
+	a = specan_archive_open(path);
+	if (a == NULL)
+		return 1;
+
+	if (info) {
+		describe(a);
+		specan_archive_close(a);
+		return 0;
+	}
+
+	/* limit the span to the data held, so that it picks the level */
+	first = UINT64_MAX;
+	last = 0;
+	for (l = 0; l < ARCHIVE_LEVELS; l++) {
+		if (specan_archive_span(a, l, &s, &e) < 0)
+			continue;
+		first = MIN(first, s);
+		last = MAX(last, e);
+	}
+	start_ns = MAX(start_ns, first);
+	end_ns = MIN(end_ns, last);
+
+	if (level < 0)
+		level = specan_archive_level(a, start_ns, end_ns, max_rows);
+
+	rows = specan_archive_read(a, level, start_ns, end_ns, print_row, &query);
+	if (rows >= 0)
+		fprintf(stderr, "%lld %s rows\n", (long long)rows,
+		        specan_archive_level_name(level));
+	if (query.fp && fclose(query.fp) != 0) {
+		perror("close");
+		rows = -1;
+	}
+	specan_archive_close(a);
+
+	return rows < 0 ? 1 : 0;
+}
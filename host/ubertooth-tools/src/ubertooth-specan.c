@@ -20,11 +20,148 @@
  */
 
 #include <getopt.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ubertooth.h"
+#include "ubertooth_archive.h"
+#include "ubertooth_specan.h"
+
+#define MAX_PERCENTILES 4
 
 uint8_t debug;
 
+static ubertooth_t* stop_ut;
+
+typedef struct {
+	FILE* fp;
+	specan_sweep* sweep;
+	uint64_t next;          /* first sweep not written yet */
+	int raw;                /* write every sweep */
+	specan_accum* accum;
+	int sweeps;             /* per accumulated frame */
+	int max;
+	int average;
+	int num_percentiles;
+	uint8_t percentiles[MAX_PERCENTILES];
+	specan_archive* archive;
+} frames_t;
+
+static int write_accumulated(frames_t* f)
+{
+	specan_accum* a = f->accum;
+	specan_frame frame = {
+		.seq = a->first_seq,
+		.ts_ns = a->first_ts_ns,
+		.start_mhz = f->sweep->low,
+		.count = a->bins,
+		.sweeps = a->sweeps,
+	};
+	int i;
+
+	if (f->max) {
+		frame.kind = SPECAN_FRAME_MAX;
+		frame.rssi = specan_accum_max(a);
+		if (specan_frame_write(f->fp, &frame) < 0)
+			return -1;
+	}
+	if (f->average) {
+		frame.kind = SPECAN_FRAME_AVERAGE;
+		frame.rssi = specan_accum_average(a);
+		if (specan_frame_write(f->fp, &frame) < 0)
+			return -1;
+	}
+	frame.kind = SPECAN_FRAME_PERCENTILE;
+	for (i = 0; i < f->num_percentiles; i++) {
+		frame.percentile = f->percentiles[i];
+		frame.rssi = specan_accum_percentile(a, f->percentiles[i]);
+		if (specan_frame_write(f->fp, &frame) < 0)
+			return -1;
+	}
+	specan_accum_reset(a);
+	return 0;
+}
+
+/* Assemble sweeps, write a frame per sweep and/or per -n sweeps and
+ * record them in the archive. */
+static void cb_specan_frames(ubertooth_t* ut, void* args)
+{
+	frames_t* f = (frames_t*)args;
+	usb_pkt_rx* rx = ringbuffer_top_usb(ut->packets);
+	specan_frame frame = {
+		.kind = SPECAN_FRAME_SWEEP,
+		.start_mhz = f->sweep->low,
+		.count = f->sweep->bins,
+		.sweeps = 1,
+	};
+
+	if (specan_sweep_add(f->sweep, rx, clock_sync_ns(&ut->clock, rx)) == 0)
+		return;
+
+	for (; f->next < f->sweep->completed; f->next++) {
+		frame.rssi = specan_sweep_get(f->sweep, f->next);
+		if (frame.rssi == NULL)
+			continue;
+		frame.seq = f->next;
+		frame.ts_ns = specan_sweep_ts_ns(f->sweep, f->next);
+		if (f->archive)
+			specan_archive_add(f->archive, frame.rssi, frame.ts_ns);
+		if (f->raw && specan_frame_write(f->fp, &frame) < 0)
+			goto fail;
+		if (f->accum) {
+			specan_accum_add(f->accum, frame.rssi, frame.seq, frame.ts_ns);
+			if (f->accum->sweeps == f->sweeps && write_accumulated(f) < 0)
+				goto fail;
+		}
+	}
+	/* consumers get each sweep as soon as it is complete */
+	if (f->fp == NULL || fflush(f->fp) == 0)
+		return;
+	perror("specan frames");
+
+fail:
+	ut->stop_ubertooth = 1;
+}
+
+/* The archive may be halfway through an update when a signal arrives,
+ * so only ask the main loop to stop; it closes the archive itself. */
+static void stop(int sig __attribute__((unused)))
+{
+	stop_ut->stop_ubertooth = 1;
+}
+
+/* "raw,max,avg,p90": the frames to write */
+static int parse_kinds(frames_t* f, char* list)
+{
+	char* kind;
+	char* end;
+	long pct;
+
+	f->raw = f->max = f->average = f->num_percentiles = 0;
+	for (kind = strtok(list, ","); kind; kind = strtok(NULL, ",")) {
+		if (strcmp(kind, "raw") == 0) {
+			f->raw = 1;
+		} else if (strcmp(kind, "max") == 0) {
+			f->max = 1;
+		} else if (strcmp(kind, "avg") == 0) {
+			f->average = 1;
+		} else if (kind[0] == 'p' && f->num_percentiles < MAX_PERCENTILES) {
+			pct = strtol(kind + 1, &end, 10);
+			if (*end != '\0' || end == kind + 1 || pct < 0 || pct > 100)
+				goto invalid;
+			f->percentiles[f->num_percentiles++] = (uint8_t)pct;
+		} else {
+			goto invalid;
+		}
+	}
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid frame kind '%s', use raw, max, avg or p<0-100> (at most %d)\n",
+	        kind, MAX_PERCENTILES);
+	return -1;
+}
+
 void cb_specan(ubertooth_t* ut __attribute__((unused)), void* args)
 {
 	uint16_t high_freq = (((uint8_t*)args)[0]) |
@@ -80,6 +217,12 @@ static void usage(FILE *file)
 	fprintf(file, "\t-g output suitable for feedgnuplot\n");
 	fprintf(file, "\t-G output suitable for 3D feedgnuplot\n");
 	fprintf(file, "\t-d <filename> output to file\n");
+	fprintf(file, "\t-f <filename> output binary sweep frames to file ('-' for stdout)\n");
+	fprintf(file, "\t-n <sweeps> accumulate this many sweeps per frame\n");
+	fprintf(file, "\t-a <kinds> frames to write: raw,max,avg,p<0-100> (default: raw, with -n max,avg)\n");
+	fprintf(file, "\t-A <filename> record sweeps in a spectrum archive, continuing an existing one\n");
+	fprintf(file, "\t-w <sweeps> sweeps kept at full resolution in a new archive (default %d)\n",
+	        ARCHIVE_DEFAULT_RAW);
 	fprintf(file, "\t-l lower frequency (default 2402)\n");
 	fprintf(file, "\t-u upper frequency (default 2480)\n");
 	fprintf(file, "\t-U<0-7> set ubertooth device to use\n");
@@ -90,10 +233,19 @@ int main(int argc, char *argv[])
 	int opt, r = 0, output_mode = SPECAN_STDOUT;
 	int lower= 2402, upper= 2480;
 	char ubertooth_device = -1;
+	frames_t frames;
+	char* kinds = NULL;
+	char* archive = NULL;
+	uint32_t archive_rows[ARCHIVE_LEVELS] = {
+		ARCHIVE_DEFAULT_RAW, ARCHIVE_DEFAULT_SECONDS,
+		ARCHIVE_DEFAULT_MINUTES, ARCHIVE_DEFAULT_HOURS
+	};
 
 	ubertooth_t* ut = NULL;
 
-	while ((opt=getopt(argc,argv,"vhgGd:l::u::U:")) != EOF) {
+	memset(&frames, 0, sizeof(frames));
+
+	while ((opt=getopt(argc,argv,"vhgGd:f:n:a:A:w:l::u::U:")) != EOF) {
 		switch(opt) {
 		case 'v':
 			debug++;
@@ -116,6 +268,39 @@ int main(int argc, char *argv[])
 				}
 			}
 			break;
+		case 'f':
+			output_mode = SPECAN_FRAMES;
+			if (strcmp(optarg, "-") == 0) {
+				frames.fp = stdout;
+			} else {
+				frames.fp = fopen(optarg, "wb");
+				if (frames.fp == NULL) {
+					perror(optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'n':
+			frames.sweeps = atoi(optarg);
+			if (frames.sweeps < 1 || frames.sweeps > SPECAN_ACCUM_MAX_SWEEPS) {
+				fprintf(stderr, "-n takes 1 to %d sweeps\n", SPECAN_ACCUM_MAX_SWEEPS);
+				return 1;
+			}
+			break;
+		case 'a':
+			kinds = optarg;
+			break;
+		case 'A':
+			output_mode = SPECAN_FRAMES;
+			archive = optarg;
+			break;
+		case 'w':
+			archive_rows[ARCHIVE_RAW] = strtoul(optarg, NULL, 10);
+			if (archive_rows[ARCHIVE_RAW] == 0) {
+				fprintf(stderr, "-w takes a number of sweeps\n");
+				return 1;
+			}
+			break;
 		case 'l':
 			if (optarg)
 				lower= atoi(optarg);
@@ -140,6 +325,39 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (output_mode == SPECAN_FRAMES) {
+		if (frames.fp == NULL) {
+			if (kinds || frames.sweeps) {
+				fprintf(stderr, "-n and -a need -f\n");
+				return 1;
+			}
+		} else if (kinds) {
+			if (parse_kinds(&frames, kinds) < 0)
+				return 1;
+		} else if (frames.sweeps) {
+			frames.max = frames.average = 1;
+		} else {
+			frames.raw = 1;
+		}
+		if (frames.sweeps == 0 && (frames.max || frames.average || frames.num_percentiles)) {
+			fprintf(stderr, "Accumulated frames need -n\n");
+			return 1;
+		}
+		frames.sweep = specan_sweep_create(lower, upper);
+		if (frames.sweep == NULL)
+			return 1;
+		if (archive) {
+			frames.archive = specan_archive_create(archive, lower, upper, archive_rows);
+			if (frames.archive == NULL)
+				return 1;
+		}
+		if (frames.sweeps) {
+			frames.accum = specan_accum_create(frames.sweep->bins, frames.num_percentiles);
+			if (frames.accum == NULL)
+				return 1;
+		}
+	}
+
 	ut = ubertooth_start(ubertooth_device);
 
 	if (ut == NULL) {
@@ -149,6 +367,12 @@ int main(int argc, char *argv[])
 
 	/* Clean up on exit. */
 	register_cleanup_handler(ut);
+	if (frames.archive) {
+		stop_ut = ut;
+		signal(SIGINT, stop);
+		signal(SIGQUIT, stop);
+		signal(SIGTERM, stop);
+	}
 
 	uint8_t specan_args[] = {
 		(uint8_t)(upper & 0xff),
@@ -169,12 +393,16 @@ int main(int argc, char *argv[])
 	// receive and process each packet
 	while(1) {
 		ubertooth_bulk_wait(ut);
-		r = ubertooth_bulk_receive(ut, cb_specan, specan_args);
-		if (r == -1)
-			return r;
+		if (output_mode == SPECAN_FRAMES)
+			r = ubertooth_bulk_receive(ut, cb_specan_frames, &frames);
+		else
+			r = ubertooth_bulk_receive(ut, cb_specan, specan_args);
+		if (r == -1 || r == 1)
+			break;
 	}
 
 	ubertooth_stop(ut);
+	specan_archive_close(frames.archive);
 	fprintf(stderr, "Ubertooth stopped\n");
 	return r;
 }
@@ -0,0 +1,280 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ubertooth_t* ut;
+static volatile sig_atomic_t running = 1;
+
+static void usage(void)
+{
+	printf("ubertooth-stream - send the raw record stream to 'ubertooth-rx -N'\n");
+	printf("Usage:\n");
+	printf("\t-h this help\n");
+	printf("\t-r <host>[:<port>] receiver to send to (default port: %s)\n", NET_DEFAULT_PORT);
+	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-i <filename> replay a dump or capture file instead of using a device\n");
+	printf("\t-b <records> records per frame (default: %d)\n", NET_BATCH_DEFAULT);
+	printf("\t-q <KiB> frames queued for the network before they are dropped (default: %d)\n",
+	       NET_QUEUE_DEFAULT / 1024);
+	printf("\t-z compress frames\n");
+	printf("\t-c <MHz> channel to receive on, 9999 to hop\n");
+	printf("\t-l LE modulation\n");
+	printf("\nLive records are never held back for the network: frames that do not fit\n");
+	printf("in the queue are dropped and counted by both ends.  A replayed file is sent\n");
+	printf("as fast as the receiver takes it.\n");
+}
+
+static void stop(int sig __attribute__((unused)))
+{
+	running = 0;
+	if (ut)
+		ut->stop_ubertooth = 1;
+}
+
+/* Records of a hits-only dump are held until their hit marker, whose
+ * sequence number tells whether the window follows the previous one */
+typedef struct {
+	uint8_t buf[NUM_BANKS][4 + PKT_LEN];
+	int count;
+	unsigned long windows;
+	uint64_t window_end;
+} held_window;
+
+static int send_record(net_sender* s, const uint8_t* buf, int* segment)
+{
+	uint32_t t = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+
+	if (*segment) {
+		if (net_sender_segment(s) < 0)
+			return -1;
+		*segment = 0;
+	}
+	return net_sender_add(s, (usb_pkt_rx*)(buf + 4), (uint64_t)t * 1000000000ull, t);
+}
+
+static int send_window(net_sender* s, held_window* w, const dump_marker* m, int* segment)
+{
+	uint64_t first = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		first = (first << 8) | m->seq[i];
+	if (w->count && w->windows && first > w->window_end)
+		*segment = 1;
+	w->window_end = (first > w->window_end ? first : w->window_end) + w->count;
+	w->windows++;
+
+	for (i = 0; i < w->count; i++)
+		if (send_record(s, w->buf[i], segment) < 0)
+			return -1;
+	w->count = 0;
+	return 0;
+}
+
+static int send_file(net_sender* s, FILE* fp)
+{
+	uint8_t buf[4 + PKT_LEN];
+	capture_record rec;
+	capture_t* cap;
+	dump_marker m;
+	held_window w;
+	int r, i, kind, hits_only = 0, segment = 0;
+
+	net_sender_set_replay(s, 1);
+
+	if (fread(buf, 4, 1, fp) != 1)
+		return 0;
+	if (capture_is_magic(buf)) {
+		cap = capture_open(fp, 1);
+		if (cap == NULL)
+			return -1;
+		while (running && (r = capture_read(cap, &rec)) > 0) {
+			if ((rec.segment && net_sender_segment(s) < 0) ||
+			    net_sender_add(s, &rec.rx, rec.ts_ns, rec.systime) < 0) {
+				r = -1;
+				break;
+			}
+		}
+		capture_close(cap);
+		return r;
+	}
+
+	memset(&w, 0, sizeof(w));
+
+	/* markers carry no records, but window markers and gaps between
+	 * the windows of a hits-only dump start a new segment */
+	r = 0;
+	while (running && r == 0 && fread(buf + 4, PKT_LEN, 1, fp) == 1) {
+		kind = dump_read_marker(buf, &m);
+		if (kind == DUMP_MARKER_HEADER) {
+			hits_only = 1;
+		} else if (kind == DUMP_MARKER_WINDOW) {
+			segment = 1;
+		} else if (kind == DUMP_MARKER_HIT && hits_only) {
+			r = send_window(s, &w, &m, &segment);
+		} else if (kind < 0 && !hits_only) {
+			r = send_record(s, buf, &segment);
+		} else if (kind < 0) {
+			if (w.count == NUM_BANKS) {
+				fprintf(stderr, "hits-only dump without hit markers\n");
+				r = -1;
+				break;
+			}
+			memcpy(w.buf[w.count++], buf, sizeof(buf));
+		}
+		if (fread(buf, 4, 1, fp) != 1)
+			break;
+	}
+
+	/* a truncated dump may end without a hit marker */
+	for (i = 0; r == 0 && i < w.count; i++)
+		r = send_record(s, w.buf[i], &segment);
+	return r;
+}
+
+static int send_live(net_sender* s, uint32_t modulation, uint32_t channel)
+{
+	usb_pkt_rx* rx;
+	uint64_t ts_ns;
+	int i;
+
+	if (cmd_set_modulation(ut->devh, modulation) < 0)
+		return -1;
+	if (channel && cmd_set_channel(ut->devh, channel) < 0)
+		return -1;
+	if (ubertooth_bulk_init(ut) < 0 || cmd_rx_syms(ut->devh) < 0)
+		return -1;
+
+	while (running && !ut->stop_ubertooth) {
+		ubertooth_bulk_wait(ut);
+		if (ut->usb_really_full) {
+			clock_sync_sample(&ut->clock);
+			for (i = 0; i < ut->full_records; i++) {
+				rx = (usb_pkt_rx*)(ut->full_usb_buf + PKT_LEN * i);
+				if (rx->pkt_type == KEEP_ALIVE)
+					continue;
+				clock_sync_advance(&ut->clock, rx);
+				ts_ns = clock_sync_ns(&ut->clock, rx);
+				if (net_sender_add(s, rx, ts_ns, ts_ns / 1000000000ull) < 0)
+					return -1;
+			}
+			ut->usb_really_full = 0;
+		}
+		if (net_sender_poll(s, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, r;
+	char ubertooth_device = -1;
+	const char* receiver = NULL;
+	FILE* infile = NULL;
+	uint32_t batch = NET_BATCH_DEFAULT;
+	size_t queue_size = NET_QUEUE_DEFAULT;
+	int compress = 0;
+	uint32_t modulation = MOD_BT_BASIC_RATE;
+	uint32_t channel = 0;
+	net_sender* s;
+
+	while ((opt=getopt(argc,argv,"hr:U:i:b:q:zc:l")) != EOF) {
+		switch(opt) {
+		case 'r':
+			receiver = optarg;
+			break;
+		case 'U':
+			ubertooth_device = atoi(optarg);
+			break;
+		case 'i':
+			infile = fopen(optarg, "rb");
+			if (infile == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			queue_size = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'c':
+			channel = atoi(optarg);
+			break;
+		case 'l':
+			modulation = MOD_BT_LOW_ENERGY;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (receiver == NULL) {
+		usage();
+		return 1;
+	}
+
+	if (infile == NULL) {
+		ut = ubertooth_start(ubertooth_device);
+		if (ut == NULL) {
+			usage();
+			return 1;
+		}
+	}
+
+	s = net_sender_connect(receiver, batch, queue_size, compress, infile != NULL);
+	if (s == NULL) {
+		if (ut)
+			ubertooth_stop(ut);
+		return 1;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGQUIT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (infile) {
+		r = send_file(s, infile);
+		fclose(infile);
+	} else {
+		r = send_live(s, modulation, channel);
+	}
+
+	if (net_sender_close(s) < 0)
+		r = -1;
+	if (ut)
+		ubertooth_stop(ut);
+
+	return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright 2016 Ubertooth contributors
+ *
+ * This file is part of Project Ubertooth.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ubertooth.h"
+#include <errno.h>
+#include <getopt.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 16
+#define LINE_LEN    128
+
+typedef struct {
+	int fd;
+	char line[LINE_LEN];
+	size_t len;
+} client_t;
+
+static ubertooth_t* ut;
+static shm_ring* ring;
+static client_t clients[MAX_CLIENTS];
+static int num_clients;
+static int listen_fd = -1;
+static int lock_fd = -1;    /* client allowed to change the mode */
+static char socket_path[108];
+static volatile sig_atomic_t running = 1;
+
+static void usage(void)
+{
+	printf("ubertoothd - share one Ubertooth among local programs\n");
+	printf("Usage:\n");
+	printf("\t-h this help\n");
+	printf("\t-U <0-7> set ubertooth device to use\n");
+	printf("\t-n <name> name of the ring and control socket (default: %s)\n", SHM_DEFAULT_NAME);
+	printf("\t-s <slots> records kept in the ring, a power of two (default: %d)\n",
+	       SHM_DEFAULT_SLOTS);
+	printf("\t-c <MHz> channel to receive on, 9999 to hop (default: 2441)\n");
+	printf("\t-l LE modulation\n");
+	printf("\t-g <group> let this group read the ring and use the control socket\n");
+	printf("\nThe USB records are published in the shared memory object /<name>, read\n");
+	printf("with e.g. 'ubertooth-rx -D <name>'.  The control socket <name>.sock, in\n");
+	printf("$UBERTOOTH_RUNTIME_DIR, $XDG_RUNTIME_DIR/ubertooth or /tmp/ubertooth-<uid>,\n");
+	printf("accepts one command per line: status, lock, unlock, channel <MHz>,\n");
+	printf("modulation <bt|le>.  While a client holds the lock only it may change the\n");
+	printf("mode.  Without -g only the user running ubertoothd has access.\n");
+}
+
+static void stop(int sig __attribute__((unused)))
+{
+	running = 0;
+	ut->stop_ubertooth = 1;
+}
+
+static void reply(int fd, const char* s)
+{
+	if (write(fd, s, strlen(s)) < 0)
+		perror("control write");
+}
+
+static int start_mode(uint32_t modulation, uint32_t channel)
+{
+	ubertooth_mode_switch(ut);
+	if (cmd_set_modulation(ut->devh, modulation) < 0 ||
+	    cmd_set_channel(ut->devh, channel) < 0 ||
+	    cmd_rx_syms(ut->devh) < 0)
+		return -1;
+	shm_ring_set_mode(ring, modulation, channel);
+	return 0;
+}
+
+static void command(client_t* c, char* line)
+{
+	char buf[LINE_LEN];
+	char* arg = strchr(line, ' ');
+	uint32_t modulation = ring->hdr->modulation;
+	uint32_t channel = ring->hdr->channel;
+
+	if (arg)
+		*arg++ = '\0';
+
+	if (strcmp(line, "status") == 0) {
+		snprintf(buf, sizeof(buf), "ok modulation=%s channel=%u seq=%llu slots=%u locked=%d\n",
+		         modulation == MOD_BT_LOW_ENERGY ? "le" : "bt", channel,
+		         (unsigned long long)ring->hdr->write_seq, ring->hdr->slot_count,
+		         lock_fd >= 0);
+		reply(c->fd, buf);
+		return;
+	}
+
+	if (lock_fd >= 0 && lock_fd != c->fd) {
+		reply(c->fd, "error locked by another client\n");
+		return;
+	}
+
+	if (strcmp(line, "lock") == 0) {
+		lock_fd = c->fd;
+	} else if (strcmp(line, "unlock") == 0) {
+		lock_fd = -1;
+	} else if (strcmp(line, "channel") == 0 && arg) {
+		channel = atoi(arg);
+		if ((channel < 2400 || channel > 2483) && channel != 9999) {
+			reply(c->fd, "error channel must be 2400-2483 or 9999\n");
+			return;
+		}
+	} else if (strcmp(line, "modulation") == 0 && arg) {
+		if (strcmp(arg, "bt") == 0)
+			modulation = MOD_BT_BASIC_RATE;
+		else if (strcmp(arg, "le") == 0)
+			modulation = MOD_BT_LOW_ENERGY;
+		else {
+			reply(c->fd, "error modulation must be bt or le\n");
+			return;
+		}
+	} else {
+		reply(c->fd, "error unknown command\n");
+		return;
+	}
+
+	if ((modulation != ring->hdr->modulation || channel != ring->hdr->channel) &&
+	    start_mode(modulation, channel) < 0) {
+		reply(c->fd, "error device command failed\n");
+		return;
+	}
+	reply(c->fd, "ok\n");
+}
+
+static void drop_client(int i)
+{
+	if (lock_fd == clients[i].fd)
+		lock_fd = -1;
+	close(clients[i].fd);
+	clients[i] = clients[--num_clients];
+}
+
+static void read_client(int i)
+{
+	client_t* c = &clients[i];
+	char* nl;
+	ssize_t n;
+
+	n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+	if (n <= 0) {
+		drop_client(i);
+		return;
+	}
+	c->len += n;
+	c->line[c->len] = '\0';
+
+	while ((nl = strchr(c->line, '\n')) != NULL) {
+		*nl = '\0';
+		if (nl > c->line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		command(c, c->line);
+		c->len -= nl + 1 - c->line;
+		memmove(c->line, nl + 1, c->len + 1);
+	}
+	if (c->len == sizeof(c->line) - 1) {
+		reply(c->fd, "error line too long\n");
+		drop_client(i);
+	}
+}
+
+/* Handle whatever the control socket has ready, without waiting */
+static void poll_control(void)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	int i, n, fd;
+
+	fds[0].fd = listen_fd;
+	fds[0].events = POLLIN;
+	for (i = 0; i < num_clients; i++) {
+		fds[i + 1].fd = clients[i].fd;
+		fds[i + 1].events = POLLIN;
+	}
+	n = num_clients;
+	if (poll(fds, n + 1, 0) <= 0)
+		return;
+
+	/* from the end, as dropping a client moves the last one */
+	for (i = n - 1; i >= 0; i--)
+		if (fds[i + 1].revents)
+			read_client(i);
+
+	if (fds[0].revents & POLLIN) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			return;
+		if (num_clients == MAX_CLIENTS) {
+			reply(fd, "error too many clients\n");
+			close(fd);
+			return;
+		}
+		clients[num_clients].fd = fd;
+		clients[num_clients].len = 0;
+		num_clients++;
+	}
+}
+
+static int open_control(const char* name, gid_t group)
+{
+	struct sockaddr_un addr;
+
+	if (shm_socket_path(name, socket_path, sizeof(socket_path)) < 0 ||
+	    shm_socket_dir_create(socket_path, group) < 0)
+		return -1;
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    (group != (gid_t)-1 && chown(socket_path, -1, group) < 0) ||
+	    chmod(socket_path, group == (gid_t)-1 ? 0600 : 0660) < 0 ||
+	    listen(listen_fd, 4) < 0) {
+		perror(socket_path);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt, i, r;
+	char ubertooth_device = -1;
+	const char* name = SHM_DEFAULT_NAME;
+	uint32_t slots = SHM_DEFAULT_SLOTS;
+	uint32_t channel = 2441;
+	uint32_t modulation = MOD_BT_BASIC_RATE;
+	gid_t group = (gid_t)-1;
+	struct group* gr;
+	usb_pkt_rx* rx;
+
+	while ((opt=getopt(argc,argv,"hU:n:s:c:lg:")) != EOF) {
+		switch(opt) {
+		case 'U':
+			ubertooth_device = atoi(optarg);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 's':
+			slots = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			channel = atoi(optarg);
+			break;
+		case 'l':
+			modulation = MOD_BT_LOW_ENERGY;
+			break;
+		case 'g':
+			gr = getgrnam(optarg);
+			if (gr == NULL) {
+				fprintf(stderr, "Unknown group %s\n", optarg);
+				return 1;
+			}
+			group = gr->gr_gid;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	ut = ubertooth_start(ubertooth_device);
+	if (ut == NULL) {
+		usage();
+		return 1;
+	}
+
+	ring = shm_ring_create(name, slots, group);
+	if (ring == NULL || open_control(name, group) < 0) {
+		ubertooth_stop(ut);
+		return 1;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGQUIT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	r = ubertooth_bulk_init(ut);
+	if (r < 0 || start_mode(modulation, channel) < 0)
+		running = 0;
+
+	fprintf(stderr, "publishing in /%s, control socket %s\n", name, socket_path);
+
+	/* records go straight from the transfer into the ring */
+	while (running && !ut->stop_ubertooth) {
+		ubertooth_bulk_wait(ut);
+		if (ut->usb_really_full) {
+			clock_sync_sample(&ut->clock);
+			for (i = 0; i < ut->full_records; i++) {
+				rx = (usb_pkt_rx*)(ut->full_usb_buf + PKT_LEN * i);
+				if (rx->pkt_type == KEEP_ALIVE)
+					continue;
+				clock_sync_advance(&ut->clock, rx);
+				shm_ring_publish(ring, rx, clock_sync_ns(&ut->clock, rx));
+			}
+			ut->usb_really_full = 0;
+		}
+		poll_control();
+	}
+
+	for (i = num_clients - 1; i >= 0; i--)
+		drop_client(i);
+	close(listen_fd);
+	unlink(socket_path);
+	shm_ring_close(ring);
+	ubertooth_stop(ut);
+
+	return 0;
+}